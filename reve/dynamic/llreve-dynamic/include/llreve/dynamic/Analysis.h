@@ -28,6 +28,10 @@
 
 #include <thread>
 
+namespace clang {
+class CodeGenAction;
+}
+
 namespace llreve {
 namespace dynamic {
 
@@ -51,10 +55,39 @@ void zipWith(LoopInfoData<T1> &loop1, LoopInfoData<T2> &loop2,
 
 using BlockNameMap = llvm::StringMap<llvm::SmallVector<Mark, 2>>;
 
+/// The options in SMTGenerationOpts that point into the modules
+struct ProgramFunctions {
+    MonoPair<llvm::Function *> mainFunctions;
+    std::set<MonoPair<llvm::Function *>> coupledFunctions;
+    std::map<const llvm::Function *, int> functionNumerals;
+    MonoPair<std::map<int, const llvm::Function *>> reversedFunctionNumerals;
+    /// The functions SMTGenerationOpts currently points to
+    static auto current() -> ProgramFunctions;
+    /// Points SMTGenerationOpts to these functions
+    void select() const;
+};
+
+/// A separately compiled and preprocessed copy of the input programs. The
+/// modules are only valid as long as the actions that created them.
+struct ProgramCopy {
+    MonoPair<std::shared_ptr<clang::CodeGenAction>> actions;
+    MonoPair<std::shared_ptr<llvm::Module>> modules;
+    ProgramFunctions functions;
+    AnalysisResultsMap analysisResults;
+};
+/// Creates a new copy of the programs, SMTGenerationOpts points to its
+/// functions afterwards
+using ProgramFactory = std::function<ProgramCopy()>;
+
+/// Finds the loop transformations and generates the SMT for the transformed
+/// programs. If several transformations are tried, the others are applied to
+/// copies of the programs created by copyPrograms and the solver gets the SMT
+/// serialized with serializeOpts, like the final output.
 std::vector<smt::SharedSMTRef>
 driver(MonoPair<llvm::Module &> modules, AnalysisResultsMap &analysisResults,
        std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>> patterns,
-       llreve::opts::FileOptions fileOpts);
+       llreve::opts::FileOptions fileOpts,
+       llreve::opts::SerializeOpts serializeOpts, ProgramFactory copyPrograms);
 
 std::vector<smt::SharedSMTRef> cegarDriver(
     MonoPair<llvm::Module &> modules, AnalysisResultsMap &analysisResults,
@@ -102,6 +135,11 @@ bool normalMarkBlock(const BlockNameMap &map, const BlockName &blockName);
 void debugAnalysis(MatchInfo<const llvm::Value *> match);
 void dumpLoopCounts(const LoopCountMap &loopCounts);
 std::map<Mark, LoopTransformation> findLoopTransformations(LoopCountMap &map);
+/// Up to count combinations of loop transformations, starting with the one of
+/// findLoopTransformations. The others combine the transformations suggested
+/// by the individual samples, ordered by how many samples suggest them.
+std::vector<std::map<Mark, LoopTransformation>>
+rankLoopTransformations(LoopCountMap &map, size_t count);
 struct LoopCountsAndMark {
     Mark mark;
     LoopCountMap loopCounts;
@@ -109,24 +147,11 @@ struct LoopCountsAndMark {
     LoopCountsAndMark() : mark(-5) {}
 };
 
+void findLoopCounts(LoopCountsAndMark &loopCountsAndMark, Mark mark,
+                    LoopInfo loopInfo);
 template <typename T>
 void findLoopCounts(LoopCountsAndMark &loopCountsAndMark, MatchInfo<T> match) {
-    if (loopCountsAndMark.mark != match.mark) {
-        loopCountsAndMark.loopCounts[match.mark].emplace_back(0, 0);
-        loopCountsAndMark.mark = match.mark;
-    }
-    switch (match.loopInfo) {
-    case LoopInfo::Left:
-        loopCountsAndMark.loopCounts[match.mark].back().first++;
-        break;
-    case LoopInfo::Right:
-        loopCountsAndMark.loopCounts[match.mark].back().second++;
-        break;
-    case LoopInfo::None:
-        loopCountsAndMark.loopCounts[match.mark].back().first++;
-        loopCountsAndMark.loopCounts[match.mark].back().second++;
-        break;
-    }
+    findLoopCounts(loopCountsAndMark, match.mark, match.loopInfo);
 }
 
 struct DynamicAnalysisResults;
@@ -142,45 +167,105 @@ Transformed analyzeMainCounterExample(
     const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
         &patterns,
     unsigned degree);
-void analyzeRelationalCounterExample(
+/// A counterexample that doesn’t start in the main functions after it has
+/// been interpreted. Only the calls and variables of the functions of the
+/// counterexample are set.
+struct InterpretedCounterExample {
+    MarkPair pathMarks;
+    MonoPair<FastVarMap> variables;
+    MonoPair<llvm::Optional<FastCall>> calls;
+};
+// The interpretation only reads the analysis results, so several
+// counterexamples can be interpreted at the same time
+auto interpretRelationalCounterExample(
     MarkPair pathMarks, const ModelValues &vals,
     MonoPair<const llvm::Function *> functions,
+    const AnalysisResultsMap &analysisResults) -> InterpretedCounterExample;
+void analyzeRelationalCounterExample(
+    const InterpretedCounterExample &counterExample, const ModelValues &vals,
     DynamicAnalysisResults &dynamicAnalysisResults,
     const MonoPair<BlockNameMap> &nameMap,
     const AnalysisResultsMap &analysisResults, unsigned maxDegree);
-void analyzeFunctionalCounterExample(
+auto interpretFunctionalCounterExample(
     MarkPair pathMarks, const ModelValues &vals, const llvm::Function *function,
+    Program program, const AnalysisResultsMap &analysisResults)
+    -> InterpretedCounterExample;
+void analyzeFunctionalCounterExample(
+    const InterpretedCounterExample &counterExample, const ModelValues &vals,
     Program program, DynamicAnalysisResults &dynamicAnalysisResults,
     const BlockNameMap &blockNameMap, const AnalysisResultsMap &analysisResults,
     unsigned maxDegree);
 
-void populateHeapPatterns(
-    HeapPatternCandidatesMap &heapPatternCandidates,
-    const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
-        &patterns,
-    const std::vector<smt::SortedVar> &primitiveVariables,
-    MatchInfo<const llvm::Value *> match, ExitIndex exitIndex);
-void populateHeapPatterns(
-    RelationalFunctionInvariantMap<
-        LoopInfoData<llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
-        &heapPatternCandidates,
-    const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
-        &patterns,
-    const std::vector<smt::SortedVar> &primitiveVariables,
-    CoupledCallInfo<const llvm::Value *> match,
-    MonoPair<llvm::Value *> returnValues);
-void populateHeapPatterns(
-    FunctionInvariantMap<HeapPatternCandidates> &heapPatternCandidates,
-    const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
-        &patterns,
-    const std::vector<smt::SortedVar> &primitiveVariables,
-    UncoupledCallInfo<const llvm::Value *> match, llvm::Value *returnValue);
+/// Collects the samples for the heap pattern candidates of one trace. The
+/// instantiations of a pattern are stored as tuples of variable indices and
+/// filtered in blocks of samples. Patterns are only created for the
+/// instantiations that match all samples when flush is called, so flush has
+/// to be called before the candidates are used.
+class HeapPatternSampler {
+    using Step = BlockStep<const llvm::Value *>;
+    static const size_t BlockSize = 64;
+    struct Instantiations {
+        size_t size;
+        // The arguments of each instantiation, one after the other
+        std::vector<uint32_t> arguments;
+    };
+    struct Batch {
+        // The variables referred to by the arguments
+        std::vector<const llvm::Value *> keys;
+        // The remaining instantiations of each pattern
+        std::vector<Instantiations> instantiations;
+        // The values of the variables of the pending samples, row major
+        std::vector<Integer> values;
+        std::vector<MonoPair<Heap>> heaps;
+    };
+    std::shared_ptr<PatternLibrary> library;
+    const std::vector<CompiledPattern> &patterns;
+    std::map<HeapPatternCandidates *, Batch> batches;
+    CompiledPattern::Registers registers;
+    // Candidates that are not new and have no batch have been created by a
+    // previous trace and are filtered directly
+    void sample(HeapPatternCandidates &candidates, bool isNew,
+                const std::vector<smt::SortedVar> &variables,
+                llvm::ArrayRef<const Step *> steps,
+                MonoPair<llvm::Value *> returnInstructions,
+                const MonoPair<Integer> &returnValues, MonoPair<Heap> heaps);
+    void filter(Batch &batch);
+    void flush(HeapPatternCandidates &candidates, Batch &batch);
+
+  public:
+    explicit HeapPatternSampler(
+        const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
+            &patterns);
+    HeapPatternSampler(const HeapPatternSampler &other) = delete;
+    HeapPatternSampler &operator=(const HeapPatternSampler &other) = delete;
+    ~HeapPatternSampler() { assert(batches.empty()); }
+    void add(HeapPatternCandidatesMap &heapPatternCandidates,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             MatchInfo<const llvm::Value *> match, ExitIndex exitIndex);
+    void add(RelationalFunctionInvariantMap<LoopInfoData<
+                 llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
+                 &heapPatternCandidates,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             CoupledCallInfo<const llvm::Value *> match,
+             MonoPair<llvm::Value *> returnValues);
+    void add(FunctionInvariantMap<HeapPatternCandidates> &heapPatternCandidates,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             UncoupledCallInfo<const llvm::Value *> match,
+             llvm::Value *returnValue);
+    void flush();
+};
+
 void dumpPolynomials(
     const IterativeInvariantMap<PolynomialEquations> &equationsMap,
     const FreeVarsMap &freeVarsmap);
 void dumpHeapPatterns(const HeapPatternCandidatesMap &heapPatternsMap);
 
 FastVarMap getVarMap(const llvm::Function *fun, std::vector<mpz_class> vals);
+/// Place an array of random length and content at the address of a random
+/// pointer argument
+HeapMap randomHeap(const llvm::Function &fun,
+                   const FastVarMap &variableValues, int lengthBound,
+                   int valLowerBound, int valUpperBound, unsigned int *seedp);
 
 llvm::StringMap<const llvm::Value *>
 instructionNameMap(const llvm::Function *fun);
@@ -195,7 +280,7 @@ FastVarMap getVarMapFromModel(
     const llvm::StringMap<const llvm::Value *> &instructionNameMap,
     std::vector<smt::SortedVar> freeVars,
     const std::map<std::string, mpz_class> &vals);
-llvm::SmallDenseMap<HeapAddress, Integer> getHeapFromModel(const ArrayVal &ar);
+HeapMap getHeapFromModel(const ArrayVal &ar);
 Heap getHeapFromModel(const std::map<std::string, ArrayVal> &arrays,
                       Program prog);
 MonoPair<Heap> getHeapsFromModel(const std::map<std::string, ArrayVal> &arrays);
@@ -441,133 +526,185 @@ void analyzeUncoupledCall(
     }
 }
 
-template <typename T>
-void analyzeExecution(
-    MonoPair<Call<T>> calls, const MonoPair<BlockNameMap> &nameMaps,
+/// The paths of a call that has already been split at its marks
+template <typename T> class SplitPaths {
+    std::vector<PathStep<T>> paths;
+    size_t index;
+
+  public:
+    explicit SplitPaths(SplitCall<T> call)
+        : paths(std::move(call.steps)), index(0) {}
+    bool atEnd() const { return index == paths.size(); }
+    const PathStep<T> &current() const { return paths[index]; }
+    PathStep<T> take() { return std::move(paths[index++]); }
+    void advance() { ++index; }
+};
+
+/// The paths of a call that is interpreted on demand. Only the current path is
+/// kept in memory, the interpreter is advanced once the next one is needed.
+class InterpretedPaths {
+    CallInterpreter interpreter;
+    const BlockNameMap &nameMap;
+    // The first step of the path after the current one
+    llvm::Optional<BlockStep<const llvm::Value *>> nextStep;
+    llvm::Optional<PathStep<const llvm::Value *>> path;
+    bool exhausted;
+    void interpretPath();
+
+  public:
+    InterpretedPaths(const llvm::Function &fun, const FastState &entry,
+                     const llvm::BasicBlock *startBlock, uint32_t maxSteps,
+                     const BlockNameMap &nameMap,
+                     const AnalysisResultsMap &analysisResults,
+                     FrameLayouts &layouts);
+    bool atEnd() const { return !path.hasValue(); }
+    const PathStep<const llvm::Value *> &current() const { return *path; }
+    PathStep<const llvm::Value *> take() {
+        PathStep<const llvm::Value *> taken = std::move(*path);
+        interpretPath();
+        return taken;
+    }
+    void advance() { interpretPath(); }
+};
+
+/// Walk through the paths of both programs and report the marks at which they
+/// synchronize. Paths is either SplitPaths or InterpretedPaths, apart from the
+/// path of each program that is currently looked at only the previous one is
+/// kept.
+template <typename T, typename Paths>
+void analyzePaths(
+    Paths &paths1, Paths &paths2, const MonoPair<BlockNameMap> &nameMaps,
     const AnalysisResultsMap &analysisResults,
     std::function<void(MatchInfo<T>)> iterativeMatch,
     std::function<void(CoupledCallInfo<T>)> relationalCallMatch,
     std::function<void(UncoupledCallInfo<T>)> functionalCallMatch) {
-    const auto call1 = splitCallAtMarks(std::move(calls.first), nameMaps.first);
-    const auto call2 =
-        splitCallAtMarks(std::move(calls.second), nameMaps.second);
-    auto stepsIt1 = call1.steps.begin();
-    auto stepsIt2 = call2.steps.begin();
-    auto prevStepsIt1 = *stepsIt1;
-    auto prevStepsIt2 = *stepsIt2;
     // The first pathstep is at an entry node and is thus not interesting to
     // us so we can start by moving to the next pathstep.
-    ++stepsIt1;
-    ++stepsIt2;
-    while (stepsIt1 != call1.steps.end() && stepsIt2 != call2.steps.end()) {
+    PathStep<T> prevPath1 = paths1.take();
+    PathStep<T> prevPath2 = paths2.take();
+    while (!paths1.atEnd() && !paths2.atEnd()) {
         // There are two cases to consider, either both programs are at the
-        // same
-        // mark or they are at different marks. The latter case can occur
-        // when
-        // one program is waiting for the other to finish its loops
+        // same mark or they are at different marks. The latter case can occur
+        // when one program is waiting for the other to finish its loops
         auto blockNameIntersection = intersection(
-            nameMaps.first.find(stepsIt1->stepsOnPath.front().blockName)
+            nameMaps.first.find(paths1.current().stepsOnPath.front().blockName)
                 ->second,
-            nameMaps.second.find(stepsIt2->stepsOnPath.front().blockName)
+            nameMaps.second
+                .find(paths2.current().stepsOnPath.front().blockName)
                 ->second);
         if (!blockNameIntersection.empty()) {
             // We want to match calls on the paths that led us here
-            analyzeCallsOnPaths(prevStepsIt1, prevStepsIt2, nameMaps,
+            analyzeCallsOnPaths(prevPath1, prevPath2, nameMaps,
                                 analysisResults, relationalCallMatch,
                                 functionalCallMatch);
             // The flexible coupling is not yet supported so we should the
             // intersection should contain exactly one block
             assert(blockNameIntersection.size() == 1);
             Mark mark = *blockNameIntersection.begin();
-            iterativeMatch(
-                MatchInfo<T>(makeMonoPair(&stepsIt1->stepsOnPath.front(),
-                                          &stepsIt2->stepsOnPath.front()),
-                             LoopInfo::None, mark));
-            prevStepsIt1 = *stepsIt1;
-            prevStepsIt2 = *stepsIt2;
-            ++stepsIt1;
-            ++stepsIt2;
+            iterativeMatch(MatchInfo<T>(
+                makeMonoPair(&paths1.current().stepsOnPath.front(),
+                             &paths2.current().stepsOnPath.front()),
+                LoopInfo::None, mark));
+            prevPath1 = paths1.take();
+            prevPath2 = paths2.take();
         } else {
             // In this case one program should have stayed at the same mark
             LoopInfo loop = LoopInfo::Left;
             Program prog = Program::First;
-            auto stepsIt = stepsIt1;
-            auto prevStepIt = prevStepsIt1;
-            auto prevStepItOther = prevStepsIt2;
-            auto end = call1.steps.end();
-            auto nameMap = nameMaps.first;
-            auto otherNameMap = nameMaps.second;
-            if (stepsIt2->stepsOnPath.front().blockName ==
-                prevStepsIt2.stepsOnPath.front().blockName) {
+            Paths *paths = &paths1;
+            const PathStep<T> *prevPath = &prevPath1;
+            const PathStep<T> *prevPathOther = &prevPath2;
+            const BlockNameMap *nameMap = &nameMaps.first;
+            const BlockNameMap *otherNameMap = &nameMaps.second;
+            if (paths2.current().stepsOnPath.front().blockName ==
+                prevPath2.stepsOnPath.front().blockName) {
                 loop = LoopInfo::Right;
                 prog = Program::Second;
-                stepsIt = stepsIt2;
-                prevStepIt = prevStepsIt2;
-                prevStepItOther = prevStepsIt1;
-                end = call2.steps.end();
-                nameMap = nameMaps.second;
-                otherNameMap = nameMaps.first;
+                paths = &paths2;
+                prevPath = &prevPath2;
+                prevPathOther = &prevPath1;
+                nameMap = &nameMaps.second;
+                otherNameMap = &nameMaps.first;
             }
             // Keep looping one program until it moves on
             do {
-                analyzeUncoupledPath(prevStepIt, nameMap, prog, analysisResults,
-                                     functionalCallMatch);
+                analyzeUncoupledPath(*prevPath, *nameMap, prog,
+                                     analysisResults, functionalCallMatch);
                 const auto blockNameIntersection = intersection(
-                    nameMap.find(prevStepIt.stepsOnPath.front().blockName)
+                    nameMap->find(prevPath->stepsOnPath.front().blockName)
                         ->second,
                     otherNameMap
-                        .find(prevStepItOther.stepsOnPath.front().blockName)
+                        ->find(prevPathOther->stepsOnPath.front().blockName)
                         ->second);
                 assert(blockNameIntersection.size() == 1);
                 Mark mark = *blockNameIntersection.begin();
+                const BlockStep<T> *loopingStep =
+                    &paths->current().stepsOnPath.front();
+                const BlockStep<T> *waitingStep =
+                    &prevPathOther->stepsOnPath.front();
                 // Make sure the first program is always the first argument
                 if (loop == LoopInfo::Left) {
-                    const BlockStep<T> *firstStep =
-                        &stepsIt->stepsOnPath.front();
-                    const BlockStep<T> *secondStep =
-                        &prevStepItOther.stepsOnPath.front();
                     iterativeMatch(MatchInfo<T>(
-                        makeMonoPair(firstStep, secondStep), loop, mark));
+                        makeMonoPair(loopingStep, waitingStep), loop, mark));
                 } else {
-                    const BlockStep<T> *secondStep =
-                        &stepsIt->stepsOnPath.front();
-                    const BlockStep<T> *firstStep =
-                        &prevStepItOther.stepsOnPath.front();
                     iterativeMatch(MatchInfo<T>(
-                        makeMonoPair(firstStep, secondStep), loop, mark));
+                        makeMonoPair(waitingStep, loopingStep), loop, mark));
                 }
                 // Go to the next mark
-                ++stepsIt;
+                paths->advance();
                 // Did we return to the same mark?
-            } while (stepsIt != end &&
-                     stepsIt->stepsOnPath.front().blockName ==
-                         prevStepIt.stepsOnPath.front().blockName);
-            // Copy the iterator values back to the corresponding terator
-            if (loop == LoopInfo::Left) {
-                stepsIt1 = stepsIt;
-            } else {
-                stepsIt2 = stepsIt;
-            }
+            } while (!paths->atEnd() &&
+                     paths->current().stepsOnPath.front().blockName ==
+                         prevPath->stepsOnPath.front().blockName);
         }
     }
     // There can be calls on the way to the return block which we need to
-    // take a
-    // look at here
-    analyzeCallsOnPaths(prevStepsIt1, prevStepsIt2, nameMaps, analysisResults,
+    // take a look at here
+    analyzeCallsOnPaths(prevPath1, prevPath2, nameMaps, analysisResults,
                         relationalCallMatch, functionalCallMatch);
     // This assertion is only correct if the interpreter didn’t stop because it
     // ran out of steps
-    // assert(stepsIt1 == call1.steps.end());
-    // assert(stepsIt2 == call2.steps.end());
+    // assert(paths1.atEnd());
+    // assert(paths2.atEnd());
 }
 
+template <typename T>
+void analyzeExecution(
+    MonoPair<Call<T>> calls, const MonoPair<BlockNameMap> &nameMaps,
+    const AnalysisResultsMap &analysisResults,
+    std::function<void(MatchInfo<T>)> iterativeMatch,
+    std::function<void(CoupledCallInfo<T>)> relationalCallMatch,
+    std::function<void(UncoupledCallInfo<T>)> functionalCallMatch) {
+    SplitPaths<T> paths1(
+        splitCallAtMarks(std::move(calls.first), nameMaps.first));
+    SplitPaths<T> paths2(
+        splitCallAtMarks(std::move(calls.second), nameMaps.second));
+    analyzePaths<T>(paths1, paths2, nameMaps, analysisResults, iterativeMatch,
+                    relationalCallMatch, functionalCallMatch);
+}
+
+/// Interpret both functions and analyze the execution at the same time. The
+/// matches are reported as soon as both programs reach them, so unlike
+/// analyzeExecution the memory does not grow with the length of the
+/// execution. The pointers in the matches are only valid during the callback.
+void analyzeInterpretedExecution(
+    MonoPair<const llvm::Function *> funs, MonoPair<FastVarMap> variables,
+    MonoPair<Heap> heaps, MonoPair<const llvm::BasicBlock *> startBlocks,
+    uint32_t maxSteps, const MonoPair<BlockNameMap> &nameMaps,
+    const AnalysisResultsMap &analysisResults, FrameLayouts &layouts,
+    std::function<void(MatchInfo<const llvm::Value *>)> iterativeMatch,
+    std::function<void(CoupledCallInfo<const llvm::Value *>)>
+        relationalCallMatch,
+    std::function<void(UncoupledCallInfo<const llvm::Value *>)>
+        functionalCallMatch);
+
 struct DynamicAnalysisResults {
     LoopCountsAndMark loopCounts;
     IterativeInvariantMap<PolynomialEquations> polynomialEquations;
     RelationalFunctionInvariantMap<
-        LoopInfoData<FunctionInvariant<Matrix<mpq_class>>>>
+        LoopInfoData<FunctionInvariant<EchelonBasis>>>
         relationalFunctionPolynomialEquations;
-    FunctionInvariantMap<Matrix<mpq_class>> functionPolynomialEquations;
+    FunctionInvariantMap<EchelonBasis> functionPolynomialEquations;
     HeapPatternCandidatesMap heapPatternCandidates;
     RelationalFunctionInvariantMap<
         LoopInfoData<llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
@@ -0,0 +1,91 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "MarkAnalysis.h"
+#include "MonoPair.h"
+
+#include "llreve/dynamic/Invariant.h"
+#include "llreve/dynamic/SerializeTraces.h"
+
+#include "llvm/IR/Function.h"
+
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace llreve {
+namespace dynamic {
+
+/// The invariant a match contributes samples to
+struct CoverageKey {
+    Mark mark;
+    LoopInfo loopInfo;
+    ExitIndex exitIndex;
+    CoverageKey(Mark mark, LoopInfo loopInfo, ExitIndex exitIndex)
+        : mark(mark), loopInfo(loopInfo), exitIndex(std::move(exitIndex)) {}
+};
+
+bool operator<(const CoverageKey &lhs, const CoverageKey &rhs);
+bool operator==(const CoverageKey &lhs, const CoverageKey &rhs);
+
+/// Chooses inputs for the main functions based on the keys reached by the
+/// traces of the previous inputs. An input is kept in the corpus if its trace
+/// reaches a key that has been reached less than RareHits times. Most inputs
+/// of a round are mutations of corpus entries, which are picked with a
+/// probability proportional to the sum of 1/hits over their keys, so inputs
+/// reaching rare keys are mutated more often. The rest are fresh random
+/// inputs like the ones of generateRandomTraces. Saturated keys don’t need
+/// more samples, so they are ignored for both decisions.
+///
+/// The inputs only depend on the seed and the recorded traces, so they don’t
+/// depend on the number of threads interpreting them.
+class CoverageGuidedInputs {
+    struct CorpusEntry {
+        WorkItem input;
+        std::vector<CoverageKey> keys;
+    };
+    static const unsigned RareHits = 4;
+    MonoPair<const llvm::Function *> funs;
+    int lowerBound;
+    int upperBound;
+    std::mt19937 gen;
+    // Used for the seeds of randomHeap
+    unsigned heapSeed;
+    std::map<CoverageKey, unsigned> hits;
+    std::set<CoverageKey> saturatedKeys;
+    std::vector<CorpusEntry> corpus;
+    auto randomInput() -> WorkItem;
+    auto mutate(WorkItem input) -> WorkItem;
+    void chooseHeap(WorkItem &input);
+
+  public:
+    CoverageGuidedInputs(MonoPair<const llvm::Function *> funs, int lowerBound,
+                         int upperBound, unsigned seed);
+    /// The inputs of the next round, their traces have to be recorded before
+    /// the next call to profit from the feedback
+    auto nextRound(size_t size) -> std::vector<WorkItem>;
+    /// Records the keys reached by the trace of the input and returns whether
+    /// one of them has not been reached before
+    auto record(const WorkItem &input, std::vector<CoverageKey> keys) -> bool;
+    /// The number of traces that reached each key
+    auto coverage() const -> const std::map<CoverageKey, unsigned> & {
+        return hits;
+    }
+    /// Marks a reached key whose equations can’t change anymore
+    void saturate(const CoverageKey &key) { saturatedKeys.insert(key); }
+    auto saturated() const -> bool {
+        return !hits.empty() && saturatedKeys.size() == hits.size();
+    }
+};
+}
+}
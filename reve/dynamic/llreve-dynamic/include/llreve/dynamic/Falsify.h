@@ -0,0 +1,71 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "AnalysisResults.h"
+#include "MonoPair.h"
+#include "Opts.h"
+
+#include "llreve/dynamic/Interpreter.h"
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/Module.h"
+
+#include <ostream>
+
+namespace llreve {
+namespace dynamic {
+
+/// Options for the differential testing that runs before SMT generation
+struct FalsifyOpts {
+    // Wall clock budget for the complete search in milliseconds
+    unsigned Timeout;
+    // Number of worker threads, 0 means one per hardware thread
+    unsigned Threads;
+    // Maximum number of blocks that are interpreted for a single execution
+    uint32_t MaxSteps;
+    // Seed for the input generator, worker i uses Seed + i
+    unsigned Seed;
+    FalsifyOpts(unsigned timeout, unsigned threads, uint32_t maxSteps,
+                unsigned seed)
+        : Timeout(timeout), Threads(threads), MaxSteps(maxSteps), Seed(seed) {}
+};
+
+/// A concrete input on which the two programs violate the output relation
+struct FalsificationWitness {
+    MonoPair<FastVarMap> arguments;
+    MonoPair<Heap> heaps;
+    MonoPair<Integer> returnValues;
+    MonoPair<Heap> returnHeaps;
+    FalsificationWitness(MonoPair<FastVarMap> arguments, MonoPair<Heap> heaps,
+                         MonoPair<Integer> returnValues,
+                         MonoPair<Heap> returnHeaps)
+        : arguments(std::move(arguments)), heaps(std::move(heaps)),
+          returnValues(std::move(returnValues)),
+          returnHeaps(std::move(returnHeaps)) {}
+};
+
+/// Run the main functions on random and boundary inputs that satisfy the input
+/// relation and check the output relation on the results. Returns the first
+/// witness found before the timeout expires.
+auto falsify(MonoPair<const llvm::Module &> modules,
+             MonoPair<const llvm::Function *> functions,
+             const AnalysisResultsMap &analysisResults,
+             const llreve::opts::FileOptions &fileOpts, FalsifyOpts opts)
+    -> llvm::Optional<FalsificationWitness>;
+
+/// Checks if the interpreter can execute the function and everything it calls
+/// using the semantics of the SMT encoding.
+auto canFalsify(const llvm::Function &fun) -> bool;
+
+void dumpWitness(std::ostream &out, const FalsificationWitness &witness);
+} // namespace dynamic
+} // namespace llreve
@@ -0,0 +1,106 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "Integer.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace llreve {
+namespace dynamic {
+using HeapAddress = Integer;
+
+/// A persistent hash array mapped trie from addresses to values. Copies share
+/// all nodes, an update only copies the shared nodes on the path to the
+/// entry, so both copying and updating take O(log n). Each node stores the
+/// sum of the hashes of the entries below it, so maps that differ can
+/// usually be told apart without looking at their entries.
+class HeapMap {
+  public:
+    using Entry = std::pair<HeapAddress, Integer>;
+
+  private:
+    struct Node {
+        // The slots of the entries and of the children, five bits of the
+        // hash of the address select the slot on each level
+        uint32_t entryMap = 0;
+        uint32_t nodeMap = 0;
+        // Ordered by slot. Nodes below MaxDepth have used all bits of the
+        // hash, their entries are unordered and the maps are empty.
+        std::vector<Entry> entries;
+        std::vector<std::shared_ptr<Node>> children;
+        size_t hash = 0;
+    };
+    static const unsigned MaxDepth = 13;
+    std::shared_ptr<Node> root;
+    size_t count = 0;
+    static void put(std::shared_ptr<Node> &node, Entry entry, size_t keyHash,
+                    unsigned depth, size_t &hashDelta);
+    static bool nodesEqual(const Node &lhs, const Node &rhs, unsigned depth);
+    static bool containedIn(const Node *small, const Node *big,
+                            const HeapMap &bigMap, const Integer &background,
+                            unsigned depth);
+
+  public:
+    class const_iterator {
+        // The nodes on the path to the current entry. The position in a node
+        // first runs over its entries and then over its children.
+        std::vector<std::pair<const Node *, size_t>> path;
+        void settle();
+
+      public:
+        explicit const_iterator(const Node *root);
+        const Entry &operator*() const {
+            return path.back().first->entries[path.back().second];
+        }
+        const Entry *operator->() const { return &**this; }
+        const_iterator &operator++() {
+            ++path.back().second;
+            settle();
+            return *this;
+        }
+        bool operator==(const const_iterator &other) const {
+            return path == other.path;
+        }
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+    };
+    auto begin() const -> const_iterator { return const_iterator(root.get()); }
+    auto end() const -> const_iterator { return const_iterator(nullptr); }
+    auto size() const -> size_t { return count; }
+    auto empty() const -> bool { return count == 0; }
+    /// nullptr if there is no entry for the address
+    auto lookup(const HeapAddress &address) const -> const Integer *;
+    /// Inserts the entry if there is none for its address yet and returns
+    /// whether it has been inserted
+    auto insert(Entry entry) -> bool;
+    void set(const HeapAddress &address, Integer value);
+    /// Copies of a map share their root until one of them is modified
+    auto sharesRootWith(const HeapMap &other) const -> bool {
+        return root == other.root;
+    }
+    /// The root of the map, it identifies the entries as long as the map
+    /// exists
+    auto identity() const -> const void * { return root.get(); }
+    /// True if each entry has the same value in big, where addresses
+    /// without an entry have the background value. Subtrees shared with big
+    /// are skipped.
+    auto isContainedIn(const HeapMap &big, const Integer &background) const
+        -> bool;
+    friend bool operator==(const HeapMap &lhs, const HeapMap &rhs);
+};
+
+bool operator==(const HeapMap &lhs, const HeapMap &rhs);
+}
+}
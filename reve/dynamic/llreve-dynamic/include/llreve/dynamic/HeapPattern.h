@@ -15,6 +15,13 @@
 #include "Permutation.h"
 #include "SerializeTraces.h"
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <algorithm>
+#include <mutex>
+
 namespace llreve {
 namespace dynamic {
 using HoleMap = std::map<size_t, mpz_class>;
@@ -662,6 +669,11 @@ template <typename T> struct UnaryIntExpr : public HeapExpr<T> {
 
 enum class RangeQuantifier { All, Any };
 
+/// True if the hole is only used as the address of heap accesses
+template <typename T> bool onlyLoadsAt(const HeapExpr<T> &expr, size_t hole);
+template <typename T>
+bool onlyLoadsAt(const HeapPattern<T> &pat, size_t hole);
+
 template <typename T> struct RangeProp : public HeapPattern<T> {
     RangeQuantifier quant;
     MonoPair<std::shared_ptr<HeapExpr<T>>> bounds;
@@ -697,13 +709,16 @@ template <typename T> struct RangeProp : public HeapPattern<T> {
     bool matches(const FastVarMap &variables,
                  const MonoPair<const Heap &> &heaps,
                  const HoleMap &holes) const override {
-        assert(holes.count(index) == 0);
+        // The index shadows a hole with the same index bound outside
         HoleMap newHoles = holes;
         MonoPair<mpz_class> boundVals = bounds.template map<mpz_class>(
             [&variables, &heaps,
              &newHoles](std::shared_ptr<HeapExpr<T>> arg) -> mpz_class {
                 return arg->eval(variables, heaps, newHoles);
             });
+        if (onlyLoadsAt(*pat, index)) {
+            return matchesSparse(variables, heaps, newHoles, boundVals);
+        }
         for (mpz_class i = boundVals.first; i <= boundVals.second; ++i) {
             newHoles[index] = i;
             bool result = pat->matches(variables, heaps, newHoles);
@@ -720,6 +735,49 @@ template <typename T> struct RangeProp : public HeapPattern<T> {
             return true;
         }
     }
+    // All indices without an entry in one of the heaps behave the same, so
+    // only the entries and one of the other indices have to be checked
+    bool matchesSparse(const FastVarMap &variables,
+                       const MonoPair<const Heap &> &heaps, HoleMap &holes,
+                       const MonoPair<mpz_class> &boundVals) const {
+        std::vector<mpz_class> addresses;
+        for (const HeapMap *entries :
+             {&heaps.first.assignedValues(), &heaps.second.assignedValues()}) {
+            for (const auto &entry : *entries) {
+                mpz_class address = entry.first.asUnbounded();
+                if (address >= boundVals.first && address <= boundVals.second) {
+                    addresses.push_back(std::move(address));
+                }
+            }
+        }
+        std::sort(addresses.begin(), addresses.end());
+        addresses.erase(std::unique(addresses.begin(), addresses.end()),
+                        addresses.end());
+        // The smallest index that has not been checked, as long as all
+        // indices below it have been checked
+        mpz_class next = boundVals.first;
+        bool dense = true;
+        for (const auto &address : addresses) {
+            if (dense && address == next) {
+                ++next;
+            } else {
+                dense = false;
+            }
+            holes[index] = address;
+            bool result = pat->matches(variables, heaps, holes);
+            if (result != (quant == RangeQuantifier::All)) {
+                return result;
+            }
+        }
+        if (next <= boundVals.second) {
+            holes[index] = next;
+            bool result = pat->matches(variables, heaps, holes);
+            if (result != (quant == RangeQuantifier::All)) {
+                return result;
+            }
+        }
+        return quant == RangeQuantifier::All;
+    }
     std::ostream &dump(std::ostream &os) const override {
         os << "(";
         switch (quant) {
@@ -869,6 +927,192 @@ template <typename T> struct HeapExprProp : public HeapPattern<T> {
     }
 };
 
+template <typename T> bool onlyLoadsAt(const HeapExpr<T> &expr, size_t hole) {
+    switch (expr.getType()) {
+    case ExprType::HeapAccess: {
+        const auto &access = static_cast<const HeapAccess<T> &>(expr);
+        if (access.atVal->getType() == ExprType::Hole) {
+            return true;
+        }
+        return onlyLoadsAt(*access.atVal, hole);
+    }
+    case ExprType::Hole:
+        return static_cast<const Hole<T> &>(expr).index != hole;
+    case ExprType::Binary: {
+        const auto &binExpr = static_cast<const BinaryIntExpr<T> &>(expr);
+        return onlyLoadsAt(*binExpr.args.first, hole) &&
+               onlyLoadsAt(*binExpr.args.second, hole);
+    }
+    case ExprType::Unary:
+        return false;
+    case ExprType::Constant:
+    case ExprType::Variable:
+    case ExprType::HeapIndex:
+    case ExprType::HeapValue:
+        return true;
+    }
+}
+
+template <typename T>
+bool onlyLoadsAt(const HeapPattern<T> &pat, size_t hole) {
+    switch (pat.getType()) {
+    case PatternType::Binary: {
+        const auto &binPat = static_cast<const BinaryHeapPattern<T> &>(pat);
+        return onlyLoadsAt(*binPat.args.first, hole) &&
+               onlyLoadsAt(*binPat.args.second, hole);
+    }
+    case PatternType::Unary:
+        return onlyLoadsAt(*static_cast<const UnaryHeapPattern<T> &>(pat).arg,
+                           hole);
+    case PatternType::HeapEquality:
+        return true;
+    case PatternType::Range: {
+        const auto &rangePat = static_cast<const RangeProp<T> &>(pat);
+        return onlyLoadsAt(*rangePat.bounds.first, hole) &&
+               onlyLoadsAt(*rangePat.bounds.second, hole) &&
+               onlyLoadsAt(*rangePat.pat, hole);
+    }
+    case PatternType::ExprProp: {
+        const auto &exprPat = static_cast<const HeapExprProp<T> &>(pat);
+        return onlyLoadsAt(*exprPat.args.first, hole) &&
+               onlyLoadsAt(*exprPat.args.second, hole);
+    }
+    }
+}
+
+/// A pattern template compiled to a postfix program over 64 bit integers, so
+/// the instantiations of a template can be evaluated without creating a
+/// pattern for each of them. The arguments of an instantiation are passed in
+/// the order used by distributeArguments.
+class CompiledPattern {
+  public:
+    /// Scratch space for evaluate
+    struct Registers {
+        std::vector<int64_t> stack;
+        std::vector<int64_t> holes;
+        // The sorted addresses of the entries of pairs of heaps, by the
+        // identities of their entries. They are shared by all patterns and
+        // have to be cleared before the heaps are destroyed.
+        std::map<std::pair<const void *, const void *>, std::vector<int64_t>>
+            addresses;
+    };
+
+  private:
+    enum class OpCode : uint8_t {
+        Argument,
+        Constant,
+        // A constant that doesn’t fit in 64 bits
+        LargeConstant,
+        Hole,
+        Load,
+        Add,
+        Subtract,
+        Mul,
+        Compare,
+        EqualHeaps,
+        Not,
+        And,
+        Or,
+        Impl,
+        // Followed by the body of the range
+        Range,
+        // A range whose body only uses the index to access the heaps
+        SparseRange
+    };
+    struct Instruction {
+        OpCode op;
+        // The heap of a load, the proposition of a comparison or the
+        // quantifier of a range
+        uint8_t kind;
+        // The argument or the hole, for a range the hole it binds
+        uint32_t operand;
+        // The constant, for a range the length of its body
+        int64_t value;
+    };
+    std::shared_ptr<HeapPattern<VariablePlaceholder>> pattern;
+    std::vector<Instruction> program;
+    size_t argumentCount;
+    // The index of the hole bound by each range, ranges are numbered in the
+    // order in which they appear. Ranges can reuse the index of a sibling
+    // or an enclosing range, so an index can belong to several holes.
+    std::vector<size_t> holeIndices;
+    // The holes bound at the current position, only used by compile
+    std::map<size_t, uint32_t> boundHoles;
+    // The values of the large constants, only needed to restore the pattern
+    std::vector<mpz_class> constants;
+    CompiledPattern() : argumentCount(0) {}
+    void compile(const HeapPattern<VariablePlaceholder> &pat);
+    void compile(const HeapExpr<VariablePlaceholder> &expr);
+    void emit(OpCode op, uint8_t kind = 0, uint32_t operand = 0,
+              int64_t value = 0) {
+        program.push_back({op, kind, operand, value});
+    }
+    bool run(size_t begin, size_t end, const int64_t *arguments,
+             const MonoPair<const Heap &> &heaps, Registers &registers) const;
+    bool runRange(size_t pc, int64_t lower, int64_t upper,
+                  const int64_t *arguments, const MonoPair<const Heap &> &heaps,
+                  Registers &registers, bool &result) const;
+    auto decompile(size_t begin, size_t end) const
+        -> std::shared_ptr<HeapPattern<VariablePlaceholder>>;
+
+  public:
+    explicit CompiledPattern(
+        std::shared_ptr<HeapPattern<VariablePlaceholder>> pattern);
+    auto arguments() const -> size_t { return argumentCount; }
+    /// None if one of the values doesn’t fit in 64 bits. In that case the
+    /// pattern has to be instantiated and matched instead.
+    auto evaluate(const int64_t *arguments, const MonoPair<const Heap &> &heaps,
+                  Registers &registers) const -> llvm::Optional<bool>;
+    auto instantiate(llvm::ArrayRef<const llvm::Value *> arguments) const
+        -> std::shared_ptr<HeapPattern<const llvm::Value *>> {
+        return pattern->distributeArguments(arguments.vec());
+    }
+    auto source() const -> std::shared_ptr<HeapPattern<VariablePlaceholder>> {
+        return pattern;
+    }
+    /// Appends the program to a pattern cache
+    void serialize(std::string &out) const;
+    /// Reads a program written by serialize and restores the pattern from
+    /// it. None if the input is truncated or not a valid program.
+    static auto deserialize(llvm::StringRef &in)
+        -> llvm::Optional<CompiledPattern>;
+};
+
+/// The compiled patterns of a pattern file. The library is shared by all
+/// samplers of a run, so the patterns are only compiled once. It also caches
+/// the instantiations for each number of variables since they only depend on
+/// the number of arguments of a pattern.
+class PatternLibrary {
+    std::vector<CompiledPattern> compiledPatterns;
+    std::mutex mutex;
+    // All tuples of arguments in the order of Range, one after the other, by
+    // the number of arguments and the number of variables
+    std::map<std::pair<size_t, uint32_t>,
+             std::shared_ptr<const std::vector<uint32_t>>>
+        tuples;
+
+  public:
+    explicit PatternLibrary(std::vector<CompiledPattern> patterns)
+        : compiledPatterns(std::move(patterns)) {}
+    /// The library of the patterns. They are only compiled if they are not
+    /// the patterns of the previous call or of the last cache that was read.
+    static auto
+    get(const std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
+            &patterns) -> std::shared_ptr<PatternLibrary>;
+    /// Reads the library from a cache written by write for a pattern file
+    /// with the same contents. Returns nullptr if there is no such cache.
+    static auto read(const std::string &cachePath, llvm::StringRef source)
+        -> std::shared_ptr<PatternLibrary>;
+    void write(const std::string &cachePath, llvm::StringRef source) const;
+    auto compiled() const -> const std::vector<CompiledPattern> & {
+        return compiledPatterns;
+    }
+    auto patterns() const
+        -> std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>;
+    auto instantiations(size_t arguments, uint32_t variables)
+        -> std::shared_ptr<const std::vector<uint32_t>>;
+};
+
 std::vector<std::shared_ptr<HeapPattern<VariablePlaceholder>>>
 parsePatterns(FILE *stream);
 }
@@ -11,39 +11,68 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <gmpxx.h>
 #include <iostream>
 
 #include "Helper.h"
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/Hashing.h"
 
 enum class IntType { Unbounded, Bounded };
 
+// The small representation relies on mpz_class accepting all int64_t values
+static_assert(sizeof(long) == sizeof(int64_t), "long needs to have 64 bits");
+
 struct Integer {
     union {
+        // Unbounded integers that fit in 64 bits are stored inline so that
+        // arithmetic on them doesn’t need to allocate
+        int64_t small;
         mpz_class unbounded;
         llvm::APInt bounded;
     };
     IntType type;
-    Integer() : unbounded(mpz_class(0)), type(IntType::Unbounded) {}
-    explicit Integer(mpz_class i)
-        : unbounded(std::move(i)), type(IntType::Unbounded) {}
-    explicit Integer(llvm::APInt i) : bounded(i), type(IntType::Bounded) {}
-    Integer(const Integer &other) : type(other.type) {
+    // Only set for unbounded integers. Unbounded integers are always stored in
+    // the small representation if they fit so equal values are represented
+    // in the same way.
+    bool isSmall;
+    Integer() : small(0), type(IntType::Unbounded), isSmall(true) {}
+    explicit Integer(mpz_class i) : type(IntType::Unbounded) {
+        if (i.fits_slong_p()) {
+            small = i.get_si();
+            isSmall = true;
+        } else {
+            new (&unbounded) mpz_class(std::move(i));
+            isSmall = false;
+        }
+    }
+    explicit Integer(llvm::APInt i)
+        : bounded(i), type(IntType::Bounded), isSmall(false) {}
+    Integer(const Integer &other) : type(other.type), isSmall(other.isSmall) {
         switch (type) {
         case IntType::Unbounded:
-            new (&unbounded) mpz_class(other.unbounded);
+            if (isSmall) {
+                small = other.small;
+            } else {
+                new (&unbounded) mpz_class(other.unbounded);
+            }
             break;
         case IntType::Bounded:
             new (&bounded) llvm::APInt(other.bounded);
             break;
         }
     }
-    Integer(Integer &&other) : type(std::move(other.type)) {
+    Integer(Integer &&other)
+        : type(std::move(other.type)), isSmall(other.isSmall) {
         switch (type) {
         case IntType::Unbounded:
-            new (&unbounded) mpz_class(std::move(other.unbounded));
+            if (isSmall) {
+                small = other.small;
+            } else {
+                new (&unbounded) mpz_class(std::move(other.unbounded));
+            }
             break;
         case IntType::Bounded:
             new (&bounded) llvm::APInt(std::move(other.bounded));
@@ -56,20 +85,34 @@ struct Integer {
 
     inline static Integer True() { return Integer(llvm::APInt(1, 1)); }
     inline static Integer False() { return Integer(llvm::APInt(1, 0)); }
-    explicit Integer(bool val) : type(IntType::Bounded) {
+    explicit Integer(bool val) : type(IntType::Bounded), isSmall(false) {
         if (val) {
             new (&bounded) llvm::APInt(1, 1);
         } else {
             new (&bounded) llvm::APInt(1, 0);
         }
     }
+    static Integer fromSmall(int64_t i) {
+        Integer result;
+        result.small = i;
+        return result;
+    }
+    bool bothSmall(const Integer &other) const {
+        return isSmall && other.isSmall;
+    }
 
     Integer asPointer() const;
     Integer &operator+=(const Integer &other) {
         assert(type == other.type);
+        int64_t result;
         switch (type) {
         case IntType::Unbounded:
-            unbounded += other.unbounded;
+            if (bothSmall(other) &&
+                !__builtin_add_overflow(small, other.small, &result)) {
+                small = result;
+            } else {
+                *this = Integer(asUnbounded() + other.asUnbounded());
+            }
             break;
         case IntType::Bounded:
             bounded += other.bounded;
@@ -82,16 +125,33 @@ struct Integer {
         return lhs;
     }
     Integer operator-() const {
+        int64_t result;
         switch (type) {
         case IntType::Unbounded:
-            return Integer(-unbounded);
+            if (isSmall && !__builtin_sub_overflow(0, small, &result)) {
+                return fromSmall(result);
+            }
+            return Integer(-asUnbounded());
         case IntType::Bounded:
             return Integer(-bounded);
         }
     }
     Integer &operator-=(const Integer &other) {
         assert(type == other.type);
-        operator+=(-other);
+        int64_t result;
+        switch (type) {
+        case IntType::Unbounded:
+            if (bothSmall(other) &&
+                !__builtin_sub_overflow(small, other.small, &result)) {
+                small = result;
+            } else {
+                *this = Integer(asUnbounded() - other.asUnbounded());
+            }
+            break;
+        case IntType::Bounded:
+            operator+=(-other);
+            break;
+        }
         return *this;
     }
     friend Integer operator-(Integer lhs, const Integer &rhs) {
@@ -102,7 +162,13 @@ struct Integer {
         assert(type == other.type);
         switch (type) {
         case IntType::Unbounded:
-            unbounded /= other.unbounded;
+            // The only quotient that doesn’t fit is INT64_MIN / -1
+            if (bothSmall(other) &&
+                !(small == INT64_MIN && other.small == -1)) {
+                small /= other.small;
+            } else {
+                *this = Integer(asUnbounded() / other.asUnbounded());
+            }
             break;
         case IntType::Bounded:
             logError("Use sdiv and udiv instead\n");
@@ -116,9 +182,15 @@ struct Integer {
     }
     Integer operator*=(const Integer &other) {
         assert(type == other.type);
+        int64_t result;
         switch (type) {
         case IntType::Unbounded:
-            unbounded *= other.unbounded;
+            if (bothSmall(other) &&
+                !__builtin_mul_overflow(small, other.small, &result)) {
+                small = result;
+            } else {
+                *this = Integer(asUnbounded() * other.asUnbounded());
+            }
             break;
         case IntType::Bounded:
             bounded *= other.bounded;
@@ -133,7 +205,7 @@ struct Integer {
     Integer &operator++() {
         switch (type) {
         case IntType::Unbounded:
-            unbounded++;
+            *this += fromSmall(1);
             break;
         case IntType::Bounded:
             bounded++;
@@ -149,7 +221,7 @@ struct Integer {
     Integer &operator--() {
         switch (type) {
         case IntType::Unbounded:
-            unbounded--;
+            *this -= fromSmall(1);
             break;
         case IntType::Bounded:
             bounded--;
@@ -165,6 +237,9 @@ struct Integer {
     std::string get_str() const {
         switch (type) {
         case IntType::Unbounded:
+            if (isSmall) {
+                return std::to_string(small);
+            }
             return unbounded.get_str();
         case IntType::Bounded:
             return bounded.toString(10, true);
@@ -173,11 +248,25 @@ struct Integer {
     mpz_class asUnbounded() const {
         switch (type) {
         case IntType::Unbounded:
+            if (isSmall) {
+                return mpz_class(static_cast<long>(small));
+            }
             return unbounded;
         case IntType::Bounded:
             return bounded.getSExtValue();
         }
     }
+    /// Stores the value of asUnbounded in result if it fits in 64 bits
+    bool asSmall(int64_t &result) const {
+        switch (type) {
+        case IntType::Unbounded:
+            result = small;
+            return isSmall;
+        case IntType::Bounded:
+            result = bounded.getSExtValue();
+            return true;
+        }
+    }
     Integer zext(unsigned width);
     Integer sext(unsigned width);
     bool eq(const Integer &rhs) const;
@@ -210,7 +299,10 @@ inline bool operator<(const Integer &lhs, const Integer &rhs) {
     assert(lhs.type == rhs.type);
     switch (lhs.type) {
     case IntType::Unbounded:
-        return lhs.unbounded < rhs.unbounded;
+        if (lhs.bothSmall(rhs)) {
+            return lhs.small < rhs.small;
+        }
+        return lhs.asUnbounded() < rhs.asUnbounded();
     case IntType::Bounded:
         // Only used for putting it in a map
         return lhs.bounded.slt(rhs.bounded);
@@ -232,6 +324,10 @@ inline bool operator==(const Integer &lhs, const Integer &rhs) {
     assert(lhs.type == rhs.type);
     switch (lhs.type) {
     case IntType::Unbounded:
+        // Both representations are canonical
+        if (lhs.isSmall || rhs.isSmall) {
+            return lhs.isSmall && rhs.isSmall && lhs.small == rhs.small;
+        }
         return lhs.unbounded == rhs.unbounded;
     case IntType::Bounded:
         return lhs.bounded == rhs.bounded;
@@ -241,4 +337,7 @@ inline bool operator!=(const Integer &lhs, const Integer &rhs) {
     return !(lhs == rhs);
 }
 
+/// Equal integers of the same type have the same hash
+llvm::hash_code hash_value(const Integer &val);
+
 llvm::APInt makeBoundedInt(unsigned numBits, int64_t i);
@@ -16,10 +16,12 @@
 
 #include <gmpxx.h>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
@@ -27,6 +29,7 @@
 
 #include "json.hpp"
 
+#include "HeapMap.h"
 #include "Integer.h"
 
 namespace llvm {
@@ -48,24 +51,15 @@ template <> struct DenseMapInfo<Integer> {
     static inline Integer getTombstoneKey() {
         return Integer(llvm::APInt::getMaxValue(5));
     }
-    static unsigned getHashValue(Integer val) {
-        switch (val.type) {
-        case IntType::Unbounded:
-            // abs is necessary because gmp is shitty
-            return (unsigned)(hash_combine_range(
-                val.unbounded.get_mpz_t()->_mp_d,
-                val.unbounded.get_mpz_t()->_mp_d +
-                    std::abs(val.unbounded.get_mpz_t()->_mp_size)));
-        case IntType::Bounded:
-            return (unsigned)(hash_value(val.bounded));
-        }
+    static unsigned getHashValue(const Integer &val) {
+        return (unsigned)(hash_value(val));
     }
-    static bool isEqual(Integer lhs, Integer rhs) {
+    static bool isEqual(const Integer &lhs, const Integer &rhs) {
         switch (lhs.type) {
         case IntType::Unbounded:
             switch (rhs.type) {
             case IntType::Unbounded:
-                return lhs.unbounded == rhs.unbounded;
+                return lhs == rhs;
             case IntType::Bounded:
                 return false;
             }
@@ -108,23 +102,30 @@ namespace llreve {
 namespace dynamic {
 using BlockName = llvm::StringRef;
 using VarName = const llvm::Value *;
-using HeapAddress = Integer;
 
 nlohmann::json toJSON(const Integer &v);
 bool unsafeBool(const Integer &v);
 
+/// The entries of a heap are a persistent map, so snapshots and passing heaps
+/// to calls don’t copy them and a store only copies the nodes on its path.
 struct Heap {
-    llvm::SmallDenseMap<HeapAddress, Integer> assignedValues;
+  private:
+    HeapMap entries;
+
+  public:
     Integer background;
-    Heap() : assignedValues({}), background(mpz_class(0)) {}
-    Heap(llvm::SmallDenseMap<HeapAddress, Integer> assignedValues,
-         Integer background)
-        : assignedValues(std::move(assignedValues)),
+    Heap() : background(mpz_class(0)) {}
+    Heap(HeapMap assignedValues, Integer background)
+        : entries(std::move(assignedValues)),
           background(std::move(background)) {}
+    const HeapMap &assignedValues() const { return entries; }
+    HeapMap &mutableAssignedValues() { return entries; }
+    bool sharesEntriesWith(const Heap &other) const {
+        return entries.sharesRootWith(other.entries);
+    }
 };
 
-bool isContainedIn(const llvm::SmallDenseMap<HeapAddress, Integer> &small,
-                   const Heap &big);
+bool isContainedIn(const HeapMap &small, const Heap &big);
 
 bool operator==(const Heap &lhs, const Heap &rhs);
 
@@ -193,23 +194,76 @@ template <typename T> struct Call : Step<T> {
 
 using FastCall = Call<const llvm::Value *>;
 
+/// The variables of a block step are stored as the variables that changed
+/// since the previous step of the same call. Every KeyframeInterval steps all
+/// variables are stored, so reconstructing the state of a step only needs to
+/// look at a bounded number of deltas.
+template <typename T> struct StateDelta {
+    static const unsigned KeyframeInterval = 32;
+    // Null for keyframes
+    std::shared_ptr<const StateDelta<T>> previous;
+    VarMap<T> changed;
+    Heap heap;
+    // Number of deltas between this one and the keyframe
+    unsigned distance;
+    StateDelta(std::shared_ptr<const StateDelta<T>> previous,
+               VarMap<T> changed, Heap heap)
+        : previous(std::move(previous)), changed(std::move(changed)),
+          heap(std::move(heap)),
+          distance(this->previous ? this->previous->distance + 1 : 0) {}
+    auto state() const -> State<T> {
+        llvm::SmallVector<const StateDelta<T> *, KeyframeInterval> chain;
+        for (auto delta = this; delta != nullptr;
+             delta = delta->previous.get()) {
+            chain.push_back(delta);
+        }
+        VarMap<T> variables(chain.back()->changed);
+        for (auto it = std::next(chain.rbegin()); it != chain.rend(); ++it) {
+            for (const auto &var : (*it)->changed) {
+                insertOrReplace(variables, var);
+            }
+        }
+        return State<T>(std::move(variables), heap);
+    }
+    /// The value of a single variable, null if it is not part of the state
+    auto lookup(const T &var) const -> const Integer * {
+        for (auto delta = this; delta != nullptr;
+             delta = delta->previous.get()) {
+            auto it = delta->changed.find(var);
+            if (it != delta->changed.end()) {
+                return &it->second;
+            }
+        }
+        return nullptr;
+    }
+};
+
 template <typename T> struct BlockStep : Step<T> {
     BlockName blockName;
-    State<T> state;
+    std::shared_ptr<const StateDelta<T>> delta;
     // The calls performed in this block
     std::vector<Call<T>> calls;
     BlockStep(BlockName blockName, State<T> state, std::vector<Call<T>> calls)
-        : blockName(std::move(blockName)), state(std::move(state)),
+        : blockName(std::move(blockName)),
+          delta(std::make_shared<StateDelta<T>>(
+              nullptr, std::move(state.variables), std::move(state.heap))),
+          calls(std::move(calls)) {}
+    BlockStep(BlockName blockName, std::shared_ptr<const StateDelta<T>> delta,
+              std::vector<Call<T>> calls)
+        : blockName(std::move(blockName)), delta(std::move(delta)),
           calls(std::move(calls)) {}
     BlockStep(BlockStep &&other) = default;
     BlockStep(const BlockStep &other) = default;
     BlockStep &operator=(BlockStep &&other) = default;
     BlockStep &operator=(const BlockStep &other) = default;
+    /// The state after the phi nodes of this block
+    auto state() const -> State<T> { return delta->state(); }
+    auto heap() const -> const Heap & { return delta->heap; }
     nlohmann::json
     toJSON(std::function<std::string(T)> varName) const override {
         nlohmann::json j;
         j["block_name"] = blockName;
-        j["state"] = stateToJSON(state, varName);
+        j["state"] = stateToJSON(state(), varName);
         std::vector<nlohmann::json> jsonCalls;
         for (auto call : calls) {
             jsonCalls.push_back(call.toJSON(varName));
@@ -221,7 +275,7 @@ template <typename T> struct BlockStep : Step<T> {
 
 template <typename T> struct BlockUpdate {
     // State after phi nodes
-    State<T> step;
+    std::shared_ptr<const StateDelta<T>> step;
     // next block, null if the block ended with a return instruction
     const llvm::BasicBlock *nextBlock;
     // function calls in this block in the order they were called
@@ -231,7 +285,7 @@ template <typename T> struct BlockUpdate {
     // steps this block has needed, if there are no function calls exactly one
     // step per block is needed
     uint32_t blocksVisited;
-    BlockUpdate(State<T> step, // State end,
+    BlockUpdate(std::shared_ptr<const StateDelta<T>> step, // State end,
                 const llvm::BasicBlock *nextBlock, std::vector<Call<T>> calls,
                 bool earlyExit, uint32_t blocksVisited)
         : step(std::move(step)), nextBlock(nextBlock), calls(std::move(calls)),
@@ -247,6 +301,92 @@ struct TerminatorUpdate {
     TerminatorUpdate() = default;
 };
 
+/// Dense slot indices for the arguments and instructions of a function. The
+/// values of a call are stored in a flat array indexed by these slots so the
+/// interpreter does not need to hash an llvm::Value for every access.
+struct FrameLayout {
+    static const unsigned NoSlot = ~0u;
+    // The arguments come first followed by the instructions in block order,
+    // so the instructions of a block occupy consecutive slots
+    std::vector<const llvm::Value *> values;
+    llvm::DenseMap<const llvm::Value *, unsigned> slots;
+    // The slots of the operands of each instruction, NoSlot for constants
+    std::vector<llvm::SmallVector<unsigned, 2>> operandSlots;
+    explicit FrameLayout(const llvm::Function &fun);
+    unsigned slot(const llvm::Value *val) const {
+        auto it = slots.find(val);
+        return it == slots.end() ? NoSlot : it->second;
+    }
+};
+
+/// Computes the layout of each function once. The layouts are only valid as
+/// long as the functions are not modified and the cache must not be shared
+/// between threads.
+class FrameLayouts {
+    std::map<const llvm::Function *, std::unique_ptr<FrameLayout>> layouts;
+
+  public:
+    auto get(const llvm::Function &fun) -> const FrameLayout &;
+};
+
+/// The register file of a single call
+struct Frame {
+    const FrameLayout &layout;
+    std::vector<Integer> values;
+    // Only variables that have been assigned are part of the state
+    std::vector<bool> assigned;
+    // Values in the entry state that are not part of the function
+    FastVarMap foreign;
+    Heap heap;
+    // Slots assigned since the last snapshot
+    std::vector<unsigned> dirty;
+    std::vector<bool> isDirty;
+    std::shared_ptr<const StateDelta<const llvm::Value *>> lastSnapshot;
+    Frame(const FrameLayout &layout, const FastState &state);
+    auto operand(unsigned slot, unsigned index, const llvm::Value *val) const
+        -> Integer;
+    void assign(unsigned slot, Integer val) {
+        values[slot] = std::move(val);
+        assigned[slot] = true;
+        if (!isDirty[slot]) {
+            isDirty[slot] = true;
+            dirty.push_back(slot);
+        }
+    }
+    auto toState() const -> FastState;
+    /// The changes since the previous snapshot
+    auto snapshot() -> std::shared_ptr<const StateDelta<const llvm::Value *>>;
+};
+
+/// Interprets a call one block at a time. interpretFunction collects all
+/// steps of the call while the streaming analysis drops them once it has
+/// looked at them.
+class CallInterpreter {
+    const llvm::Function &fun;
+    const AnalysisResultsMap &analysisResults;
+    FrameLayouts &layouts;
+    Frame frame;
+    const llvm::BasicBlock *prevBlock;
+    const llvm::BasicBlock *currentBlock;
+    uint32_t maxSteps;
+    uint32_t blocksVisited;
+    bool earlyExit;
+
+  public:
+    CallInterpreter(const llvm::Function &fun, const FastState &entry,
+                    const llvm::BasicBlock *startBlock, uint32_t maxSteps,
+                    const AnalysisResultsMap &analysisResults,
+                    FrameLayouts &layouts);
+    /// Interpret the next block, None once the call has returned or ran out
+    /// of steps
+    auto next() -> llvm::Optional<BlockStep<const llvm::Value *>>;
+    auto function() const -> const llvm::Function & { return fun; }
+    /// Did we stop because we ran out of steps?
+    auto ranOutOfSteps() const -> bool { return earlyExit; }
+    auto visitedBlocks() const -> uint32_t { return blocksVisited; }
+    auto state() const -> FastState { return frame.toState(); }
+};
+
 /// The variables in the entry state will be renamed appropriately for both
 /// programs
 MonoPair<FastCall>
@@ -254,6 +394,12 @@ interpretFunctionPair(MonoPair<const llvm::Function *> funs,
                       MonoPair<FastVarMap> variables, MonoPair<Heap> heaps,
                       uint32_t maxSteps,
                       const AnalysisResultsMap &analysisResults);
+MonoPair<FastCall>
+interpretFunctionPair(MonoPair<const llvm::Function *> funs,
+                      MonoPair<FastVarMap> variables, MonoPair<Heap> heaps,
+                      uint32_t maxSteps,
+                      const AnalysisResultsMap &analysisResults,
+                      FrameLayouts &layouts);
 MonoPair<FastCall> interpretFunctionPair(
     MonoPair<const llvm::Function *> funs, MonoPair<FastVarMap> variables,
     MonoPair<Heap> heaps, MonoPair<const llvm::BasicBlock *> startBlocks,
@@ -264,38 +410,54 @@ auto interpretFunction(const llvm::Function &fun, FastState entry,
 auto interpretFunction(const llvm::Function &fun, FastState entry,
                        const llvm::BasicBlock *bb, uint32_t maxSteps,
                        const AnalysisResultsMap &analysisResults) -> FastCall;
+auto interpretFunction(const llvm::Function &fun, FastState entry,
+                       const llvm::BasicBlock *bb, uint32_t maxSteps,
+                       const AnalysisResultsMap &analysisResults,
+                       FrameLayouts &layouts) -> FastCall;
 auto interpretBlock(const llvm::BasicBlock &block,
-                    const llvm::BasicBlock *prevBlock, FastState &state,
+                    const llvm::BasicBlock *prevBlock, Frame &frame,
                     bool skipPhi, uint32_t maxStep,
-                    const AnalysisResultsMap &analysisResults)
-    -> BlockUpdate<const llvm::Value *>;
-auto interpretPHI(const llvm::PHINode &instr, FastState &state,
+                    const AnalysisResultsMap &analysisResults,
+                    FrameLayouts &layouts) -> BlockUpdate<const llvm::Value *>;
+// The slot is the slot of the instruction in the frame
+auto interpretPHI(const llvm::PHINode &instr, unsigned slot, Frame &frame,
                   const llvm::BasicBlock *prevBlock) -> void;
-auto interpretInstruction(const llvm::Instruction *instr, FastState &state)
-    -> void;
-auto interpretTerminator(const llvm::TerminatorInst *instr, FastState &state)
-    -> TerminatorUpdate;
+auto interpretInstruction(const llvm::Instruction *instr, unsigned slot,
+                          Frame &frame) -> void;
+auto interpretTerminator(const llvm::TerminatorInst *instr, unsigned slot,
+                         Frame &frame) -> TerminatorUpdate;
+/// Loads and stores on the byte addressed heap used for bounded integers. The
+/// JIT calls these as well so both produce the same heaps.
+auto loadBytes(Heap &heap, const HeapAddress &ptr, unsigned width) -> Integer;
+auto storeBytes(Heap &heap, const HeapAddress &addr, const Integer &val,
+                unsigned width) -> void;
 auto resolveValue(const llvm::Value *val, const FastState &state,
                   const llvm::Type *type) -> Integer;
-auto interpretICmpInst(const llvm::ICmpInst *instr, FastState &state) -> void;
+auto resolveConstant(const llvm::Value *val) -> Integer;
+auto interpretICmpInst(const llvm::ICmpInst *instr, unsigned slot,
+                       Frame &frame) -> void;
 auto interpretIntPredicate(const llvm::ICmpInst *instr,
                            llvm::CmpInst::Predicate pred, const Integer &i0,
-                           const Integer &i1, FastState &state) -> void;
-auto interpretBinOp(const llvm::BinaryOperator *instr, FastState &state)
-    -> void;
+                           const Integer &i1) -> bool;
+auto interpretBinOp(const llvm::BinaryOperator *instr, unsigned slot,
+                    Frame &frame) -> void;
 auto interpretIntBinOp(const llvm::BinaryOperator *instr,
                        llvm::Instruction::BinaryOps op, const Integer &i0,
-                       const Integer &i1, FastState &state) -> void;
+                       const Integer &i1) -> Integer;
 auto interpretBoolBinOp(const llvm::BinaryOperator *instr,
-                        llvm::Instruction::BinaryOps op, bool b0, bool b1,
-                        FastState &state) -> void;
+                        llvm::Instruction::BinaryOps op, bool b0, bool b1)
+    -> bool;
 
-template <typename A, typename T> Integer resolveGEP(T &gep, State<A> &state) {
-    Integer offset = resolveValue(gep.getPointerOperand(), state,
-                                  gep.getPointerOperand()->getType());
+/// The pointer operand is the operand with index 0 followed by the indices,
+/// resolve gets the operand index and the operand.
+template <typename T, typename Resolve>
+Integer resolveGEP(T &gep, Resolve resolve) {
+    Integer offset = resolve(0, gep.getPointerOperand());
     const auto type = gep.getSourceElementType();
     std::vector<llvm::Value *> indices;
-    for (auto ix = gep.idx_begin(), e = gep.idx_end(); ix != e; ++ix) {
+    unsigned operandIndex = 1;
+    for (auto ix = gep.idx_begin(), e = gep.idx_end(); ix != e;
+         ++ix, ++operandIndex) {
         // Try several ways of finding the module
         const llvm::Module *mod = nullptr;
         if (auto instr = llvm::dyn_cast<llvm::Instruction>(&gep)) {
@@ -312,7 +474,7 @@ template <typename A, typename T> Integer resolveGEP(T &gep, State<A> &state) {
         const auto indexedType = llvm::GetElementPtrInst::getIndexedType(
             type, llvm::ArrayRef<llvm::Value *>(indices));
         const auto size = typeSize(indexedType, mod->getDataLayout());
-        Integer val = resolveValue(*ix, state, (*ix)->getType());
+        Integer val = resolve(operandIndex, *ix);
         offset += Integer(mpz_class(size)).asPointer() *
                   Integer(val.asUnbounded()).asPointer();
     }
@@ -55,7 +55,7 @@ using RelationalFunctionInvariantMap =
 template <typename V>
 using FunctionInvariantMap =
     std::map<const llvm::Function *, std::map<Mark, FunctionInvariant<V>>>;
-using PolynomialEquations = LoopInfoData<Matrix<mpq_class>>;
+using PolynomialEquations = LoopInfoData<EchelonBasis>;
 using PolynomialSolutions =
     IterativeInvariantMap<LoopInfoData<Matrix<mpz_class>>>;
 using HeapPatternCandidates =
@@ -75,22 +75,22 @@ std::map<Mark, smt::SharedSMTRef> makeIterativeInvariantDefinitions(
 RelationalFunctionInvariantMap<FunctionInvariant<smt::SharedSMTRef>>
 makeRelationalFunctionInvariantDefinitions(
     const RelationalFunctionInvariantMap<
-        LoopInfoData<FunctionInvariant<Matrix<mpq_class>>>> &equations,
+        LoopInfoData<FunctionInvariant<EchelonBasis>>> &equations,
     const RelationalFunctionInvariantMap<
         LoopInfoData<llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
         &patterns,
     const AnalysisResultsMap &analysisResults, size_t degree);
 FunctionInvariantMap<smt::SharedSMTRef> makeFunctionInvariantDefinitions(
     const llvm::Module &module,
-    const FunctionInvariantMap<Matrix<mpq_class>> &equations,
+    const FunctionInvariantMap<EchelonBasis> &equations,
     const FunctionInvariantMap<HeapPatternCandidates> &patterns,
     const AnalysisResultsMap &analysisResults, Program prog, size_t degree);
 FunctionInvariantMap<smt::SharedSMTRef> makeFunctionInvariantDefinitions(
     MonoPair<const llvm::Module &> modules,
-    const FunctionInvariantMap<Matrix<mpq_class>> &equations,
+    const FunctionInvariantMap<EchelonBasis> &equations,
     const FunctionInvariantMap<HeapPatternCandidates> &patterns,
     const AnalysisResultsMap &analysisResults, size_t degree);
-Matrix<mpz_class> findSolutions(Matrix<mpq_class> equations);
+Matrix<mpz_class> findSolutions(const EchelonBasis &equations);
 PolynomialSolutions
 findSolutions(const IterativeInvariantMap<PolynomialEquations> &equationsMap);
 // This can return a nullpointer if the invariant is empty, conceptually this
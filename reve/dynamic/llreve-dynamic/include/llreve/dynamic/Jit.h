@@ -0,0 +1,83 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "AnalysisResults.h"
+#include "MonoPair.h"
+
+#include "llreve/dynamic/Interpreter.h"
+
+#include "llvm/ADT/Optional.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llreve {
+namespace dynamic {
+
+/// Collects traces of bounded programs by running them natively. Both modules
+/// are cloned, instrumented and compiled with ORC:
+/// - The entry block and the blocks of normal marks record the values that
+///   dominate them.
+/// - Every block is a step, the call is aborted once it uses more steps than
+///   allowed just like in the interpreter.
+/// - Loads and stores go through loadBytes and storeBytes on a shadow heap.
+///
+/// The calls only contain the recorded steps and no nested calls. This is
+/// enough for analyzeExecution to produce the same iterative matches as for
+/// the interpreter, which stays the reference implementation.
+class TraceJit {
+    class Engine;
+    struct RecordedBlock {
+        const llvm::BasicBlock *block;
+        std::vector<const llvm::Value *> values;
+    };
+    struct CompiledFunction {
+        const llvm::Function *function;
+        const llvm::Value *returnInstruction;
+        std::vector<RecordedBlock> blocks;
+        void (*entry)(const uint64_t *args, uint64_t *result);
+    };
+    struct Run;
+    // The run of the current thread, used by the hooks
+    static thread_local Run *currentRun;
+    std::unique_ptr<Engine> engine;
+    MonoPair<CompiledFunction> compiled;
+    TraceJit(std::unique_ptr<Engine> engine,
+             MonoPair<CompiledFunction> compiled);
+    static auto compile(Engine &engine, const llvm::Function &fun,
+                        const AnalysisResultsMap &analysisResults,
+                        const std::string &entryName) -> CompiledFunction;
+    static auto run(const CompiledFunction &compiled, FastVarMap variables,
+                    Heap heap, uint32_t maxSteps) -> FastCall;
+    static void stepHook();
+    static void recordHook(uint32_t block, const uint64_t *values);
+    static auto loadHook(uint64_t ptr, uint32_t width) -> uint64_t;
+    static void storeHook(uint64_t ptr, uint64_t val, uint32_t width);
+
+  public:
+    /// Null if one of the functions uses something the JIT doesn’t support
+    static auto create(MonoPair<const llvm::Function *> funs,
+                       const AnalysisResultsMap &analysisResults)
+        -> std::unique_ptr<TraceJit>;
+    ~TraceJit();
+    /// Can be called from several threads at the same time
+    auto run(MonoPair<FastVarMap> variables, MonoPair<Heap> heaps,
+             uint32_t maxSteps) const -> MonoPair<FastCall>;
+};
+
+/// The reason why a function or one of its callees can’t be compiled
+auto unsupportedByJit(const llvm::Function &fun,
+                      const AnalysisResultsMap &analysisResults)
+    -> llvm::Optional<std::string>;
+} // namespace dynamic
+} // namespace llreve
@@ -12,6 +12,9 @@
 
 #include "Interpreter.h"
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+
 template <typename T> bool isZero(const std::vector<T> &a) {
     for (auto &val : a) {
         if (val != 0) {
@@ -24,8 +27,6 @@ template <typename T> bool isZero(const std::vector<T> &a) {
 // The outer vector indicates the row
 template <typename T> using Matrix = std::vector<std::vector<T>>;
 
-void reducedRowEchelonForm(Matrix<mpq_class> &input);
-
 template <typename T> void dumpMatrix(const Matrix<T> &m) {
     for (const auto &row : m) {
         for (const auto &col : row) {
@@ -35,11 +36,63 @@ template <typename T> void dumpMatrix(const Matrix<T> &m) {
     }
 }
 
-bool linearlyIndependent(const Matrix<mpq_class> &vectors,
-                         std::vector<mpq_class> newVector);
-std::vector<std::vector<mpq_class>> nullSpace(const Matrix<mpq_class> &m);
-std::vector<mpq_class> multiplyRow(std::vector<mpq_class> vec, mpq_class c);
-std::vector<mpz_class> ratToInt(std::vector<mpq_class> vec);
+/// The span of the rows added so far. The rows are kept in one row major
+/// buffer together with their row echelon form modulo a 31 bit prime, so
+/// adding a row only needs O(rank · columns) operations on 64 bit integers.
+/// A row that is not zero after the reduction is independent of the others.
+/// If it is zero, the row is checked for orthogonality against the null space
+/// which is only computed once a dependent row shows up and is then reused
+/// until another row is added.
+class EchelonBasis {
+    struct NullSpace {
+        Matrix<mpz_class> vectors;
+        // The vectors in one row major buffer if all entries fit in 64 bits
+        std::vector<int64_t> smallVectors;
+        bool small;
+    };
+    size_t cols = 0;
+    // Divided by the gcd of their entries
+    std::vector<mpz_class> rows;
+    size_t primeIndex = 0;
+    // The rows modulo the prime in row echelon form with leading entries one
+    std::vector<uint64_t> echelon;
+    // The column of the leading entry of each row in echelon
+    std::vector<size_t> pivots;
+    // The rows of echelon sorted by their pivot
+    std::vector<size_t> order;
+    mutable llvm::Optional<NullSpace> nullSpaceCache;
+    auto row(size_t i) const -> const mpz_class * { return &rows[i * cols]; }
+    auto reduceModular(std::vector<uint64_t> &vec) const
+        -> llvm::Optional<size_t>;
+    void insertModular(std::vector<uint64_t> vec, size_t pivot);
+    void rebuildModular();
+    auto computeNullSpace() const -> Matrix<mpz_class>;
+    auto modularNullSpace() const -> llvm::Optional<Matrix<mpz_class>>;
+    auto exactNullSpace() const -> Matrix<mpz_class>;
+    auto orthogonalToNullSpace(const std::vector<mpz_class> &vec) const
+        -> bool;
+    auto smallOrthogonalToNullSpace(llvm::ArrayRef<int64_t> vec) const
+        -> llvm::Optional<bool>;
+
+  public:
+    /// Adds the row if it is linearly independent of the rows added so far
+    /// and returns whether it has been added. All rows need the same length.
+    auto insert(std::vector<mpz_class> row) -> bool;
+    /// Rows of small integers are only converted if they are not dependent
+    /// according to the cached null space
+    auto insert(llvm::ArrayRef<int64_t> row) -> bool;
+    auto rank() const -> size_t { return pivots.size(); }
+    auto columns() const -> size_t { return cols; }
+    /// The rows span all vectors so further rows can’t change the basis and
+    /// there is no point in collecting more samples
+    auto saturated() const -> bool { return cols > 0 && rank() == cols; }
+    /// A basis of the vectors orthogonal to all rows. There is one vector for
+    /// each non pivot column of the reduced row echelon form. Its entry in
+    /// that column is negative, its entries in the other non pivot columns
+    /// are zero and its entries are coprime.
+    auto nullSpace() const -> const Matrix<mpz_class> &;
+};
+
 template <typename T>
 std::vector<T> matrixTimesVector(const Matrix<T> &m,
                                  const std::vector<T> &vec) {
@@ -16,6 +16,7 @@
 #include <set>
 #include <vector>
 
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Function.h>
 
 #include "MonoPair.h"
@@ -90,6 +91,14 @@ struct ITE : public SMTExpr {
     ArrayVal getArrayVal() const override;
 };
 
+/// An array whose entries are known, e.g. a flattened ite chain
+struct ArrayLiteral : public SMTExpr {
+    ArrayVal val;
+    ArrayLiteral(ArrayVal val) : val(std::move(val)) {}
+    std::set<std::string> references() const override;
+    ArrayVal getArrayVal() const override;
+};
+
 struct Identifier : public SMTExpr {
     std::string name;
     Identifier(std::string name) : name(name) {}
@@ -146,4 +155,16 @@ struct Sat : public Result {
     bool isSat() const override;
 };
 
+/// Reads the output of a solver, nullptr if it is neither sat nor unsat. The
+/// model is read without recursion: ite chains over the argument of a
+/// function and store chains become ArrayLiterals and as-array references
+/// are replaced by the array of the function they refer to. Functions with
+/// several arguments and definitions using other sorts than Int, Bool and
+/// (Array Int Int) are skipped.
 std::shared_ptr<Result> parseResult(FILE *stream);
+std::shared_ptr<Result> parseResult(llvm::StringRef output);
+/// Same as parseResult but maps the file instead of reading it
+std::shared_ptr<Result> parseResultFile(const std::string &path);
+/// The first sat, unsat, unknown or timeout in the output of a solver, empty
+/// if there is none. The model is not read.
+llvm::StringRef resultToken(llvm::StringRef output);
@@ -3,21 +3,94 @@
 #include "llreve/dynamic/Invariant.h"
 #include "llreve/dynamic/Match.h"
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+
+#include <unordered_set>
+
 namespace llreve {
 namespace dynamic {
 
-void populateEquationsMap(
-    IterativeInvariantMap<PolynomialEquations> &equationsMap,
-    const std::vector<smt::SortedVar> &primitiveVariables,
-    MatchInfo<const llvm::Value *> match, ExitIndex exitIndex, size_t degree);
-void populateEquationsMap(
-    RelationalFunctionInvariantMap<
-        LoopInfoData<FunctionInvariant<Matrix<mpq_class>>>> &equationsMap,
-    const std::vector<smt::SortedVar> &primitiveVariables,
-    CoupledCallInfo<const llvm::Value *> match, size_t degree);
-void populateEquationsMap(FunctionInvariantMap<Matrix<mpq_class>> &equationsMap,
-                          const std::vector<smt::SortedVar> &primitiveVariables,
-                          UncoupledCallInfo<const llvm::Value *> match,
-                          size_t degree);
+/// The polynomial terms of a list of variables in the order of
+/// polynomialTermsOfDegree followed by the constant. Each term of a higher
+/// degree is the product of a term of the previous degree and a variable, so
+/// every term only needs a single multiplication.
+class MonomialPlan {
+    static const unsigned NoFactor = ~0u;
+    struct Term {
+        // The term of the previous degree, NoFactor for the variables
+        unsigned factor;
+        unsigned variable;
+    };
+    size_t variableCount;
+    std::vector<Term> terms;
+
+  public:
+    MonomialPlan(const std::vector<smt::SortedVar> &variables, size_t degree);
+    auto variables() const -> size_t { return variableCount; }
+    /// The number of terms including the constant
+    auto columns() const -> size_t { return terms.size() + 1; }
+    /// Evaluates the terms for a block of samples given by the values of the
+    /// variables in row major order. The rows are stored in block in row
+    /// major order, fits is false for the rows that don’t fit in 64 bits.
+    void evaluate(llvm::ArrayRef<Integer> values, size_t samples,
+                  std::vector<int64_t> &block, std::vector<bool> &fits) const;
+    /// Evaluates the terms for a single sample using unbounded integers
+    auto evaluateExact(llvm::ArrayRef<Integer> values) const
+        -> std::vector<mpz_class>;
+};
+
+/// Collects the samples for the polynomial equations of one trace and adds
+/// them to the equations in blocks. flush has to be called before the
+/// equations are used or destroyed.
+class EquationSampler {
+    using Step = BlockStep<const llvm::Value *>;
+    static const size_t BlockSize = 64;
+    struct Batch {
+        MonomialPlan plan;
+        // The variables that are not passed as extra values
+        std::vector<const llvm::Value *> keys;
+        // The values of the variables of the pending samples, row major
+        std::vector<Integer> values;
+        size_t samples;
+        // The hashes of the samples since the last flush of all batches,
+        // repeated loop states are only added once. Only the hashes are kept
+        // so long traces don’t keep all their states alive, a collision
+        // merely drops a sample.
+        std::unordered_set<uint64_t> seen;
+        Batch(MonomialPlan plan, std::vector<const llvm::Value *> keys)
+            : plan(std::move(plan)), keys(std::move(keys)), samples(0) {}
+    };
+    size_t degree;
+    std::map<EchelonBasis *, Batch> batches;
+    // The extra values are the values of the last variables, the others are
+    // taken from the steps
+    void sample(EchelonBasis &equations,
+                llvm::function_ref<std::vector<smt::SortedVar>()> variables,
+                llvm::ArrayRef<const Step *> steps,
+                llvm::ArrayRef<Integer> extraValues);
+    void flush(EchelonBasis &equations, Batch &batch);
+
+  public:
+    explicit EquationSampler(size_t degree) : degree(degree) {}
+    EquationSampler(const EquationSampler &other) = delete;
+    EquationSampler &operator=(const EquationSampler &other) = delete;
+    ~EquationSampler() { assert(pending() == 0); }
+    void add(IterativeInvariantMap<PolynomialEquations> &equationsMap,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             MatchInfo<const llvm::Value *> match, ExitIndex exitIndex);
+    void add(RelationalFunctionInvariantMap<
+                 LoopInfoData<FunctionInvariant<EchelonBasis>>> &equationsMap,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             CoupledCallInfo<const llvm::Value *> match);
+    void add(FunctionInvariantMap<EchelonBasis> &equationsMap,
+             const std::vector<smt::SortedVar> &primitiveVariables,
+             UncoupledCallInfo<const llvm::Value *> match);
+    /// The number of samples that have not been added yet
+    auto pending() const -> size_t;
+    /// Adds the pending samples and forgets the batches
+    void flush();
+};
 }
 }
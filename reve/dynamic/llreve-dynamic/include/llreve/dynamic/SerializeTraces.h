@@ -10,12 +10,16 @@
 
 #pragma once
 
+#include "AnalysisResults.h"
 #include "Interpreter.h"
 #include "MonoPair.h"
 #include "ThreadSafeQueue.h"
 
+#include <functional>
+
 #include "gmpxx.h"
 
+#include "llvm/ADT/Optional.h"
 #include "llvm/IR/Function.h"
 
 // All combinations of values inside the bounds, upperbound included
@@ -56,4 +60,69 @@ struct WorkItem {
     MonoPair<llreve::dynamic::Heap> heaps;
     bool heapSet;
     int counter;
+    // Without a heap, the heap is chosen when the item is processed
+    WorkItem(MonoPair<std::vector<mpz_class>> vals, int counter)
+        : vals(std::move(vals)), heapBackgrounds(0, 0),
+          heaps(llreve::dynamic::Heap(), llreve::dynamic::Heap()),
+          heapSet(false), counter(counter) {}
+};
+
+/// Options for the parallel trace generation
+struct TraceGenerationOpts {
+    // Number of worker threads, 0 means one per hardware thread
+    unsigned Threads;
+    // The inputs of sample i are generated from Seed + i, so they don’t
+    // depend on the number of threads
+    unsigned Seed;
+    // Maximum number of buffered inputs and traces
+    size_t QueueSize;
+    uint32_t MaxSteps;
+    TraceGenerationOpts(unsigned threads, unsigned seed, size_t queueSize,
+                        uint32_t maxSteps)
+        : Threads(threads), Seed(seed), QueueSize(queueSize),
+          MaxSteps(maxSteps) {}
+};
+
+using TraceCallback =
+    std::function<void(MonoPair<llreve::dynamic::FastCall> calls)>;
+
+/// The inputs of a work item once its heap has been chosen
+struct TraceInputs {
+    int counter;
+    MonoPair<llreve::dynamic::FastVarMap> variables;
+    MonoPair<llreve::dynamic::Heap> heaps;
+    TraceInputs(int counter, MonoPair<llreve::dynamic::FastVarMap> variables,
+                MonoPair<llreve::dynamic::Heap> heaps)
+        : counter(counter), variables(std::move(variables)),
+          heaps(std::move(heaps)) {}
 };
+
+/// Called on the worker threads together with the layout cache of the worker,
+/// so it has to be thread safe
+using InputCallback = std::function<void(
+    TraceInputs inputs, llreve::dynamic::FrameLayouts &layouts)>;
+
+/// Interpret the functions on the work items returned by produce until it
+/// returns None. The items are interpreted by a pool of workers but the
+/// callback is called on the calling thread in the order in which the items
+/// were produced, so the analyses don’t need to be thread safe and the results
+/// don’t depend on the scheduling. Items without a heap get a random heap.
+void generateTraces(MonoPair<const llvm::Function *> funs,
+                    std::function<llvm::Optional<WorkItem>()> produce,
+                    const AnalysisResultsMap &analysisResults,
+                    TraceGenerationOpts opts, TraceCallback callback);
+/// Interpret the functions on all argument combinations in the range
+void generateTraces(MonoPair<const llvm::Function *> funs, Range range,
+                    const AnalysisResultsMap &analysisResults,
+                    TraceGenerationOpts opts, TraceCallback callback);
+/// Interpret the functions on count random arguments inside the bounds
+void generateRandomTraces(MonoPair<const llvm::Function *> funs, unsigned count,
+                          int lowerBound, int upperBound,
+                          const AnalysisResultsMap &analysisResults,
+                          TraceGenerationOpts opts, TraceCallback callback);
+/// Pass the same inputs as generateRandomTraces to the callback without
+/// interpreting them first, so the callback can interpret and analyze them in
+/// one pass instead of keeping the whole traces in memory
+void forEachRandomInput(MonoPair<const llvm::Function *> funs, unsigned count,
+                        int lowerBound, int upperBound,
+                        TraceGenerationOpts opts, InputCallback callback);
@@ -10,9 +10,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "llvm/ADT/Optional.h"
 
 template <typename T> class ThreadSafeQueue {
   private:
@@ -24,7 +32,7 @@ template <typename T> class ThreadSafeQueue {
     void push(T &&val) {
         {
             std::lock_guard<std::mutex> lock(m);
-            q.push(val);
+            q.push(std::move(val));
         }
         cv.notify_one();
     }
@@ -40,8 +48,276 @@ template <typename T> class ThreadSafeQueue {
         while (q.empty()) {
             cv.wait(lock);
         }
-        T r = q.front();
+        T r = std::move(q.front());
         q.pop();
         return r;
     }
 };
+
+
+/// A lock-free bounded queue for multiple producers and consumers.
+/**
+Each slot of the ring buffer carries a sequence number that tells producers
+and consumers whose turn it is, so the only shared state they contend on are
+the two positions. Elements are moved in and out of the buffer.
+
+Waiting operations spin for a few attempts and then block on a condition
+variable. The other side only takes the lock to notify them if there are
+blocked threads, so it stays lock-free as long as nobody waits.
+
+Closing the queue makes all future pushes fail. Consumers can continue to pop
+the remaining elements and pop returns None once the queue is closed and
+drained. Pushes that started before the queue was closed are not lost.
+*/
+template <typename T> class BoundedMPMCQueue {
+  private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        T *value() { return reinterpret_cast<T *>(&storage); }
+    };
+    // Keep the positions on separate cache lines
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+    alignas(64) std::atomic<bool> closed;
+    // Number of pushes that have checked closed but not finished yet
+    std::atomic<size_t> activePushes;
+    const size_t mask;
+    std::vector<Slot> slots;
+    // Only used by threads that have given up spinning
+    static const unsigned SpinLimit = 64;
+    std::mutex waitMutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::atomic<unsigned> waitingConsumers;
+    std::atomic<unsigned> waitingProducers;
+
+    // The fence pairs with the one in waitUntil, so either the waiting
+    // thread sees the change or this sees the waiting thread
+    void wakeUp(std::atomic<unsigned> &waiting, std::condition_variable &cv) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(waitMutex);
+            cv.notify_all();
+        }
+    }
+    template <typename Ready>
+    void waitUntil(std::atomic<unsigned> &waiting, std::condition_variable &cv,
+                   Ready ready) {
+        std::unique_lock<std::mutex> lock(waitMutex);
+        waiting.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, ready);
+        waiting.fetch_sub(1);
+    }
+
+    static size_t roundUpToPowerOfTwo(size_t n) {
+        size_t result = 1;
+        while (result < n) {
+            result <<= 1;
+        }
+        return result;
+    }
+    bool tryEnqueue(T &val) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) -
+                        static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    new (slot.value()) T(std::move(val));
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // The consumer of the previous round has not finished yet
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    llvm::Optional<T> tryDequeue() {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) -
+                        static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    llvm::Optional<T> result(std::move(*slot.value()));
+                    slot.value()->~T();
+                    slot.sequence.store(pos + mask + 1,
+                                        std::memory_order_release);
+                    return result;
+                }
+            } else if (diff < 0) {
+                return llvm::None;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // The following don’t wake up the other side, so they can be called
+    // while holding waitMutex
+    bool pushWithoutWakeUp(T &val) {
+        activePushes.fetch_add(1);
+        bool pushed = !closed.load() && tryEnqueue(val);
+        activePushes.fetch_sub(1, std::memory_order_release);
+        return pushed;
+    }
+    size_t popBatchWithoutWakeUp(std::vector<T> &out, size_t max) {
+        size_t popped = 0;
+        while (popped < max) {
+            llvm::Optional<T> val = tryDequeue();
+            if (!val.hasValue()) {
+                break;
+            }
+            out.push_back(std::move(*val));
+            ++popped;
+        }
+        return popped;
+    }
+    // Consumers waiting for the queue to drain have to check again once the
+    // last push has finished
+    void afterPush(bool pushed) {
+        if (pushed || closed.load()) {
+            wakeUp(waitingConsumers, notEmpty);
+        }
+    }
+    void afterPop(bool popped) {
+        if (popped) {
+            wakeUp(waitingProducers, notFull);
+        }
+    }
+
+  public:
+    /// The capacity is rounded up to the next power of two
+    explicit BoundedMPMCQueue(size_t capacity)
+        : enqueuePos(0), dequeuePos(0), closed(false), activePushes(0),
+          mask(roundUpToPowerOfTwo(std::max<size_t>(capacity, 2)) - 1),
+          slots(mask + 1), waitingConsumers(0), waitingProducers(0) {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    BoundedMPMCQueue(const BoundedMPMCQueue &other) = delete;
+    BoundedMPMCQueue &operator=(const BoundedMPMCQueue &other) = delete;
+    ~BoundedMPMCQueue() {
+        while (tryDequeue().hasValue()) {
+        }
+    }
+
+    /// Fails if the queue is full or closed, val is only moved from on
+    /// success
+    bool try_push(T &val) {
+        bool pushed = pushWithoutWakeUp(val);
+        afterPush(pushed);
+        return pushed;
+    }
+    bool try_push(T &&val) { return try_push(val); }
+    llvm::Optional<T> try_pop() {
+        llvm::Optional<T> val = tryDequeue();
+        afterPop(val.hasValue());
+        return val;
+    }
+    /// Moves up to max elements to the end of out and returns their number
+    size_t try_pop_batch(std::vector<T> &out, size_t max) {
+        size_t popped = popBatchWithoutWakeUp(out, max);
+        afterPop(popped > 0);
+        return popped;
+    }
+
+    /// Waits while the queue is full, fails if the queue has been closed
+    bool push(T val) {
+        for (unsigned spins = 0; !try_push(val); ++spins) {
+            if (closed.load()) {
+                return false;
+            }
+            if (spins < SpinLimit) {
+                std::this_thread::yield();
+                continue;
+            }
+            bool pushed = false;
+            waitUntil(waitingProducers, notFull, [&]() {
+                pushed = pushWithoutWakeUp(val);
+                return pushed || closed.load();
+            });
+            afterPush(pushed);
+            return pushed;
+        }
+        return true;
+    }
+    /// Waits for an element, returns None once the queue is closed and
+    /// drained
+    llvm::Optional<T> pop() {
+        for (unsigned spins = 0;; ++spins) {
+            llvm::Optional<T> val = try_pop();
+            if (val.hasValue()) {
+                return val;
+            }
+            if (isDrained()) {
+                // A push might have finished after the previous attempt
+                return try_pop();
+            }
+            if (spins < SpinLimit) {
+                std::this_thread::yield();
+                continue;
+            }
+            waitUntil(waitingConsumers, notEmpty, [&]() {
+                val = tryDequeue();
+                return val.hasValue() || isDrained();
+            });
+            if (!val.hasValue()) {
+                return try_pop();
+            }
+            afterPop(true);
+            return val;
+        }
+    }
+    /// Waits for at least one element and pops up to max elements, returns 0
+    /// once the queue is closed and drained
+    size_t pop_batch(std::vector<T> &out, size_t max) {
+        assert(max > 0);
+        for (unsigned spins = 0;; ++spins) {
+            size_t popped = try_pop_batch(out, max);
+            if (popped > 0) {
+                return popped;
+            }
+            if (isDrained()) {
+                return try_pop_batch(out, max);
+            }
+            if (spins < SpinLimit) {
+                std::this_thread::yield();
+                continue;
+            }
+            waitUntil(waitingConsumers, notEmpty, [&]() {
+                popped = popBatchWithoutWakeUp(out, max);
+                return popped > 0 || isDrained();
+            });
+            if (popped == 0) {
+                return try_pop_batch(out, max);
+            }
+            afterPop(true);
+            return popped;
+        }
+    }
+
+    void close() {
+        closed.store(true);
+        wakeUp(waitingConsumers, notEmpty);
+        wakeUp(waitingProducers, notFull);
+    }
+    bool isClosed() const { return closed.load(); }
+
+  private:
+    // No further elements can arrive once this returns true
+    bool isDrained() const {
+        return closed.load() && activePushes.load() == 0;
+    }
+};
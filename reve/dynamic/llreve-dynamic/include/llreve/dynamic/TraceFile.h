@@ -0,0 +1,114 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "MonoPair.h"
+#include "Program.h"
+
+#include "llreve/dynamic/Interpreter.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llreve {
+namespace dynamic {
+
+/// Traces are stored in DIR/traces.bin. The file starts with a magic number
+/// followed by the traces, a table of the function, block and variable names
+/// they reference and an index of the offsets of both calls of each trace.
+/// The last 16 bytes contain the offsets of the table and the index.
+///
+/// Integers and lengths are varints, variables are stored as their slot in
+/// the frame layout of their function. Block steps are stored like in memory
+/// as the variables that changed since the previous step, heaps are only
+/// written if they differ from the heap of the previous step.
+auto traceFilePath(const std::string &dir) -> std::string;
+
+/// Appends traces to a new trace file. The traces must come from the same
+/// modules that are later used to replay them.
+class TraceWriter {
+    FILE *file;
+    uint64_t offset;
+    std::string buffer;
+    llvm::StringMap<uint64_t> stringIds;
+    std::vector<std::string> strings;
+    std::vector<MonoPair<uint64_t>> index;
+    FrameLayouts layouts;
+    auto stringId(llvm::StringRef str) -> uint64_t;
+    void writeCall(const FastCall &call, Program prog);
+    void writeState(const FastState &state, const FrameLayout &layout);
+    void writeVariables(const FastVarMap &variables,
+                        const FrameLayout &layout);
+    void writeHeap(const Heap &heap);
+    void writeInteger(const Integer &val);
+    void writeVarint(uint64_t val);
+    void writeFixed(uint64_t val);
+    void flush();
+
+  public:
+    /// Creates the directory if necessary
+    explicit TraceWriter(const std::string &dir);
+    TraceWriter(const TraceWriter &other) = delete;
+    TraceWriter &operator=(const TraceWriter &other) = delete;
+    ~TraceWriter();
+    void write(const MonoPair<FastCall> &calls);
+    /// Write the name table and the index, called by the destructor
+    void close();
+};
+
+/// Reads the traces in a trace file that is mapped into memory. The traces
+/// are only decoded when they are requested and the block names point into
+/// the mapped file, so the traces must not outlive the reader.
+class TraceReader {
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    std::vector<llvm::StringRef> strings;
+    std::vector<MonoPair<uint64_t>> index;
+    MonoPair<const llvm::Module *> modules;
+    std::map<std::pair<uint64_t, Program>, const llvm::Function *> functions;
+    // Values of both modules by name, built when the first variable that is
+    // not part of its function is read
+    llvm::StringMap<const llvm::Value *> valuesByName;
+    FrameLayouts layouts;
+    class Decoder;
+    auto readCall(Decoder &decoder) -> FastCall;
+    auto readState(Decoder &decoder, const llvm::Function &fun) -> FastState;
+    auto readVariables(Decoder &decoder, const llvm::Function &fun)
+        -> FastVarMap;
+    auto readHeap(Decoder &decoder) -> Heap;
+    auto function(uint64_t nameId, Program prog) -> const llvm::Function &;
+    auto name(uint64_t id) const -> llvm::StringRef;
+    auto foreignValues() -> const llvm::StringMap<const llvm::Value *> &;
+
+  public:
+    TraceReader(const std::string &dir,
+                MonoPair<const llvm::Module *> modules);
+    TraceReader(const TraceReader &other) = delete;
+    TraceReader &operator=(const TraceReader &other) = delete;
+    ~TraceReader();
+    /// The number of traces in the file
+    auto traces() const -> size_t { return index.size(); }
+    auto trace(size_t i) -> MonoPair<FastCall>;
+};
+
+/// Pass all traces in DIR to the callback in the order they were written
+void replayTraces(const std::string &dir,
+                  MonoPair<const llvm::Module *> modules,
+                  std::function<void(MonoPair<FastCall>)> callback);
+} // namespace dynamic
+} // namespace llreve
@@ -16,15 +16,21 @@
 #include "MonoPair.h"
 #include "PathAnalysis.h"
 #include "Serialize.h"
+#include "llreve/dynamic/Coverage.h"
 #include "llreve/dynamic/HeapPattern.h"
 #include "llreve/dynamic/Interpreter.h"
+#include "llreve/dynamic/Jit.h"
 #include "llreve/dynamic/Linear.h"
 #include "llreve/dynamic/Peel.h"
 #include "llreve/dynamic/PolynomialEquation.h"
 #include "llreve/dynamic/SerializeTraces.h"
+#include "llreve/dynamic/ThreadSafeQueue.h"
+#include "llreve/dynamic/TraceFile.h"
 #include "llreve/dynamic/Unroll.h"
 #include "llreve/dynamic/Util.h"
 
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <random>
@@ -33,10 +39,16 @@
 
 // I don't care about windows
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/FileSystem.h"
 
 using llvm::Module;
 using llvm::Optional;
@@ -84,6 +96,77 @@ static llreve::cl::opt<unsigned> InterpretStepsFlag(
     llreve::cl::desc(
         "The number of instructions that are interpreted for each example"),
     cl::init(10));
+static llreve::cl::opt<unsigned> TraceThreadsFlag(
+    "trace-threads",
+    llreve::cl::desc("Number of threads used for collecting traces, 0 means "
+                     "one per hardware thread"),
+    llreve::cl::init(0));
+static llreve::cl::opt<unsigned>
+    TraceSeedFlag("trace-seed",
+                  llreve::cl::desc("Seed for the inputs of the traces"),
+                  llreve::cl::init(0));
+static llreve::cl::opt<string> DumpTracesFlag(
+    "dump-traces",
+    llreve::cl::desc("Write the traces used for finding loop "
+                     "transformations to a trace file in DIR"),
+    llreve::cl::value_desc("DIR"));
+static llreve::cl::opt<string> ReplayTracesFlag(
+    "replay-traces",
+    llreve::cl::desc("Read the traces from a directory written by "
+                     "-dump-traces instead of interpreting the programs"),
+    llreve::cl::value_desc("DIR"));
+
+static llreve::cl::opt<bool>
+    JitFlag("jit", llreve::cl::desc("Compile the programs to native code for "
+                                    "finding loop transformations, only "
+                                    "used with -bounded"));
+static llreve::cl::opt<bool> CheckJitFlag(
+    "check-jit",
+    llreve::cl::desc("Run the interpreter next to -jit and fail if they find "
+                     "different matches"));
+
+static llreve::cl::opt<unsigned> CounterExamplesFlag(
+    "counterexamples",
+    llreve::cl::desc("Maximum number of counterexamples that are extracted "
+                     "from the solver and analyzed in each iteration"),
+    llreve::cl::init(1));
+static llreve::cl::opt<unsigned> CoverageTracesFlag(
+    "coverage-traces",
+    llreve::cl::desc("Maximum number of traces on coverage guided inputs "
+                     "that are sampled before the first solver call, 0 "
+                     "disables them"),
+    llreve::cl::init(0));
+
+static llreve::cl::opt<unsigned> HeldOutTracesFlag(
+    "held-out-traces",
+    llreve::cl::desc("Number of fresh random traces that filter the "
+                     "candidates before each solver call, 0 disables them"),
+    llreve::cl::init(0));
+static llreve::cl::opt<unsigned> SolverThreadsFlag(
+    "solver-threads",
+    llreve::cl::desc("Number of threads that check the paths between each "
+                     "pair of marks in separate Z3 contexts"),
+    llreve::cl::init(1));
+
+static llreve::cl::opt<unsigned> TransformCandidatesFlag(
+    "transform-candidates",
+    llreve::cl::desc("Number of loop transformations that are tried in "
+                     "parallel with -only-transform, needs -transform-solver"),
+    llreve::cl::init(1));
+static llreve::cl::opt<string> TransformSolverFlag(
+    "transform-solver",
+    llreve::cl::desc("Command that is run on the SMT file of each loop "
+                     "transformation, the file is appended to it"),
+    llreve::cl::value_desc("COMMAND"));
+static llreve::cl::opt<string> TransformProofFlag(
+    "transform-proof",
+    llreve::cl::desc("Result of the solver for a successful proof, other "
+                     "than sat and unsat it has to be its first line"),
+    llreve::cl::init("unsat"));
+static llreve::cl::opt<unsigned> TransformTimeoutFlag(
+    "transform-timeout",
+    llreve::cl::desc("Seconds after which the solver is stopped"),
+    llreve::cl::init(300));
 
 bool ImplicationsFlag;
 
@@ -94,6 +177,52 @@ static void wait() {
     }
 }
 
+// Adds the values at the match to the equations and heap patterns
+static void sampleMatch(MatchInfo<const llvm::Value *> match,
+                        const ExitIndex &exitIndex,
+                        MonoPair<const llvm::Function *> functions,
+                        DynamicAnalysisResults &dynamicAnalysisResults,
+                        const AnalysisResultsMap &analysisResults,
+                        EquationSampler &equationSampler,
+                        HeapPatternSampler &heapPatternSampler) {
+    const auto primitiveVariables =
+        getPrimitiveFreeVariables(functions, match.mark, analysisResults);
+    equationSampler.add(dynamicAnalysisResults.polynomialEquations,
+                        primitiveVariables, match, exitIndex);
+    heapPatternSampler.add(dynamicAnalysisResults.heapPatternCandidates,
+                           primitiveVariables, match, exitIndex);
+}
+
+static void sampleMatch(CoupledCallInfo<const llvm::Value *> match,
+                        DynamicAnalysisResults &dynamicAnalysisResults,
+                        const AnalysisResultsMap &analysisResults,
+                        EquationSampler &equationSampler,
+                        HeapPatternSampler &heapPatternSampler) {
+    const auto primitiveVariables = getPrimitiveFreeVariables(
+        match.functions, match.mark, analysisResults);
+    auto returnInstrs = getReturnInstructions(match.functions, analysisResults);
+    equationSampler.add(
+        dynamicAnalysisResults.relationalFunctionPolynomialEquations,
+        primitiveVariables, match);
+    heapPatternSampler.add(
+        dynamicAnalysisResults.relationalFunctionHeapPatterns,
+        primitiveVariables, match, returnInstrs);
+}
+
+static void sampleMatch(UncoupledCallInfo<const llvm::Value *> match,
+                        DynamicAnalysisResults &dynamicAnalysisResults,
+                        const AnalysisResultsMap &analysisResults,
+                        EquationSampler &equationSampler,
+                        HeapPatternSampler &heapPatternSampler) {
+    const auto primitiveVariables = getPrimitiveFreeVariables(
+        match.function, match.mark, analysisResults);
+    equationSampler.add(dynamicAnalysisResults.functionPolynomialEquations,
+                        primitiveVariables, match);
+    heapPatternSampler.add(
+        dynamicAnalysisResults.functionHeapPatterns, primitiveVariables, match,
+        analysisResults.at(match.function).returnInstruction);
+}
+
 Transformed analyzeMainCounterExample(
     MarkPair pathMarks, ModelValues &vals, MonoPair<llvm::Function *> functions,
     DynamicAnalysisResults &dynamicAnalysisResults,
@@ -124,47 +253,30 @@ Transformed analyzeMainCounterExample(
     auto secondBlock =
         *markMaps.second.MarkToBlocksMap.at(pathMarks.startMark).begin();
 
-    MonoPair<Call<const llvm::Value *>> calls = interpretFunctionPair(
+    FrameLayouts layouts;
+    EquationSampler equationSampler(degree);
+    HeapPatternSampler heapPatternSampler(patterns);
+    analyzeInterpretedExecution(
         functions, variableValues, getHeapsFromModel(vals.arrays),
-        {firstBlock, secondBlock}, InterpretStepsFlag, analysisResults);
-    analyzeExecution<const llvm::Value *>(
-        std::move(calls), nameMap, analysisResults,
+        {firstBlock, secondBlock}, InterpretStepsFlag, nameMap,
+        analysisResults, layouts,
         [&](MatchInfo<const llvm::Value *> match) {
             ExitIndex exitIndex = getExitIndex(match);
             findLoopCounts<const llvm::Value *>(
                 dynamicAnalysisResults.loopCounts, match);
-            const auto primitiveVariables = getPrimitiveFreeVariables(
-                functions, match.mark, analysisResults);
-            populateEquationsMap(dynamicAnalysisResults.polynomialEquations,
-                                 primitiveVariables, match, exitIndex, degree);
-            populateHeapPatterns(dynamicAnalysisResults.heapPatternCandidates,
-                                 patterns, primitiveVariables, match,
-                                 exitIndex);
+            sampleMatch(match, exitIndex, functions, dynamicAnalysisResults,
+                        analysisResults, equationSampler, heapPatternSampler);
         },
         [&](CoupledCallInfo<const llvm::Value *> match) {
-            const auto primitiveVariables = getPrimitiveFreeVariables(
-                match.functions, match.mark, analysisResults);
-            auto returnInstrs =
-                getReturnInstructions(match.functions, analysisResults);
-            populateEquationsMap(
-                dynamicAnalysisResults.relationalFunctionPolynomialEquations,
-                primitiveVariables, match, degree);
-            populateHeapPatterns(
-                dynamicAnalysisResults.relationalFunctionHeapPatterns, patterns,
-                primitiveVariables, match, returnInstrs);
+            sampleMatch(match, dynamicAnalysisResults, analysisResults,
+                        equationSampler, heapPatternSampler);
         },
         [&](UncoupledCallInfo<const llvm::Value *> match) {
-            const auto primitiveVariables = getPrimitiveFreeVariables(
-                match.function, match.mark, analysisResults);
-            populateEquationsMap(
-                dynamicAnalysisResults.functionPolynomialEquations,
-                primitiveVariables, match, degree);
-            populateHeapPatterns(
-                dynamicAnalysisResults.functionHeapPatterns, patterns,
-                primitiveVariables, match,
-                analysisResults.at(match.function).returnInstruction);
-
+            sampleMatch(match, dynamicAnalysisResults, analysisResults,
+                        equationSampler, heapPatternSampler);
         });
+    equationSampler.flush();
+    heapPatternSampler.flush();
     auto loopTransformations =
         findLoopTransformations(dynamicAnalysisResults.loopCounts.loopCounts);
     dumpLoopTransformations(loopTransformations);
@@ -191,15 +303,11 @@ Transformed analyzeMainCounterExample(
     return Transformed::No;
 }
 
-void analyzeRelationalCounterExample(
+auto interpretRelationalCounterExample(
     MarkPair pathMarks, const ModelValues &vals,
     MonoPair<const llvm::Function *> functions,
-    DynamicAnalysisResults &dynamicAnalysisResults,
-    const MonoPair<BlockNameMap> &nameMap,
-    const AnalysisResultsMap &analysisResults, unsigned maxDegree) {
+    const AnalysisResultsMap &analysisResults) -> InterpretedCounterExample {
     const auto markMaps = getBlockMarkMaps(functions, analysisResults);
-    auto primitiveFreeVariables = getPrimitiveFreeVariables(
-        functions, pathMarks.startMark, analysisResults);
     // reconstruct input from counterexample
     // TODO we could cache the result of instructionNameMap somewhere
     auto variableValues = getVarMapFromModel(
@@ -211,11 +319,6 @@ void analyzeRelationalCounterExample(
 
         vals.values);
 
-    dumpCounterExample(pathMarks.startMark, pathMarks.endMark, variableValues,
-                       vals.arrays);
-
-    wait();
-
     assert(markMaps.first.MarkToBlocksMap.at(pathMarks.startMark).size() == 1);
     assert(markMaps.second.MarkToBlocksMap.at(pathMarks.startMark).size() == 1);
     auto firstBlock =
@@ -223,35 +326,50 @@ void analyzeRelationalCounterExample(
     auto secondBlock =
         *markMaps.second.MarkToBlocksMap.at(pathMarks.startMark).begin();
 
-    MonoPair<Call<const llvm::Value *>> calls = interpretFunctionPair(
+    MonoPair<FastCall> calls = interpretFunctionPair(
         functions, variableValues, getHeapsFromModel(vals.arrays),
         {firstBlock, secondBlock}, InterpretStepsFlag, analysisResults);
+    return {pathMarks, std::move(variableValues),
+            {std::move(calls.first), std::move(calls.second)}};
+}
+
+void analyzeRelationalCounterExample(
+    const InterpretedCounterExample &counterExample, const ModelValues &vals,
+    DynamicAnalysisResults &dynamicAnalysisResults,
+    const MonoPair<BlockNameMap> &nameMap,
+    const AnalysisResultsMap &analysisResults, unsigned maxDegree) {
+    dumpCounterExample(counterExample.pathMarks.startMark,
+                       counterExample.pathMarks.endMark,
+                       counterExample.variables, vals.arrays);
+
+    wait();
+
+    EquationSampler equationSampler(maxDegree);
     analyzeCoupledCalls<const llvm::Value *>(
-        calls.first, calls.second, nameMap, analysisResults,
+        *counterExample.calls.first, *counterExample.calls.second, nameMap,
+        analysisResults,
         [&](CoupledCallInfo<const llvm::Value *> match) {
             const auto primitiveVariables = getPrimitiveFreeVariables(
                 match.functions, match.mark, analysisResults);
-            populateEquationsMap(
+            equationSampler.add(
                 dynamicAnalysisResults.relationalFunctionPolynomialEquations,
-                primitiveVariables, match, maxDegree);
+                primitiveVariables, match);
         },
         [&](UncoupledCallInfo<const llvm::Value *> match) {
-            populateEquationsMap(
+            equationSampler.add(
                 dynamicAnalysisResults.functionPolynomialEquations,
                 removeHeapVariables(analysisResults.at(match.function)
                                         .freeVariables.at(match.mark)),
-                match, maxDegree);
+                match);
         });
+    equationSampler.flush();
 }
 
-void analyzeFunctionalCounterExample(
+auto interpretFunctionalCounterExample(
     MarkPair pathMarks, const ModelValues &vals, const llvm::Function *function,
-    Program program, DynamicAnalysisResults &dynamicAnalysisResults,
-    const BlockNameMap &blockNameMap, const AnalysisResultsMap &analysisResults,
-    unsigned maxDegree) {
+    Program program, const AnalysisResultsMap &analysisResults)
+    -> InterpretedCounterExample {
     const auto markMap = analysisResults.at(function).blockMarkMap;
-    auto primitiveFreeVariables = getPrimitiveFreeVariables(
-        function, pathMarks.startMark, analysisResults);
     // reconstruct input from counterexample
     // TODO we could cache the result of instructionNameMap somewhere
     auto variableValues =
@@ -260,38 +378,63 @@ void analyzeFunctionalCounterExample(
                                function, pathMarks.startMark, analysisResults),
                            vals.values);
 
-    dumpCounterExample(pathMarks.startMark, pathMarks.endMark, variableValues,
-                       vals.arrays);
-
-    wait();
-
     assert(markMap.MarkToBlocksMap.at(pathMarks.startMark).size() == 1);
     auto startBlock = *markMap.MarkToBlocksMap.at(pathMarks.startMark).begin();
 
-    Call<const llvm::Value *> call = interpretFunction(
+    FastCall call = interpretFunction(
         *function,
         FastState(variableValues, getHeapFromModel(vals.arrays, program)),
         startBlock, InterpretStepsFlag, analysisResults);
+    InterpretedCounterExample counterExample{
+        pathMarks, {FastVarMap(), FastVarMap()}, {llvm::None, llvm::None}};
+    if (program == Program::First) {
+        counterExample.variables.first = std::move(variableValues);
+        counterExample.calls.first = std::move(call);
+    } else {
+        counterExample.variables.second = std::move(variableValues);
+        counterExample.calls.second = std::move(call);
+    }
+    return counterExample;
+}
+
+void analyzeFunctionalCounterExample(
+    const InterpretedCounterExample &counterExample, const ModelValues &vals,
+    Program program, DynamicAnalysisResults &dynamicAnalysisResults,
+    const BlockNameMap &blockNameMap, const AnalysisResultsMap &analysisResults,
+    unsigned maxDegree) {
+    dumpCounterExample(counterExample.pathMarks.startMark,
+                       counterExample.pathMarks.endMark,
+                       program == Program::First
+                           ? counterExample.variables.first
+                           : counterExample.variables.second,
+                       vals.arrays);
+
+    wait();
+
+    const FastCall &call = program == Program::First
+                               ? *counterExample.calls.first
+                               : *counterExample.calls.second;
     std::cout << "analyzing trace\n";
+    EquationSampler equationSampler(maxDegree);
     analyzeUncoupledCall<const llvm::Value *>(
         call, blockNameMap, program, analysisResults,
         [&](UncoupledCallInfo<const llvm::Value *> match) {
-            populateEquationsMap(
+            equationSampler.add(
                 dynamicAnalysisResults.functionPolynomialEquations,
                 removeHeapVariables(analysisResults.at(match.function)
                                         .freeVariables.at(match.mark)),
-                match, maxDegree);
+                match);
         });
+    equationSampler.flush();
     std::cout << "analyzed trace\n";
 }
 
-static llvm::SmallDenseMap<HeapAddress, Integer>
-randomHeap(const llvm::Function &fun, const FastVarMap &variableValues,
-           int lengthBound, int valLowerBound, int valUpperBound,
-           unsigned int *seedp) {
+HeapMap randomHeap(const llvm::Function &fun,
+                   const FastVarMap &variableValues, int lengthBound,
+                   int valLowerBound, int valUpperBound, unsigned int *seedp) {
     // We place an array with a random length <= lengthBound with random values
     // >= valLowerBound and <= valUpperBound at each pointer argument
-    llvm::SmallDenseMap<HeapAddress, Integer> heap;
+    HeapMap heap;
     for (const auto &arg : fun.args()) {
         if (arg.getType()->isPointerTy()) {
             Integer arrayStart = variableValues.find(&arg)->second;
@@ -316,55 +459,314 @@ randomHeap(const llvm::Function &fun, const FastVarMap &variableValues,
     }
     return heap;
 }
-static void analyzeExample(
-    std::function<void(MonoPair<Call<const llvm::Value *>>)> callback,
-    MonoPair<std::vector<mpz_class>> initialValues,
-    MonoPair<const llvm::Function *> funs,
-    AnalysisResultsMap &analysisResults) {
-    unsigned int seedp = static_cast<unsigned int>(time(NULL));
-    MonoPair<FastVarMap> variableValues = {FastVarMap(), FastVarMap()};
-    variableValues.first = getVarMap(funs.first, initialValues.first);
-    variableValues.second = getVarMap(funs.second, initialValues.second);
-    auto heap =
-        randomHeap(*funs.first, variableValues.first, 5, -20, 20, &seedp);
-    MonoPair<Heap> heaps = {{heap, Integer(0)}, {heap, Integer(0)}};
-    MonoPair<Call<const llvm::Value *>> calls = interpretFunctionPair(
-        funs, std::move(variableValues), heaps, 10000, analysisResults);
-    callback(std::move(calls));
+// A copy of a match whose steps outlive the trace
+struct RecordedMatch {
+    Mark mark;
+    LoopInfo loopInfo;
+    MonoPair<BlockStep<const llvm::Value *>> steps;
+};
+
+// The JIT only records the values that are available at a mark while the
+// interpreter keeps all values of a call
+static bool sameStep(const BlockStep<const llvm::Value *> &jitStep,
+                     const BlockStep<const llvm::Value *> &step) {
+    if (jitStep.blockName != step.blockName ||
+        !(jitStep.heap() == step.heap())) {
+        return false;
+    }
+    const auto variables = step.state().variables;
+    for (const auto &var : jitStep.state().variables) {
+        auto it = variables.find(var.first);
+        if (it == variables.end() || it->second != var.second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sameMatch(const RecordedMatch &jitMatch,
+                      const MatchInfo<const llvm::Value *> &match) {
+    return jitMatch.mark == match.mark &&
+           jitMatch.loopInfo == match.loopInfo &&
+           sameStep(jitMatch.steps.first, *match.steps.first) &&
+           sameStep(jitMatch.steps.second, *match.steps.second);
+}
+
+// Interpret the programs on the inputs of a JIT trace and compare the matches
+static void checkJitMatches(
+    const TraceJit &jit, MonoPair<const llvm::Function *> funs,
+    TraceInputs inputs, uint32_t maxSteps,
+    const MonoPair<BlockNameMap> &nameMaps,
+    const AnalysisResultsMap &analysisResults, FrameLayouts &layouts,
+    std::function<void(MatchInfo<const llvm::Value *>)> iterativeMatch) {
+    vector<RecordedMatch> jitMatches;
+    analyzeExecution<const llvm::Value *>(
+        jit.run(inputs.variables, inputs.heaps, maxSteps), nameMaps,
+        analysisResults,
+        [&](MatchInfo<const llvm::Value *> match) {
+            jitMatches.push_back(
+                {match.mark, match.loopInfo,
+                 {*match.steps.first, *match.steps.second}});
+        },
+        [](auto match) {}, [](auto match) {});
+    const auto disagree = [&]() {
+        logError("The JIT and the interpreter disagree on trace " +
+                 std::to_string(inputs.counter) + "\n");
+        exit(1);
+    };
+    size_t index = 0;
+    analyzeInterpretedExecution(
+        funs, inputs.variables, inputs.heaps,
+        {&funs.first->getEntryBlock(), &funs.second->getEntryBlock()},
+        maxSteps, nameMaps, analysisResults, layouts,
+        [&](MatchInfo<const llvm::Value *> match) {
+            if (index >= jitMatches.size() ||
+                !sameMatch(jitMatches[index], match)) {
+                disagree();
+            }
+            ++index;
+            iterativeMatch(match);
+        },
+        [](auto match) {}, [](auto match) {});
+    if (index != jitMatches.size()) {
+        disagree();
+    }
 }
 
 static unsigned randomExamples = 50;
-static void iterateTracesInRange(
-    MonoPair<llvm::Function *> funs, mpz_class lowerBound, mpz_class upperBound,
-    AnalysisResultsMap &analysisResults,
-    std::function<void(MonoPair<Call<const llvm::Value *>>)> callback) {
+static TraceGenerationOpts loopTraceOpts() {
+    return TraceGenerationOpts(TraceThreadsFlag, TraceSeedFlag, 64, 10000);
+}
+// Only the marks at which the programs synchronize are needed, so the traces
+// are analyzed while they are interpreted instead of being kept in memory.
+// Returns the matches of each trace in the order of the traces.
+static vector<vector<std::pair<Mark, LoopInfo>>>
+collectLoopMatches(MonoPair<llvm::Function *> funs, int lowerBound,
+                   int upperBound, const MonoPair<BlockNameMap> &nameMaps,
+                   const AnalysisResultsMap &analysisResults) {
     assert(!(funs.first->isVarArg() || funs.second->isVarArg()));
-    std::vector<Integer> argValues;
-
     assert(funs.first->arg_size() == funs.second->arg_size());
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> distribution(0, 100);
-    for (unsigned i = 0; i < randomExamples; ++i) {
-        std::vector<mpz_class> vals(funs.first->arg_size());
-        for (auto &val : vals) {
-            val = mpz_class(distribution(gen));
+    vector<vector<std::pair<Mark, LoopInfo>>> matches(randomExamples);
+    const TraceGenerationOpts opts = loopTraceOpts();
+    std::unique_ptr<TraceJit> jit;
+    if (JitFlag || CheckJitFlag) {
+        if (SMTGenerationOpts::getInstance().BitVect) {
+            jit = TraceJit::create({funs.first, funs.second}, analysisResults);
+        } else {
+            logWarning("The JIT is only used for bounded integers\n");
+        }
+    }
+    forEachRandomInput(
+        funs, randomExamples, lowerBound, upperBound, opts,
+        [&](TraceInputs inputs, FrameLayouts &layouts) {
+            // Each trace has its own entry so no locking is needed
+            auto &traceMatches = matches[inputs.counter];
+            const auto collect = [&](MatchInfo<const llvm::Value *> match) {
+                traceMatches.emplace_back(match.mark, match.loopInfo);
+            };
+            if (jit != nullptr && CheckJitFlag) {
+                checkJitMatches(*jit, {funs.first, funs.second},
+                                std::move(inputs), opts.MaxSteps, nameMaps,
+                                analysisResults, layouts, collect);
+            } else if (jit != nullptr) {
+                analyzeExecution<const llvm::Value *>(
+                    jit->run(std::move(inputs.variables),
+                             std::move(inputs.heaps), opts.MaxSteps),
+                    nameMaps, analysisResults, collect,
+                    // We ignore functions for now
+                    [](auto match) {}, [](auto match) {});
+            } else {
+                analyzeInterpretedExecution(
+                    funs, std::move(inputs.variables),
+                    std::move(inputs.heaps),
+                    {&funs.first->getEntryBlock(),
+                     &funs.second->getEntryBlock()},
+                    opts.MaxSteps, nameMaps, analysisResults, layouts, collect,
+                    // We ignore functions for now
+                    [](auto match) {}, [](auto match) {});
+            }
+        });
+    return matches;
+}
+
+auto ProgramFunctions::current() -> ProgramFunctions {
+    const auto &opts = SMTGenerationOpts::getInstance();
+    return {opts.MainFunctions, opts.CoupledFunctions, opts.FunctionNumerals,
+            opts.ReversedFunctionNumerals};
+}
+
+void ProgramFunctions::select() const {
+    auto &opts = SMTGenerationOpts::getInstance();
+    opts.MainFunctions = mainFunctions;
+    opts.CoupledFunctions = coupledFunctions;
+    opts.FunctionNumerals = functionNumerals;
+    opts.ReversedFunctionNumerals = reversedFunctionNumerals;
+}
+
+// Peels and unrolls the main functions SMTGenerationOpts points to
+static vector<SharedSMTRef> transformAndGenerateSMT(
+    MonoPair<llvm::Module &> modules, AnalysisResultsMap &analysisResults,
+    const map<Mark, LoopTransformation> &loopTransformations,
+    const FileOptions &fileOpts) {
+    auto functionPair = SMTGenerationOpts::getInstance().MainFunctions;
+    applyLoopTransformation(functionPair, analysisResults, loopTransformations,
+                            getBlockMarkMaps(functionPair, analysisResults));
+    analysisResults.at(functionPair.first).freeVariables =
+        freeVars(analysisResults.at(functionPair.first).paths,
+                 analysisResults.at(functionPair.first).functionArguments,
+                 Program::First);
+    analysisResults.at(functionPair.second).freeVariables =
+        freeVars(analysisResults.at(functionPair.second).paths,
+                 analysisResults.at(functionPair.second).functionArguments,
+                 Program::Second);
+
+    return generateSMT(modules, analysisResults, fileOpts);
+}
+
+// SMT solvers can print warnings before the result, so their output is
+// searched for the result instead of comparing the first line. Other solvers,
+// e.g. for Horn clauses, have to report the proof on the first line.
+static bool reportsProof(const string &output) {
+    if (TransformProofFlag == "sat" || TransformProofFlag == "unsat") {
+        return resultToken(llvm::StringRef(output)) == TransformProofFlag;
+    }
+    return output.substr(0, output.find('\n')) == TransformProofFlag;
+}
+
+// Runs the solver on the file until it exits, the timeout expires or stop is
+// set and returns whether its output reports a proof. The solver gets its own
+// process group so it can be killed together with the processes it started.
+// The pipe is closed on exec so the solvers started by other threads don’t
+// keep it open after this solver exits.
+static bool runSolver(const string &file, const std::atomic<bool> &stop) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        logError("Couldn’t create a pipe for the solver\n");
+        exit(1);
+    }
+    const string command = TransformSolverFlag + " " + file;
+    pid_t pid = fork();
+    if (pid < 0) {
+        logError("Couldn’t start the solver\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+        _exit(127);
+    }
+    // Also set in the parent, the solver could be killed before the child
+    // got to it
+    setpgid(pid, pid);
+    close(fds[1]);
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::seconds(TransformTimeoutFlag);
+    string output;
+    bool finished = false;
+    while (!stop && std::chrono::steady_clock::now() < deadline) {
+        pollfd fd = {fds[0], POLLIN, 0};
+        if (poll(&fd, 1, 100) <= 0) {
+            continue;
+        }
+        char buffer[4096];
+        ssize_t bytes = read(fds[0], buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            finished = true;
+            break;
+        }
+        output.append(buffer, static_cast<size_t>(bytes));
+    }
+    close(fds[0]);
+    if (!finished && kill(-pid, SIGKILL) != 0) {
+        kill(pid, SIGKILL);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return finished && reportsProof(output);
+}
+
+// Generates the SMT for each combination of loop transformations, the first
+// one on the programs themselves and the others on copies, and runs the solver
+// on all of them in parallel. The SMT of the first proof is returned, if
+// there is none the SMT of the first combination. The SMT is serialized like
+// the final output, only to temporary files.
+static vector<SharedSMTRef>
+proveTransformations(MonoPair<llvm::Module &> modules,
+                     AnalysisResultsMap &analysisResults,
+                     const vector<map<Mark, LoopTransformation>> &candidates,
+                     const FileOptions &fileOpts, SerializeOpts serializeOpts,
+                     ProgramFactory copyPrograms) {
+    if (TransformSolverFlag.empty()) {
+        logError("-transform-candidates needs -transform-solver\n");
+        exit(1);
+    }
+    const ProgramFunctions original = ProgramFunctions::current();
+    // SMTGenerationOpts is shared, so the SMT is generated one after another
+    vector<ProgramCopy> copies;
+    vector<vector<SharedSMTRef>> variants;
+    vector<string> files;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        std::cerr << "Candidate " << i << "\n";
+        dumpLoopTransformations(candidates[i]);
+        if (i == 0) {
+            variants.push_back(transformAndGenerateSMT(
+                modules, analysisResults, candidates[i], fileOpts));
+        } else {
+            copies.push_back(copyPrograms());
+            ProgramCopy &copy = copies.back();
+            variants.push_back(transformAndGenerateSMT(
+                {*copy.modules.first, *copy.modules.second},
+                copy.analysisResults, candidates[i], fileOpts));
         }
-        for (auto val : vals) {
-            std::cout << val << ", ";
+        llvm::SmallString<128> path;
+        if (llvm::sys::fs::createTemporaryFile("llreve-transform", "smt2",
+                                               path)) {
+            logError("Couldn’t create a temporary file\n");
+            exit(1);
         }
-        std::cout << "\n";
-        analyzeExample(callback, {vals, vals}, funs, analysisResults);
+        files.push_back(path.str().str());
+        serializeOpts.OutputFileName = files.back();
+        serializeSMT(variants.back(), true, serializeOpts);
+    }
+    original.select();
+
+    std::atomic<bool> proven(false);
+    std::atomic<int> winner(-1);
+    vector<std::thread> solvers;
+    for (size_t i = 0; i < files.size(); ++i) {
+        solvers.emplace_back([&, i] {
+            if (runSolver(files[i], proven)) {
+                int none = -1;
+                if (winner.compare_exchange_strong(none, static_cast<int>(i))) {
+                    proven = true;
+                }
+            }
+        });
     }
+    for (auto &thread : solvers) {
+        thread.join();
+    }
+    for (const auto &file : files) {
+        llvm::sys::fs::remove(file);
+    }
+    if (winner < 0) {
+        logWarning("None of the loop transformations has been proven, using "
+                   "the first one\n");
+        return variants.front();
+    }
+    std::cerr << "Candidate " << winner << " has been proven\n";
+    return variants[static_cast<size_t>(winner.load())];
 }
 
 vector<SharedSMTRef>
 driver(MonoPair<llvm::Module &> modules, AnalysisResultsMap &analysisResults,
        vector<shared_ptr<HeapPattern<VariablePlaceholder>>> patterns,
-       FileOptions fileOpts) {
+       FileOptions fileOpts, SerializeOpts serializeOpts,
+       ProgramFactory copyPrograms) {
     auto functionPair = SMTGenerationOpts::getInstance().MainFunctions;
-    const MonoPair<BidirBlockMarkMap> markMaps =
-        getBlockMarkMaps(functionPair, analysisResults);
     MonoPair<BlockNameMap> nameMap = getBlockNameMaps(analysisResults);
     const auto funArgsPair =
         getFunctionArguments(functionPair, analysisResults);
@@ -376,33 +778,418 @@ driver(MonoPair<llvm::Module &> modules, AnalysisResultsMap &analysisResults,
 
     // Collect loop info
     LoopCountsAndMark loopCounts;
-    iterateTracesInRange(functionPair, 47, 50, analysisResults,
-                         [&](MonoPair<Call<const llvm::Value *>> calls) {
-                             analyzeExecution<const llvm::Value *>(
-                                 std::move(calls), nameMap, analysisResults,
-                                 [&](MatchInfo<const llvm::Value *> matchInfo) {
-                                     findLoopCounts<const llvm::Value *>(
-                                         loopCounts, matchInfo);
-                                 },
-                                 // We ignore functions for now
-                                 [](auto match) {}, [](auto match) {});
-                         });
-    auto loopTransformations = findLoopTransformations(loopCounts.loopCounts);
-    dumpLoopTransformations(loopTransformations);
+    const auto analyzeTrace = [&](MonoPair<Call<const llvm::Value *>> calls) {
+        analyzeExecution<const llvm::Value *>(
+            std::move(calls), nameMap, analysisResults,
+            [&](MatchInfo<const llvm::Value *> matchInfo) {
+                findLoopCounts<const llvm::Value *>(loopCounts, matchInfo);
+            },
+            // We ignore functions for now
+            [](auto match) {}, [](auto match) {});
+    };
+    if (!ReplayTracesFlag.empty()) {
+        replayTraces(ReplayTracesFlag, {&modules.first, &modules.second},
+                     analyzeTrace);
+    } else if (!DumpTracesFlag.empty()) {
+        // Writing the traces needs them in memory, so they can’t be streamed
+        TraceWriter writer(DumpTracesFlag);
+        generateRandomTraces(functionPair, randomExamples, 0, 100,
+                             analysisResults, loopTraceOpts(),
+                             [&](MonoPair<Call<const llvm::Value *>> calls) {
+                                 writer.write(calls);
+                                 analyzeTrace(std::move(calls));
+                             });
+    } else {
+        for (const auto &traceMatches : collectLoopMatches(
+                 functionPair, 0, 100, nameMap, analysisResults)) {
+            for (const auto &match : traceMatches) {
+                findLoopCounts(loopCounts, match.first, match.second);
+            }
+        }
+    }
+    const auto candidates = rankLoopTransformations(
+        loopCounts.loopCounts, std::max(1u, unsigned(TransformCandidatesFlag)));
+    if (candidates.size() == 1) {
+        dumpLoopTransformations(candidates.front());
+        return transformAndGenerateSMT(modules, analysisResults,
+                                       candidates.front(), fileOpts);
+    }
+    return proveTransformations(modules, analysisResults, candidates, fileOpts,
+                                serializeOpts, copyPrograms);
+}
 
-    // Peel and unroll loops
-    applyLoopTransformation(functionPair, analysisResults, loopTransformations,
-                            markMaps);
-    analysisResults.at(functionPair.first).freeVariables =
-        freeVars(analysisResults.at(functionPair.first).paths,
-                 analysisResults.at(functionPair.first).functionArguments,
-                 Program::First);
-    analysisResults.at(functionPair.second).freeVariables =
-        freeVars(analysisResults.at(functionPair.second).paths,
-                 analysisResults.at(functionPair.second).functionArguments,
-                 Program::Second);
+static void dumpCounterExampleInfo(const ModelValues &vals) {
+    Mark cexStartMark(
+        static_cast<int>(vals.values.at("INV_INDEX_START").get_si()));
+    Mark cexEndMark(static_cast<int>(vals.values.at("INV_INDEX_END").get_si()));
+    std::cout << "MAIN: " << vals.main << "\n";
+    std::cout << "startMark: " << cexStartMark << "\n";
+    std::cout << "endMark: " << cexEndMark << "\n";
+    if (vals.functions.first) {
+        std::cout << "function 1: " << vals.functions.first->getName().str()
+                  << "\n";
+    }
+    if (vals.functions.second) {
+        std::cout << "function 2: " << vals.functions.second->getName().str()
+                  << "\n";
+    }
+}
 
-    return generateSMT(modules, analysisResults, fileOpts);
+static MarkPair counterExampleMarks(const ModelValues &vals) {
+    return {Mark(static_cast<int>(vals.values.at("INV_INDEX_START").get_si())),
+            Mark(static_cast<int>(vals.values.at("INV_INDEX_END").get_si()))};
+}
+
+static auto interpretCounterExample(const ModelValues &vals,
+                                    const AnalysisResultsMap &analysisResults)
+    -> InterpretedCounterExample {
+    assert(!vals.main);
+    if (vals.functions.first && vals.functions.second) {
+        return interpretRelationalCounterExample(
+            counterExampleMarks(vals), vals, vals.functions, analysisResults);
+    } else if (vals.functions.first) {
+        return interpretFunctionalCounterExample(
+            counterExampleMarks(vals), vals, vals.functions.first,
+            Program::First, analysisResults);
+    } else {
+        return interpretFunctionalCounterExample(
+            counterExampleMarks(vals), vals, vals.functions.second,
+            Program::Second, analysisResults);
+    }
+}
+
+// The counterexamples are interpreted by as many threads as the traces
+static unsigned interpreterThreads() {
+    if (TraceThreadsFlag == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return TraceThreadsFlag;
+}
+
+// Analyzes the counterexamples in order, first the ones starting in the main
+// functions. If one of them leads to a loop transformation, the others are
+// dropped and counterExamples only contains the new initial values. The
+// remaining counterexamples only read the analysis results while they are
+// interpreted, so they are interpreted in parallel on a fixed pool of
+// threads. The results are added in the order of the counterexamples so they
+// don’t depend on the scheduling.
+static Transformed analyzeCounterExamples(
+    vector<ModelValues> &counterExamples, MonoPair<llvm::Function *> functions,
+    DynamicAnalysisResults &dynamicAnalysisResults,
+    AnalysisResultsMap &analysisResults,
+    llvm::StringMap<const llvm::Value *> &instrNameMap,
+    const MonoPair<BlockNameMap> &blockNameMap,
+    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
+    unsigned degree) {
+    for (auto &vals : counterExamples) {
+        assert(vals.functions.first || vals.functions.second);
+        if (!vals.main) {
+            continue;
+        }
+        dumpCounterExampleInfo(vals);
+        Transformed transformed = analyzeMainCounterExample(
+            counterExampleMarks(vals), vals, functions, dynamicAnalysisResults,
+            analysisResults, instrNameMap, blockNameMap, patterns, degree);
+        if (transformed == Transformed::Yes) {
+            ModelValues initialValues = std::move(vals);
+            counterExamples.clear();
+            counterExamples.push_back(std::move(initialValues));
+            return Transformed::Yes;
+        }
+    }
+    vector<Optional<InterpretedCounterExample>> interpreted(
+        counterExamples.size());
+    BoundedMPMCQueue<size_t> work(counterExamples.size());
+    for (size_t i = 0; i < counterExamples.size(); ++i) {
+        if (!counterExamples[i].main) {
+            work.push(i);
+        }
+    }
+    work.close();
+    const size_t workers =
+        std::min<size_t>(interpreterThreads(), counterExamples.size());
+    vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; ++worker) {
+        threads.emplace_back([&work, &counterExamples, &interpreted,
+                              &analysisResults] {
+            while (Optional<size_t> i = work.pop()) {
+                interpreted[*i] = interpretCounterExample(
+                    counterExamples[*i], analysisResults);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < counterExamples.size(); ++i) {
+        const ModelValues &vals = counterExamples[i];
+        if (vals.main) {
+            continue;
+        }
+        dumpCounterExampleInfo(vals);
+        if (vals.functions.first && vals.functions.second) {
+            analyzeRelationalCounterExample(*interpreted[i], vals,
+                                            dynamicAnalysisResults,
+                                            blockNameMap, analysisResults,
+                                            degree);
+        } else if (vals.functions.first) {
+            analyzeFunctionalCounterExample(
+                *interpreted[i], vals, Program::First, dynamicAnalysisResults,
+                blockNameMap.first, analysisResults, degree);
+        } else {
+            analyzeFunctionalCounterExample(
+                *interpreted[i], vals, Program::Second, dynamicAnalysisResults,
+                blockNameMap.second, analysisResults, degree);
+        }
+    }
+    return Transformed::No;
+}
+
+// Satisfied by the models that describe the same path with the same inputs
+// as the model, so negating it blocks the counterexample
+static z3::expr sameCounterExample(z3::context &z3Cxt, const z3::model &model,
+                                   const llvm::StringMap<z3::expr> &nameMap,
+                                   const ModelValues &vals) {
+    vector<string> names = {"MAIN", "PROGRAM_1", "PROGRAM_2"};
+    if (vals.functions.first) {
+        names.push_back("FUNCTION_1");
+    }
+    if (vals.functions.second) {
+        names.push_back("FUNCTION_2");
+    }
+    // The marks and the input values
+    for (const auto &val : vals.values) {
+        names.push_back(val.first);
+    }
+    z3::expr same = z3Cxt.bool_val(true);
+    for (const auto &name : names) {
+        const z3::expr &var = nameMap.find(name)->second;
+        same = same && var == model.eval(var, true);
+    }
+    return same;
+}
+
+// Once the equations of a key are saturated, further traces reaching it can
+// only remove heap patterns
+static void
+saturateKeys(CoverageGuidedInputs &inputs,
+             IterativeInvariantMap<PolynomialEquations> &equations) {
+    for (const auto &key : inputs.coverage()) {
+        if (getDataForLoopInfo(equations[key.first.mark][key.first.exitIndex],
+                               key.first.loopInfo)
+                .saturated()) {
+            inputs.saturate(key.first);
+        }
+    }
+}
+
+static size_t
+coveredEquationsRank(const std::map<CoverageKey, unsigned> &coverage,
+                     IterativeInvariantMap<PolynomialEquations> &equations) {
+    size_t rank = 0;
+    for (const auto &key : coverage) {
+        rank += getDataForLoopInfo(
+                    equations[key.first.mark][key.first.exitIndex],
+                    key.first.loopInfo)
+                    .rank();
+    }
+    return rank;
+}
+
+// Interprets the inputs in parallel and samples the matches of their traces
+// in order, so the samples don’t depend on the scheduling. The keys reached
+// by the trace of each input are passed to recordKeys with its index.
+static void sampleTraces(
+    MonoPair<const llvm::Function *> functions, const vector<WorkItem> &inputs,
+    DynamicAnalysisResults &dynamicAnalysisResults,
+    const AnalysisResultsMap &analysisResults,
+    const MonoPair<BlockNameMap> &nameMap, EquationSampler &equationSampler,
+    HeapPatternSampler &heapPatternSampler,
+    std::function<void(size_t, vector<CoverageKey>)> recordKeys) {
+    size_t produced = 0;
+    size_t analyzed = 0;
+    generateTraces(
+        functions,
+        [&]() -> Optional<WorkItem> {
+            if (produced == inputs.size()) {
+                return llvm::None;
+            }
+            return inputs[produced++];
+        },
+        analysisResults, loopTraceOpts(),
+        [&](MonoPair<FastCall> calls) {
+            vector<CoverageKey> keys;
+            analyzeExecution<const llvm::Value *>(
+                std::move(calls), nameMap, analysisResults,
+                [&](MatchInfo<const llvm::Value *> match) {
+                    ExitIndex exitIndex = getExitIndex(match);
+                    sampleMatch(match, exitIndex, functions,
+                                dynamicAnalysisResults, analysisResults,
+                                equationSampler, heapPatternSampler);
+                    keys.emplace_back(match.mark, match.loopInfo,
+                                      std::move(exitIndex));
+                },
+                [&](CoupledCallInfo<const llvm::Value *> match) {
+                    sampleMatch(match, dynamicAnalysisResults, analysisResults,
+                                equationSampler, heapPatternSampler);
+                },
+                [&](UncoupledCallInfo<const llvm::Value *> match) {
+                    sampleMatch(match, dynamicAnalysisResults, analysisResults,
+                                equationSampler, heapPatternSampler);
+                });
+            recordKeys(analyzed++, std::move(keys));
+        });
+    equationSampler.flush();
+    heapPatternSampler.flush();
+}
+
+static const size_t coverageRoundSize = 16;
+// Samples traces of the main functions on coverage guided inputs in rounds.
+// Stops once the equations of all reached keys are saturated or a round
+// neither reaches a new key nor increases the rank of the equations.
+static void sampleCoverageGuidedTraces(
+    MonoPair<const llvm::Function *> functions,
+    DynamicAnalysisResults &dynamicAnalysisResults,
+    const AnalysisResultsMap &analysisResults,
+    const MonoPair<BlockNameMap> &nameMap,
+    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
+    unsigned degree) {
+    CoverageGuidedInputs inputs(functions, 0, 100, TraceSeedFlag);
+    EquationSampler equationSampler(degree);
+    HeapPatternSampler heapPatternSampler(patterns);
+    auto &equations = dynamicAnalysisResults.polynomialEquations;
+    size_t traces = 0;
+    while (traces < CoverageTracesFlag) {
+        const vector<WorkItem> round = inputs.nextRound(
+            std::min(coverageRoundSize,
+                     static_cast<size_t>(CoverageTracesFlag) - traces));
+        const size_t rank = coveredEquationsRank(inputs.coverage(), equations);
+        bool newKey = false;
+        sampleTraces(functions, round, dynamicAnalysisResults,
+                     analysisResults, nameMap, equationSampler,
+                     heapPatternSampler,
+                     [&](size_t input, vector<CoverageKey> keys) {
+                         newKey |= inputs.record(round[input], std::move(keys));
+                     });
+        traces += round.size();
+        saturateKeys(inputs, equations);
+        if (inputs.saturated() ||
+            (!newKey &&
+             coveredEquationsRank(inputs.coverage(), equations) == rank)) {
+            break;
+        }
+    }
+    std::cout << "Sampled " << traces << " coverage guided traces reaching "
+              << inputs.coverage().size() << " invariants\n";
+}
+
+// Samples fresh random traces before a solver call. Candidates that don’t
+// hold on them are dropped here instead of costing another solver call.
+static void sampleHeldOutTraces(
+    MonoPair<const llvm::Function *> functions,
+    DynamicAnalysisResults &dynamicAnalysisResults,
+    const AnalysisResultsMap &analysisResults,
+    const MonoPair<BlockNameMap> &nameMap,
+    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
+    unsigned degree, unsigned iteration) {
+    // Without a corpus all inputs are fresh, the seed differs in each
+    // iteration and from the one of the coverage guided traces
+    CoverageGuidedInputs inputs(functions, 0, 100,
+                                TraceSeedFlag + 1 + iteration);
+    EquationSampler equationSampler(degree);
+    HeapPatternSampler heapPatternSampler(patterns);
+    sampleTraces(functions, inputs.nextRound(HeldOutTracesFlag),
+                 dynamicAnalysisResults, analysisResults, nameMap,
+                 equationSampler, heapPatternSampler,
+                 [](size_t /* unused */, vector<CoverageKey> /* unused */) {});
+    std::cout << "Filtered the candidates on " << HeldOutTracesFlag
+              << " held-out traces\n";
+}
+
+// Checks the query separately for each path between a pair of marks, in a
+// Z3 context per path, so one iteration finds the counterexamples of all
+// paths whose invariants don’t hold. The inverted query asserts the
+// disjunction of the paths, other queries are checked in one piece. Returns
+// None if the query is unsat. The candidates refuted on a path are not
+// dropped here, they are refined by interpreting the counterexamples like
+// the ones of the sequential check.
+static auto solvePathsInParallel(const vector<SharedSMTRef> &clauses,
+                                 const AnalysisResultsMap &analysisResults)
+    -> Optional<vector<ModelValues>> {
+    size_t disjunction = clauses.size();
+    vector<SharedSMTRef> paths;
+    for (size_t i = 0; i < clauses.size(); ++i) {
+        const Assert *assertion = clauses[i]->asAssert();
+        if (assertion != nullptr && assertion->expr->asOp() != nullptr &&
+            assertion->expr->asOp()->opName == "or") {
+            disjunction = i;
+            paths = assertion->expr->asOp()->args;
+        }
+    }
+    if (disjunction == clauses.size()) {
+        paths.push_back(nullptr);
+    }
+    vector<vector<ModelValues>> counterExamples(paths.size());
+    std::atomic<size_t> nextPath(0);
+    std::atomic<bool> unknown(false);
+    auto check = [&]() {
+        for (size_t path = nextPath++; path < paths.size(); path = nextPath++) {
+            z3::context z3Cxt;
+            z3::solver z3Solver(z3Cxt);
+            llvm::StringMap<z3::expr> nameMap;
+            llvm::StringMap<smt::Z3DefineFun> defineFunMap;
+            for (size_t i = 0; i < clauses.size(); ++i) {
+                if (i == disjunction) {
+                    Assert(paths[path])
+                        .toZ3(z3Cxt, z3Solver, nameMap, defineFunMap);
+                } else {
+                    clauses[i]->toZ3(z3Cxt, z3Solver, nameMap, defineFunMap);
+                }
+            }
+            for (unsigned i = 0; i < CounterExamplesFlag; ++i) {
+                const z3::check_result result = z3Solver.check();
+                if (result == z3::unknown && i == 0) {
+                    unknown = true;
+                }
+                if (result != z3::sat) {
+                    break;
+                }
+                z3::model z3Model = z3Solver.get_model();
+                counterExamples[path].push_back(
+                    parseZ3Model(z3Cxt, z3Model, nameMap, analysisResults));
+                z3Solver.add(!sameCounterExample(
+                    z3Cxt, z3Model, nameMap, counterExamples[path].back()));
+            }
+        }
+    };
+    vector<std::thread> threads;
+    for (unsigned i = 1; i < SolverThreadsFlag; ++i) {
+        threads.emplace_back(check);
+    }
+    check();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (unknown) {
+        std::cout << "Why is this unknown :(\n";
+        exit(1);
+    }
+    vector<ModelValues> result;
+    for (auto &pathCounterExamples : counterExamples) {
+        for (auto &vals : pathCounterExamples) {
+            result.push_back(std::move(vals));
+        }
+    }
+    if (result.empty()) {
+        return llvm::None;
+    }
+    std::cout << "Found counterexamples on "
+              << std::count_if(counterExamples.begin(), counterExamples.end(),
+                               [](const vector<ModelValues> &vals) {
+                                   return !vals.empty();
+                               })
+              << " of " << paths.size() << " paths\n";
+    return result;
 }
 
 std::vector<smt::SharedSMTRef>
@@ -416,28 +1203,15 @@ cegarDriver(MonoPair<llvm::Module &> modules,
     // Run the interpreter on the unrolled code
     DynamicAnalysisResults dynamicAnalysisResults;
     size_t degree = DegreeFlag;
-    ModelValues vals = initialModelValues(functions);
+    vector<ModelValues> counterExamples = {initialModelValues(functions)};
+    bool sampledCoverage = false;
+    unsigned iteration = 0;
     auto instrNameMap = instructionNameMap(functions);
     z3::context z3Cxt;
     z3::solver z3Solver(z3Cxt);
     // We start by assuming equivalence and change it to non equivalence
     LlreveResult result = LlreveResult::Equivalent;
     do {
-        Mark cexStartMark(
-            static_cast<int>(vals.values.at("INV_INDEX_START").get_si()));
-        Mark cexEndMark(
-            static_cast<int>(vals.values.at("INV_INDEX_END").get_si()));
-        std::cout << "MAIN: " << vals.main << "\n";
-        std::cout << "startMark: " << cexStartMark << "\n";
-        std::cout << "endMark: " << cexEndMark << "\n";
-        if (vals.functions.first) {
-            std::cout << "function 1: " << vals.functions.first->getName().str()
-                      << "\n";
-        }
-        if (vals.functions.second) {
-            std::cout << "function 2: "
-                      << vals.functions.second->getName().str() << "\n";
-        }
         // TODO we can’t stop if there is a function call on this path so for
         // now we disable this
         // if ((vals.main && cexEndMark == EXIT_MARK) ||
@@ -450,30 +1224,26 @@ cegarDriver(MonoPair<llvm::Module &> modules,
         //     break;
         // }
 
-        assert(vals.functions.first || vals.functions.second);
-        if (vals.main) {
-            Transformed transformed = analyzeMainCounterExample(
-                {cexStartMark, cexEndMark}, vals, functions,
-                dynamicAnalysisResults, analysisResults, instrNameMap,
-                blockNameMap, patterns, degree);
-            if (transformed == Transformed::Yes) {
-                continue;
-            }
-        } else if (vals.functions.first && vals.functions.second) {
-            analyzeRelationalCounterExample(
-                {cexStartMark, cexEndMark}, vals, vals.functions,
-                dynamicAnalysisResults, blockNameMap, analysisResults, degree);
-        } else if (vals.functions.first) {
-            analyzeFunctionalCounterExample(
-                {cexStartMark, cexEndMark}, vals, vals.functions.first,
-                Program::First, dynamicAnalysisResults, blockNameMap.first,
-                analysisResults, degree);
-        } else if (vals.functions.second) {
-            analyzeFunctionalCounterExample(
-                {cexStartMark, cexEndMark}, vals, vals.functions.second,
-                Program::Second, dynamicAnalysisResults, blockNameMap.second,
-                analysisResults, degree);
+        Transformed transformed = analyzeCounterExamples(
+            counterExamples, functions, dynamicAnalysisResults,
+            analysisResults, instrNameMap, blockNameMap, patterns, degree);
+        if (transformed == Transformed::Yes) {
+            // The samples have been dropped together with the old program
+            sampledCoverage = false;
+            continue;
         }
+        if (!sampledCoverage && CoverageTracesFlag > 0) {
+            sampleCoverageGuidedTraces(
+                {functions.first, functions.second}, dynamicAnalysisResults,
+                analysisResults, blockNameMap, patterns, degree);
+            sampledCoverage = true;
+        }
+        if (HeldOutTracesFlag > 0) {
+            sampleHeldOutTraces({functions.first, functions.second},
+                                dynamicAnalysisResults, analysisResults,
+                                blockNameMap, patterns, degree, iteration);
+        }
+        ++iteration;
 
         auto invariantCandidates = makeIterativeInvariantDefinitions(
             functions, dynamicAnalysisResults.polynomialEquations,
@@ -497,9 +1267,6 @@ cegarDriver(MonoPair<llvm::Module &> modules,
             functionInvariantCandidates;
         vector<SharedSMTRef> clauses =
             generateSMT(modules, analysisResults, fileOpts);
-        z3Solver.reset();
-        llvm::StringMap<z3::expr> nameMap;
-        llvm::StringMap<smt::Z3DefineFun> defineFunMap;
         vector<SharedSMTRef> z3Clauses;
         set<SortedVar> introducedVariables;
         for (const auto &clause : clauses) {
@@ -508,17 +1275,32 @@ cegarDriver(MonoPair<llvm::Module &> modules,
         vector<SharedSMTRef> introducedClauses;
         for (const auto &var : introducedVariables) {
             introducedClauses.push_back(make_unique<VarDecl>(var));
-            VarDecl(var).toZ3(z3Cxt, z3Solver, nameMap, defineFunMap);
         }
         z3Clauses.insert(z3Clauses.begin(), introducedClauses.begin(),
                          introducedClauses.end());
-        for (const auto &clause : z3Clauses) {
-            clause->toZ3(z3Cxt, z3Solver, nameMap, defineFunMap);
-        }
         if (DumpIntermediateSMTFlag) {
             serializeSMT(z3Clauses, false,
                          SerializeOpts("out.smt2", true, false, true, false));
         }
+        // The paths are loaded into their own contexts, so the clauses are
+        // only loaded into the main solver if it is used
+        if (SolverThreadsFlag > 1) {
+            auto pathCounterExamples =
+                solvePathsInParallel(z3Clauses, analysisResults);
+            if (!pathCounterExamples) {
+                std::cout << "Unsat\n";
+                break;
+            }
+            std::cout << "Sat\n";
+            counterExamples = std::move(*pathCounterExamples);
+            continue;
+        }
+        z3Solver.reset();
+        llvm::StringMap<z3::expr> nameMap;
+        llvm::StringMap<smt::Z3DefineFun> defineFunMap;
+        for (const auto &clause : z3Clauses) {
+            clause->toZ3(z3Cxt, z3Solver, nameMap, defineFunMap);
+        }
         bool unsat = false;
         switch (z3Solver.check()) {
         case z3::unsat:
@@ -535,8 +1317,18 @@ cegarDriver(MonoPair<llvm::Module &> modules,
         if (unsat) {
             break;
         }
-        z3::model z3Model = z3Solver.get_model();
-        vals = parseZ3Model(z3Cxt, z3Model, nameMap, analysisResults);
+        counterExamples.clear();
+        for (unsigned i = 0; i < CounterExamplesFlag; ++i) {
+            // Each counterexample has to differ from the previous ones
+            if (i > 0 && z3Solver.check() != z3::sat) {
+                break;
+            }
+            z3::model z3Model = z3Solver.get_model();
+            counterExamples.push_back(
+                parseZ3Model(z3Cxt, z3Model, nameMap, analysisResults));
+            z3Solver.add(!sameCounterExample(z3Cxt, z3Model, nameMap,
+                                             counterExamples.back()));
+        }
     } while (1 /* sat */);
 
     vector<SharedSMTRef> clauses;
@@ -811,13 +1603,100 @@ map<Mark, LoopTransformation> findLoopTransformations(LoopCountMap &map) {
     return transforms;
 }
 
+static auto transformationKey(const LoopTransformation &transformation)
+    -> std::tuple<LoopTransformType, LoopTransformSide, size_t> {
+    return std::make_tuple(transformation.type, transformation.side,
+                           transformation.count);
+}
+
+// The transformation findLoopTransformations would choose if this was the only
+// sample
+static auto sampleTransformation(MonoPair<int> sample) -> LoopTransformation {
+    const int difference = sample.first - sample.second;
+    if (abs(difference) <= 4) {
+        return LoopTransformation(
+            LoopTransformType::Peel,
+            difference >= 0 ? LoopTransformSide::Left
+                            : LoopTransformSide::Right,
+            static_cast<size_t>(abs(difference)));
+    }
+    float factor =
+        static_cast<float>(sample.first) / static_cast<float>(sample.second);
+    LoopTransformSide side =
+        factor < 1 ? LoopTransformSide::Right : LoopTransformSide::Left;
+    factor = factor < 1 ? 1 / factor : factor;
+    return LoopTransformation(LoopTransformType::Unroll, side,
+                              static_cast<size_t>(std::round(factor)));
+}
+
+vector<map<Mark, LoopTransformation>>
+rankLoopTransformations(LoopCountMap &map, size_t count) {
+    const auto chosen = findLoopTransformations(map);
+    // The alternatives for each mark, the chosen one first and the others by
+    // the number of samples suggesting them
+    vector<Mark> marks;
+    vector<vector<LoopTransformation>> alternatives;
+    for (const auto &it : chosen) {
+        std::map<std::tuple<LoopTransformType, LoopTransformSide, size_t>,
+                 std::pair<unsigned, LoopTransformation>>
+            suggestions;
+        for (auto sample : map.at(it.first)) {
+            if (sample.first < 3 || sample.second < 3) {
+                continue;
+            }
+            const auto transformation = sampleTransformation(sample);
+            auto suggestion = suggestions.insert(
+                {transformationKey(transformation), {0, transformation}});
+            ++suggestion.first->second.first;
+        }
+        suggestions.erase(transformationKey(it.second));
+        vector<std::pair<unsigned, LoopTransformation>> sorted;
+        for (const auto &suggestion : suggestions) {
+            sorted.push_back(suggestion.second);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const auto &a, const auto &b) {
+                             return a.first > b.first;
+                         });
+        vector<LoopTransformation> markAlternatives = {it.second};
+        for (const auto &suggestion : sorted) {
+            markAlternatives.push_back(suggestion.second);
+        }
+        marks.push_back(it.first);
+        alternatives.push_back(std::move(markAlternatives));
+    }
+    // Enumerate the combinations by the sum of the ranks of their
+    // alternatives, so the first one is the chosen one
+    set<std::pair<size_t, vector<size_t>>> frontier = {
+        {0, vector<size_t>(marks.size(), 0)}};
+    set<vector<size_t>> seen;
+    vector<std::map<Mark, LoopTransformation>> combinations;
+    while (!frontier.empty() && combinations.size() < count) {
+        const auto next = *frontier.begin();
+        frontier.erase(frontier.begin());
+        std::map<Mark, LoopTransformation> combination;
+        for (size_t i = 0; i < marks.size(); ++i) {
+            combination.insert({marks[i], alternatives[i][next.second[i]]});
+            vector<size_t> ranks = next.second;
+            if (++ranks[i] < alternatives[i].size() &&
+                seen.insert(ranks).second) {
+                frontier.insert({next.first + 1, std::move(ranks)});
+            }
+        }
+        combinations.push_back(std::move(combination));
+    }
+    return combinations;
+}
+
 ExitIndex getExitIndex(const MatchInfo<const llvm::Value *> match) {
-    for (auto var : match.steps.first->state.variables) {
+    const auto firstState = match.steps.first->state();
+    for (auto var : firstState.variables) {
         if (var.first->getName() == "exitIndex$1_" + match.mark.toString()) {
             return var.second.asUnbounded();
         }
     }
-    for (auto var : match.steps.second->state.variables) {
+    const auto secondState = match.steps.second->state();
+    for (auto var : secondState.variables) {
         if (var.first->getName() == "exitIndex$1_" + match.mark.toString()) {
             return var.second.asUnbounded();
         }
@@ -838,154 +1717,257 @@ static void filterPatterns(HeapPatternCandidates &patterns,
     }
 }
 
-void populateHeapPatterns(
-    HeapPatternCandidatesMap &heapPatternCandidates,
-    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
-    const vector<SortedVar> &primitiveVariables,
-    MatchInfo<const llvm::Value *> match, ExitIndex exitIndex) {
-    VarMap<const llvm::Value *> variables(match.steps.first->state.variables);
-    variables.insert(match.steps.second->state.variables.begin(),
-                     match.steps.second->state.variables.end());
-    // TODO don’t copy heaps
-    MonoPair<const Heap &> heaps(match.steps.first->state.heap,
-                                 match.steps.second->state.heap);
-    bool newCandidates =
-        heapPatternCandidates[match.mark].count(exitIndex) == 0 ||
-        !getDataForLoopInfo(heapPatternCandidates.at(match.mark).at(exitIndex),
-                            match.loopInfo)
-             .hasValue();
-    if (newCandidates) {
-        list<shared_ptr<HeapPattern<const llvm::Value *>>> candidates;
-        for (auto pat : patterns) {
-            auto newCandidates =
-                pat->instantiate(primitiveVariables, variables, heaps);
-            candidates.splice(candidates.end(), newCandidates);
-        }
-        // This entry could already be present
-        auto it = heapPatternCandidates.at(match.mark)
-                      .insert({exitIndex,
-                               {Optional<HeapPatternCandidates>(),
-                                Optional<HeapPatternCandidates>(),
-                                Optional<HeapPatternCandidates>()}});
-        auto &patternCandidates =
-            getDataForLoopInfo(it.first->second, match.loopInfo);
-        assert(!patternCandidates.hasValue());
-        patternCandidates = std::move(candidates);
-    } else {
-        HeapPatternCandidates &patterns =
-            getDataForLoopInfo(
-                heapPatternCandidates.at(match.mark).at(exitIndex),
-                match.loopInfo)
-                .getValue();
-        filterPatterns(patterns, variables, heaps);
+HeapPatternSampler::HeapPatternSampler(
+    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns)
+    : library(PatternLibrary::get(patterns)), patterns(library->compiled()) {}
+
+void HeapPatternSampler::sample(HeapPatternCandidates &candidates, bool isNew,
+                                const vector<SortedVar> &variables,
+                                llvm::ArrayRef<const Step *> steps,
+                                MonoPair<llvm::Value *> returnInstructions,
+                                const MonoPair<Integer> &returnValues,
+                                MonoPair<Heap> heaps) {
+    auto batchIt = batches.find(&candidates);
+    if (batchIt == batches.end() && !isNew) {
+        VarMap<const llvm::Value *> variableValues;
+        for (const Step *step : steps) {
+            const auto stepVariables = step->state().variables;
+            variableValues.insert(stepVariables.begin(), stepVariables.end());
+        }
+        if (returnInstructions.first != nullptr) {
+            variableValues.insert(
+                {returnInstructions.first, returnValues.first});
+        }
+        if (returnInstructions.second != nullptr) {
+            variableValues.insert(
+                {returnInstructions.second, returnValues.second});
+        }
+        filterPatterns(candidates, variableValues,
+                       MonoPair<const Heap &>(heaps.first, heaps.second));
+        return;
+    }
+    if (batchIt == batches.end()) {
+        // Look up the variables by name once, afterwards the values are
+        // taken directly from the steps
+        llvm::StringMap<const llvm::Value *> values;
+        for (const Step *step : steps) {
+            for (const auto &var : step->state().variables) {
+                values.insert({var.first->getName(), var.first});
+            }
+        }
+        if (returnInstructions.first != nullptr) {
+            values.insert(
+                {resultName(Program::First), returnInstructions.first});
+        }
+        if (returnInstructions.second != nullptr) {
+            values.insert(
+                {resultName(Program::Second), returnInstructions.second});
+        }
+        Batch batch;
+        for (const auto &var : variables) {
+            assert(values.count(var.name) == 1);
+            batch.keys.push_back(values.lookup(var.name));
+        }
+        // All instantiations in the order of Range
+        const auto n = static_cast<uint32_t>(batch.keys.size());
+        for (const auto &pat : patterns) {
+            const size_t k = pat.arguments();
+            auto tuples = library->instantiations(k, n);
+            batch.instantiations.push_back(
+                {k == 0 ? 1 : tuples->size() / k, *tuples});
+        }
+        batchIt = batches.insert({&candidates, std::move(batch)}).first;
+    }
+    Batch &batch = batchIt->second;
+    for (const llvm::Value *key : batch.keys) {
+        if (key == returnInstructions.first) {
+            batch.values.push_back(returnValues.first);
+        } else if (key == returnInstructions.second) {
+            batch.values.push_back(returnValues.second);
+        } else {
+            const Integer *val = nullptr;
+            for (const Step *step : steps) {
+                val = step->delta->lookup(key);
+                if (val != nullptr) {
+                    break;
+                }
+            }
+            assert(val != nullptr);
+            batch.values.push_back(*val);
+        }
+    }
+    batch.heaps.push_back(std::move(heaps));
+    if (batch.heaps.size() == BlockSize) {
+        filter(batch);
+    }
+}
+
+void HeapPatternSampler::filter(Batch &batch) {
+    const size_t samples = batch.heaps.size();
+    const size_t cols = batch.keys.size();
+    vector<int64_t> values(batch.values.size());
+    vector<uint8_t> fits(batch.values.size());
+    for (size_t i = 0; i < batch.values.size(); ++i) {
+        fits[i] = batch.values[i].asSmall(values[i]);
+    }
+    vector<int64_t> args;
+    vector<const llvm::Value *> keys;
+    for (size_t p = 0; p < patterns.size(); ++p) {
+        const CompiledPattern &pat = patterns[p];
+        Instantiations &instantiations = batch.instantiations[p];
+        const size_t k = pat.arguments();
+        args.resize(k);
+        keys.resize(k);
+        // One bit for each instantiation that matches all samples so far
+        vector<uint64_t> survivors((instantiations.size + 63) / 64, ~0ull);
+        if (instantiations.size % 64 != 0) {
+            survivors.back() >>= 64 - instantiations.size % 64;
+        }
+        for (size_t word = 0; word < survivors.size(); ++word) {
+            uint64_t &alive = survivors[word];
+            for (size_t s = 0; s < samples && alive != 0; ++s) {
+                const MonoPair<const Heap &> heaps(batch.heaps[s].first,
+                                                   batch.heaps[s].second);
+                for (uint64_t bits = alive; bits != 0; bits &= bits - 1) {
+                    const unsigned bit =
+                        static_cast<unsigned>(__builtin_ctzll(bits));
+                    const uint32_t *tuple = instantiations.arguments.data() +
+                                            (word * 64 + bit) * k;
+                    bool small = true;
+                    for (size_t i = 0; i < k; ++i) {
+                        args[i] = values[s * cols + tuple[i]];
+                        small &= fits[s * cols + tuple[i]] != 0;
+                    }
+                    Optional<bool> matches;
+                    if (small) {
+                        matches = pat.evaluate(args.data(), heaps, registers);
+                    }
+                    if (!matches.hasValue()) {
+                        // Fall back to unbounded integers
+                        VarMap<const llvm::Value *> variableValues;
+                        for (size_t i = 0; i < k; ++i) {
+                            keys[i] = batch.keys[tuple[i]];
+                            variableValues.insert(
+                                {keys[i], batch.values[s * cols + tuple[i]]});
+                        }
+                        matches =
+                            pat.instantiate(keys)->matches(variableValues,
+                                                           heaps);
+                    }
+                    if (!matches.getValue()) {
+                        alive &= ~(1ull << bit);
+                    }
+                }
+            }
+        }
+        // Remove the instantiations that didn’t match
+        size_t remaining = 0;
+        for (size_t i = 0; i < instantiations.size; ++i) {
+            if (survivors[i / 64] & (1ull << (i % 64))) {
+                std::copy_n(instantiations.arguments.data() + i * k, k,
+                            instantiations.arguments.data() + remaining * k);
+                ++remaining;
+            }
+        }
+        instantiations.size = remaining;
+        instantiations.arguments.resize(remaining * k);
+    }
+    registers.addresses.clear();
+    batch.values.clear();
+    batch.heaps.clear();
+}
+
+void HeapPatternSampler::flush(HeapPatternCandidates &candidates,
+                               Batch &batch) {
+    filter(batch);
+    vector<const llvm::Value *> keys;
+    for (size_t p = 0; p < patterns.size(); ++p) {
+        const Instantiations &instantiations = batch.instantiations[p];
+        const size_t k = patterns[p].arguments();
+        keys.resize(k);
+        for (size_t i = 0; i < instantiations.size; ++i) {
+            for (size_t j = 0; j < k; ++j) {
+                keys[j] = batch.keys[instantiations.arguments[i * k + j]];
+            }
+            candidates.push_back(patterns[p].instantiate(keys));
+        }
+    }
+}
+
+void HeapPatternSampler::flush() {
+    for (auto &batch : batches) {
+        flush(*batch.first, batch.second);
     }
+    batches.clear();
 }
 
-void populateHeapPatterns(
+void HeapPatternSampler::add(HeapPatternCandidatesMap &heapPatternCandidates,
+                             const vector<SortedVar> &primitiveVariables,
+                             MatchInfo<const llvm::Value *> match,
+                             ExitIndex exitIndex) {
+    auto &patternCandidates = getDataForLoopInfo(
+        heapPatternCandidates[match.mark][exitIndex], match.loopInfo);
+    const bool isNew = !patternCandidates.hasValue();
+    if (isNew) {
+        patternCandidates = HeapPatternCandidates();
+    }
+    const Step *steps[] = {match.steps.first, match.steps.second};
+    sample(patternCandidates.getValue(), isNew, primitiveVariables, steps,
+           {nullptr, nullptr}, {Integer(), Integer()},
+           {match.steps.first->heap(), match.steps.second->heap()});
+}
+
+void HeapPatternSampler::add(
     RelationalFunctionInvariantMap<
         LoopInfoData<llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
         &heapPatternCandidates,
-    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
     const vector<SortedVar> &primitiveVariables,
     CoupledCallInfo<const llvm::Value *> match,
     MonoPair<llvm::Value *> returnValues) {
-    VarMap<const llvm::Value *> variables(match.steps.first->state.variables);
-    variables.insert(match.steps.second->state.variables.begin(),
-                     match.steps.second->state.variables.end());
-    variables.insert({returnValues.first, match.returnValues.first});
-    variables.insert({returnValues.second, match.returnValues.second});
-    vector<SortedVar> preVariables = primitiveVariables;
-    vector<SortedVar> postVariables = preVariables;
+    auto &patternCandidates = getDataForLoopInfo(
+        heapPatternCandidates[match.functions][match.mark], match.loopInfo);
+    const bool isNew = !patternCandidates.hasValue();
+    if (isNew) {
+        patternCandidates = FunctionInvariant<HeapPatternCandidates>();
+    }
+    vector<SortedVar> postVariables = primitiveVariables;
     postVariables.emplace_back(resultName(Program::First), int64Type());
     postVariables.emplace_back(resultName(Program::Second), int64Type());
-    // TODO don’t copy heaps
-    MonoPair<Heap> heaps = makeMonoPair(match.steps.first->state.heap,
-                                        match.steps.second->state.heap);
-    bool newCandidates =
-        heapPatternCandidates[match.functions].count(match.mark) == 0 ||
-        !getDataForLoopInfo(
-             heapPatternCandidates.at(match.functions).at(match.mark),
-             match.loopInfo)
-             .hasValue();
-    if (newCandidates) {
-        list<shared_ptr<HeapPattern<const llvm::Value *>>> preCandidates;
-        list<shared_ptr<HeapPattern<const llvm::Value *>>> postCandidates;
-        for (const auto &pat : patterns) {
-            auto newCandidates =
-                pat->instantiate(preVariables, variables, heaps);
-            preCandidates.splice(preCandidates.end(), newCandidates);
-            newCandidates =
-                pat->instantiate(postVariables, variables, heaps, returnValues);
-            postCandidates.splice(postCandidates.end(), newCandidates);
-        }
-        // This entry could already be present but insert will not do anything
-        // in that case
-        llvm::Optional<FunctionInvariant<HeapPatternCandidates>> emptyInvariant;
-        auto it =
-            heapPatternCandidates.at(match.functions)
-                .insert({match.mark,
-                         {emptyInvariant, emptyInvariant, emptyInvariant}});
-        auto &patternCandidates =
-            getDataForLoopInfo(it.first->second, match.loopInfo);
-        assert(!patternCandidates.hasValue());
-        patternCandidates = {std::move(preCandidates),
-                             std::move(postCandidates)};
-    } else {
-        FunctionInvariant<HeapPatternCandidates> &patterns =
-            getDataForLoopInfo(
-                heapPatternCandidates.at(match.functions).at(match.mark),
-                match.loopInfo)
-                .getValue();
-        filterPatterns(patterns.preCondition, variables, heaps);
-        filterPatterns(patterns.postCondition, variables, heaps);
-    }
+    const Step *steps[] = {match.steps.first, match.steps.second};
+    // Copying heaps doesn’t copy their entries
+    const MonoPair<Heap> heaps(match.steps.first->heap(),
+                               match.steps.second->heap());
+    sample(patternCandidates->preCondition, isNew, primitiveVariables, steps,
+           returnValues, match.returnValues, heaps);
+    sample(patternCandidates->postCondition, isNew, postVariables, steps,
+           returnValues, match.returnValues, heaps);
 }
 
-void populateHeapPatterns(
+void HeapPatternSampler::add(
     FunctionInvariantMap<HeapPatternCandidates> &heapPatternCandidates,
-    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns,
     const vector<SortedVar> &primitiveVariables,
     UncoupledCallInfo<const llvm::Value *> match, llvm::Value *returnValue) {
-    VarMap<const llvm::Value *> variables(match.step->state.variables);
-    variables.insert({returnValue, match.returnValue});
-    vector<SortedVar> preVariables = primitiveVariables;
-    vector<SortedVar> postVariables = preVariables;
-    postVariables.emplace_back(resultName(match.prog), int64Type());
+    const bool isNew =
+        heapPatternCandidates[match.function].count(match.mark) == 0;
+    auto &patternCandidates = heapPatternCandidates[match.function][match.mark];
+    MonoPair<llvm::Value *> returnInstructions(nullptr, nullptr);
+    MonoPair<Integer> returnValues = {Integer(), Integer()};
     MonoPair<Heap> heaps = {Heap(), Heap()};
     if (match.prog == Program::First) {
-        heaps = {match.step->state.heap, {}};
+        returnInstructions.first = returnValue;
+        returnValues.first = match.returnValue;
+        heaps.first = match.step->heap();
     } else {
-        heaps = {{}, match.step->state.heap};
-    }
-    bool newCandidates =
-        heapPatternCandidates[match.function].count(match.mark) == 0;
-    if (newCandidates) {
-        list<shared_ptr<HeapPattern<const llvm::Value *>>> preCandidates;
-        list<shared_ptr<HeapPattern<const llvm::Value *>>> postCandidates;
-        MonoPair<llvm::Value *> returnInstructions(nullptr, nullptr);
-        if (match.prog == Program::First) {
-            returnInstructions.first = returnValue;
-        } else {
-            returnInstructions.second = returnValue;
-        }
-        for (auto pat : patterns) {
-            auto newCandidates = pat->instantiate(primitiveVariables, variables,
-                                                  heaps, returnInstructions);
-            preCandidates.splice(preCandidates.end(), newCandidates);
-            newCandidates = pat->instantiate(primitiveVariables, variables,
-                                             heaps, returnInstructions);
-            postCandidates.splice(postCandidates.end(), newCandidates);
-        }
-        // TODO figure out postcondition
-        heapPatternCandidates.at(match.function)
-            .insert({match.mark,
-                     {std::move(preCandidates), std::move(postCandidates)}});
-    } else {
-        FunctionInvariant<HeapPatternCandidates> &patterns =
-            heapPatternCandidates.at(match.function).at(match.mark);
-        filterPatterns(patterns.preCondition, variables, heaps);
-        filterPatterns(patterns.postCondition, variables, heaps);
+        returnInstructions.second = returnValue;
+        returnValues.second = match.returnValue;
+        heaps.second = match.step->heap();
     }
+    const Step *steps[] = {match.step};
+    // TODO figure out postcondition
+    sample(patternCandidates.preCondition, isNew, primitiveVariables, steps,
+           returnInstructions, returnValues, heaps);
+    sample(patternCandidates.postCondition, isNew, primitiveVariables, steps,
+           returnInstructions, returnValues, heaps);
 }
 
 void insertInBlockNameMap(BlockNameMap &nameMap,
@@ -1019,6 +2001,85 @@ bool normalMarkBlock(const BlockNameMap &map, const BlockName &blockName) {
                                ENTRY_MARK);
 }
 
+void findLoopCounts(LoopCountsAndMark &loopCountsAndMark, Mark mark,
+                    LoopInfo loopInfo) {
+    if (loopCountsAndMark.mark != mark) {
+        loopCountsAndMark.loopCounts[mark].emplace_back(0, 0);
+        loopCountsAndMark.mark = mark;
+    }
+    switch (loopInfo) {
+    case LoopInfo::Left:
+        loopCountsAndMark.loopCounts[mark].back().first++;
+        break;
+    case LoopInfo::Right:
+        loopCountsAndMark.loopCounts[mark].back().second++;
+        break;
+    case LoopInfo::None:
+        loopCountsAndMark.loopCounts[mark].back().first++;
+        loopCountsAndMark.loopCounts[mark].back().second++;
+        break;
+    }
+}
+
+InterpretedPaths::InterpretedPaths(const llvm::Function &fun,
+                                   const FastState &entry,
+                                   const llvm::BasicBlock *startBlock,
+                                   uint32_t maxSteps,
+                                   const BlockNameMap &nameMap,
+                                   const AnalysisResultsMap &analysisResults,
+                                   FrameLayouts &layouts)
+    : interpreter(fun, entry, startBlock, maxSteps, analysisResults, layouts),
+      nameMap(nameMap), exhausted(false) {
+    interpretPath();
+}
+
+// Splits the steps in the same places as splitCallAtMarks
+void InterpretedPaths::interpretPath() {
+    if (exhausted) {
+        path = llvm::None;
+        return;
+    }
+    vector<BlockStep<const llvm::Value *>> steps;
+    if (nextStep.hasValue()) {
+        steps.push_back(std::move(*nextStep));
+        nextStep = llvm::None;
+    }
+    while (auto step = interpreter.next()) {
+        if (normalMarkBlock(nameMap, step->blockName)) {
+            nextStep = std::move(step);
+            path = PathStep<const llvm::Value *>(std::move(steps));
+            return;
+        }
+        steps.push_back(std::move(*step));
+    }
+    exhausted = true;
+    path = PathStep<const llvm::Value *>(std::move(steps));
+}
+
+void analyzeInterpretedExecution(
+    MonoPair<const llvm::Function *> funs, MonoPair<FastVarMap> variables,
+    MonoPair<Heap> heaps, MonoPair<const llvm::BasicBlock *> startBlocks,
+    uint32_t maxSteps, const MonoPair<BlockNameMap> &nameMaps,
+    const AnalysisResultsMap &analysisResults, FrameLayouts &layouts,
+    std::function<void(MatchInfo<const llvm::Value *>)> iterativeMatch,
+    std::function<void(CoupledCallInfo<const llvm::Value *>)>
+        relationalCallMatch,
+    std::function<void(UncoupledCallInfo<const llvm::Value *>)>
+        functionalCallMatch) {
+    InterpretedPaths paths1(
+        *funs.first,
+        FastState(std::move(variables.first), std::move(heaps.first)),
+        startBlocks.first, maxSteps, nameMaps.first, analysisResults, layouts);
+    InterpretedPaths paths2(
+        *funs.second,
+        FastState(std::move(variables.second), std::move(heaps.second)),
+        startBlocks.second, maxSteps, nameMaps.second, analysisResults,
+        layouts);
+    analyzePaths<const llvm::Value *>(paths1, paths2, nameMaps,
+                                      analysisResults, iterativeMatch,
+                                      relationalCallMatch, functionalCallMatch);
+}
+
 void debugAnalysis(MatchInfo<const llvm::Value *> match) {
     switch (match.loopInfo) {
     case LoopInfo::None:
@@ -1186,8 +2247,8 @@ FastVarMap getVarMapFromModel(
     return variableValues;
 }
 
-llvm::SmallDenseMap<HeapAddress, Integer> getHeapFromModel(const ArrayVal &ar) {
-    llvm::SmallDenseMap<HeapAddress, Integer> result;
+HeapMap getHeapFromModel(const ArrayVal &ar) {
+    HeapMap result;
     for (const auto &it : ar.vals) {
         result.insert({Integer(it.first), Integer(it.second)});
     }
@@ -1198,8 +2259,7 @@ Heap getHeapFromModel(const std::map<std::string, ArrayVal> &arrays,
                       Program prog) {
     if (SMTGenerationOpts::getInstance().Heap ==
         llreve::opts::HeapOpt::Disabled) {
-        return {llvm::SmallDenseMap<HeapAddress, Integer>(),
-                Integer(mpz_class(0))};
+        return {HeapMap(), Integer(mpz_class(0))};
     }
     std::string heap = heapName(prog) + "_old";
     return {getHeapFromModel(arrays.at(heap)),
@@ -0,0 +1,146 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "llreve/dynamic/Coverage.h"
+
+#include "llreve/dynamic/Analysis.h"
+
+#include <algorithm>
+#include <tuple>
+
+using std::vector;
+
+namespace llreve {
+namespace dynamic {
+
+bool operator<(const CoverageKey &lhs, const CoverageKey &rhs) {
+    return std::tie(lhs.mark, lhs.loopInfo, lhs.exitIndex) <
+           std::tie(rhs.mark, rhs.loopInfo, rhs.exitIndex);
+}
+
+bool operator==(const CoverageKey &lhs, const CoverageKey &rhs) {
+    return lhs.mark == rhs.mark && lhs.loopInfo == rhs.loopInfo &&
+           lhs.exitIndex == rhs.exitIndex;
+}
+
+CoverageGuidedInputs::CoverageGuidedInputs(
+    MonoPair<const llvm::Function *> funs, int lowerBound, int upperBound,
+    unsigned seed)
+    : funs(funs), lowerBound(lowerBound), upperBound(upperBound), gen(seed),
+      heapSeed(seed) {
+    assert(funs.first->arg_size() == funs.second->arg_size());
+}
+
+void CoverageGuidedInputs::chooseHeap(WorkItem &input) {
+    unsigned int seed = heapSeed++;
+    Heap heap(randomHeap(*funs.first, getVarMap(funs.first, input.vals.first),
+                         5, -20, 20, &seed),
+              Integer(mpz_class(0)));
+    input.heaps = {heap, heap};
+    input.heapSet = true;
+}
+
+auto CoverageGuidedInputs::randomInput() -> WorkItem {
+    std::uniform_int_distribution<> distribution(lowerBound, upperBound);
+    vector<mpz_class> vals(funs.first->arg_size());
+    for (auto &val : vals) {
+        val = mpz_class(distribution(gen));
+    }
+    WorkItem input({vals, vals}, 0);
+    chooseHeap(input);
+    return input;
+}
+
+// Changes one or two arguments by a small amount, to a random value or picks
+// a new heap. Pointers stay inside the bounds and changing them also picks a
+// new heap since the arrays are placed at the pointers.
+auto CoverageGuidedInputs::mutate(WorkItem input) -> WorkItem {
+    vector<mpz_class> &vals = input.vals.first;
+    const unsigned mutations = 1 + gen() % 2;
+    bool newHeap = false;
+    for (unsigned i = 0; i < mutations; ++i) {
+        if (vals.empty() || gen() % 4 == 0) {
+            newHeap = true;
+            continue;
+        }
+        const size_t index = gen() % vals.size();
+        mpz_class &val = vals[index];
+        switch (gen() % 3) {
+        case 0:
+            val += gen() % 2 == 0 ? 1 : -1;
+            break;
+        case 1:
+            val += std::uniform_int_distribution<>(-10, 10)(gen);
+            break;
+        default:
+            val = std::uniform_int_distribution<>(lowerBound, upperBound)(gen);
+            break;
+        }
+        auto arg = funs.first->arg_begin();
+        std::advance(arg, index);
+        if (arg->getType()->isPointerTy()) {
+            val = std::max(mpz_class(lowerBound),
+                           std::min(mpz_class(upperBound), val));
+            newHeap = true;
+        }
+    }
+    input.vals.second = vals;
+    if (newHeap) {
+        chooseHeap(input);
+    }
+    return input;
+}
+
+auto CoverageGuidedInputs::nextRound(size_t size) -> vector<WorkItem> {
+    vector<double> weights;
+    double totalWeight = 0;
+    for (const auto &entry : corpus) {
+        double weight = 0;
+        for (const auto &key : entry.keys) {
+            if (saturatedKeys.count(key) == 0) {
+                weight += 1.0 / hits.at(key);
+            }
+        }
+        weights.push_back(weight);
+        totalWeight += weight;
+    }
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    vector<WorkItem> inputs;
+    for (size_t i = 0; i < size; ++i) {
+        // Keep exploring with fresh inputs, they find keys that are far away
+        // from the ones in the corpus
+        if (totalWeight == 0 || gen() % 4 == 0) {
+            inputs.push_back(randomInput());
+        } else {
+            inputs.push_back(mutate(corpus[pick(gen)].input));
+        }
+    }
+    return inputs;
+}
+
+auto CoverageGuidedInputs::record(const WorkItem &input,
+                                  vector<CoverageKey> keys) -> bool {
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    bool newKey = false;
+    bool rareKey = false;
+    for (const auto &key : keys) {
+        unsigned &keyHits = hits[key];
+        newKey |= keyHits == 0;
+        rareKey |= keyHits < RareHits && saturatedKeys.count(key) == 0;
+        ++keyHits;
+    }
+    if (rareKey) {
+        corpus.push_back({input, std::move(keys)});
+    }
+    return newKey;
+}
+}
+}
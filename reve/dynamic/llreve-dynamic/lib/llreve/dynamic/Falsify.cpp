@@ -0,0 +1,401 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "llreve/dynamic/Falsify.h"
+
+#include "Helper.h"
+#include "ModuleSMTGeneration.h"
+#include "llreve/dynamic/Analysis.h"
+
+#include "llvm/IR/Constants.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+
+using llvm::Optional;
+using llvm::dyn_cast;
+using llvm::isa;
+
+using std::map;
+using std::string;
+using std::vector;
+
+using namespace llreve::opts;
+
+namespace llreve {
+namespace dynamic {
+
+// Inputs close to zero and around the bounds of the random range tend to hit
+// the corner cases in which regressions hide, so all combinations of these
+// values are tried before switching to random inputs
+static const int64_t BoundaryValues[] = {0, 1, -1, 2, -2, 10, -10, 100, -100};
+static const uint64_t NumBoundaryValues =
+    sizeof(BoundaryValues) / sizeof(BoundaryValues[0]);
+// Upper limit on the number of boundary combinations for functions with many
+// arguments
+static const uint64_t MaxBoundaryCombinations = 1 << 16;
+
+static bool canFalsifyInstruction(const llvm::Instruction &instr) {
+    if (instr.getType()->isFloatingPointTy()) {
+        return false;
+    }
+    for (const auto op : instr.operand_values()) {
+        if (isa<llvm::GlobalVariable>(op) || isa<llvm::ConstantExpr>(op) ||
+            isa<llvm::ConstantFP>(op) || isa<llvm::UndefValue>(op)) {
+            return false;
+        }
+    }
+    if (const auto call = dyn_cast<llvm::CallInst>(&instr)) {
+        // This includes intrinsics, they are only declared
+        const auto fun = call->getCalledFunction();
+        return fun != nullptr && !fun->isDeclaration();
+    }
+    if (const auto binOp = dyn_cast<llvm::BinaryOperator>(&instr)) {
+        switch (binOp->getOpcode()) {
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+        case llvm::Instruction::Mul:
+            return true;
+        case llvm::Instruction::And:
+        case llvm::Instruction::Or:
+        case llvm::Instruction::Xor:
+            return binOp->getType()->isIntegerTy(1);
+        default:
+            // The interpreter truncates divisions and remainders while the
+            // encoding uses div and mod, which round towards negative
+            // infinity for positive divisors, so a witness for them could be
+            // spurious. Shifts are only implemented for bounded integers.
+            return false;
+        }
+    }
+    if (const auto cast = dyn_cast<llvm::CastInst>(&instr)) {
+        if (cast->getSrcTy()->isIntegerTy(1)) {
+            return cast->getDestTy()->isIntegerTy();
+        }
+        return isa<llvm::ZExtInst>(cast) || isa<llvm::SExtInst>(cast) ||
+               isa<llvm::TruncInst>(cast) || isa<llvm::PtrToIntInst>(cast);
+    }
+    if (const auto cmp = dyn_cast<llvm::ICmpInst>(&instr)) {
+        // Unsigned predicates are encoded as signed ones but the interpreter
+        // only treats them that way if everything is signed
+        return !cmp->isUnsigned() ||
+               SMTGenerationOpts::getInstance().EverythingSigned;
+    }
+    return isa<llvm::GetElementPtrInst>(instr) ||
+           isa<llvm::LoadInst>(instr) || isa<llvm::StoreInst>(instr) ||
+           isa<llvm::SelectInst>(instr) || isa<llvm::PHINode>(instr) ||
+           isa<llvm::ReturnInst>(instr) || isa<llvm::BranchInst>(instr) ||
+           isa<llvm::SwitchInst>(instr);
+}
+
+bool canFalsify(const llvm::Function &fun) {
+    std::set<const llvm::Function *> visited;
+    vector<const llvm::Function *> worklist = {&fun};
+    while (!worklist.empty()) {
+        const llvm::Function *f = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(f).second) {
+            continue;
+        }
+        if (f->isDeclaration() || f->isVarArg()) {
+            return false;
+        }
+        for (const auto &arg : f->args()) {
+            if (!arg.getType()->isIntegerTy() &&
+                !arg.getType()->isPointerTy()) {
+                return false;
+            }
+        }
+        for (const auto &bb : *f) {
+            for (const auto &instr : bb) {
+                if (!canFalsifyInstruction(instr)) {
+                    return false;
+                }
+            }
+        }
+        for (const auto called : calledFunctions(*f)) {
+            worklist.push_back(called);
+        }
+    }
+    return true;
+}
+
+static vector<mpz_class> sampleArguments(const llvm::Function &fun,
+                                         uint64_t sample, std::mt19937 &gen) {
+    vector<mpz_class> vals(fun.arg_size());
+    uint64_t boundaryCombinations = 1;
+    for (size_t i = 0; i < vals.size() &&
+                       boundaryCombinations <= MaxBoundaryCombinations;
+         ++i) {
+        boundaryCombinations *= NumBoundaryValues;
+    }
+    boundaryCombinations =
+        std::min(boundaryCombinations, MaxBoundaryCombinations);
+    if (sample < boundaryCombinations) {
+        for (auto &val : vals) {
+            val = static_cast<long>(BoundaryValues[sample % NumBoundaryValues]);
+            sample /= NumBoundaryValues;
+        }
+    } else {
+        std::uniform_int_distribution<int64_t> distribution(-100, 100);
+        std::uniform_int_distribution<uint64_t> boundary(
+            0, NumBoundaryValues - 1);
+        for (auto &val : vals) {
+            // Mix in boundary values so they are also combined with random
+            // values for the other arguments
+            if (boundary(gen) == 0) {
+                val = static_cast<long>(BoundaryValues[boundary(gen)]);
+            } else {
+                val = static_cast<long>(distribution(gen));
+            }
+        }
+    }
+    auto argIt = fun.arg_begin();
+    for (auto &val : vals) {
+        if (argIt->getType()->isPointerTy()) {
+            val = abs(val);
+        }
+        ++argIt;
+    }
+    return vals;
+}
+
+static z3::expr concreteValue(z3::context &cxt, const smt::Type &type,
+                              const Integer &val) {
+    if (type.getTag() == smt::TypeTag::Bool) {
+        return cxt.bool_val(val.asUnbounded() != 0);
+    }
+    return cxt.int_val(val.asUnbounded().get_str().c_str());
+}
+
+static z3::expr concreteHeap(z3::context &cxt, const Heap &heap) {
+    z3::expr array = z3::const_array(
+        cxt.int_sort(),
+        cxt.int_val(heap.background.asUnbounded().get_str().c_str()));
+    for (const auto &entry : heap.assignedValues()) {
+        array = z3::store(
+            array, cxt.int_val(entry.first.asUnbounded().get_str().c_str()),
+            cxt.int_val(entry.second.asUnbounded().get_str().c_str()));
+    }
+    return array;
+}
+
+/// Evaluate the body of IN_INV or OUT_INV on concrete values. For OUT_INV the
+/// heaps are the heaps after the execution and results have to be passed.
+static bool relationHolds(z3::context &cxt, const smt::FunDef &relation,
+                          const MonoPair<FastVarMap> &arguments,
+                          const MonoPair<Heap> &heaps,
+                          const MonoPair<Integer> *results) {
+    llvm::StringMap<const Integer *> values;
+    for (const auto &var : arguments.first) {
+        values[var.first->getName()] = &var.second;
+    }
+    for (const auto &var : arguments.second) {
+        values[var.first->getName()] = &var.second;
+    }
+    if (results != nullptr) {
+        values[resultName(Program::First)] = &results->first;
+        values[resultName(Program::Second)] = &results->second;
+    }
+    llvm::StringMap<z3::expr> nameMap;
+    for (const auto &arg : relation.args) {
+        if (arg.name == heapName(Program::First)) {
+            nameMap.insert({arg.name, concreteHeap(cxt, heaps.first)});
+        } else if (arg.name == heapName(Program::Second)) {
+            nameMap.insert({arg.name, concreteHeap(cxt, heaps.second)});
+        } else {
+            auto it = values.find(arg.name);
+            if (it == values.end()) {
+                logError("No concrete value for " + arg.name + " in " +
+                         relation.funName + "\n");
+                exit(1);
+            }
+            nameMap.insert(
+                {arg.name, concreteValue(cxt, arg.type, *it->second)});
+        }
+    }
+    llvm::StringMap<smt::Z3DefineFun> defineFunMap;
+    z3::expr holds =
+        relation.body->toZ3Expr(cxt, nameMap, defineFunMap).simplify();
+    switch (Z3_get_bool_value(cxt, holds)) {
+    case Z3_L_TRUE:
+        return true;
+    case Z3_L_FALSE:
+        return false;
+    case Z3_L_UNDEF:
+        break;
+    }
+    // The simplifier does not always decide equalities of arrays but the
+    // formula is ground so this is cheap
+    z3::solver solver(cxt);
+    solver.add(!holds);
+    return solver.check() == z3::unsat;
+}
+
+Optional<FalsificationWitness>
+falsify(MonoPair<const llvm::Module &> modules,
+        MonoPair<const llvm::Function *> functions,
+        const AnalysisResultsMap &analysisResults, const FileOptions &fileOpts,
+        FalsifyOpts opts) {
+    const auto &smtOpts = SMTGenerationOpts::getInstance();
+    if (smtOpts.BitVect || smtOpts.Stack == StackOpt::Enabled) {
+        logWarning("Falsification is not supported with bitvectors or a "
+                   "stack, skipping it\n");
+        return Optional<FalsificationWitness>();
+    }
+    if (!canFalsify(*functions.first) || !canFalsify(*functions.second)) {
+        logWarning("The programs use features not supported by the "
+                   "interpreter, skipping falsification\n");
+        return Optional<FalsificationWitness>();
+    }
+    if (fileOpts.InRelation == nullptr &&
+        functions.first->arg_size() != functions.second->arg_size()) {
+        logWarning("Falsification requires a custom input relation for "
+                   "functions with different arguments\n");
+        return Optional<FalsificationWitness>();
+    }
+
+    // Without a custom relation the inputs are equal by construction so there
+    // is nothing to check
+    std::unique_ptr<smt::FunDef> inRelation;
+    if (fileOpts.InRelation != nullptr) {
+        inRelation =
+            inInvariant(functions, analysisResults, fileOpts.InRelation,
+                        modules.first, modules.second,
+                        smtOpts.GlobalConstants == GlobalConstantsOpt::Enabled,
+                        fileOpts.AdditionalInRelation);
+    }
+    const std::unique_ptr<smt::FunDef> outRelation =
+        outInvariant(getFunctionArguments(functions, analysisResults),
+                     fileOpts.OutRelation, functions.first->getReturnType());
+
+    unsigned threads = opts.Threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(opts.Timeout);
+    std::atomic<bool> found(false);
+    std::mutex witnessMutex;
+    Optional<FalsificationWitness> witness;
+
+    auto worker = [&](unsigned workerIndex) {
+        // Contexts can’t be shared between threads
+        z3::context z3Cxt;
+        FrameLayouts layouts;
+        std::mt19937 gen(opts.Seed + workerIndex);
+        unsigned int heapSeed = opts.Seed + workerIndex;
+        for (uint64_t sample = workerIndex;
+             !found && std::chrono::steady_clock::now() < deadline;
+             sample += threads) {
+            vector<mpz_class> args1 =
+                sampleArguments(*functions.first, sample, gen);
+            vector<mpz_class> args2 =
+                functions.first->arg_size() == functions.second->arg_size()
+                    ? args1
+                    : sampleArguments(*functions.second, sample, gen);
+            MonoPair<FastVarMap> variables = {
+                getVarMap(functions.first, args1),
+                getVarMap(functions.second, args2)};
+            Heap heap(randomHeap(*functions.first, variables.first, 5, -20, 20,
+                                 &heapSeed),
+                      Integer(mpz_class(0)));
+            MonoPair<Heap> heaps = {heap, heap};
+            if (inRelation &&
+                !relationHolds(z3Cxt, *inRelation, variables, heaps, nullptr)) {
+                continue;
+            }
+            MonoPair<FastCall> calls =
+                interpretFunctionPair(functions, variables, heaps,
+                                      opts.MaxSteps, analysisResults, layouts);
+            // Running out of steps says nothing about the relation
+            if (calls.first.earlyExit || calls.second.earlyExit) {
+                continue;
+            }
+            MonoPair<Integer> results =
+                getReturnValues(calls.first, calls.second, analysisResults);
+            MonoPair<Heap> returnHeaps = {calls.first.returnState.heap,
+                                          calls.second.returnState.heap};
+            if (relationHolds(z3Cxt, *outRelation, variables, returnHeaps,
+                              &results)) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(witnessMutex);
+            if (!witness.hasValue()) {
+                witness = FalsificationWitness(
+                    std::move(variables), std::move(heaps), std::move(results),
+                    std::move(returnHeaps));
+            }
+            found = true;
+        }
+    };
+
+    vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(worker, i);
+    }
+    for (auto &thread : workers) {
+        thread.join();
+    }
+    return witness;
+}
+
+static void dumpVariables(std::ostream &out, const FastVarMap &variables) {
+    // Sort by name to get a stable output
+    map<string, string> sorted;
+    for (const auto &var : variables) {
+        sorted.insert({var.first->getName().str(), var.second.get_str()});
+    }
+    for (const auto &var : sorted) {
+        out << ";   " << var.first << " = " << var.second << "\n";
+    }
+}
+
+static void dumpHeap(std::ostream &out, const Heap &heap) {
+    vector<std::pair<mpz_class, string>> sorted;
+    for (const auto &entry : heap.assignedValues()) {
+        sorted.push_back({entry.first.asUnbounded(), entry.second.get_str()});
+    }
+    std::sort(sorted.begin(), sorted.end());
+    out << ";   background: " << heap.background.get_str() << "\n";
+    for (const auto &entry : sorted) {
+        out << ";   [" << entry.first.get_str() << "] = " << entry.second
+            << "\n";
+    }
+}
+
+void dumpWitness(std::ostream &out, const FalsificationWitness &witness) {
+    out << "; Counterexample found by concrete execution\n";
+    out << "; arguments:\n";
+    dumpVariables(out, witness.arguments.first);
+    dumpVariables(out, witness.arguments.second);
+    if (SMTGenerationOpts::getInstance().Heap == HeapOpt::Enabled) {
+        out << "; heap:\n";
+        dumpHeap(out, witness.heaps.first);
+    }
+    out << "; results:\n";
+    out << ";   " << resultName(Program::First) << " = "
+        << witness.returnValues.first.get_str() << "\n";
+    out << ";   " << resultName(Program::Second) << " = "
+        << witness.returnValues.second.get_str() << "\n";
+    if (SMTGenerationOpts::getInstance().Heap == HeapOpt::Enabled) {
+        out << "; " << heapName(Program::First) << " after the call:\n";
+        dumpHeap(out, witness.returnHeaps.first);
+        out << "; " << heapName(Program::Second) << " after the call:\n";
+        dumpHeap(out, witness.returnHeaps.second);
+    }
+}
+} // namespace dynamic
+} // namespace llreve
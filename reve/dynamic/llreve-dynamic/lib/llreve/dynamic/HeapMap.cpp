@@ -0,0 +1,265 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "llreve/dynamic/HeapMap.h"
+
+#include "llreve/dynamic/Interpreter.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace llreve {
+namespace dynamic {
+
+static size_t addressHash(const HeapAddress &address) {
+    return hash_value(address);
+}
+
+static size_t entryHash(size_t keyHash, const Integer &value) {
+    return llvm::hash_combine(keyHash, hash_value(value));
+}
+
+static uint32_t slotBit(size_t keyHash, unsigned depth) {
+    return 1u << ((keyHash >> (5 * depth)) & 31);
+}
+
+// The position of the slot in the entries or children of a node
+static size_t slotIndex(uint32_t map, uint32_t bit) {
+    return static_cast<size_t>(__builtin_popcount(map & (bit - 1)));
+}
+
+static bool sameInteger(const Integer &lhs, const Integer &rhs) {
+    return llvm::DenseMapInfo<Integer>::isEqual(lhs, rhs);
+}
+
+// Replaces the entry for the address or inserts it if there is none. The
+// hash delta is the change of the hash of each node on the path.
+void HeapMap::put(std::shared_ptr<Node> &node, Entry entry, size_t keyHash,
+                  unsigned depth, size_t &hashDelta) {
+    if (node == nullptr) {
+        node = std::make_shared<Node>();
+    } else if (node.use_count() > 1) {
+        node = std::make_shared<Node>(*node);
+    } else {
+        // Synchronize with the release of the other owners
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    Node &n = *node;
+    const size_t newHash = entryHash(keyHash, entry.second);
+    if (depth >= MaxDepth) {
+        auto it = std::find_if(n.entries.begin(), n.entries.end(),
+                               [&entry](const Entry &other) {
+                                   return sameInteger(other.first, entry.first);
+                               });
+        if (it != n.entries.end()) {
+            hashDelta = newHash - entryHash(keyHash, it->second);
+            it->second = std::move(entry.second);
+        } else {
+            hashDelta = newHash;
+            n.entries.push_back(std::move(entry));
+        }
+    } else {
+        const uint32_t bit = slotBit(keyHash, depth);
+        if (n.nodeMap & bit) {
+            put(n.children[slotIndex(n.nodeMap, bit)], std::move(entry),
+                keyHash, depth + 1, hashDelta);
+        } else if (n.entryMap & bit) {
+            const size_t index = slotIndex(n.entryMap, bit);
+            Entry &existing = n.entries[index];
+            if (sameInteger(existing.first, entry.first)) {
+                hashDelta = newHash - entryHash(keyHash, existing.second);
+                existing.second = std::move(entry.second);
+            } else {
+                // Both entries move to a new child
+                std::shared_ptr<Node> child;
+                size_t movedDelta = 0;
+                const size_t movedHash = addressHash(existing.first);
+                put(child, std::move(existing), movedHash, depth + 1,
+                    movedDelta);
+                put(child, std::move(entry), keyHash, depth + 1, hashDelta);
+                n.entries.erase(n.entries.begin() +
+                                static_cast<long>(index));
+                n.entryMap &= ~bit;
+                n.children.insert(n.children.begin() +
+                                      static_cast<long>(
+                                          slotIndex(n.nodeMap, bit)),
+                                  std::move(child));
+                n.nodeMap |= bit;
+            }
+        } else {
+            hashDelta = newHash;
+            n.entries.insert(n.entries.begin() +
+                                 static_cast<long>(slotIndex(n.entryMap, bit)),
+                             std::move(entry));
+            n.entryMap |= bit;
+        }
+    }
+    n.hash += hashDelta;
+}
+
+auto HeapMap::lookup(const HeapAddress &address) const -> const Integer * {
+    const size_t keyHash = addressHash(address);
+    const Node *node = root.get();
+    for (unsigned depth = 0; node != nullptr; ++depth) {
+        if (depth >= MaxDepth) {
+            for (const auto &entry : node->entries) {
+                if (sameInteger(entry.first, address)) {
+                    return &entry.second;
+                }
+            }
+            return nullptr;
+        }
+        const uint32_t bit = slotBit(keyHash, depth);
+        if (node->entryMap & bit) {
+            const Entry &entry = node->entries[slotIndex(node->entryMap, bit)];
+            return sameInteger(entry.first, address) ? &entry.second : nullptr;
+        }
+        if (!(node->nodeMap & bit)) {
+            return nullptr;
+        }
+        node = node->children[slotIndex(node->nodeMap, bit)].get();
+    }
+    return nullptr;
+}
+
+auto HeapMap::insert(Entry entry) -> bool {
+    if (lookup(entry.first) != nullptr) {
+        return false;
+    }
+    const size_t keyHash = addressHash(entry.first);
+    size_t hashDelta = 0;
+    put(root, std::move(entry), keyHash, 0, hashDelta);
+    ++count;
+    return true;
+}
+
+void HeapMap::set(const HeapAddress &address, Integer value) {
+    const Integer *current = lookup(address);
+    // Storing the same value again doesn’t copy shared nodes
+    if (current != nullptr && sameInteger(*current, value)) {
+        return;
+    }
+    const bool isNew = current == nullptr;
+    size_t hashDelta = 0;
+    put(root, {address, std::move(value)}, addressHash(address), 0,
+        hashDelta);
+    if (isNew) {
+        ++count;
+    }
+}
+
+// The structure of a trie only depends on its entries, so equal maps have
+// equal nodes
+bool HeapMap::nodesEqual(const Node &lhs, const Node &rhs, unsigned depth) {
+    if (&lhs == &rhs) {
+        return true;
+    }
+    if (lhs.hash != rhs.hash || lhs.entryMap != rhs.entryMap ||
+        lhs.nodeMap != rhs.nodeMap ||
+        lhs.entries.size() != rhs.entries.size() ||
+        lhs.children.size() != rhs.children.size()) {
+        return false;
+    }
+    if (depth >= MaxDepth) {
+        return std::all_of(
+            lhs.entries.begin(), lhs.entries.end(), [&rhs](const Entry &entry) {
+                return std::any_of(rhs.entries.begin(), rhs.entries.end(),
+                                   [&entry](const Entry &other) {
+                                       return sameInteger(entry.first,
+                                                          other.first) &&
+                                              sameInteger(entry.second,
+                                                          other.second);
+                                   });
+            });
+    }
+    for (size_t i = 0; i < lhs.entries.size(); ++i) {
+        if (!sameInteger(lhs.entries[i].first, rhs.entries[i].first) ||
+            !sameInteger(lhs.entries[i].second, rhs.entries[i].second)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < lhs.children.size(); ++i) {
+        if (!nodesEqual(*lhs.children[i], *rhs.children[i], depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Big is the node of the big map at the position of small or nullptr if
+// there is none
+bool HeapMap::containedIn(const Node *small, const Node *big,
+                          const HeapMap &bigMap, const Integer &background,
+                          unsigned depth) {
+    if (small == nullptr || small == big) {
+        return true;
+    }
+    for (const auto &entry : small->entries) {
+        const Integer *val = bigMap.lookup(entry.first);
+        if (val != nullptr ? *val != entry.second
+                           : entry.second != background) {
+            return false;
+        }
+    }
+    uint32_t remaining = small->nodeMap;
+    for (const auto &child : small->children) {
+        const uint32_t bit = remaining & (~remaining + 1);
+        remaining &= remaining - 1;
+        const Node *bigChild = nullptr;
+        if (big != nullptr && (big->nodeMap & bit)) {
+            bigChild = big->children[slotIndex(big->nodeMap, bit)].get();
+        }
+        if (!containedIn(child.get(), bigChild, bigMap, background,
+                         depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto HeapMap::isContainedIn(const HeapMap &big, const Integer &background) const
+    -> bool {
+    return containedIn(root.get(), big.root.get(), big, background, 0);
+}
+
+bool operator==(const HeapMap &lhs, const HeapMap &rhs) {
+    if (lhs.root == rhs.root) {
+        return true;
+    }
+    return lhs.count == rhs.count && lhs.root != nullptr &&
+           rhs.root != nullptr && HeapMap::nodesEqual(*lhs.root, *rhs.root, 0);
+}
+
+HeapMap::const_iterator::const_iterator(const Node *root) {
+    if (root != nullptr) {
+        path.push_back({root, 0});
+        settle();
+    }
+}
+
+// Moves to the next entry if the position is past the entries of its node
+void HeapMap::const_iterator::settle() {
+    while (!path.empty()) {
+        const Node *node = path.back().first;
+        size_t &pos = path.back().second;
+        if (pos < node->entries.size()) {
+            return;
+        }
+        const size_t child = pos - node->entries.size();
+        if (child < node->children.size()) {
+            ++pos;
+            path.push_back({node->children[child].get(), 0});
+        } else {
+            path.pop_back();
+        }
+    }
+}
+}
+}
@@ -10,6 +10,20 @@
 
 #include "llreve/dynamic/HeapPattern.h"
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
 namespace llreve {
 namespace dynamic {
 template <>
@@ -28,9 +42,9 @@ std::ostream &Variable<const llvm::Value *>::dump(std::ostream &os) const {
 }
 
 mpz_class getHeapVal(HeapAddress addr, Heap heap) {
-    auto it = heap.assignedValues.find(addr);
-    if (it != heap.assignedValues.end()) {
-        return it->second.asUnbounded();
+    const Integer *val = heap.assignedValues().lookup(addr);
+    if (val != nullptr) {
+        return val->asUnbounded();
     } else {
         return heap.background.asUnbounded();
     }
@@ -54,5 +68,748 @@ template <> smt::SMTRef Variable<const llvm::Value *>::toSMT() const {
     }
     return smt::stringExpr(varName->getName());
 }
+
+CompiledPattern::CompiledPattern(
+    std::shared_ptr<HeapPattern<VariablePlaceholder>> pattern)
+    : pattern(std::move(pattern)), argumentCount(0) {
+    compile(*this->pattern);
+    assert(argumentCount == this->pattern->arguments());
+    assert(boundHoles.empty());
+}
+
+void CompiledPattern::compile(const HeapPattern<VariablePlaceholder> &pat) {
+    switch (pat.getType()) {
+    case PatternType::Binary: {
+        const auto &binPat =
+            static_cast<const BinaryHeapPattern<VariablePlaceholder> &>(pat);
+        compile(*binPat.args.first);
+        compile(*binPat.args.second);
+        switch (binPat.op) {
+        case BinaryBooleanOp::And:
+            emit(OpCode::And);
+            break;
+        case BinaryBooleanOp::Or:
+            emit(OpCode::Or);
+            break;
+        case BinaryBooleanOp::Impl:
+            emit(OpCode::Impl);
+            break;
+        }
+        break;
+    }
+    case PatternType::Unary: {
+        const auto &unPat =
+            static_cast<const UnaryHeapPattern<VariablePlaceholder> &>(pat);
+        compile(*unPat.arg);
+        emit(OpCode::Not);
+        break;
+    }
+    case PatternType::HeapEquality:
+        emit(OpCode::EqualHeaps);
+        break;
+    case PatternType::Range: {
+        const auto &rangePat =
+            static_cast<const RangeProp<VariablePlaceholder> &>(pat);
+        // The bounds can’t refer to the hole bound by the range
+        compile(*rangePat.bounds.first);
+        compile(*rangePat.bounds.second);
+        const auto hole = static_cast<uint32_t>(holeIndices.size());
+        holeIndices.push_back(rangePat.index);
+        // The binding is only visible in the body and shadows a binding of
+        // the same index by an enclosing range
+        auto outer = boundHoles.find(rangePat.index);
+        llvm::Optional<uint32_t> outerHole;
+        if (outer != boundHoles.end()) {
+            outerHole = outer->second;
+        }
+        boundHoles[rangePat.index] = hole;
+        const size_t range = program.size();
+        emit(OpCode::Range, static_cast<uint8_t>(rangePat.quant), hole);
+        compile(*rangePat.pat);
+        program[range].value = static_cast<int64_t>(program.size() - range - 1);
+        if (outerHole) {
+            boundHoles[rangePat.index] = *outerHole;
+        } else {
+            boundHoles.erase(rangePat.index);
+        }
+        // The body only depends on the index if it reads the heaps there
+        bool sparse = true;
+        for (size_t pc = range + 1; pc < program.size(); ++pc) {
+            if (program[pc].op == OpCode::Hole &&
+                program[pc].operand == hole &&
+                (pc + 1 == program.size() ||
+                 program[pc + 1].op != OpCode::Load)) {
+                sparse = false;
+            }
+        }
+        if (sparse) {
+            program[range].op = OpCode::SparseRange;
+        }
+        break;
+    }
+    case PatternType::ExprProp: {
+        const auto &exprPat =
+            static_cast<const HeapExprProp<VariablePlaceholder> &>(pat);
+        compile(*exprPat.args.first);
+        compile(*exprPat.args.second);
+        emit(OpCode::Compare, static_cast<uint8_t>(exprPat.op));
+        break;
+    }
+    }
+}
+
+void CompiledPattern::compile(const HeapExpr<VariablePlaceholder> &expr) {
+    switch (expr.getType()) {
+    case ExprType::HeapAccess: {
+        const auto &access =
+            static_cast<const HeapAccess<VariablePlaceholder> &>(expr);
+        compile(*access.atVal);
+        emit(OpCode::Load, static_cast<uint8_t>(access.programIndex));
+        break;
+    }
+    case ExprType::Constant: {
+        const auto &constant =
+            static_cast<const Constant<VariablePlaceholder> &>(expr);
+        if (constant.value.fits_slong_p()) {
+            emit(OpCode::Constant, 0, 0, constant.value.get_si());
+        } else {
+            emit(OpCode::LargeConstant, 0,
+                 static_cast<uint32_t>(constants.size()));
+            constants.push_back(constant.value);
+        }
+        break;
+    }
+    case ExprType::Variable:
+        emit(OpCode::Argument, 0, static_cast<uint32_t>(argumentCount++));
+        break;
+    case ExprType::Hole: {
+        const auto &hole = static_cast<const Hole<VariablePlaceholder> &>(expr);
+        assert(boundHoles.count(hole.index) == 1);
+        emit(OpCode::Hole, 0, boundHoles.at(hole.index));
+        break;
+    }
+    case ExprType::Binary: {
+        const auto &binExpr =
+            static_cast<const BinaryIntExpr<VariablePlaceholder> &>(expr);
+        compile(*binExpr.args.first);
+        compile(*binExpr.args.second);
+        switch (binExpr.op) {
+        case BinaryIntOp::Mul:
+            emit(OpCode::Mul);
+            break;
+        case BinaryIntOp::Add:
+            emit(OpCode::Add);
+            break;
+        case BinaryIntOp::Subtract:
+            emit(OpCode::Subtract);
+            break;
+        }
+        break;
+    }
+    case ExprType::Unary:
+    case ExprType::HeapIndex:
+    case ExprType::HeapValue:
+        logError("Cannot compile pattern expression\n");
+        exit(1);
+    }
+}
+
+static bool compare(BinaryIntProp op, int64_t lhs, int64_t rhs) {
+    switch (op) {
+    case BinaryIntProp::LT:
+        return lhs < rhs;
+    case BinaryIntProp::LE:
+        return lhs <= rhs;
+    case BinaryIntProp::EQ:
+        return lhs == rhs;
+    case BinaryIntProp::NE:
+        return lhs != rhs;
+    case BinaryIntProp::GE:
+        return lhs >= rhs;
+    case BinaryIntProp::GT:
+        return lhs > rhs;
+    }
+}
+
+// Same as getHeapVal but fails if the address or the value doesn’t fit
+static bool load(const Heap &heap, int64_t address, int64_t &result) {
+    const Integer *val =
+        heap.assignedValues().lookup(Integer::fromSmall(address).asPointer());
+    if (val != nullptr) {
+        return val->asSmall(result);
+    }
+    return heap.background.asSmall(result);
+}
+
+bool CompiledPattern::run(size_t begin, size_t end, const int64_t *arguments,
+                          const MonoPair<const Heap &> &heaps,
+                          Registers &registers) const {
+    std::vector<int64_t> &stack = registers.stack;
+    for (size_t pc = begin; pc < end; ++pc) {
+        const Instruction &instr = program[pc];
+        int64_t rhs = 0;
+        // Binary instructions replace the top of the stack
+        switch (instr.op) {
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Mul:
+        case OpCode::Compare:
+        case OpCode::And:
+        case OpCode::Or:
+        case OpCode::Impl:
+            rhs = stack.back();
+            stack.pop_back();
+            break;
+        default:
+            break;
+        }
+        switch (instr.op) {
+        case OpCode::Argument:
+            stack.push_back(arguments[instr.operand]);
+            break;
+        case OpCode::Constant:
+            stack.push_back(instr.value);
+            break;
+        case OpCode::LargeConstant:
+            return false;
+        case OpCode::Hole:
+            stack.push_back(registers.holes[instr.operand]);
+            break;
+        case OpCode::Load: {
+            const Heap &heap =
+                static_cast<ProgramIndex>(instr.kind) == ProgramIndex::First
+                    ? heaps.first
+                    : heaps.second;
+            if (!load(heap, stack.back(), stack.back())) {
+                return false;
+            }
+            break;
+        }
+        case OpCode::Add:
+            if (__builtin_add_overflow(stack.back(), rhs, &stack.back())) {
+                return false;
+            }
+            break;
+        case OpCode::Subtract:
+            if (__builtin_sub_overflow(stack.back(), rhs, &stack.back())) {
+                return false;
+            }
+            break;
+        case OpCode::Mul:
+            if (__builtin_mul_overflow(stack.back(), rhs, &stack.back())) {
+                return false;
+            }
+            break;
+        case OpCode::Compare:
+            stack.back() = compare(static_cast<BinaryIntProp>(instr.kind),
+                                   stack.back(), rhs);
+            break;
+        case OpCode::EqualHeaps:
+            stack.push_back(heaps.first == heaps.second);
+            break;
+        case OpCode::Not:
+            stack.back() = !stack.back();
+            break;
+        case OpCode::And:
+            stack.back() = stack.back() && rhs;
+            break;
+        case OpCode::Or:
+            stack.back() = stack.back() || rhs;
+            break;
+        case OpCode::Impl:
+            stack.back() = !stack.back() || rhs;
+            break;
+        case OpCode::Range:
+        case OpCode::SparseRange: {
+            const int64_t upper = stack.back();
+            stack.pop_back();
+            const int64_t lower = stack.back();
+            stack.pop_back();
+            bool result;
+            if (!runRange(pc, lower, upper, arguments, heaps, registers,
+                          result)) {
+                return false;
+            }
+            stack.push_back(result);
+            pc += static_cast<size_t>(instr.value);
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+// The sorted addresses of the entries of both heaps
+static auto heapAddresses(const MonoPair<const Heap &> &heaps,
+                          CompiledPattern::Registers &registers)
+    -> const vector<int64_t> & {
+    auto key = std::make_pair(heaps.first.assignedValues().identity(),
+                              heaps.second.assignedValues().identity());
+    auto it = registers.addresses.find(key);
+    if (it != registers.addresses.end()) {
+        return it->second;
+    }
+    vector<int64_t> addresses;
+    for (const Heap *heap : {&heaps.first, &heaps.second}) {
+        for (const auto &entry : heap->assignedValues()) {
+            int64_t address;
+            // Addresses that don’t fit can’t be reached by the holes
+            if (entry.first.asSmall(address)) {
+                addresses.push_back(address);
+            }
+        }
+    }
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()),
+                    addresses.end());
+    return registers.addresses.insert({key, std::move(addresses)})
+        .first->second;
+}
+
+bool CompiledPattern::runRange(size_t pc, int64_t lower, int64_t upper,
+                               const int64_t *arguments,
+                               const MonoPair<const Heap &> &heaps,
+                               Registers &registers, bool &result) const {
+    const Instruction &range = program[pc];
+    const size_t bodyEnd = pc + 1 + static_cast<size_t>(range.value);
+    const bool all =
+        static_cast<RangeQuantifier>(range.kind) == RangeQuantifier::All;
+    result = all;
+    // Stores whether the index decides the range in decided
+    auto check = [&](int64_t i, bool &decided) {
+        registers.holes[range.operand] = i;
+        if (!run(pc + 1, bodyEnd, arguments, heaps, registers)) {
+            return false;
+        }
+        const bool matches = registers.stack.back() != 0;
+        registers.stack.pop_back();
+        // A match decides ∃, a mismatch decides ∀
+        decided = matches != all;
+        if (decided) {
+            result = matches;
+        }
+        return true;
+    };
+    bool decided = false;
+    if (range.op == OpCode::Range) {
+        for (int64_t i = lower; i <= upper && !decided; ++i) {
+            if (!check(i, decided)) {
+                return false;
+            }
+            // Incrementing would overflow
+            if (i == upper) {
+                break;
+            }
+        }
+        return true;
+    }
+    // All indices without an entry in one of the heaps behave the same, so
+    // only the entries and one of the other indices have to be checked
+    const vector<int64_t> &addresses = heapAddresses(heaps, registers);
+    // The smallest index that has not been checked, as long as all indices
+    // below it have been checked
+    int64_t next = lower;
+    bool dense = true;
+    bool covered = false;
+    for (auto it = std::lower_bound(addresses.begin(), addresses.end(), lower);
+         it != addresses.end() && *it <= upper && !decided; ++it) {
+        if (dense && *it == next) {
+            if (next == upper) {
+                covered = true;
+            } else {
+                ++next;
+            }
+        } else {
+            dense = false;
+        }
+        if (!check(*it, decided)) {
+            return false;
+        }
+    }
+    if (!decided && !covered && lower <= upper) {
+        return check(next, decided);
+    }
+    return true;
+}
+
+auto CompiledPattern::evaluate(const int64_t *arguments,
+                               const MonoPair<const Heap &> &heaps,
+                               Registers &registers) const
+    -> llvm::Optional<bool> {
+    registers.stack.clear();
+    registers.holes.resize(holeIndices.size());
+    if (!run(0, program.size(), arguments, heaps, registers)) {
+        return llvm::None;
+    }
+    assert(registers.stack.size() == 1);
+    return registers.stack.back() != 0;
+}
+
+// The inverse of compile, returns nullptr if the instructions are not the
+// program of a pattern
+auto CompiledPattern::decompile(size_t begin, size_t end) const
+    -> shared_ptr<HeapPattern<VariablePlaceholder>> {
+    using Expr = shared_ptr<HeapExpr<VariablePlaceholder>>;
+    using Pattern = shared_ptr<HeapPattern<VariablePlaceholder>>;
+    vector<Expr> exprs;
+    vector<Pattern> pats;
+    for (size_t pc = begin; pc < end; ++pc) {
+        const Instruction &instr = program[pc];
+        MonoPair<Expr> exprArgs = {nullptr, nullptr};
+        MonoPair<Pattern> patArgs = {nullptr, nullptr};
+        switch (instr.op) {
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Mul:
+        case OpCode::Compare:
+        case OpCode::Range:
+        case OpCode::SparseRange:
+            if (exprs.size() < 2) {
+                return nullptr;
+            }
+            exprArgs.second = exprs.back();
+            exprs.pop_back();
+            exprArgs.first = exprs.back();
+            exprs.pop_back();
+            break;
+        case OpCode::And:
+        case OpCode::Or:
+        case OpCode::Impl:
+            if (pats.size() < 2) {
+                return nullptr;
+            }
+            patArgs.second = pats.back();
+            pats.pop_back();
+            patArgs.first = pats.back();
+            pats.pop_back();
+            break;
+        case OpCode::Load:
+            if (exprs.empty() || instr.kind > 1) {
+                return nullptr;
+            }
+            break;
+        case OpCode::Not:
+            if (pats.empty()) {
+                return nullptr;
+            }
+            break;
+        default:
+            break;
+        }
+        switch (instr.op) {
+        case OpCode::Argument:
+            exprs.push_back(make_shared<Variable<VariablePlaceholder>>(
+                VariablePlaceholder()));
+            break;
+        case OpCode::Constant:
+            exprs.push_back(make_shared<Constant<VariablePlaceholder>>(
+                mpz_class(static_cast<long>(instr.value))));
+            break;
+        case OpCode::LargeConstant:
+            if (instr.operand >= constants.size()) {
+                return nullptr;
+            }
+            exprs.push_back(make_shared<Constant<VariablePlaceholder>>(
+                constants[instr.operand]));
+            break;
+        case OpCode::Hole:
+            if (instr.operand >= holeIndices.size()) {
+                return nullptr;
+            }
+            exprs.push_back(make_shared<Hole<VariablePlaceholder>>(
+                holeIndices[instr.operand]));
+            break;
+        case OpCode::Load:
+            exprs.back() = make_shared<HeapAccess<VariablePlaceholder>>(
+                static_cast<ProgramIndex>(instr.kind), exprs.back());
+            break;
+        case OpCode::Add:
+            exprs.push_back(make_shared<BinaryIntExpr<VariablePlaceholder>>(
+                BinaryIntOp::Add, exprArgs));
+            break;
+        case OpCode::Subtract:
+            exprs.push_back(make_shared<BinaryIntExpr<VariablePlaceholder>>(
+                BinaryIntOp::Subtract, exprArgs));
+            break;
+        case OpCode::Mul:
+            exprs.push_back(make_shared<BinaryIntExpr<VariablePlaceholder>>(
+                BinaryIntOp::Mul, exprArgs));
+            break;
+        case OpCode::Compare:
+            if (instr.kind > static_cast<uint8_t>(BinaryIntProp::GT)) {
+                return nullptr;
+            }
+            pats.push_back(make_shared<HeapExprProp<VariablePlaceholder>>(
+                static_cast<BinaryIntProp>(instr.kind), exprArgs));
+            break;
+        case OpCode::EqualHeaps:
+            pats.push_back(make_shared<HeapEqual<VariablePlaceholder>>());
+            break;
+        case OpCode::Not:
+            pats.back() = make_shared<UnaryHeapPattern<VariablePlaceholder>>(
+                UnaryBooleanOp::Neg, pats.back());
+            break;
+        case OpCode::And:
+            pats.push_back(make_shared<BinaryHeapPattern<VariablePlaceholder>>(
+                BinaryBooleanOp::And, patArgs));
+            break;
+        case OpCode::Or:
+            pats.push_back(make_shared<BinaryHeapPattern<VariablePlaceholder>>(
+                BinaryBooleanOp::Or, patArgs));
+            break;
+        case OpCode::Impl:
+            pats.push_back(make_shared<BinaryHeapPattern<VariablePlaceholder>>(
+                BinaryBooleanOp::Impl, patArgs));
+            break;
+        case OpCode::Range:
+        case OpCode::SparseRange: {
+            if (instr.kind > static_cast<uint8_t>(RangeQuantifier::Any) ||
+                instr.operand >= holeIndices.size() || instr.value < 0 ||
+                static_cast<uint64_t>(instr.value) >= end - pc) {
+                return nullptr;
+            }
+            const size_t bodyEnd = pc + 1 + static_cast<size_t>(instr.value);
+            auto body = decompile(pc + 1, bodyEnd);
+            if (body == nullptr) {
+                return nullptr;
+            }
+            pats.push_back(make_shared<RangeProp<VariablePlaceholder>>(
+                static_cast<RangeQuantifier>(instr.kind), exprArgs,
+                holeIndices[instr.operand], body));
+            pc = bodyEnd - 1;
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+    if (!exprs.empty() || pats.size() != 1) {
+        return nullptr;
+    }
+    return pats.back();
+}
+
+template <typename T> static void writeValue(string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> static bool readValue(llvm::StringRef &in, T &value) {
+    if (in.size() < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(&value, in.data(), sizeof(T));
+    in = in.drop_front(sizeof(T));
+    return true;
+}
+
+void CompiledPattern::serialize(string &out) const {
+    writeValue(out, static_cast<uint32_t>(program.size()));
+    for (const Instruction &instr : program) {
+        writeValue(out, static_cast<uint8_t>(instr.op));
+        writeValue(out, instr.kind);
+        writeValue(out, instr.operand);
+        writeValue(out, instr.value);
+    }
+    writeValue(out, static_cast<uint32_t>(holeIndices.size()));
+    for (size_t index : holeIndices) {
+        writeValue(out, static_cast<uint64_t>(index));
+    }
+    writeValue(out, static_cast<uint32_t>(constants.size()));
+    for (const auto &constant : constants) {
+        const string digits = constant.get_str();
+        writeValue(out, static_cast<uint32_t>(digits.size()));
+        out += digits;
+    }
+}
+
+auto CompiledPattern::deserialize(llvm::StringRef &in)
+    -> llvm::Optional<CompiledPattern> {
+    CompiledPattern compiled;
+    uint32_t size;
+    if (!readValue(in, size)) {
+        return llvm::None;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        uint8_t op;
+        Instruction instr;
+        if (!readValue(in, op) || !readValue(in, instr.kind) ||
+            !readValue(in, instr.operand) || !readValue(in, instr.value) ||
+            op > static_cast<uint8_t>(OpCode::SparseRange)) {
+            return llvm::None;
+        }
+        instr.op = static_cast<OpCode>(op);
+        // Arguments are numbered in the order of distributeArguments
+        if (instr.op == OpCode::Argument &&
+            instr.operand != compiled.argumentCount++) {
+            return llvm::None;
+        }
+        compiled.program.push_back(instr);
+    }
+    if (!readValue(in, size)) {
+        return llvm::None;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        uint64_t index;
+        if (!readValue(in, index)) {
+            return llvm::None;
+        }
+        compiled.holeIndices.push_back(index);
+    }
+    if (!readValue(in, size)) {
+        return llvm::None;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        uint32_t length;
+        mpz_class constant;
+        if (!readValue(in, length) || in.size() < length ||
+            constant.set_str(in.substr(0, length).str(), 10) != 0) {
+            return llvm::None;
+        }
+        in = in.drop_front(length);
+        compiled.constants.push_back(constant);
+    }
+    compiled.pattern = compiled.decompile(0, compiled.program.size());
+    if (compiled.pattern == nullptr) {
+        return llvm::None;
+    }
+    return compiled;
+}
+
+// The library returned by the last call of get or read
+static std::mutex currentLibraryMutex;
+static shared_ptr<PatternLibrary> currentLibrary;
+
+auto PatternLibrary::get(
+    const vector<shared_ptr<HeapPattern<VariablePlaceholder>>> &patterns)
+    -> shared_ptr<PatternLibrary> {
+    std::lock_guard<std::mutex> lock(currentLibraryMutex);
+    if (currentLibrary != nullptr && currentLibrary->patterns() == patterns) {
+        return currentLibrary;
+    }
+    vector<CompiledPattern> compiled;
+    for (const auto &pat : patterns) {
+        compiled.emplace_back(pat);
+    }
+    currentLibrary = make_shared<PatternLibrary>(std::move(compiled));
+    return currentLibrary;
+}
+
+auto PatternLibrary::patterns() const
+    -> vector<shared_ptr<HeapPattern<VariablePlaceholder>>> {
+    vector<shared_ptr<HeapPattern<VariablePlaceholder>>> patterns;
+    for (const auto &pat : compiledPatterns) {
+        patterns.push_back(pat.source());
+    }
+    return patterns;
+}
+
+static const char PatternCacheMagic[8] = {'l', 'l', 'r', 'e',
+                                          'v', 'e', 'P', '2'};
+
+// FNV-1a, unlike llvm::hash_value it is stable across builds
+static uint64_t hashSource(llvm::StringRef source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : source) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+auto PatternLibrary::read(const string &cachePath, llvm::StringRef source)
+    -> shared_ptr<PatternLibrary> {
+    const int fd = open(cachePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat s;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && s.st_size > 0) {
+        data = mmap(nullptr, static_cast<size_t>(s.st_size), PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    llvm::StringRef in(static_cast<const char *>(data),
+                       static_cast<size_t>(s.st_size));
+    const llvm::StringRef magic(PatternCacheMagic, sizeof(PatternCacheMagic));
+    shared_ptr<PatternLibrary> library;
+    uint64_t hash;
+    uint64_t length;
+    uint32_t size;
+    // The cache of another pattern file is replaced without a warning
+    bool matches = in.startswith(magic);
+    if (matches) {
+        in = in.drop_front(magic.size());
+        matches = readValue(in, hash) && readValue(in, length) &&
+                  hash == hashSource(source) && length == source.size();
+    }
+    if (matches) {
+        vector<CompiledPattern> compiled;
+        bool valid = readValue(in, size);
+        for (uint32_t i = 0; valid && i < size; ++i) {
+            auto pat = CompiledPattern::deserialize(in);
+            valid = pat.hasValue();
+            if (valid) {
+                compiled.push_back(std::move(*pat));
+            }
+        }
+        if (valid && in.empty()) {
+            library = make_shared<PatternLibrary>(std::move(compiled));
+        } else {
+            logWarning("Ignoring invalid pattern cache\n");
+        }
+    }
+    munmap(data, static_cast<size_t>(s.st_size));
+    if (library != nullptr) {
+        std::lock_guard<std::mutex> lock(currentLibraryMutex);
+        currentLibrary = library;
+    }
+    return library;
+}
+
+void PatternLibrary::write(const string &cachePath,
+                           llvm::StringRef source) const {
+    string out(PatternCacheMagic, sizeof(PatternCacheMagic));
+    writeValue(out, hashSource(source));
+    writeValue(out, static_cast<uint64_t>(source.size()));
+    writeValue(out, static_cast<uint32_t>(compiledPatterns.size()));
+    for (const auto &pat : compiledPatterns) {
+        pat.serialize(out);
+    }
+    // Concurrent runs may share the cache, so it is replaced atomically
+    const string tmpPath = cachePath + "." + std::to_string(getpid());
+    std::ofstream file(tmpPath, std::ios::binary);
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        logWarning("Couldn’t write pattern cache\n");
+    }
+}
+
+auto PatternLibrary::instantiations(size_t arguments, uint32_t variables)
+    -> shared_ptr<const vector<uint32_t>> {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &cached = tuples[{arguments, variables}];
+    if (cached != nullptr) {
+        return cached;
+    }
+    auto result = make_shared<vector<uint32_t>>();
+    vector<uint32_t> args(arguments, 0);
+    while (variables > 0 || arguments == 0) {
+        result->insert(result->end(), args.begin(), args.end());
+        size_t i = 0;
+        while (i < arguments && ++args[i] == variables) {
+            args[i++] = 0;
+        }
+        if (i == arguments) {
+            break;
+        }
+    }
+    cached = result;
+    return cached;
+}
 }
 }
@@ -15,18 +15,23 @@
 using namespace llreve::opts;
 
 Integer &Integer::operator=(const Integer &other) {
-    switch (type) {
-    case IntType::Unbounded:
-        unbounded.~mpz_class();
-        break;
-    case IntType::Bounded:
-        bounded.~APInt();
-        break;
+    if (this == &other) {
+        return *this;
+    }
+    if (bothSmall(other)) {
+        small = other.small;
+        return *this;
     }
+    this->~Integer();
     type = other.type;
+    isSmall = other.isSmall;
     switch (type) {
     case IntType::Unbounded:
-        new (&unbounded) mpz_class(other.unbounded);
+        if (isSmall) {
+            small = other.small;
+        } else {
+            new (&unbounded) mpz_class(other.unbounded);
+        }
         break;
     case IntType::Bounded:
         new (&bounded) llvm::APInt(other.bounded);
@@ -36,18 +41,23 @@ Integer &Integer::operator=(const Integer &other) {
 }
 
 Integer &Integer::operator=(Integer &&other) {
-    switch (type) {
-    case IntType::Unbounded:
-        unbounded.~mpz_class();
-        break;
-    case IntType::Bounded:
-        bounded.~APInt();
-        break;
+    if (this == &other) {
+        return *this;
+    }
+    if (bothSmall(other)) {
+        small = other.small;
+        return *this;
     }
+    this->~Integer();
     type = other.type;
+    isSmall = other.isSmall;
     switch (type) {
     case IntType::Unbounded:
-        new (&unbounded) mpz_class(std::move(other.unbounded));
+        if (isSmall) {
+            small = other.small;
+        } else {
+            new (&unbounded) mpz_class(std::move(other.unbounded));
+        }
         break;
     case IntType::Bounded:
         new (&bounded) llvm::APInt(std::move(other.bounded));
@@ -59,7 +69,9 @@ Integer &Integer::operator=(Integer &&other) {
 Integer::~Integer() {
     switch (type) {
     case IntType::Unbounded:
-        unbounded.~mpz_class();
+        if (!isSmall) {
+            unbounded.~mpz_class();
+        }
         break;
     case IntType::Bounded:
         bounded.~APInt();
@@ -117,11 +129,19 @@ Integer Integer::sext(unsigned width) {
     return res;
 }
 
+// The absolute value of INT64_MIN only fits in an unsigned integer
+static uint64_t magnitude(int64_t i) {
+    return i < 0 ? 0 - static_cast<uint64_t>(i) : static_cast<uint64_t>(i);
+}
+
 bool Integer::eq(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded == rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small == rhs.small;
+        }
+        return asUnbounded() == rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.eq(rhs.bounded);
     }
@@ -130,7 +150,10 @@ bool Integer::ne(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded != rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small != rhs.small;
+        }
+        return asUnbounded() != rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.ne(rhs.bounded);
     }
@@ -139,10 +162,16 @@ bool Integer::ult(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
+        if (bothSmall(rhs)) {
+            if (SMTGenerationOpts::getInstance().EverythingSigned) {
+                return small < rhs.small;
+            }
+            return magnitude(small) < magnitude(rhs.small);
+        }
         if (SMTGenerationOpts::getInstance().EverythingSigned) {
-            return unbounded < rhs.unbounded;
+            return asUnbounded() < rhs.asUnbounded();
         }
-        return abs(unbounded) < abs(rhs.unbounded);
+        return abs(asUnbounded()) < abs(rhs.asUnbounded());
     case IntType::Bounded:
         return bounded.ult(rhs.bounded);
     }
@@ -151,7 +180,10 @@ bool Integer::slt(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded < rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small < rhs.small;
+        }
+        return asUnbounded() < rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.slt(rhs.bounded);
     }
@@ -160,10 +192,16 @@ bool Integer::ule(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
+        if (bothSmall(rhs)) {
+            if (SMTGenerationOpts::getInstance().EverythingSigned) {
+                return small <= rhs.small;
+            }
+            return magnitude(small) <= magnitude(rhs.small);
+        }
         if (SMTGenerationOpts::getInstance().EverythingSigned) {
-            return unbounded <= rhs.unbounded;
+            return asUnbounded() <= rhs.asUnbounded();
         }
-        return abs(unbounded) <= abs(rhs.unbounded);
+        return abs(asUnbounded()) <= abs(rhs.asUnbounded());
     case IntType::Bounded:
         return bounded.ule(rhs.bounded);
     }
@@ -172,7 +210,10 @@ bool Integer::sle(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded <= rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small <= rhs.small;
+        }
+        return asUnbounded() <= rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.sle(rhs.bounded);
     }
@@ -181,10 +222,16 @@ bool Integer::ugt(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
+        if (bothSmall(rhs)) {
+            if (SMTGenerationOpts::getInstance().EverythingSigned) {
+                return small > rhs.small;
+            }
+            return magnitude(small) > magnitude(rhs.small);
+        }
         if (SMTGenerationOpts::getInstance().EverythingSigned) {
-            return unbounded > rhs.unbounded;
+            return asUnbounded() > rhs.asUnbounded();
         }
-        return abs(unbounded) > abs(rhs.unbounded);
+        return abs(asUnbounded()) > abs(rhs.asUnbounded());
     case IntType::Bounded:
         return bounded.ugt(rhs.bounded);
     }
@@ -193,7 +240,10 @@ bool Integer::sgt(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded > rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small > rhs.small;
+        }
+        return asUnbounded() > rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.sgt(rhs.bounded);
     }
@@ -202,10 +252,16 @@ bool Integer::uge(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
+        if (bothSmall(rhs)) {
+            if (SMTGenerationOpts::getInstance().EverythingSigned) {
+                return small >= rhs.small;
+            }
+            return magnitude(small) >= magnitude(rhs.small);
+        }
         if (SMTGenerationOpts::getInstance().EverythingSigned) {
-            return unbounded >= rhs.unbounded;
+            return asUnbounded() >= rhs.asUnbounded();
         }
-        return abs(unbounded) >= abs(rhs.unbounded);
+        return abs(asUnbounded()) >= abs(rhs.asUnbounded());
     case IntType::Bounded:
         return bounded.uge(rhs.bounded);
     }
@@ -214,7 +270,10 @@ bool Integer::sge(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return unbounded >= rhs.unbounded;
+        if (bothSmall(rhs)) {
+            return small >= rhs.small;
+        }
+        return asUnbounded() >= rhs.asUnbounded();
     case IntType::Bounded:
         return bounded.sge(rhs.bounded);
     }
@@ -224,7 +283,7 @@ Integer Integer::sdiv(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return Integer(unbounded / rhs.unbounded);
+        return *this / rhs;
     case IntType::Bounded:
         return Integer(bounded.sdiv(rhs.bounded));
     }
@@ -233,7 +292,7 @@ Integer Integer::udiv(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return Integer(unbounded / rhs.unbounded);
+        return *this / rhs;
     case IntType::Bounded:
         return Integer(bounded.udiv(rhs.bounded));
     }
@@ -242,7 +301,11 @@ Integer Integer::srem(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return Integer(unbounded % rhs.unbounded);
+        // INT64_MIN % -1 overflows although the result is 0
+        if (bothSmall(rhs) && rhs.small != -1) {
+            return fromSmall(small % rhs.small);
+        }
+        return Integer(asUnbounded() % rhs.asUnbounded());
     case IntType::Bounded:
         return Integer(bounded.srem(rhs.bounded));
     }
@@ -251,7 +314,11 @@ Integer Integer::urem(const Integer &rhs) const {
     assert(type == rhs.type);
     switch (type) {
     case IntType::Unbounded:
-        return Integer(unbounded % rhs.unbounded);
+        // INT64_MIN % -1 overflows although the result is 0
+        if (bothSmall(rhs) && rhs.small != -1) {
+            return fromSmall(small % rhs.small);
+        }
+        return Integer(asUnbounded() % rhs.asUnbounded());
     case IntType::Bounded:
         return Integer(bounded.urem(rhs.bounded));
     }
@@ -300,8 +367,24 @@ Integer Integer::asPointer() const {
         }
         return Integer(bounded.sext(64));
     case IntType::Unbounded:
-        assert(unbounded.fits_slong_p());
-        return Integer(makeBoundedInt(64, unbounded.get_si()));
+        assert(isSmall);
+        return Integer(makeBoundedInt(64, small));
+    }
+}
+
+llvm::hash_code hash_value(const Integer &val) {
+    switch (val.type) {
+    case IntType::Unbounded:
+        if (val.isSmall) {
+            return llvm::hash_value(val.small);
+        }
+        // abs is necessary because gmp is shitty
+        return llvm::hash_combine_range(
+            val.unbounded.get_mpz_t()->_mp_d,
+            val.unbounded.get_mpz_t()->_mp_d +
+                std::abs(val.unbounded.get_mpz_t()->_mp_size));
+    case IntType::Bounded:
+        return llvm::hash_value(val.bounded);
     }
 }
 
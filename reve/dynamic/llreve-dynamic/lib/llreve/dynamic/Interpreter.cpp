@@ -27,6 +27,7 @@ using llvm::GetElementPtrInst;
 using llvm::ICmpInst;
 using llvm::Instruction;
 using llvm::LoadInst;
+using llvm::Optional;
 using llvm::PHINode;
 using llvm::ReturnInst;
 using llvm::SelectInst;
@@ -74,29 +75,103 @@ bool unsafeBool(const Integer &val) {
     }
 }
 
-bool isContainedIn(const llvm::SmallDenseMap<HeapAddress, Integer> &small,
-                   const Heap &big) {
-    for (const auto &val : small) {
-        auto it = big.assignedValues.find(val.first);
-        if (it != big.assignedValues.end()) {
-            if (val.second != it->second) {
-                return false;
+bool isContainedIn(const HeapMap &small, const Heap &big) {
+    return small.isContainedIn(big.assignedValues(), big.background);
+}
+
+bool operator==(const Heap &lhs, const Heap &rhs) {
+    if (lhs.background != rhs.background) {
+        return false;
+    }
+    if (lhs.assignedValues() == rhs.assignedValues()) {
+        return true;
+    }
+    return isContainedIn(lhs.assignedValues(), rhs) &&
+           isContainedIn(rhs.assignedValues(), lhs);
+}
+
+FrameLayout::FrameLayout(const Function &fun) {
+    for (const auto &arg : fun.args()) {
+        slots.insert({&arg, static_cast<unsigned>(values.size())});
+        values.push_back(&arg);
+    }
+    for (const auto &bb : fun) {
+        for (const auto &instr : bb) {
+            slots.insert({&instr, static_cast<unsigned>(values.size())});
+            values.push_back(&instr);
+        }
+    }
+    // Operands can refer to instructions in later blocks so all slots need to
+    // be known before they can be resolved
+    operandSlots.resize(values.size());
+    for (unsigned i = 0; i < values.size(); ++i) {
+        if (const auto instr = dyn_cast<Instruction>(values[i])) {
+            for (const auto &op : instr->operands()) {
+                operandSlots[i].push_back(slot(op.get()));
             }
+        }
+    }
+}
+
+const FrameLayout &FrameLayouts::get(const Function &fun) {
+    auto it = layouts.find(&fun);
+    if (it == layouts.end()) {
+        auto layout = std::make_unique<FrameLayout>(fun);
+        it = layouts.insert(std::make_pair(&fun, std::move(layout))).first;
+    }
+    return *it->second;
+}
+
+Frame::Frame(const FrameLayout &layout, const FastState &state)
+    : layout(layout), values(layout.values.size()),
+      assigned(layout.values.size(), false), heap(state.heap),
+      isDirty(layout.values.size(), false) {
+    for (const auto &var : state.variables) {
+        unsigned slot = layout.slot(var.first);
+        if (slot == FrameLayout::NoSlot) {
+            foreign.insert(var);
         } else {
-            if (val.second != big.background) {
-                return false;
-            }
+            assign(slot, var.second);
         }
     }
-    return true;
 }
 
-bool operator==(const Heap &lhs, const Heap &rhs) {
-    if (lhs.background != rhs.background) {
-        return false;
+Integer Frame::operand(unsigned slot, unsigned index, const Value *val) const {
+    unsigned operandSlot = layout.operandSlots[slot][index];
+    if (operandSlot == FrameLayout::NoSlot) {
+        return resolveConstant(val);
+    }
+    return values[operandSlot];
+}
+
+FastState Frame::toState() const {
+    FastVarMap variables(foreign);
+    for (unsigned i = 0; i < values.size(); ++i) {
+        if (assigned[i]) {
+            variables.insert({layout.values[i], values[i]});
+        }
     }
-    return isContainedIn(lhs.assignedValues, rhs) &&
-           isContainedIn(rhs.assignedValues, lhs);
+    return FastState(std::move(variables), heap);
+}
+
+shared_ptr<const StateDelta<const Value *>> Frame::snapshot() {
+    using Delta = StateDelta<const Value *>;
+    if (lastSnapshot == nullptr ||
+        lastSnapshot->distance + 1 >= Delta::KeyframeInterval) {
+        lastSnapshot = make_shared<Delta>(nullptr, toState().variables, heap);
+    } else {
+        FastVarMap changed(static_cast<unsigned>(dirty.size()));
+        for (unsigned slot : dirty) {
+            changed.insert({layout.values[slot], values[slot]});
+        }
+        lastSnapshot = make_shared<Delta>(std::move(lastSnapshot),
+                                          std::move(changed), heap);
+    }
+    for (unsigned slot : dirty) {
+        isDirty[slot] = false;
+    }
+    dirty.clear();
+    return lastSnapshot;
 }
 
 MonoPair<FastCall>
@@ -104,54 +179,93 @@ interpretFunctionPair(MonoPair<const Function *> funs,
                       MonoPair<FastVarMap> variables, MonoPair<Heap> heaps,
                       uint32_t maxSteps,
                       const AnalysisResultsMap &analysisResults) {
+    FrameLayouts layouts;
+    return interpretFunctionPair(funs, std::move(variables), std::move(heaps),
+                                 maxSteps, analysisResults, layouts);
+}
+
+MonoPair<FastCall>
+interpretFunctionPair(MonoPair<const Function *> funs,
+                      MonoPair<FastVarMap> variables, MonoPair<Heap> heaps,
+                      uint32_t maxSteps,
+                      const AnalysisResultsMap &analysisResults,
+                      FrameLayouts &layouts) {
     return makeMonoPair(
         interpretFunction(*funs.first, FastState(variables.first, heaps.first),
-                          maxSteps, analysisResults),
+                          &funs.first->getEntryBlock(), maxSteps,
+                          analysisResults, layouts),
         interpretFunction(*funs.second,
-                          FastState(variables.second, heaps.second), maxSteps,
-                          analysisResults));
+                          FastState(variables.second, heaps.second),
+                          &funs.second->getEntryBlock(), maxSteps,
+                          analysisResults, layouts));
 }
 
 MonoPair<FastCall> interpretFunctionPair(
     MonoPair<const llvm::Function *> funs, MonoPair<FastVarMap> variables,
     MonoPair<Heap> heaps, MonoPair<const llvm::BasicBlock *> startBlocks,
     uint32_t maxSteps, const AnalysisResultsMap &analysisResults) {
+    FrameLayouts layouts;
     return makeMonoPair(
         interpretFunction(*funs.first, FastState(variables.first, heaps.first),
-                          startBlocks.first, maxSteps, analysisResults),
+                          startBlocks.first, maxSteps, analysisResults,
+                          layouts),
         interpretFunction(*funs.second,
                           FastState(variables.second, heaps.second),
-                          startBlocks.second, maxSteps, analysisResults));
+                          startBlocks.second, maxSteps, analysisResults,
+                          layouts));
 }
 
 FastCall interpretFunction(const Function &fun, FastState entry,
                            const llvm::BasicBlock *startBlock,
                            uint32_t maxSteps,
                            const AnalysisResultsMap &analysisResults) {
-    const BasicBlock *prevBlock = nullptr;
-    const BasicBlock *currentBlock = startBlock;
+    FrameLayouts layouts;
+    return interpretFunction(fun, std::move(entry), startBlock, maxSteps,
+                             analysisResults, layouts);
+}
+
+FastCall interpretFunction(const Function &fun, FastState entry,
+                           const llvm::BasicBlock *startBlock,
+                           uint32_t maxSteps,
+                           const AnalysisResultsMap &analysisResults,
+                           FrameLayouts &layouts) {
+    CallInterpreter interpreter(fun, entry, startBlock, maxSteps,
+                                analysisResults, layouts);
     vector<BlockStep<const llvm::Value *>> steps;
-    FastState currentState = entry;
-    BlockUpdate<const llvm::Value *> update;
-    uint32_t blocksVisited = 0;
-    bool firstBlock = true;
-    do {
-        update =
-            interpretBlock(*currentBlock, prevBlock, currentState, firstBlock,
-                           maxSteps - blocksVisited, analysisResults);
-        firstBlock = false;
-        blocksVisited += update.blocksVisited;
-        steps.emplace_back(currentBlock->getName(), std::move(update.step),
-                           std::move(update.calls));
-        prevBlock = currentBlock;
-        currentBlock = update.nextBlock;
-        if (blocksVisited > maxSteps || update.earlyExit) {
-            return FastCall(&fun, std::move(entry), std::move(currentState),
-                            std::move(steps), true, blocksVisited);
-        }
-    } while (currentBlock != nullptr);
-    return FastCall(&fun, std::move(entry), std::move(currentState),
-                    std::move(steps), false, blocksVisited);
+    while (Optional<BlockStep<const llvm::Value *>> step = interpreter.next()) {
+        steps.push_back(std::move(*step));
+    }
+    return FastCall(&fun, std::move(entry), interpreter.state(),
+                    std::move(steps), interpreter.ranOutOfSteps(),
+                    interpreter.visitedBlocks());
+}
+
+CallInterpreter::CallInterpreter(const Function &fun, const FastState &entry,
+                                 const BasicBlock *startBlock,
+                                 uint32_t maxSteps,
+                                 const AnalysisResultsMap &analysisResults,
+                                 FrameLayouts &layouts)
+    : fun(fun), analysisResults(analysisResults), layouts(layouts),
+      frame(layouts.get(fun), entry), prevBlock(nullptr),
+      currentBlock(startBlock), maxSteps(maxSteps), blocksVisited(0),
+      earlyExit(false) {}
+
+Optional<BlockStep<const llvm::Value *>> CallInterpreter::next() {
+    if (currentBlock == nullptr || earlyExit) {
+        return llvm::None;
+    }
+    // The phi nodes of the first block have no predecessor to choose from
+    BlockUpdate<const llvm::Value *> update = interpretBlock(
+        *currentBlock, prevBlock, frame, prevBlock == nullptr,
+        maxSteps - blocksVisited, analysisResults, layouts);
+    blocksVisited += update.blocksVisited;
+    BlockStep<const llvm::Value *> step(currentBlock->getName(),
+                                        std::move(update.step),
+                                        std::move(update.calls));
+    prevBlock = currentBlock;
+    currentBlock = update.nextBlock;
+    earlyExit = blocksVisited > maxSteps || update.earlyExit;
+    return std::move(step);
 }
 
 FastCall interpretFunction(const Function &fun, FastState entry,
@@ -163,216 +277,216 @@ FastCall interpretFunction(const Function &fun, FastState entry,
 
 BlockUpdate<const llvm::Value *>
 interpretBlock(const BasicBlock &block, const BasicBlock *prevBlock,
-               FastState &state, bool skipPhi, uint32_t maxSteps,
-               const AnalysisResultsMap &analysisResults) {
+               Frame &frame, bool skipPhi, uint32_t maxSteps,
+               const AnalysisResultsMap &analysisResults,
+               FrameLayouts &layouts) {
     uint32_t blocksVisited = 1;
     const Instruction *firstNonPhi = block.getFirstNonPHI();
     const Instruction *terminator = block.getTerminator();
+    // The instructions of a block have consecutive slots
+    unsigned slot = frame.layout.slot(&block.front());
     // Handle phi instructions
     BasicBlock::const_iterator instrIterator;
     for (instrIterator = block.begin(); &*instrIterator != firstNonPhi;
-         ++instrIterator) {
+         ++instrIterator, ++slot) {
         const Instruction *inst = &*instrIterator;
         assert(isa<PHINode>(inst));
         if (!skipPhi) {
-            interpretPHI(*dyn_cast<PHINode>(inst), state, prevBlock);
+            interpretPHI(*dyn_cast<PHINode>(inst), slot, frame, prevBlock);
         }
     }
-    FastState step(state);
+    auto step = frame.snapshot();
 
     vector<FastCall> calls;
     // Handle non phi instructions
-    for (; &*instrIterator != terminator; ++instrIterator) {
+    for (; &*instrIterator != terminator; ++instrIterator, ++slot) {
         if (const auto call = dyn_cast<llvm::CallInst>(&*instrIterator)) {
             const Function *fun = call->getCalledFunction();
             FastVarMap args;
             auto argIt = fun->arg_begin();
+            unsigned argIndex = 0;
             for (const auto &arg : call->arg_operands()) {
                 args.insert(std::make_pair(
-                    &*argIt, resolveValue(arg, state, arg->getType())));
+                    &*argIt, frame.operand(slot, argIndex, arg)));
                 ++argIt;
+                ++argIndex;
             }
-            FastCall c =
-                interpretFunction(*fun, FastState(args, state.heap),
-                                  maxSteps - blocksVisited, analysisResults);
+            FastCall c = interpretFunction(
+                *fun, FastState(args, frame.heap), &fun->getEntryBlock(),
+                maxSteps - blocksVisited, analysisResults, layouts);
             blocksVisited += c.blocksVisited;
             if (blocksVisited > maxSteps || c.earlyExit) {
                 return BlockUpdate<const llvm::Value *>(
                     std::move(step), nullptr, std::move(calls), true,
                     blocksVisited);
             }
-            state.heap = c.returnState.heap;
-            insertOrReplace(
-                state.variables,
-                {call, c.returnState.variables
-                           .find(analysisResults.at(fun).returnInstruction)
-                           ->second});
+            frame.heap = c.returnState.heap;
+            frame.assign(slot,
+                         c.returnState.variables
+                             .find(analysisResults.at(fun).returnInstruction)
+                             ->second);
             calls.push_back(std::move(c));
         } else {
-            interpretInstruction(&*instrIterator, state);
+            interpretInstruction(&*instrIterator, slot, frame);
         }
     }
 
     // Terminator instruction
-    TerminatorUpdate update = interpretTerminator(block.getTerminator(), state);
+    TerminatorUpdate update =
+        interpretTerminator(block.getTerminator(), slot, frame);
 
     return BlockUpdate<const llvm::Value *>(std::move(step), update.nextBlock,
                                             std::move(calls), false,
                                             blocksVisited);
 }
 
-void interpretInstruction(const Instruction *instr, FastState &state) {
+void interpretInstruction(const Instruction *instr, unsigned slot,
+                          Frame &frame) {
     if (const auto binOp = dyn_cast<BinaryOperator>(instr)) {
-        interpretBinOp(binOp, state);
+        interpretBinOp(binOp, slot, frame);
     } else if (const auto icmp = dyn_cast<ICmpInst>(instr)) {
-        interpretICmpInst(icmp, state);
+        interpretICmpInst(icmp, slot, frame);
     } else if (const auto cast = dyn_cast<CastInst>(instr)) {
         assert(cast->getNumOperands() == 1);
+        Integer operand = frame.operand(slot, 0, cast->getOperand(0));
         if (cast->getSrcTy()->isIntegerTy(1) &&
             cast->getDestTy()->getIntegerBitWidth() > 1) {
             // Convert a bool to an integer
-            Integer operand = state.variables.find(cast->getOperand(0))->second;
             if (SMTGenerationOpts::getInstance().BitVect) {
-                insertOrReplace(
-                    state.variables,
-                    {cast, Integer(makeBoundedInt(
-                               cast->getType()->getIntegerBitWidth(),
-                               unsafeBool(operand) ? 1 : 0))});
+                frame.assign(slot, Integer(makeBoundedInt(
+                                       cast->getType()->getIntegerBitWidth(),
+                                       unsafeBool(operand) ? 1 : 0)));
             } else {
-                insertOrReplace(
-                    state.variables,
-                    {cast, Integer(mpz_class(unsafeBool(operand) ? 1 : 0))});
+                frame.assign(slot,
+                             Integer(mpz_class(unsafeBool(operand) ? 1 : 0)));
             }
         } else {
             if (const auto zext = dyn_cast<llvm::ZExtInst>(instr)) {
-                insertOrReplace(
-                    state.variables,
-                    {zext,
-                     resolveValue(zext->getOperand(0), state, zext->getType())
-                         .zext(zext->getType()->getIntegerBitWidth())});
+                frame.assign(slot, operand.zext(
+                                       zext->getType()->getIntegerBitWidth()));
             } else if (const auto sext = dyn_cast<llvm::SExtInst>(instr)) {
-                insertOrReplace(
-                    state.variables,
-                    {sext,
-                     resolveValue(sext->getOperand(0), state, sext->getType())
-                         .sext(sext->getType()->getIntegerBitWidth())});
+                frame.assign(slot, operand.sext(
+                                       sext->getType()->getIntegerBitWidth()));
             } else if (const auto trunc = dyn_cast<llvm::TruncInst>(instr)) {
-                insertOrReplace(
-                    state.variables,
-                    {trunc,
-                     resolveValue(trunc->getOperand(0), state, trunc->getType())
-                         .zextOrTrunc(trunc->getType()->getIntegerBitWidth())});
+                frame.assign(slot,
+                             operand.zextOrTrunc(
+                                 trunc->getType()->getIntegerBitWidth()));
             } else if (const auto ptrToInt =
                            dyn_cast<llvm::PtrToIntInst>(instr)) {
-                insertOrReplace(
-                    state.variables,
-                    {ptrToInt,
-                     resolveValue(ptrToInt->getPointerOperand(), state,
-                                  ptrToInt->getPointerOperand()->getType())
-                         .zextOrTrunc(
-                             ptrToInt->getType()->getIntegerBitWidth())});
-            } else if (const auto intToPtr =
-                           dyn_cast<llvm::IntToPtrInst>(instr)) {
-                insertOrReplace(
-                    state.variables,
-                    {ptrToInt, resolveValue(intToPtr->getOperand(0), state,
-                                            intToPtr->getOperand(0)->getType())
-                                   .zextOrTrunc(64)});
+                frame.assign(slot,
+                             operand.zextOrTrunc(
+                                 ptrToInt->getType()->getIntegerBitWidth()));
+            } else if (isa<llvm::IntToPtrInst>(instr)) {
+                frame.assign(slot, operand.zextOrTrunc(64));
             } else {
                 logErrorData("Unsupported instruction:\n", *instr);
                 exit(1);
             }
         }
     } else if (const auto gep = dyn_cast<GetElementPtrInst>(instr)) {
-        insertOrReplace(state.variables, {gep, resolveGEP(*gep, state)});
+        frame.assign(slot, resolveGEP(*gep, [&](unsigned index,
+                                                const Value *val) {
+                         return frame.operand(slot, index, val);
+                     }));
     } else if (const auto load = dyn_cast<LoadInst>(instr)) {
-        Integer ptr = resolveValue(load->getPointerOperand(), state,
-                                   load->getPointerOperand()->getType());
-        // This will only insert 0 if there is not already a different element
+        Integer ptr = frame.operand(slot, 0, load->getPointerOperand());
         if (SMTGenerationOpts::getInstance().BitVect) {
-            unsigned bytes = load->getType()->getIntegerBitWidth() / 8;
-            llvm::APInt val =
-                makeBoundedInt(load->getType()->getIntegerBitWidth(), 0);
-            for (unsigned i = 0; i < bytes; ++i) {
-                auto heapIt = state.heap.assignedValues.insert(std::make_pair(
-                    ptr.asPointer() + Integer(mpz_class(i)).asPointer(),
-                    Integer(makeBoundedInt(
-                        8, state.heap.background.asUnbounded().get_si()))));
-                assert(heapIt.first->second.type == IntType::Bounded);
-                assert(heapIt.first->second.bounded.getBitWidth() == 8);
-                val = (val << 8) |
-                      (heapIt.first->second.bounded).sextOrSelf(bytes * 8);
-            }
-            insertOrReplace(state.variables, {load, Integer(val)});
+            frame.assign(slot,
+                         loadBytes(frame.heap, ptr,
+                                   load->getType()->getIntegerBitWidth()));
         } else {
-            auto heapIt = state.heap.assignedValues.insert(
-                std::make_pair(ptr.asPointer(), state.heap.background));
-            insertOrReplace(state.variables, {load, heapIt.first->second});
+            // Only copy shared nodes if the address has not been seen yet
+            const Integer *val =
+                frame.heap.assignedValues().lookup(ptr.asPointer());
+            if (val != nullptr) {
+                frame.assign(slot, *val);
+            } else {
+                frame.heap.mutableAssignedValues().insert(
+                    std::make_pair(ptr.asPointer(), frame.heap.background));
+                frame.assign(slot, frame.heap.background);
+            }
         }
     } else if (const auto store = dyn_cast<StoreInst>(instr)) {
-        HeapAddress addr = resolveValue(store->getPointerOperand(), state,
-                                        store->getPointerOperand()->getType());
-        Integer val = resolveValue(store->getValueOperand(), state,
-                                   store->getValueOperand()->getType());
+        HeapAddress addr = frame.operand(slot, 1, store->getPointerOperand());
+        Integer val = frame.operand(slot, 0, store->getValueOperand());
         if (SMTGenerationOpts::getInstance().BitVect) {
-            int bytes =
-                store->getValueOperand()->getType()->getIntegerBitWidth() / 8;
-            assert(val.type == IntType::Bounded);
-            llvm::APInt bval = val.bounded;
-            if (bytes == 1) {
-                state.heap.assignedValues[addr] = val;
-            } else {
-                uint64_t i = 0;
-                for (; bytes >= 0; --bytes) {
-                    llvm::APInt el = bval.trunc(8);
-                    bval = bval.ashr(8);
-                    state.heap
-                        .assignedValues[addr + Integer(llvm::APInt(
-                                                   64, static_cast<uint64_t>(
-                                                           bytes)))] =
-                        Integer(el);
-                    ++i;
-                }
-            }
+            storeBytes(
+                frame.heap, addr, val,
+                store->getValueOperand()->getType()->getIntegerBitWidth());
         } else {
-            state.heap.assignedValues[addr] = val;
+            frame.heap.mutableAssignedValues().set(addr, val);
         }
     } else if (const auto select = dyn_cast<SelectInst>(instr)) {
-        Integer cond = resolveValue(select->getCondition(), state,
-                                    select->getCondition()->getType());
-        bool condVal = unsafeBool(cond);
-        if (condVal) {
-            Integer var =
-                resolveValue(select->getTrueValue(), state, select->getType());
-            insertOrReplace(state.variables, {select, var});
+        Integer cond = frame.operand(slot, 0, select->getCondition());
+        if (unsafeBool(cond)) {
+            frame.assign(slot, frame.operand(slot, 1, select->getTrueValue()));
         } else {
-            Integer var =
-                resolveValue(select->getFalseValue(), state, select->getType());
-            insertOrReplace(state.variables, {select, var});
+            frame.assign(slot,
+                         frame.operand(slot, 2, select->getFalseValue()));
         }
-
     } else {
         logErrorData("unsupported instruction:\n", *instr);
     }
 }
 
-void interpretPHI(const PHINode &instr, FastState &state,
+Integer loadBytes(Heap &heap, const HeapAddress &ptr, unsigned width) {
+    // This will only insert 0 if there is not already a different element
+    unsigned bytes = width / 8;
+    llvm::APInt val = makeBoundedInt(width, 0);
+    HeapMap &entries = heap.mutableAssignedValues();
+    const Integer background(
+        makeBoundedInt(8, heap.background.asUnbounded().get_si()));
+    for (unsigned i = 0; i < bytes; ++i) {
+        const HeapAddress address =
+            ptr.asPointer() + Integer(mpz_class(i)).asPointer();
+        const Integer *byte = entries.lookup(address);
+        if (byte == nullptr) {
+            entries.insert({address, background});
+            byte = &background;
+        }
+        assert(byte->type == IntType::Bounded);
+        assert(byte->bounded.getBitWidth() == 8);
+        val = (val << 8) | byte->bounded.sextOrSelf(bytes * 8);
+    }
+    return Integer(val);
+}
+
+void storeBytes(Heap &heap, const HeapAddress &addr, const Integer &val,
+                unsigned width) {
+    int bytes = static_cast<int>(width / 8);
+    assert(val.type == IntType::Bounded);
+    llvm::APInt bval = val.bounded;
+    if (bytes == 1) {
+        heap.mutableAssignedValues().set(addr, val);
+    } else {
+        HeapMap &entries = heap.mutableAssignedValues();
+        for (; bytes >= 0; --bytes) {
+            llvm::APInt el = bval.trunc(8);
+            bval = bval.ashr(8);
+            entries.set(addr + Integer(llvm::APInt(
+                                   64, static_cast<uint64_t>(bytes))),
+                        Integer(el));
+        }
+    }
+}
+
+void interpretPHI(const PHINode &instr, unsigned slot, Frame &frame,
                   const BasicBlock *prevBlock) {
-    const Value *val = instr.getIncomingValueForBlock(prevBlock);
-    Integer var = resolveValue(val, state, val->getType());
-    insertOrReplace(state.variables, {&instr, var});
+    // The operands of a phi are its incoming values
+    int index = instr.getBasicBlockIndex(prevBlock);
+    assert(index >= 0);
+    const Value *val = instr.getIncomingValue(static_cast<unsigned>(index));
+    frame.assign(slot, frame.operand(slot, static_cast<unsigned>(index), val));
 }
 
 TerminatorUpdate interpretTerminator(const TerminatorInst *instr,
-                                     FastState &state) {
+                                     unsigned slot, Frame &frame) {
     if (const auto retInst = dyn_cast<ReturnInst>(instr)) {
         if (retInst->getReturnValue() == nullptr) {
-            insertOrReplace(state.variables, {retInst, Integer(mpz_class(0))});
+            frame.assign(slot, Integer(mpz_class(0)));
         } else {
-            insertOrReplace(
-                state.variables,
-                {retInst, resolveValue(retInst->getReturnValue(), state,
-                                       retInst->getReturnValue()->getType())});
+            frame.assign(slot,
+                         frame.operand(slot, 0, retInst->getReturnValue()));
         }
         return TerminatorUpdate(nullptr);
     } else if (const auto branchInst = dyn_cast<BranchInst>(instr)) {
@@ -380,8 +494,8 @@ TerminatorUpdate interpretTerminator(const TerminatorInst *instr,
             assert(branchInst->getNumSuccessors() == 1);
             return TerminatorUpdate(branchInst->getSuccessor(0));
         } else {
-            Integer cond = resolveValue(branchInst->getCondition(), state,
-                                        branchInst->getCondition()->getType());
+            // The condition is the first operand of a conditional branch
+            Integer cond = frame.operand(slot, 0, branchInst->getCondition());
             bool condVal = unsafeBool(cond);
             assert(branchInst->getNumSuccessors() == 2);
             if (condVal) {
@@ -391,8 +505,7 @@ TerminatorUpdate interpretTerminator(const TerminatorInst *instr,
             }
         }
     } else if (const auto switchInst = dyn_cast<SwitchInst>(instr)) {
-        Integer condVal = resolveValue(switchInst->getCondition(), state,
-                                       switchInst->getCondition()->getType());
+        Integer condVal = frame.operand(slot, 0, switchInst->getCondition());
         for (auto c : switchInst->cases()) {
             Integer caseVal;
             if (SMTGenerationOpts::getInstance().BitVect) {
@@ -416,7 +529,12 @@ Integer resolveValue(const Value *val, const FastState &state,
                      const llvm::Type * /* unused */) {
     if (isa<Instruction>(val) || isa<Argument>(val)) {
         return state.variables.find(val)->second;
-    } else if (const auto constInt = dyn_cast<ConstantInt>(val)) {
+    }
+    return resolveConstant(val);
+}
+
+Integer resolveConstant(const Value *val) {
+    if (const auto constInt = dyn_cast<ConstantInt>(val)) {
         if (constInt->getBitWidth() == 1) {
             return Integer(constInt->getValue());
         } else if (!SMTGenerationOpts::getInstance().BitVect) {
@@ -431,22 +549,16 @@ Integer resolveValue(const Value *val, const FastState &state,
     exit(1);
 }
 
-void interpretICmpInst(const ICmpInst *instr, FastState &state) {
+void interpretICmpInst(const ICmpInst *instr, unsigned slot, Frame &frame) {
     assert(instr->getNumOperands() == 2);
-    Integer op0 = resolveValue(instr->getOperand(0), state,
-                               instr->getOperand(0)->getType());
-    Integer op1 = resolveValue(instr->getOperand(1), state,
-                               instr->getOperand(0)->getType());
-    switch (instr->getPredicate()) {
-    default:
-        interpretIntPredicate(instr, instr->getPredicate(), std::move(op0),
-                              std::move(op1), state);
-    }
+    Integer op0 = frame.operand(slot, 0, instr->getOperand(0));
+    Integer op1 = frame.operand(slot, 1, instr->getOperand(1));
+    frame.assign(slot, Integer(interpretIntPredicate(
+                           instr, instr->getPredicate(), op0, op1)));
 }
 
-void interpretIntPredicate(const ICmpInst *instr, CmpInst::Predicate pred,
-                           const Integer &i0, const Integer &i1,
-                           FastState &state) {
+bool interpretIntPredicate(const ICmpInst *instr, CmpInst::Predicate pred,
+                           const Integer &i0, const Integer &i1) {
     bool predVal = false;
     switch (pred) {
     case CmpInst::ICMP_EQ:
@@ -482,26 +594,26 @@ void interpretIntPredicate(const ICmpInst *instr, CmpInst::Predicate pred,
     default:
         logErrorData("Unsupported predicate:\n", *instr);
     }
-    insertOrReplace(state.variables, {instr, Integer(predVal)});
+    return predVal;
 }
 
-void interpretBinOp(const BinaryOperator *instr, FastState &state) {
-    const Integer op0 = resolveValue(instr->getOperand(0), state,
-                                     instr->getOperand(0)->getType());
-    const Integer op1 = resolveValue(instr->getOperand(1), state,
-                                     instr->getOperand(1)->getType());
+void interpretBinOp(const BinaryOperator *instr, unsigned slot,
+                    Frame &frame) {
+    const Integer op0 = frame.operand(slot, 0, instr->getOperand(0));
+    const Integer op1 = frame.operand(slot, 1, instr->getOperand(1));
     if (instr->getType()->getIntegerBitWidth() == 1) {
         bool b0 = unsafeBool(op0);
         bool b1 = unsafeBool(op1);
-        interpretBoolBinOp(instr, instr->getOpcode(), b0, b1, state);
+        frame.assign(slot, Integer(interpretBoolBinOp(
+                               instr, instr->getOpcode(), b0, b1)));
     } else {
-        interpretIntBinOp(instr, instr->getOpcode(), std::move(op0),
-                          std::move(op1), state);
+        frame.assign(slot,
+                     interpretIntBinOp(instr, instr->getOpcode(), op0, op1));
     }
 }
 
-void interpretBoolBinOp(const BinaryOperator *instr, Instruction::BinaryOps op,
-                        bool b0, bool b1, FastState &state) {
+bool interpretBoolBinOp(const BinaryOperator *instr, Instruction::BinaryOps op,
+                        bool b0, bool b1) {
     bool result = false;
     switch (op) {
     case Instruction::Or:
@@ -517,11 +629,12 @@ void interpretBoolBinOp(const BinaryOperator *instr, Instruction::BinaryOps op,
         logErrorData("Unsupported binop:\n", *instr);
         llvm::errs() << "\n";
     }
-    insertOrReplace(state.variables, {instr, Integer(result)});
+    return result;
 }
 
-void interpretIntBinOp(const BinaryOperator *instr, Instruction::BinaryOps op,
-                       const Integer &i0, const Integer &i1, FastState &state) {
+Integer interpretIntBinOp(const BinaryOperator *instr,
+                          Instruction::BinaryOps op, const Integer &i0,
+                          const Integer &i1) {
     Integer result;
     switch (op) {
     case Instruction::Add:
@@ -567,7 +680,7 @@ void interpretIntBinOp(const BinaryOperator *instr, Instruction::BinaryOps op,
         logErrorData("Unsupported binop:\n", *instr);
         llvm::errs() << "\n";
     }
-    insertOrReplace(state.variables, {instr, result});
+    return result;
 }
 
 bool varValEq(const Integer &lhs, const Integer &rhs) { return lhs == rhs; }
@@ -581,7 +694,7 @@ json stateToJSON(State<T> state, function<string(T)> getName) {
         string varName = getName(var.first);
         jsonVariables.insert({varName, toJSON(var.second)});
     }
-    for (const auto &index : state.heap.assignedValues) {
+    for (const auto &index : state.heap.assignedValues()) {
         jsonHeap.insert({index.first.get_str(), index.second.get_str()});
     }
     json j;
@@ -98,7 +98,7 @@ map<Mark, SharedSMTRef> makeIterativeInvariantDefinitions(
 RelationalFunctionInvariantMap<FunctionInvariant<smt::SharedSMTRef>>
 makeRelationalFunctionInvariantDefinitions(
     const RelationalFunctionInvariantMap<
-        LoopInfoData<FunctionInvariant<Matrix<mpq_class>>>> &equations,
+        LoopInfoData<FunctionInvariant<EchelonBasis>>> &equations,
     const RelationalFunctionInvariantMap<
         LoopInfoData<llvm::Optional<FunctionInvariant<HeapPatternCandidates>>>>
         &patterns,
@@ -176,7 +176,7 @@ makeRelationalFunctionInvariantDefinitions(
 
 FunctionInvariantMap<smt::SharedSMTRef> makeFunctionInvariantDefinitions(
     MonoPair<const llvm::Module &> modules,
-    const FunctionInvariantMap<Matrix<mpq_class>> &equations,
+    const FunctionInvariantMap<EchelonBasis> &equations,
     const FunctionInvariantMap<HeapPatternCandidates> &patterns,
     const AnalysisResultsMap &analysisResults, size_t degree) {
     auto invariants = makeFunctionInvariantDefinitions(
@@ -191,7 +191,7 @@ FunctionInvariantMap<smt::SharedSMTRef> makeFunctionInvariantDefinitions(
 
 FunctionInvariantMap<smt::SharedSMTRef> makeFunctionInvariantDefinitions(
     const llvm::Module &module,
-    const FunctionInvariantMap<Matrix<mpq_class>> &equations,
+    const FunctionInvariantMap<EchelonBasis> &equations,
     const FunctionInvariantMap<HeapPatternCandidates> &patterns,
     const AnalysisResultsMap &analysisResults, Program prog, size_t degree) {
     FunctionInvariantMap<smt::SharedSMTRef> definitions;
@@ -371,13 +371,8 @@ SharedSMTRef makeEquation(const vector<mpz_class> &eq,
     return makeOp("=", leftSide, rightSide);
 }
 
-Matrix<mpz_class> findSolutions(Matrix<mpq_class> equations) {
-    Matrix<mpq_class> solution = nullSpace(equations);
-    Matrix<mpz_class> integerSolution(solution.size());
-    for (size_t i = 0; i < solution.size(); ++i) {
-        integerSolution.at(i) = ratToInt(solution.at(i));
-    }
-    return integerSolution;
+Matrix<mpz_class> findSolutions(const EchelonBasis &equations) {
+    return equations.nullSpace();
 }
 PolynomialSolutions findSolutions(
     const IterativeInvariantMap<PolynomialEquations> &polynomialEquations) {
@@ -0,0 +1,667 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "llreve/dynamic/Jit.h"
+
+#include "Compat.h"
+#include "Helper.h"
+#include "MarkAnalysis.h"
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <csetjmp>
+#include <mutex>
+#include <set>
+
+using llvm::BasicBlock;
+using llvm::BinaryOperator;
+using llvm::ConstantInt;
+using llvm::Function;
+using llvm::GetElementPtrInst;
+using llvm::IRBuilder;
+using llvm::Instruction;
+using llvm::LoadInst;
+using llvm::Optional;
+using llvm::StoreInst;
+using llvm::Type;
+using llvm::Value;
+using llvm::dyn_cast;
+using llvm::isa;
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace llreve {
+namespace dynamic {
+
+class TraceJit::Engine {
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+    const llvm::DataLayout dataLayout;
+    llvm::orc::RTDyldObjectLinkingLayer objectLayer;
+    llvm::orc::IRCompileLayer<decltype(objectLayer), llvm::orc::SimpleCompiler>
+        compileLayer;
+    llvm::StringMap<llvm::JITTargetAddress> hooks;
+
+  public:
+    Engine();
+    auto mangle(const string &name) const -> string;
+    /// Compiles the module and returns the address of the function
+    auto compile(std::unique_ptr<llvm::Module> module, const string &name)
+        -> llvm::JITTargetAddress;
+};
+
+struct TraceJit::Run {
+    const CompiledFunction &compiled;
+    Heap heap;
+    vector<BlockStep<const Value *>> steps;
+    uint32_t maxSteps;
+    uint32_t blocksVisited;
+    // The step hook jumps back here once we ran out of steps
+    std::jmp_buf outOfSteps;
+    Run(const CompiledFunction &compiled, Heap heap, uint32_t maxSteps)
+        : compiled(compiled), heap(std::move(heap)), maxSteps(maxSteps),
+          blocksVisited(0) {}
+};
+
+thread_local TraceJit::Run *TraceJit::currentRun = nullptr;
+
+static llvm::TargetMachine *nativeTarget() {
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+    });
+    return llvm::EngineBuilder().selectTarget();
+}
+
+TraceJit::Engine::Engine()
+    : targetMachine(nativeTarget()),
+      dataLayout(targetMachine->createDataLayout()),
+      objectLayer(
+          []() { return std::make_shared<llvm::SectionMemoryManager>(); }),
+      compileLayer(objectLayer, llvm::orc::SimpleCompiler(*targetMachine)) {
+    hooks[mangle("llreve_jit_step")] =
+        reinterpret_cast<llvm::JITTargetAddress>(&TraceJit::stepHook);
+    hooks[mangle("llreve_jit_record")] =
+        reinterpret_cast<llvm::JITTargetAddress>(&TraceJit::recordHook);
+    hooks[mangle("llreve_jit_load")] =
+        reinterpret_cast<llvm::JITTargetAddress>(&TraceJit::loadHook);
+    hooks[mangle("llreve_jit_store")] =
+        reinterpret_cast<llvm::JITTargetAddress>(&TraceJit::storeHook);
+}
+
+string TraceJit::Engine::mangle(const string &name) const {
+    string mangled;
+    llvm::raw_string_ostream stream(mangled);
+    llvm::Mangler::getNameWithPrefix(stream, name, dataLayout);
+    return stream.str();
+}
+
+llvm::JITTargetAddress
+TraceJit::Engine::compile(std::unique_ptr<llvm::Module> module,
+                          const string &name) {
+    module->setDataLayout(dataLayout);
+    // The hooks are the only external symbols used by the programs
+    auto resolver = llvm::orc::createLambdaResolver(
+        [this](const string &symbol) {
+            if (auto sym = compileLayer.findSymbol(symbol, false)) {
+                return sym;
+            }
+            return llvm::JITSymbol(nullptr);
+        },
+        [this](const string &symbol) {
+            auto it = hooks.find(symbol);
+            if (it != hooks.end()) {
+                return llvm::JITSymbol(it->second,
+                                       llvm::JITSymbolFlags::Exported);
+            }
+            return llvm::JITSymbol(nullptr);
+        });
+    llvm::cantFail(
+        compileLayer.addModule(std::move(module), std::move(resolver)));
+    return llvm::cantFail(
+        compileLayer.findSymbol(mangle(name), true).getAddress());
+}
+
+static bool supportedType(const Type *type) {
+    return type->isPointerTy() ||
+           (type->isIntegerTy() && type->getIntegerBitWidth() <= 64);
+}
+
+static bool supportedOperand(const Value *val) {
+    return isa<Instruction>(val) || isa<llvm::Argument>(val) ||
+           isa<ConstantInt>(val) || isa<llvm::ConstantPointerNull>(val) ||
+           isa<BasicBlock>(val);
+}
+
+// Native code traps or differs from the interpreter for division by zero or
+// -1 and for shifts by at least the bitwidth
+static bool supportedBinOp(const BinaryOperator &binOp) {
+    unsigned width = binOp.getType()->getIntegerBitWidth();
+    const auto rhs = dyn_cast<ConstantInt>(binOp.getOperand(1));
+    switch (binOp.getOpcode()) {
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+        return true;
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+        return width > 1;
+    case Instruction::UDiv:
+    case Instruction::URem:
+        return width > 1 && rhs != nullptr && !rhs->isZero();
+    case Instruction::SDiv:
+    case Instruction::SRem:
+        return width > 1 && rhs != nullptr && !rhs->isZero() &&
+               !rhs->isMinusOne();
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+        return width > 1 && rhs != nullptr && rhs->getValue().ult(width);
+    default:
+        return false;
+    }
+}
+
+static Optional<string> unsupportedInstruction(const Instruction &instr) {
+    if (!instr.getType()->isVoidTy() && !supportedType(instr.getType())) {
+        return string("unsupported type");
+    }
+    const auto call = dyn_cast<llvm::CallInst>(&instr);
+    for (const auto &op : instr.operands()) {
+        if (call != nullptr && op.get() == call->getCalledValue()) {
+            continue;
+        }
+        if (!supportedOperand(op.get())) {
+            return string("unsupported operand");
+        }
+    }
+    if (const auto binOp = dyn_cast<BinaryOperator>(&instr)) {
+        if (!supportedBinOp(*binOp)) {
+            return string("unsupported binary operator");
+        }
+    } else if (const auto load = dyn_cast<LoadInst>(&instr)) {
+        if (!load->getType()->isIntegerTy() ||
+            load->getType()->getIntegerBitWidth() % 8 != 0) {
+            return string("unsupported load");
+        }
+    } else if (const auto store = dyn_cast<StoreInst>(&instr)) {
+        const Type *type = store->getValueOperand()->getType();
+        if (!type->isIntegerTy() || type->getIntegerBitWidth() % 8 != 0 ||
+            type->getIntegerBitWidth() > 64) {
+            return string("unsupported store");
+        }
+    } else if (call != nullptr) {
+        const Function *fun = call->getCalledFunction();
+        if (fun == nullptr || fun->isDeclaration() || fun->isVarArg()) {
+            return string("call to an unknown function");
+        }
+    } else if (const auto gep = dyn_cast<GetElementPtrInst>(&instr)) {
+        if (!gep->getPointerOperandType()->isPointerTy()) {
+            return string("vector of pointers");
+        }
+    } else if (!isa<llvm::PHINode>(&instr) && !isa<llvm::ICmpInst>(&instr) &&
+               !isa<llvm::ZExtInst>(&instr) && !isa<llvm::SExtInst>(&instr) &&
+               !isa<llvm::TruncInst>(&instr) &&
+               !isa<llvm::PtrToIntInst>(&instr) &&
+               !isa<llvm::IntToPtrInst>(&instr) &&
+               !isa<llvm::SelectInst>(&instr) &&
+               !isa<llvm::ReturnInst>(&instr) &&
+               !isa<llvm::BranchInst>(&instr) &&
+               !isa<llvm::SwitchInst>(&instr)) {
+        return string("unsupported instruction");
+    }
+    return llvm::None;
+}
+
+// The functions that can be called starting from fun including fun itself
+static set<const Function *> reachableFunctions(const Function &fun) {
+    set<const Function *> reachable = {&fun};
+    vector<const Function *> worklist = {&fun};
+    while (!worklist.empty()) {
+        const Function *current = worklist.back();
+        worklist.pop_back();
+        for (const auto &bb : *current) {
+            for (const auto &instr : bb) {
+                if (const auto call = dyn_cast<llvm::CallInst>(&instr)) {
+                    const Function *callee = call->getCalledFunction();
+                    if (callee != nullptr && reachable.insert(callee).second) {
+                        worklist.push_back(callee);
+                    }
+                }
+            }
+        }
+    }
+    return reachable;
+}
+
+Optional<string> unsupportedByJit(const Function &fun,
+                                  const AnalysisResultsMap &analysisResults) {
+    if (analysisResults.find(&fun) == analysisResults.end()) {
+        return "no analysis results for " + fun.getName().str();
+    }
+    for (const auto callee : reachableFunctions(fun)) {
+        if (callee->isDeclaration()) {
+            return "call to " + callee->getName().str();
+        }
+        for (const auto &arg : callee->args()) {
+            if (!supportedType(arg.getType())) {
+                return "unsupported argument of " + callee->getName().str();
+            }
+        }
+        if (!callee->getReturnType()->isVoidTy() &&
+            !supportedType(callee->getReturnType())) {
+            return "unsupported return type of " + callee->getName().str();
+        }
+        for (const auto &bb : *callee) {
+            for (const auto &instr : bb) {
+                if (auto reason = unsupportedInstruction(instr)) {
+                    return *reason + " in " + callee->getName().str();
+                }
+            }
+        }
+    }
+    return llvm::None;
+}
+
+static Value *toRaw(IRBuilder<> &builder, Value *val) {
+    Type *i64 = builder.getInt64Ty();
+    if (val->getType()->isPointerTy()) {
+        return builder.CreatePtrToInt(val, i64);
+    }
+    return builder.CreateZExtOrTrunc(val, i64);
+}
+
+static Value *fromRaw(IRBuilder<> &builder, Value *raw, Type *type) {
+    if (type->isPointerTy()) {
+        return builder.CreateIntToPtr(raw, type);
+    }
+    return builder.CreateZExtOrTrunc(raw, type);
+}
+
+// Pointers are plain 64 bit integers
+static Integer fromRaw(const Type *type, uint64_t raw) {
+    if (type->isPointerTy()) {
+        return Integer(llvm::APInt(64, raw));
+    }
+    return Integer(llvm::APInt(type->getIntegerBitWidth(), raw));
+}
+
+static uint64_t toRaw(const Integer &val) {
+    assert(val.type == IntType::Bounded);
+    return val.bounded.getZExtValue();
+}
+
+// Compute the address like resolveGEP does, typeSize does not use the
+// layout of structs so native address computations would differ
+static void lowerGEP(GetElementPtrInst &gep, const llvm::DataLayout &layout) {
+    IRBuilder<> builder(&gep);
+    Type *i64 = builder.getInt64Ty();
+    Value *offset = builder.CreatePtrToInt(gep.getPointerOperand(), i64);
+    vector<Value *> indices;
+    for (auto ix = gep.idx_begin(), e = gep.idx_end(); ix != e; ++ix) {
+        indices.push_back(*ix);
+        const auto indexedType = GetElementPtrInst::getIndexedType(
+            gep.getSourceElementType(), indices);
+        const auto size = typeSize(indexedType, layout);
+        offset = builder.CreateAdd(
+            offset, builder.CreateMul(builder.CreateSExtOrTrunc(*ix, i64),
+                                      builder.getInt64(
+                                          static_cast<uint64_t>(size))));
+    }
+    gep.replaceAllUsesWith(builder.CreateIntToPtr(offset, gep.getType()));
+    gep.eraseFromParent();
+}
+
+// Replaces the instructions whose native semantics differ from the
+// interpreter
+static void lowerInstruction(Instruction &instr, const llvm::DataLayout &layout,
+                             Function &loadHook, Function &storeHook) {
+    if (auto gep = dyn_cast<GetElementPtrInst>(&instr)) {
+        lowerGEP(*gep, layout);
+        return;
+    }
+    IRBuilder<> builder(&instr);
+    if (auto sext = dyn_cast<llvm::SExtInst>(&instr)) {
+        // Bools are always converted to 1
+        if (sext->getSrcTy()->isIntegerTy(1)) {
+            sext->replaceAllUsesWith(
+                builder.CreateZExt(sext->getOperand(0), sext->getType()));
+            sext->eraseFromParent();
+        }
+    } else if (auto load = dyn_cast<LoadInst>(&instr)) {
+        Value *raw = builder.CreateCall(
+            &loadHook, {toRaw(builder, load->getPointerOperand()),
+                        builder.getInt32(
+                            load->getType()->getIntegerBitWidth())});
+        load->replaceAllUsesWith(fromRaw(builder, raw, load->getType()));
+        load->eraseFromParent();
+    } else if (auto store = dyn_cast<StoreInst>(&instr)) {
+        builder.CreateCall(
+            &storeHook,
+            {toRaw(builder, store->getPointerOperand()),
+             toRaw(builder, store->getValueOperand()),
+             builder.getInt32(
+                 store->getValueOperand()->getType()->getIntegerBitWidth())});
+        store->eraseFromParent();
+    }
+}
+
+// The entry block and the blocks of normal marks are recorded
+static bool recordedBlock(const BasicBlock &bb,
+                          const AnalysisResults &results) {
+    if (&bb == &bb.getParent()->getEntryBlock()) {
+        return true;
+    }
+    const auto &blockMarks = results.blockMarkMap.BlockToMarksMap;
+    auto it = blockMarks.find(const_cast<BasicBlock *>(&bb));
+    return it != blockMarks.end() && it->second.count(ENTRY_MARK) == 0;
+}
+
+// The values that are available at the beginning of a block after its phi
+// nodes, i.e. the arguments, the phi nodes and the values of the dominating
+// blocks
+static vector<Value *> availableValues(Function &fun, BasicBlock &bb,
+                                       const llvm::DominatorTree &domTree) {
+    vector<Value *> values;
+    for (auto &arg : fun.args()) {
+        values.push_back(&arg);
+    }
+    for (auto &other : fun) {
+        if (&other == &bb) {
+            for (auto &instr : other) {
+                if (isa<llvm::PHINode>(&instr)) {
+                    values.push_back(&instr);
+                }
+            }
+        } else if (domTree.dominates(&other, &bb)) {
+            for (auto &instr : other) {
+                if (!instr.getType()->isVoidTy()) {
+                    values.push_back(&instr);
+                }
+            }
+        }
+    }
+    return values;
+}
+
+auto TraceJit::compile(Engine &engine, const Function &fun,
+                       const AnalysisResultsMap &analysisResults,
+                       const string &entryName) -> CompiledFunction {
+    const llvm::Module &original = *fun.getParent();
+    llvm::ValueToValueMapTy cloneMap;
+    std::unique_ptr<llvm::Module> module = llvm::CloneModule(&original,
+                                                             cloneMap);
+    llvm::LLVMContext &context = module->getContext();
+    IRBuilder<> builder(context);
+    Type *voidTy = builder.getVoidTy();
+    Type *i32 = builder.getInt32Ty();
+    Type *i64 = builder.getInt64Ty();
+    Type *i64Ptr = i64->getPointerTo();
+
+    const auto reachable = reachableFunctions(fun);
+    vector<Function *> functions;
+    for (const auto &other : original) {
+        Value *mapped = cloneMap[&other];
+        Function *clone = llvm::cast<Function>(mapped);
+        if (reachable.count(&other) > 0) {
+            clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+            functions.push_back(clone);
+        } else if (!other.isDeclaration()) {
+            clone->deleteBody();
+        }
+    }
+    // Recursive calls of the main function must not be recorded so the
+    // recorded blocks are part of a separate copy
+    Value *clonedMain = cloneMap[&fun];
+    llvm::ValueToValueMapTy tracedMap;
+    Function *traced =
+        llvm::CloneFunction(llvm::cast<Function>(clonedMain), tracedMap);
+    functions.push_back(traced);
+    // Map the values of the copy back to the original function
+    llvm::DenseMap<const Value *, const Value *> originals;
+    const auto addOriginal = [&](const Value *val) {
+        Value *clone = cloneMap[val];
+        Value *copy = tracedMap[clone];
+        originals[copy] = val;
+    };
+    for (const auto &arg : fun.args()) {
+        addOriginal(&arg);
+    }
+    for (const auto &bb : fun) {
+        addOriginal(&bb);
+        for (const auto &instr : bb) {
+            addOriginal(&instr);
+        }
+    }
+
+    // Collect the instructions before the instrumentation adds its own
+    vector<Instruction *> lowered;
+    for (Function *f : functions) {
+        for (auto &bb : *f) {
+            for (auto &instr : bb) {
+                if (isa<GetElementPtrInst>(&instr) ||
+                    isa<llvm::SExtInst>(&instr) || isa<LoadInst>(&instr) ||
+                    isa<StoreInst>(&instr)) {
+                    lowered.push_back(&instr);
+                }
+            }
+        }
+    }
+
+    const auto hook = [&](const string &name, Type *result,
+                          llvm::ArrayRef<Type *> args) {
+        return Function::Create(llvm::FunctionType::get(result, args, false),
+                                llvm::GlobalValue::ExternalLinkage, name,
+                                module.get());
+    };
+    Function *stepHook = hook("llreve_jit_step", voidTy, {});
+    Function *recordHook = hook("llreve_jit_record", voidTy, {i32, i64Ptr});
+    Function *loadHook = hook("llreve_jit_load", i64, {i64, i32});
+    Function *storeHook = hook("llreve_jit_store", voidTy, {i64, i64, i32});
+
+    const AnalysisResults &results = analysisResults.at(&fun);
+    CompiledFunction compiled;
+    compiled.function = &fun;
+    compiled.returnInstruction = results.returnInstruction;
+    llvm::DominatorTree domTree(*traced);
+    vector<std::pair<BasicBlock *, vector<Value *>>> recorded;
+    size_t bufferSize = 0;
+    for (auto &bb : *traced) {
+        const auto orig = llvm::cast<BasicBlock>(originals.lookup(&bb));
+        if (recordedBlock(*orig, results)) {
+            auto values = availableValues(*traced, bb, domTree);
+            bufferSize = std::max(bufferSize, values.size());
+            RecordedBlock block{orig, {}};
+            for (const auto val : values) {
+                block.values.push_back(originals.lookup(val));
+            }
+            compiled.blocks.push_back(std::move(block));
+            recorded.emplace_back(&bb, std::move(values));
+        }
+    }
+
+    // Recording comes before the step since the interpreter also records the
+    // step that exceeds the limit
+    llvm::DenseMap<const BasicBlock *, Instruction *> steps;
+    for (Function *f : functions) {
+        for (auto &bb : *f) {
+            builder.SetInsertPoint(&*bb.getFirstInsertionPt());
+            steps[&bb] = builder.CreateCall(stepHook, {});
+        }
+    }
+    builder.SetInsertPoint(steps[&traced->getEntryBlock()]);
+    Value *buffer = builder.CreateAlloca(
+        llvm::ArrayType::get(i64, std::max<size_t>(bufferSize, 1)));
+    for (size_t i = 0; i < recorded.size(); ++i) {
+        builder.SetInsertPoint(steps[recorded[i].first]);
+        const auto &values = recorded[i].second;
+        for (size_t j = 0; j < values.size(); ++j) {
+            builder.CreateStore(toRaw(builder, values[j]),
+                                builder.CreateConstGEP2_64(buffer, 0, j));
+        }
+        builder.CreateCall(recordHook,
+                           {builder.getInt32(static_cast<uint32_t>(i)),
+                            builder.CreateConstGEP2_64(buffer, 0, 0)});
+    }
+    for (Instruction *instr : lowered) {
+        lowerInstruction(*instr, original.getDataLayout(), *loadHook,
+                         *storeHook);
+    }
+
+    // Called as entry(args, result) with raw 64 bit values
+    Function *entry = hook(entryName, voidTy, {i64Ptr, i64Ptr});
+    builder.SetInsertPoint(BasicBlock::Create(context, "entry", entry));
+    auto entryArgs = entry->arg_begin();
+    Value *argsPtr = &*entryArgs++;
+    Value *resultPtr = &*entryArgs;
+    vector<Value *> callArgs;
+    for (auto &arg : traced->args()) {
+        Value *raw = builder.CreateLoad(
+            builder.CreateConstGEP1_64(argsPtr, arg.getArgNo()));
+        callArgs.push_back(fromRaw(builder, raw, arg.getType()));
+    }
+    Value *result = builder.CreateCall(traced, callArgs);
+    if (!result->getType()->isVoidTy()) {
+        builder.CreateStore(toRaw(builder, result), resultPtr);
+    }
+    builder.CreateRetVoid();
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        logError("The instrumented module is broken\n");
+        exit(1);
+    }
+    compiled.entry =
+        reinterpret_cast<void (*)(const uint64_t *, uint64_t *)>(
+            engine.compile(std::move(module), entryName));
+    return compiled;
+}
+
+TraceJit::TraceJit(std::unique_ptr<Engine> engine,
+                   MonoPair<CompiledFunction> compiled)
+    : engine(std::move(engine)), compiled(std::move(compiled)) {}
+
+TraceJit::~TraceJit() = default;
+
+std::unique_ptr<TraceJit>
+TraceJit::create(MonoPair<const Function *> funs,
+                 const AnalysisResultsMap &analysisResults) {
+    for (const Function *fun : {funs.first, funs.second}) {
+        if (auto reason = unsupportedByJit(*fun, analysisResults)) {
+            logWarning("Using the interpreter, the JIT doesn’t support " +
+                       *reason + "\n");
+            return nullptr;
+        }
+    }
+    auto engine = std::make_unique<Engine>();
+    auto first =
+        compile(*engine, *funs.first, analysisResults, "llreve_jit_entry_1");
+    auto second =
+        compile(*engine, *funs.second, analysisResults, "llreve_jit_entry_2");
+    return std::unique_ptr<TraceJit>(
+        new TraceJit(std::move(engine),
+                     makeMonoPair(std::move(first), std::move(second))));
+}
+
+// Kept separate so that no objects with destructors are skipped when the step
+// hook jumps back
+static bool callEntry(void (*entry)(const uint64_t *, uint64_t *),
+                      const uint64_t *args, uint64_t *result,
+                      std::jmp_buf &outOfSteps) {
+    if (setjmp(outOfSteps) != 0) {
+        return false;
+    }
+    entry(args, result);
+    return true;
+}
+
+FastCall TraceJit::run(const CompiledFunction &compiled, FastVarMap variables,
+                       Heap heap, uint32_t maxSteps) {
+    const Function &fun = *compiled.function;
+    vector<uint64_t> args;
+    for (const auto &arg : fun.args()) {
+        args.push_back(toRaw(variables.find(&arg)->second));
+    }
+    FastState entry(std::move(variables), heap);
+    Run run(compiled, std::move(heap), maxSteps);
+    uint64_t result = 0;
+    currentRun = &run;
+    bool returned = callEntry(compiled.entry, args.data(), &result,
+                              run.outOfSteps);
+    currentRun = nullptr;
+    FastVarMap returnVariables;
+    if (returned) {
+        if (fun.getReturnType()->isVoidTy()) {
+            returnVariables.insert(
+                {compiled.returnInstruction, Integer(mpz_class(0))});
+        } else {
+            returnVariables.insert({compiled.returnInstruction,
+                                    fromRaw(fun.getReturnType(), result)});
+        }
+    }
+    return FastCall(&fun, std::move(entry),
+                    FastState(std::move(returnVariables), run.heap),
+                    std::move(run.steps), !returned, run.blocksVisited);
+}
+
+MonoPair<FastCall> TraceJit::run(MonoPair<FastVarMap> variables,
+                                 MonoPair<Heap> heaps,
+                                 uint32_t maxSteps) const {
+    return makeMonoPair(run(compiled.first, std::move(variables.first),
+                            std::move(heaps.first), maxSteps),
+                        run(compiled.second, std::move(variables.second),
+                            std::move(heaps.second), maxSteps));
+}
+
+void TraceJit::stepHook() {
+    Run &run = *currentRun;
+    if (++run.blocksVisited > run.maxSteps) {
+        std::longjmp(run.outOfSteps, 1);
+    }
+}
+
+void TraceJit::recordHook(uint32_t block, const uint64_t *values) {
+    Run &run = *currentRun;
+    const RecordedBlock &recorded = run.compiled.blocks[block];
+    FastVarMap variables(static_cast<unsigned>(recorded.values.size()));
+    for (size_t i = 0; i < recorded.values.size(); ++i) {
+        const Value *val = recorded.values[i];
+        variables.insert({val, fromRaw(val->getType(), values[i])});
+    }
+    run.steps.emplace_back(recorded.block->getName(),
+                           FastState(std::move(variables), run.heap),
+                           vector<FastCall>());
+}
+
+uint64_t TraceJit::loadHook(uint64_t ptr, uint32_t width) {
+    return toRaw(loadBytes(currentRun->heap, Integer(llvm::APInt(64, ptr)),
+                           width));
+}
+
+void TraceJit::storeHook(uint64_t ptr, uint64_t val, uint32_t width) {
+    storeBytes(currentRun->heap, Integer(llvm::APInt(64, ptr)),
+               Integer(llvm::APInt(width, val)), width);
+}
+} // namespace dynamic
+} // namespace llreve
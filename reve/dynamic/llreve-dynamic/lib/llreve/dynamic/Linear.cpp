@@ -10,161 +10,503 @@
 
 #include "llreve/dynamic/Linear.h"
 
+#include <algorithm>
 #include <gmpxx.h>
 
 using std::vector;
 
-// This is not completely reduced as the leading entries are not normalized
-void reducedRowEchelonForm(Matrix<mpq_class> &input) {
-    size_t currentRow = 0;
-    for (size_t currentCol = 0; currentCol < input.at(0).size(); ++currentCol) {
-        // Find non-zero entry in this column
-        int64_t nonZeroRow = -1;
-        for (size_t i = currentRow; i < input.size(); ++i) {
-            if (input[i][currentCol] != mpq_class(0)) {
-                nonZeroRow = static_cast<int64_t>(i);
-                break;
+using llvm::Optional;
+
+// Primes below 2^31 so products of residues fit in 64 bits
+static auto modularPrimes() -> const vector<uint64_t> & {
+    static const vector<uint64_t> primes = [] {
+        vector<uint64_t> result;
+        for (uint64_t candidate = (1ull << 31) - 1; result.size() < 128;
+             candidate -= 2) {
+            bool prime = true;
+            for (uint64_t divisor = 3; divisor * divisor <= candidate;
+                 divisor += 2) {
+                if (candidate % divisor == 0) {
+                    prime = false;
+                    break;
+                }
+            }
+            if (prime) {
+                result.push_back(candidate);
             }
         }
-        if (nonZeroRow == -1) {
-            // No non zero entry
-            continue;
+        return result;
+    }();
+    return primes;
+}
+
+static auto powMod(uint64_t base, uint64_t exponent, uint64_t prime)
+    -> uint64_t {
+    uint64_t result = 1;
+    base %= prime;
+    while (exponent > 0) {
+        if (exponent & 1) {
+            result = result * base % prime;
         }
-        if (static_cast<size_t>(nonZeroRow) != currentRow) {
-            // Swap rows
-            swap(input[static_cast<size_t>(nonZeroRow)], input[currentRow]);
+        base = base * base % prime;
+        exponent >>= 1;
+    }
+    return result;
+}
+
+static auto inverseMod(uint64_t val, uint64_t prime) -> uint64_t {
+    return powMod(val, prime - 2, prime);
+}
+
+static auto residues(const mpz_class *vec, size_t size, uint64_t prime)
+    -> vector<uint64_t> {
+    vector<uint64_t> result(size);
+    for (size_t i = 0; i < size; ++i) {
+        result[i] = mpz_fdiv_ui(vec[i].get_mpz_t(), prime);
+    }
+    return result;
+}
+
+// Subtracts factor times row from vec, starting at the column start
+static void subtractModular(uint64_t *vec, const uint64_t *row,
+                            uint64_t factor, size_t start, size_t size,
+                            uint64_t prime) {
+    const uint64_t negated = prime - factor;
+    for (size_t col = start; col < size; ++col) {
+        vec[col] = (vec[col] + negated * row[col]) % prime;
+    }
+}
+
+// Divide the entries by their greatest common divisor
+static void makePrimitive(mpz_class *vec, size_t size) {
+    mpz_class divisor = 0;
+    for (size_t i = 0; i < size && divisor != 1; ++i) {
+        if (vec[i] != 0) {
+            mpz_gcd(divisor.get_mpz_t(), divisor.get_mpz_t(),
+                    vec[i].get_mpz_t());
         }
-        // Subtract the current row from the rows above it
-        for (size_t i = 0; i < currentRow; ++i) {
-            mpq_class multiple =
-                input[i][currentCol] / input[currentRow][currentCol];
-            for (size_t j = currentCol; j < input[i].size(); ++j) {
-                input[i][j] -= multiple * input[currentRow][j];
-            }
+    }
+    if (divisor > 1) {
+        for (size_t i = 0; i < size; ++i) {
+            mpz_divexact(vec[i].get_mpz_t(), vec[i].get_mpz_t(),
+                         divisor.get_mpz_t());
         }
-        // Subtract the current row from the rows below it
-        for (size_t i = currentRow + 1; i < input.size(); ++i) {
-            mpq_class multiple =
-                input[i][currentCol] / input[currentRow][currentCol];
-            for (size_t j = currentCol; j < input[i].size(); ++j) {
-                input[i][j] -= multiple * input[currentRow][j];
+    }
+}
+
+// Eliminates the entry of vec in the pivot column of row without introducing
+// fractions
+static void eliminate(mpz_class *vec, const mpz_class *row, size_t pivot,
+                      size_t size) {
+    mpz_class rowFactor = row[pivot];
+    mpz_class vecFactor = vec[pivot];
+    mpz_class divisor = gcd(rowFactor, vecFactor);
+    rowFactor /= divisor;
+    vecFactor /= divisor;
+    for (size_t col = 0; col < size; ++col) {
+        vec[col] *= rowFactor;
+        if (col >= pivot) {
+            vec[col] -= vecFactor * row[col];
+        }
+    }
+    makePrimitive(vec, size);
+}
+
+static auto dotProduct(const mpz_class *a, const mpz_class *b, size_t size)
+    -> mpz_class {
+    mpz_class result = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (a[i] != 0 && b[i] != 0) {
+            result += a[i] * b[i];
+        }
+    }
+    return result;
+}
+
+auto EchelonBasis::insert(vector<mpz_class> newRow) -> bool {
+    if (cols == 0) {
+        cols = newRow.size();
+    }
+    assert(newRow.size() == cols);
+    if (saturated()) {
+        return false;
+    }
+    makePrimitive(newRow.data(), cols);
+    if (nullSpaceCache && orthogonalToNullSpace(newRow)) {
+        return false;
+    }
+    vector<uint64_t> reduced =
+        residues(newRow.data(), cols, modularPrimes()[primeIndex]);
+    Optional<size_t> pivot = reduceModular(reduced);
+    if (!pivot) {
+        // The row is dependent modulo the prime, which almost always means
+        // that it is dependent
+        if (!nullSpaceCache) {
+            nullSpace();
+            if (orthogonalToNullSpace(newRow)) {
+                return false;
             }
         }
-        ++currentRow;
     }
+    rows.insert(rows.end(), std::make_move_iterator(newRow.begin()),
+                std::make_move_iterator(newRow.end()));
+    nullSpaceCache = llvm::None;
+    if (pivot) {
+        insertModular(std::move(reduced), *pivot);
+    } else {
+        rebuildModular();
+    }
+    return true;
+}
+
+auto EchelonBasis::insert(llvm::ArrayRef<int64_t> newRow) -> bool {
+    if (cols == 0) {
+        cols = newRow.size();
+    }
+    assert(newRow.size() == cols);
+    if (saturated()) {
+        return false;
+    }
+    if (nullSpaceCache) {
+        auto orthogonal = smallOrthogonalToNullSpace(newRow);
+        if (orthogonal && *orthogonal) {
+            return false;
+        }
+    }
+    vector<mpz_class> row;
+    row.reserve(cols);
+    for (int64_t entry : newRow) {
+        row.emplace_back(static_cast<long>(entry));
+    }
+    return insert(std::move(row));
 }
 
-// Checks if newVector is linearly indepentent of vectors. vectors has to be in
-// reduced row echelon form
-bool linearlyIndependent(const Matrix<mpq_class> &vectors,
-                         vector<mpq_class> newVector) {
-    if (vectors.empty()) {
-        return true;
+auto EchelonBasis::reduceModular(vector<uint64_t> &vec) const
+    -> Optional<size_t> {
+    const uint64_t prime = modularPrimes()[primeIndex];
+    for (size_t i : order) {
+        if (vec[pivots[i]] != 0) {
+            subtractModular(vec.data(), &echelon[i * cols], vec[pivots[i]],
+                            pivots[i], cols, prime);
+        }
     }
-    assert(newVector.size() == vectors[0].size());
-    size_t col = 0;
-    for (size_t row = 0; row < vectors.size(); ++row) {
-        // We don’t allow zero rows so we don’t need a bounds check here
-        while (vectors[row][col] == 0) {
-            if (newVector[col] != 0) {
-                return true;
-            } else {
-                ++col;
+    for (size_t col = 0; col < cols; ++col) {
+        if (vec[col] != 0) {
+            return col;
+        }
+    }
+    return llvm::None;
+}
+
+void EchelonBasis::insertModular(vector<uint64_t> vec, size_t pivot) {
+    const uint64_t prime = modularPrimes()[primeIndex];
+    const uint64_t inverse = inverseMod(vec[pivot], prime);
+    for (size_t col = pivot; col < cols; ++col) {
+        vec[col] = vec[col] * inverse % prime;
+    }
+    auto orderIt =
+        std::find_if(order.begin(), order.end(),
+                     [&](size_t i) { return pivots[i] > pivot; });
+    order.insert(orderIt, pivots.size());
+    pivots.push_back(pivot);
+    echelon.insert(echelon.end(), vec.begin(), vec.end());
+}
+
+// Switches to the next prime for which the rows stay independent
+void EchelonBasis::rebuildModular() {
+    const size_t rowCount = rows.size() / cols;
+    do {
+        ++primeIndex;
+        assert(primeIndex < modularPrimes().size());
+        echelon.clear();
+        pivots.clear();
+        order.clear();
+        for (size_t i = 0; i < rowCount; ++i) {
+            vector<uint64_t> reduced =
+                residues(row(i), cols, modularPrimes()[primeIndex]);
+            Optional<size_t> pivot = reduceModular(reduced);
+            if (!pivot) {
+                break;
             }
+            insertModular(std::move(reduced), *pivot);
         }
-        assert(col < vectors[row].size());
-        assert(vectors[row][col] != 0);
-        mpq_class multiple = newVector[col] / vectors[row][col];
-        for (size_t newVecCol = col; newVecCol < newVector.size();
-             ++newVecCol) {
-            newVector[newVecCol] -= multiple * vectors[row][newVecCol];
+    } while (pivots.size() < rowCount);
+}
+
+auto EchelonBasis::nullSpace() const -> const Matrix<mpz_class> & {
+    if (!nullSpaceCache) {
+        NullSpace result;
+        result.vectors = computeNullSpace();
+        result.small = true;
+        for (const auto &vec : result.vectors) {
+            for (const auto &entry : vec) {
+                result.small = result.small && entry.fits_slong_p();
+                result.smallVectors.push_back(entry.get_si());
+            }
+        }
+        if (!result.small) {
+            result.smallVectors.clear();
         }
-        assert(newVector[col] == 0);
-        ++col;
+        nullSpaceCache = std::move(result);
+    }
+    return nullSpaceCache->vectors;
+}
+
+// A row lies in the span of the basis iff it is orthogonal to the null space
+auto EchelonBasis::orthogonalToNullSpace(const vector<mpz_class> &vec) const
+    -> bool {
+    vector<int64_t> smallVec;
+    for (const auto &entry : vec) {
+        if (!entry.fits_slong_p()) {
+            break;
+        }
+        smallVec.push_back(entry.get_si());
+    }
+    if (smallVec.size() == vec.size()) {
+        if (auto orthogonal = smallOrthogonalToNullSpace(smallVec)) {
+            return *orthogonal;
+        }
+    }
+    for (const auto &nullVec : nullSpaceCache->vectors) {
+        if (dotProduct(vec.data(), nullVec.data(), cols) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// None if the null space is not small or one of the dot products overflows
+auto EchelonBasis::smallOrthogonalToNullSpace(
+    llvm::ArrayRef<int64_t> vec) const -> Optional<bool> {
+    const auto &nullSpace = *nullSpaceCache;
+    if (!nullSpace.small) {
+        return llvm::None;
     }
-    for (const auto &i : newVector) {
-        if (i != 0) {
-            return true;
+    for (size_t i = 0; i < nullSpace.vectors.size(); ++i) {
+        const int64_t *nullVec = &nullSpace.smallVectors[i * cols];
+        int64_t sum = 0;
+        for (size_t j = 0; j < cols; ++j) {
+            int64_t product;
+            if (__builtin_mul_overflow(vec[j], nullVec[j], &product) ||
+                __builtin_add_overflow(sum, product, &sum)) {
+                return llvm::None;
+            }
+        }
+        if (sum != 0) {
+            return false;
         }
     }
-    return false;
+    return true;
 }
 
-vector<mpq_class> multiplyRow(vector<mpq_class> vec, mpq_class c) {
-    for (auto &entry : vec) {
-        entry *= c;
+// The null space vector for the non pivot column free, given the entries of
+// the reduced row echelon form in that column
+static auto nullVector(const vector<size_t> &pivots, size_t free, size_t cols,
+                       const vector<mpq_class> &entries) -> vector<mpz_class> {
+    mpz_class denominator = 1;
+    for (const auto &entry : entries) {
+        denominator = lcm(denominator, entry.get_den());
     }
+    vector<mpz_class> vec(cols, 0);
+    vec[free] = -denominator;
+    for (size_t i = 0; i < pivots.size(); ++i) {
+        vec[pivots[i]] =
+            entries[i].get_num() * (denominator / entries[i].get_den());
+    }
+    makePrimitive(vec.data(), cols);
     return vec;
 }
 
-vector<vector<mpq_class>> nullSpace(const Matrix<mpq_class> &m) {
-    if (m.empty()) {
-        // Not sure if this is correct mathematically but it’s the sensible
-        // thing to do here
+static auto freeColumns(const vector<size_t> &pivots, size_t cols)
+    -> vector<size_t> {
+    vector<size_t> result;
+    for (size_t col = 0, next = 0; col < cols; ++col) {
+        if (next < pivots.size() && pivots[next] == col) {
+            ++next;
+        } else {
+            result.push_back(col);
+        }
+    }
+    return result;
+}
+
+auto EchelonBasis::computeNullSpace() const -> Matrix<mpz_class> {
+    if (rank() == cols) {
         return {};
     }
-    assert(m.at(0).size() >= m.size());
-    Matrix<mpq_class> rowEchelon = m;
-    reducedRowEchelonForm(rowEchelon);
-    for (size_t row = 0; row < rowEchelon.size(); ++row) {
-        size_t col = 0;
-        while (rowEchelon.at(row).at(col) == 0) {
-            col++;
-        }
-        if (col < rowEchelon.at(row).size()) {
-            rowEchelon.at(row) =
-                multiplyRow(rowEchelon.at(row), 1 / rowEchelon.at(row).at(col));
-            for (size_t i = 0; i < row; ++i) {
-                mpq_class multiple = rowEchelon.at(i).at(col);
-                for (size_t j = col; j < rowEchelon.at(i).size(); ++j) {
-                    rowEchelon.at(i).at(j) -=
-                        multiple * rowEchelon.at(row).at(j);
-                }
+    if (auto modular = modularNullSpace()) {
+        return *modular;
+    }
+    return exactNullSpace();
+}
+
+// Fraction free Gauss-Jordan elimination on a copy of the rows
+auto EchelonBasis::exactNullSpace() const -> Matrix<mpz_class> {
+    const size_t rowCount = rank();
+    vector<mpz_class> reduced(rows);
+    vector<size_t> sortedPivots;
+    for (size_t col = 0; col < cols && sortedPivots.size() < rowCount;
+         ++col) {
+        const size_t current = sortedPivots.size();
+        size_t nonZeroRow = current;
+        while (nonZeroRow < rowCount && reduced[nonZeroRow * cols + col] == 0) {
+            ++nonZeroRow;
+        }
+        if (nonZeroRow == rowCount) {
+            continue;
+        }
+        std::swap_ranges(&reduced[nonZeroRow * cols],
+                         &reduced[(nonZeroRow + 1) * cols],
+                         &reduced[current * cols]);
+        for (size_t i = 0; i < rowCount; ++i) {
+            if (i != current && reduced[i * cols + col] != 0) {
+                eliminate(&reduced[i * cols], &reduced[current * cols], col,
+                          cols);
             }
         }
+        sortedPivots.push_back(col);
     }
-    vector<mpq_class> zero(m.at(0).size());
-    Matrix<mpq_class> full(zero.size(), zero);
-    for (const auto &row : rowEchelon) {
-        // Find first non zero entry
-        size_t i = 0;
-        while (row.at(i) == 0) {
-            ++i;
-        }
-        if (i != full.size()) {
-            full.at(i) = row;
+    Matrix<mpz_class> result;
+    for (size_t col : freeColumns(sortedPivots, cols)) {
+        vector<mpq_class> entries;
+        for (size_t i = 0; i < rowCount; ++i) {
+            entries.emplace_back(reduced[i * cols + col],
+                                 reduced[i * cols + sortedPivots[i]]);
+            entries.back().canonicalize();
         }
+        result.push_back(nullVector(sortedPivots, col, cols, entries));
     }
-    vector<vector<mpq_class>> nullSpaceBasis;
-    for (size_t i = 0; i < full.size(); ++i) {
-        if (full.at(i).at(i) == 0) {
-            vector<mpq_class> basisVector(full.size(), 0);
-            for (size_t k = 0; k < i; ++k) {
-                basisVector.at(k) = full.at(k).at(i);
+    return result;
+}
+
+// Computes the reduced row echelon form modulo the prime. Returns the columns
+// of the leading entries.
+static auto modularReducedRowEchelonForm(vector<uint64_t> &matrix,
+                                         size_t rowCount, size_t cols,
+                                         uint64_t prime) -> vector<size_t> {
+    vector<size_t> pivots;
+    for (size_t col = 0; col < cols && pivots.size() < rowCount; ++col) {
+        const size_t current = pivots.size();
+        size_t nonZeroRow = current;
+        while (nonZeroRow < rowCount && matrix[nonZeroRow * cols + col] == 0) {
+            ++nonZeroRow;
+        }
+        if (nonZeroRow == rowCount) {
+            continue;
+        }
+        std::swap_ranges(&matrix[nonZeroRow * cols],
+                         &matrix[(nonZeroRow + 1) * cols],
+                         &matrix[current * cols]);
+        uint64_t *pivotRow = &matrix[current * cols];
+        const uint64_t inverse = inverseMod(pivotRow[col], prime);
+        for (size_t j = col; j < cols; ++j) {
+            pivotRow[j] = pivotRow[j] * inverse % prime;
+        }
+        for (size_t i = 0; i < rowCount; ++i) {
+            uint64_t *vec = &matrix[i * cols];
+            if (i != current && vec[col] != 0) {
+                subtractModular(vec, pivotRow, vec[col], col, cols, prime);
             }
-            basisVector.at(i) = -1;
-            nullSpaceBasis.push_back(basisVector);
         }
+        pivots.push_back(col);
     }
-    return nullSpaceBasis;
+    return pivots;
 }
 
-vector<mpz_class> ratToInt(vector<mpq_class> vec) {
-    mpz_class leastCommonMultiple = vec.at(0).get_den();
-    for (size_t i = 1; i < vec.size(); ++i) {
-        leastCommonMultiple = lcm(leastCommonMultiple, vec.at(i).get_den());
-    }
-    vector<mpz_class> output(vec.size());
-    for (size_t i = 0; i < vec.size(); ++i) {
-        output.at(i) =
-            vec.at(i).get_num() * (leastCommonMultiple / vec.at(i).get_den());
+// Finds a fraction n/d with |n|, d <= sqrt(modulus/2) that is congruent to val
+static auto reconstructRational(const mpz_class &val, const mpz_class &modulus,
+                                mpq_class &result) -> bool {
+    mpz_class bound = sqrt(modulus / 2);
+    mpz_class r0 = modulus, r1 = val;
+    mpz_class s0 = 0, s1 = 1;
+    while (r1 > bound) {
+        mpz_class quotient = r0 / r1;
+        r0 -= quotient * r1;
+        std::swap(r0, r1);
+        s0 -= quotient * s1;
+        std::swap(s0, s1);
     }
-    mpz_class greatestCommonDivisor = output.at(0);
-    for (size_t i = 1; i < output.size(); ++i) {
-        greatestCommonDivisor = gcd(greatestCommonDivisor, output.at(i));
+    if (s1 == 0 || abs(s1) > bound) {
+        return false;
     }
-    for (auto &entry : output) {
-        entry /= greatestCommonDivisor;
+    result = mpq_class(r1, s1);
+    result.canonicalize();
+    return true;
+}
+
+// Computes the reduced row echelon form modulo several primes, combines the
+// results using the chinese remainder theorem and reconstructs the rational
+// entries. Once the reconstruction is stable, the null space is checked
+// against the rows so the result is never wrong.
+auto EchelonBasis::modularNullSpace() const -> Optional<Matrix<mpz_class>> {
+    const size_t rowCount = rank();
+    vector<size_t> pivotCols;
+    vector<size_t> freeCols;
+    // The entries of the pivot rows in the non pivot columns
+    vector<mpz_class> combined;
+    mpz_class modulus = 1;
+    vector<mpq_class> previous;
+    for (uint64_t prime : modularPrimes()) {
+        vector<uint64_t> reduced = residues(rows.data(), rows.size(), prime);
+        vector<size_t> primePivots =
+            modularReducedRowEchelonForm(reduced, rowCount, cols, prime);
+        // For unlucky primes the rank drops or the pivots move to the right
+        if (primePivots.size() < rowCount) {
+            continue;
+        }
+        if (modulus == 1 || primePivots < pivotCols) {
+            pivotCols = primePivots;
+            freeCols = freeColumns(pivotCols, cols);
+            combined.assign(rowCount * freeCols.size(), 0);
+            modulus = 1;
+            previous.clear();
+        } else if (primePivots != pivotCols) {
+            continue;
+        }
+        const uint64_t modulusInverse =
+            inverseMod(mpz_fdiv_ui(modulus.get_mpz_t(), prime), prime);
+        for (size_t i = 0; i < rowCount; ++i) {
+            for (size_t j = 0; j < freeCols.size(); ++j) {
+                mpz_class &val = combined[i * freeCols.size() + j];
+                const uint64_t residue = reduced[i * cols + freeCols[j]];
+                const uint64_t difference =
+                    (residue + prime - mpz_fdiv_ui(val.get_mpz_t(), prime)) %
+                    prime;
+                val += modulus * (difference * modulusInverse % prime);
+            }
+        }
+        modulus *= prime;
+        vector<mpq_class> rationals(combined.size());
+        bool reconstructed = true;
+        for (size_t i = 0; i < combined.size() && reconstructed; ++i) {
+            reconstructed =
+                reconstructRational(combined[i], modulus, rationals[i]);
+        }
+        if (!reconstructed || rationals != previous) {
+            previous = std::move(rationals);
+            continue;
+        }
+        Matrix<mpz_class> result;
+        for (size_t j = 0; j < freeCols.size(); ++j) {
+            vector<mpq_class> entries;
+            for (size_t i = 0; i < rowCount; ++i) {
+                entries.push_back(rationals[i * freeCols.size() + j]);
+            }
+            result.push_back(nullVector(pivotCols, freeCols[j], cols, entries));
+        }
+        bool correct = true;
+        for (size_t i = 0; i < rowCount && correct; ++i) {
+            for (const auto &vec : result) {
+                if (dotProduct(row(i), vec.data(), cols) != 0) {
+                    correct = false;
+                    break;
+                }
+            }
+        }
+        if (correct) {
+            return result;
+        }
+        previous = std::move(rationals);
     }
-    return output;
+    return llvm::None;
 }
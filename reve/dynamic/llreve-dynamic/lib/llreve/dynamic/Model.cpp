@@ -13,10 +13,20 @@
 #include "Helper.h"
 
 #include <cassert>
+#include <cctype>
+#include <unordered_map>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::make_shared;
 using std::set;
+using std::shared_ptr;
 using std::map;
 using std::string;
+using std::vector;
 
 TopLevelExpr::~TopLevelExpr() = default;
 SMTExpr::~SMTExpr() = default;
@@ -93,6 +103,10 @@ ArrayVal ITE::getArrayVal() const {
     return acc;
 }
 
+set<string> ArrayLiteral::references() const { return {}; }
+
+ArrayVal ArrayLiteral::getArrayVal() const { return val; }
+
 set<string> Identifier::references() const { return {name}; }
 
 Result::~Result() = default;
@@ -100,3 +114,347 @@ Result::~Result() = default;
 bool Unsat::isSat() const { return false; }
 
 bool Sat::isSat() const { return true; }
+
+namespace {
+// Splits the output of a solver into parentheses and atoms without copying it
+class ModelLexer {
+    llvm::StringRef input;
+    void skipSpace() {
+        while (!input.empty()) {
+            if (std::isspace(static_cast<unsigned char>(input.front()))) {
+                input = input.drop_front();
+            } else if (input.front() == ';') {
+                input = input.drop_front(std::min(input.find('\n'),
+                                                  input.size()));
+            } else {
+                break;
+            }
+        }
+    }
+
+  public:
+    explicit ModelLexer(llvm::StringRef input) : input(input) {}
+    // Empty at the end of the input
+    auto next() -> llvm::StringRef {
+        skipSpace();
+        size_t length = 0;
+        if (input.empty()) {
+            return input;
+        } else if (input.front() == '(' || input.front() == ')') {
+            length = 1;
+        } else if (input.front() == '|' || input.front() == '"') {
+            length = std::min(input.find(input.front(), 1) + 1, input.size());
+        } else {
+            while (length < input.size() &&
+                   !std::isspace(static_cast<unsigned char>(input[length])) &&
+                   input[length] != '(' && input[length] != ')' &&
+                   input[length] != ';') {
+                ++length;
+            }
+        }
+        llvm::StringRef token = input.take_front(length);
+        input = input.drop_front(length);
+        return token;
+    }
+    auto peek() const -> llvm::StringRef { return ModelLexer(*this).next(); }
+    // True if the next tokens are an opening parenthesis and the keyword
+    auto opens(llvm::StringRef keyword) const -> bool {
+        ModelLexer ahead(*this);
+        return ahead.next() == "(" && ahead.next() == keyword;
+    }
+    void expect(llvm::StringRef token) {
+        if (next() != token) {
+            logError("Expected “" + token.str() + "” in the model\n");
+            exit(1);
+        }
+    }
+    // Skips an atom or a whole list
+    void skip() {
+        size_t depth = 0;
+        do {
+            llvm::StringRef token = next();
+            if (token.empty()) {
+                return;
+            }
+            if (token == "(") {
+                ++depth;
+            } else if (token == ")") {
+                if (depth == 0) {
+                    return;
+                }
+                --depth;
+            }
+        } while (depth > 0);
+    }
+};
+}
+
+static mpz_class parseNumeral(llvm::StringRef token) {
+    mpz_class val;
+    if (token.empty() || val.set_str(token.str(), 10) != 0) {
+        logError("Expected a numeral in the model instead of “" +
+                 token.str() + "”\n");
+        exit(1);
+    }
+    return val;
+}
+
+// Booleans are treated as integers so the flags of the model can be read
+// using getVal
+static mpz_class parseScalar(ModelLexer &lexer) {
+    llvm::StringRef token = lexer.next();
+    if (token == "(") {
+        lexer.expect("-");
+        mpz_class val = -parseNumeral(lexer.next());
+        lexer.expect(")");
+        return val;
+    } else if (token == "true") {
+        return 1;
+    } else if (token == "false") {
+        return 0;
+    }
+    return parseNumeral(token);
+}
+
+// Other sorts than Int, Bool and (Array Int Int), e.g. bitvectors in bounded
+// mode, are skipped
+static llvm::Optional<Type> parseSort(ModelLexer &lexer) {
+    if (lexer.peek() != "(") {
+        llvm::StringRef token = lexer.next();
+        if (token == "Int" || token == "Bool") {
+            return Type::Int;
+        }
+        return llvm::None;
+    }
+    ModelLexer sort(lexer);
+    lexer.skip();
+    if (sort.next() == "(" && sort.next() == "Array" && sort.next() == "Int" &&
+        sort.next() == "Int" && sort.next() == ")") {
+        return Type::IntArray;
+    }
+    return llvm::None;
+}
+
+// The index compared to the argument of the function, the argument is the
+// only operand that is not a numeral
+static mpz_class parseCondition(ModelLexer &lexer) {
+    lexer.expect("(");
+    lexer.expect("=");
+    llvm::Optional<mpz_class> index;
+    for (int i = 0; i < 2; ++i) {
+        llvm::StringRef token = lexer.peek();
+        if (token.empty()) {
+            break;
+        }
+        if (token == "(" || token == "true" || token == "false" ||
+            std::isdigit(static_cast<unsigned char>(token.front()))) {
+            index = parseScalar(lexer);
+        } else {
+            lexer.next();
+        }
+    }
+    lexer.expect(")");
+    if (!index) {
+        logError("Unsupported condition in the model\n");
+        exit(1);
+    }
+    return *index;
+}
+
+// Reads the definition of an array or a function with one argument. Entries
+// of outer ites and stores take precedence over inner ones. If the base of
+// the definition refers to another function, its name is returned and the
+// entries have to be added to the array of that function.
+static string parseArray(ModelLexer &lexer, ArrayVal &array) {
+    bool lambda = lexer.opens("lambda");
+    if (lambda) {
+        lexer.next();
+        lexer.next();
+        lexer.skip();
+    }
+    size_t ites = 0;
+    while (lexer.opens("ite")) {
+        lexer.next();
+        lexer.next();
+        mpz_class index = parseCondition(lexer);
+        array.vals.insert({index, parseScalar(lexer)});
+        ++ites;
+    }
+    size_t stores = 0;
+    while (lexer.opens("store")) {
+        lexer.next();
+        lexer.next();
+        ++stores;
+    }
+    string reference;
+    if (lexer.opens("_")) {
+        lexer.next();
+        lexer.next();
+        lexer.expect("as-array");
+        reference = lexer.next().trim('|').str();
+        lexer.expect(")");
+    } else if (lexer.opens("(")) {
+        // ((as const (Array Int Int)) background)
+        lexer.next();
+        lexer.next();
+        lexer.expect("as");
+        lexer.expect("const");
+        parseSort(lexer);
+        lexer.expect(")");
+        array.background = parseScalar(lexer);
+        lexer.expect(")");
+    } else {
+        array.background = parseScalar(lexer);
+    }
+    map<mpz_class, mpz_class> stored;
+    for (size_t i = 0; i < stores; ++i) {
+        mpz_class index = parseScalar(lexer);
+        stored[index] = parseScalar(lexer);
+        lexer.expect(")");
+    }
+    array.vals.insert(stored.begin(), stored.end());
+    for (size_t i = 0; i < ites; ++i) {
+        lexer.expect(")");
+    }
+    if (lambda) {
+        lexer.expect(")");
+    }
+    return reference;
+}
+
+// Skips errors and other output before the result and returns the result
+static llvm::StringRef skipToResult(ModelLexer &lexer) {
+    while (true) {
+        llvm::StringRef token = lexer.peek();
+        lexer.skip();
+        if (token.empty() || token == "sat" || token == "unsat" ||
+            token == "unknown" || token == "timeout") {
+            return token;
+        }
+    }
+}
+
+llvm::StringRef resultToken(llvm::StringRef output) {
+    ModelLexer lexer(output);
+    return skipToResult(lexer);
+}
+
+std::shared_ptr<Result> parseResult(llvm::StringRef output) {
+    ModelLexer lexer(output);
+    llvm::StringRef token = skipToResult(lexer);
+    if (token == "unsat") {
+        return make_shared<Unsat>();
+    }
+    if (token != "sat") {
+        return nullptr;
+    }
+    // The model is only printed if it has been requested
+    if (!lexer.opens("model") && !lexer.opens("(") && !lexer.opens(")")) {
+        return make_shared<Sat>(Model({}));
+    }
+    lexer.expect("(");
+    if (lexer.peek() == "model") {
+        lexer.next();
+    }
+    vector<shared_ptr<DefineFun>> definitions;
+    std::unordered_map<string, size_t> definitionIndices;
+    // Definitions whose base refers to another function
+    vector<std::pair<size_t, string>> references;
+    while (lexer.peek() == "(") {
+        if (!lexer.opens("define-fun")) {
+            lexer.skip();
+            continue;
+        }
+        lexer.next();
+        lexer.next();
+        string name = lexer.next().trim('|').str();
+        vector<TypedArg> argTypes;
+        bool supported = true;
+        lexer.expect("(");
+        while (lexer.peek() == "(") {
+            lexer.next();
+            string argName = lexer.next().trim('|').str();
+            const auto sort = parseSort(lexer);
+            supported = supported && sort.hasValue();
+            argTypes.push_back({argName, sort.getValueOr(Type::Int)});
+            lexer.expect(")");
+        }
+        lexer.expect(")");
+        const auto sort = parseSort(lexer);
+        // Only functions of a single argument describe arrays
+        if (!supported || !sort || argTypes.size() > 1) {
+            lexer.skip();
+            lexer.expect(")");
+            continue;
+        }
+        const Type returnType = *sort;
+        shared_ptr<SMTExpr> definition;
+        if (returnType == Type::IntArray || !argTypes.empty()) {
+            ArrayVal array;
+            string reference = parseArray(lexer, array);
+            if (!reference.empty()) {
+                references.push_back({definitions.size(), reference});
+            }
+            definition = make_shared<ArrayLiteral>(std::move(array));
+        } else {
+            definition = make_shared<Int>(parseScalar(lexer));
+        }
+        lexer.expect(")");
+        definitionIndices.insert({name, definitions.size()});
+        definitions.push_back(make_shared<DefineFun>(
+            name, std::move(argTypes), returnType, definition));
+    }
+    lexer.expect(")");
+    // The functions referred to by as-array are defined by ite chains, so
+    // they are complete at this point
+    for (const auto &reference : references) {
+        auto it = definitionIndices.find(reference.second);
+        if (it == definitionIndices.end()) {
+            logError("Undefined array “" + reference.second +
+                     "” in the model\n");
+            exit(1);
+        }
+        auto &literal = static_cast<ArrayLiteral &>(
+            *definitions[reference.first]->definition);
+        ArrayVal array = definitions[it->second]->getArrayVal();
+        for (const auto &entry : literal.val.vals) {
+            array.vals[entry.first] = entry.second;
+        }
+        literal.val = std::move(array);
+    }
+    return make_shared<Sat>(Model(vector<shared_ptr<TopLevelExpr>>(
+        definitions.begin(), definitions.end())));
+}
+
+std::shared_ptr<Result> parseResult(FILE *stream) {
+    string output;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), stream)) > 0) {
+        output.append(buffer, read);
+    }
+    return parseResult(llvm::StringRef(output));
+}
+
+std::shared_ptr<Result> parseResultFile(const std::string &path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logError("Couldn’t open the solver output " + path + "\n");
+        exit(1);
+    }
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = static_cast<size_t>(s.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        logError("Couldn’t map the solver output " + path + "\n");
+        exit(1);
+    }
+    auto result = parseResult(llvm::StringRef(static_cast<char *>(data), size));
+    munmap(data, size);
+    return result;
+}
@@ -2,6 +2,11 @@
 
 #include "llreve/dynamic/Util.h"
 
+#include "llvm/ADT/StringMap.h"
+
+#include <algorithm>
+
+using std::map;
 using std::vector;
 using std::string;
 
@@ -11,147 +16,232 @@ using smt::SortedVar;
 namespace llreve {
 namespace dynamic {
 
-static mpz_class evalTerm(const std::vector<std::string> &term,
-                          const VarMap<string> &variables) {
-    mpz_class termVal = 1;
-    for (const auto &var : term) {
-        termVal *= variables.find(var)->second.asUnbounded();
+MonomialPlan::MonomialPlan(const vector<SortedVar> &variables,
+                           size_t degree)
+    : variableCount(variables.size()) {
+    llvm::StringMap<unsigned> indices;
+    for (size_t i = 0; i < variables.size(); ++i) {
+        indices.insert({variables[i].name, static_cast<unsigned>(i)});
+    }
+    // The terms of the previous degree by their sorted variables
+    map<vector<unsigned>, unsigned> previousTerms;
+    for (size_t i = 1; i <= degree; ++i) {
+        map<vector<unsigned>, unsigned> currentTerms;
+        for (const auto &term : polynomialTermsOfDegree(variables, i)) {
+            vector<unsigned> vars;
+            for (const auto &var : term) {
+                vars.push_back(indices.lookup(var));
+            }
+            unsigned variable = vars.back();
+            vars.pop_back();
+            std::sort(vars.begin(), vars.end());
+            unsigned factor =
+                vars.empty() ? NoFactor : previousTerms.at(vars);
+            vars.push_back(variable);
+            std::sort(vars.begin(), vars.end());
+            currentTerms.insert({vars, static_cast<unsigned>(terms.size())});
+            terms.push_back({factor, variable});
+        }
+        previousTerms = std::move(currentTerms);
     }
-    return termVal;
 }
 
-static vector<mpq_class>
-createEquation(const vector<SortedVar> &primitiveVariables,
-               const VarMap<string> &variables, unsigned maxDegree) {
-    vector<mpq_class> equation;
-    for (size_t i = 1; i <= maxDegree; ++i) {
-        auto polynomialTerms = polynomialTermsOfDegree(primitiveVariables, i);
-        for (const auto &term : polynomialTerms) {
-            equation.push_back(evalTerm(term, variables));
+void MonomialPlan::evaluate(llvm::ArrayRef<Integer> values, size_t samples,
+                            vector<int64_t> &block, vector<bool> &fits) const {
+    assert(values.size() == samples * variableCount);
+    // Terms are evaluated one at a time for all samples, so the values are
+    // stored by variable and the terms by column
+    vector<int64_t> inputs(variableCount * samples);
+    vector<uint8_t> overflow(samples, false);
+    for (size_t s = 0; s < samples; ++s) {
+        for (size_t var = 0; var < variableCount; ++var) {
+            overflow[s] |= !values[s * variableCount + var].asSmall(
+                inputs[var * samples + s]);
+        }
+    }
+    vector<int64_t> termValues(terms.size() * samples);
+    for (size_t t = 0; t < terms.size(); ++t) {
+        const Term &term = terms[t];
+        const int64_t *variable = &inputs[term.variable * samples];
+        int64_t *result = &termValues[t * samples];
+        if (term.factor == NoFactor) {
+            std::copy(variable, variable + samples, result);
+            continue;
+        }
+        const int64_t *factor = &termValues[term.factor * samples];
+        for (size_t s = 0; s < samples; ++s) {
+            overflow[s] |=
+                __builtin_mul_overflow(factor[s], variable[s], &result[s]);
+        }
+    }
+    const size_t cols = columns();
+    block.resize(samples * cols);
+    fits.resize(samples);
+    for (size_t s = 0; s < samples; ++s) {
+        for (size_t t = 0; t < terms.size(); ++t) {
+            block[s * cols + t] = termValues[t * samples + s];
         }
+        // this represents the constant
+        block[s * cols + terms.size()] = 1;
+        fits[s] = !overflow[s];
     }
-    // this represents the constant
-    equation.push_back(1);
-    return equation;
 }
 
-static void insertInStringMap(const FastVarMap &variables,
-                              VarMap<string> &stringVariables) {
-    for (const auto &varIt : variables) {
-        stringVariables.insert({varIt.first->getName(), varIt.second});
+auto MonomialPlan::evaluateExact(llvm::ArrayRef<Integer> values) const
+    -> vector<mpz_class> {
+    assert(values.size() == variableCount);
+    vector<mpz_class> row;
+    row.reserve(columns());
+    for (const Term &term : terms) {
+        mpz_class val = values[term.variable].asUnbounded();
+        if (term.factor != NoFactor) {
+            val *= row[term.factor];
+        }
+        row.push_back(std::move(val));
+    }
+    row.push_back(1);
+    return row;
+}
+
+void EquationSampler::sample(
+    EchelonBasis &equations,
+    llvm::function_ref<vector<SortedVar>()> getVariables,
+    llvm::ArrayRef<const Step *> steps, llvm::ArrayRef<Integer> extraValues) {
+    if (equations.saturated()) {
+        return;
+    }
+    auto batchIt = batches.find(&equations);
+    if (batchIt == batches.end()) {
+        // Look up the variables by name once, afterwards the values are
+        // taken directly from the steps
+        const vector<SortedVar> variables = getVariables();
+        llvm::StringMap<const llvm::Value *> values;
+        for (const Step *step : steps) {
+            for (const auto &var : step->state().variables) {
+                values.insert({var.first->getName(), var.first});
+            }
+        }
+        vector<const llvm::Value *> keys;
+        for (size_t i = 0; i + extraValues.size() < variables.size(); ++i) {
+            keys.push_back(values.lookup(variables[i].name));
+        }
+        Batch batch(MonomialPlan(variables, degree), std::move(keys));
+        batchIt = batches.insert({&equations, std::move(batch)}).first;
+    }
+    Batch &batch = batchIt->second;
+    vector<Integer> values;
+    values.reserve(batch.keys.size() + extraValues.size());
+    for (const llvm::Value *key : batch.keys) {
+        const Integer *val = nullptr;
+        for (const Step *step : steps) {
+            val = step->delta->lookup(key);
+            if (val != nullptr) {
+                break;
+            }
+        }
+        assert(val != nullptr);
+        values.push_back(*val);
+    }
+    values.insert(values.end(), extraValues.begin(), extraValues.end());
+    // A repeated sample produces the same row which can’t change the basis
+    if (!batch.seen
+             .insert(llvm::hash_combine_range(values.begin(), values.end()))
+             .second) {
+        return;
+    }
+    batch.values.insert(batch.values.end(), values.begin(), values.end());
+    if (++batch.samples == BlockSize) {
+        flush(equations, batch);
     }
 }
 
-static VarMap<string> getStringVarMap(const FastVarMap &variables) {
-    VarMap<string> stringVariables(variables.size());
-    insertInStringMap(variables, stringVariables);
-    return stringVariables;
+void EquationSampler::flush(EchelonBasis &equations, Batch &batch) {
+    vector<int64_t> block;
+    vector<bool> fits;
+    batch.plan.evaluate(batch.values, batch.samples, block, fits);
+    const size_t cols = batch.plan.columns();
+    const size_t vars = batch.plan.variables();
+    for (size_t s = 0; s < batch.samples && !equations.saturated(); ++s) {
+        if (fits[s]) {
+            equations.insert(
+                llvm::ArrayRef<int64_t>(block).slice(s * cols, cols));
+        } else {
+            equations.insert(batch.plan.evaluateExact(
+                llvm::ArrayRef<Integer>(batch.values).slice(s * vars, vars)));
+        }
+    }
+    batch.values.clear();
+    batch.samples = 0;
+    if (equations.saturated()) {
+        // No further samples are taken for saturated equations
+        batch.seen.clear();
+    }
 }
 
-static VarMap<string> getStringVarMap(const FastVarMap &variables1,
-                                      const FastVarMap &variables2) {
-    VarMap<string> stringVariables(variables1.size() + variables2.size());
-    insertInStringMap(variables1, stringVariables);
-    insertInStringMap(variables2, stringVariables);
-    return stringVariables;
+void EquationSampler::flush() {
+    for (auto &batch : batches) {
+        flush(*batch.first, batch.second);
+    }
+    batches.clear();
 }
 
-void populateEquationsMap(
-    IterativeInvariantMap<PolynomialEquations> &polynomialEquations,
-    const vector<smt::SortedVar> &primitiveVariables,
-    MatchInfo<const llvm::Value *> match, ExitIndex exitIndex, size_t degree) {
-    VarMap<string> variables =
-        getStringVarMap(match.steps.first->state.variables,
-                        match.steps.second->state.variables);
-    vector<mpq_class> equation =
-        createEquation(primitiveVariables, variables, degree);
-    if (polynomialEquations[match.mark].count(exitIndex) == 0) {
-        polynomialEquations.at(match.mark)
-            .insert(make_pair(exitIndex,
-                              LoopInfoData<Matrix<mpq_class>>({}, {}, {})));
-        getDataForLoopInfo(polynomialEquations.at(match.mark).at(exitIndex),
-                           match.loopInfo) = {equation};
-    } else {
-        Matrix<mpq_class> &vecs = getDataForLoopInfo(
-            polynomialEquations.at(match.mark).at(exitIndex), match.loopInfo);
-        if (linearlyIndependent(vecs, equation)) {
-            vecs.push_back(equation);
-            reducedRowEchelonForm(vecs);
-        }
+auto EquationSampler::pending() const -> size_t {
+    size_t samples = 0;
+    for (const auto &batch : batches) {
+        samples += batch.second.samples;
     }
+    return samples;
 }
 
-void populateEquationsMap(
+void EquationSampler::add(
+    IterativeInvariantMap<PolynomialEquations> &equationsMap,
+    const vector<SortedVar> &primitiveVariables,
+    MatchInfo<const llvm::Value *> match, ExitIndex exitIndex) {
+    EchelonBasis &equations = getDataForLoopInfo(
+        equationsMap[match.mark][exitIndex], match.loopInfo);
+    const Step *steps[] = {match.steps.first, match.steps.second};
+    sample(equations, [&] { return primitiveVariables; }, steps, {});
+}
+
+void EquationSampler::add(
     RelationalFunctionInvariantMap<
-        LoopInfoData<FunctionInvariant<Matrix<mpq_class>>>> &equationsMap,
+        LoopInfoData<FunctionInvariant<EchelonBasis>>> &equationsMap,
     const vector<SortedVar> &primitiveVariables,
-    CoupledCallInfo<const llvm::Value *> match, size_t degree) {
-    auto &polynomialEquations = equationsMap[match.functions];
-    VarMap<string> variables =
-        getStringVarMap(match.steps.first->state.variables,
-                        match.steps.second->state.variables);
-    variables.insert({resultName(Program::First), match.returnValues.first});
-    variables.insert({resultName(Program::Second), match.returnValues.second});
-    vector<smt::SortedVar> preVariables = primitiveVariables;
-    vector<smt::SortedVar> postVariables = preVariables;
-    postVariables.emplace_back(resultName(Program::First), int64Type());
-    postVariables.emplace_back(resultName(Program::Second), int64Type());
-    vector<mpq_class> preEquation =
-        createEquation(preVariables, variables, degree);
-    vector<mpq_class> postEquation =
-        createEquation(postVariables, variables, degree);
-    if (polynomialEquations.count(match.mark) == 0) {
-        polynomialEquations.insert(
-            {match.mark, {{{}, {}}, {{}, {}}, {{}, {}}}});
-        getDataForLoopInfo(polynomialEquations.at(match.mark),
-                           match.loopInfo) = {{preEquation}, {postEquation}};
-    } else {
-        auto &vecsRef = getDataForLoopInfo(polynomialEquations.at(match.mark),
-                                           match.loopInfo);
-        auto &preVecs = vecsRef.preCondition;
-        auto &postVecs = vecsRef.postCondition;
-        if (linearlyIndependent(preVecs, preEquation)) {
-            preVecs.push_back(preEquation);
-            reducedRowEchelonForm(preVecs);
-        }
-        if (linearlyIndependent(postVecs, postEquation)) {
-            postVecs.push_back(postEquation);
-            reducedRowEchelonForm(postVecs);
-        }
-    }
+    CoupledCallInfo<const llvm::Value *> match) {
+    auto &equations = getDataForLoopInfo(
+        equationsMap[match.functions][match.mark], match.loopInfo);
+    const Step *steps[] = {match.steps.first, match.steps.second};
+    const Integer returnValues[] = {match.returnValues.first,
+                                    match.returnValues.second};
+    sample(equations.preCondition, [&] { return primitiveVariables; }, steps,
+           {});
+    sample(equations.postCondition,
+           [&] {
+               vector<SortedVar> postVariables = primitiveVariables;
+               postVariables.emplace_back(resultName(Program::First),
+                                          int64Type());
+               postVariables.emplace_back(resultName(Program::Second),
+                                          int64Type());
+               return postVariables;
+           },
+           steps, returnValues);
 }
 
-void populateEquationsMap(FunctionInvariantMap<Matrix<mpq_class>> &equationsMap,
+void EquationSampler::add(FunctionInvariantMap<EchelonBasis> &equationsMap,
                           const vector<SortedVar> &primitiveVariables,
-                          UncoupledCallInfo<const llvm::Value *> match,
-                          size_t degree) {
-    auto &polynomialEquations = equationsMap[match.function];
-    VarMap<string> variables = getStringVarMap(match.step->state.variables);
-    variables.insert({resultName(match.prog), match.returnValue});
-    vector<smt::SortedVar> preVariables = primitiveVariables;
-    vector<smt::SortedVar> postVariables = preVariables;
-    postVariables.emplace_back(resultName(match.prog), int64Type());
-    vector<mpq_class> preEquation =
-        createEquation(preVariables, variables, degree);
-    vector<mpq_class> postEquation =
-        createEquation(postVariables, variables, degree);
-    auto polynomialEquationsIt = polynomialEquations.find(match.mark);
-    if (polynomialEquationsIt == polynomialEquations.end()) {
-        polynomialEquations.insert(
-            {match.mark, {{preEquation}, {postEquation}}});
-    } else {
-        auto &equationsForMark = polynomialEquationsIt->second;
-        auto &preVecs = equationsForMark.preCondition;
-        auto &postVecs = equationsForMark.postCondition;
-        if (linearlyIndependent(preVecs, preEquation)) {
-            preVecs.push_back(preEquation);
-            reducedRowEchelonForm(preVecs);
-        }
-        if (linearlyIndependent(postVecs, postEquation)) {
-            postVecs.push_back(postEquation);
-            reducedRowEchelonForm(postVecs);
-        }
-    }
+                          UncoupledCallInfo<const llvm::Value *> match) {
+    auto &equations = equationsMap[match.function][match.mark];
+    const Step *steps[] = {match.step};
+    sample(equations.preCondition, [&] { return primitiveVariables; }, steps,
+           {});
+    sample(equations.postCondition,
+           [&] {
+               vector<SortedVar> postVariables = primitiveVariables;
+               postVariables.emplace_back(resultName(match.prog),
+                                          int64Type());
+               return postVariables;
+           },
+           steps, match.returnValue);
 }
 }
 }
@@ -10,11 +10,16 @@
 
 #include "llreve/dynamic/SerializeTraces.h"
 
+#include "llreve/dynamic/Analysis.h"
 #include "llreve/dynamic/Interpreter.h"
 #include "llreve/dynamic/ThreadSafeQueue.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <random>
 #include <thread>
 
 using std::vector;
@@ -23,6 +28,14 @@ using std::make_shared;
 using std::map;
 
 using llvm::Function;
+using llvm::Optional;
+
+using llreve::dynamic::FastCall;
+using llreve::dynamic::FastVarMap;
+using llreve::dynamic::FrameLayouts;
+using llreve::dynamic::Heap;
+using llreve::dynamic::getVarMap;
+using llreve::dynamic::randomHeap;
 
 Range::RangeIterator Range::begin() {
     vector<mpz_class> vals(n);
@@ -68,3 +81,190 @@ Range::RangeIterator &Range::RangeIterator::operator++() {
     }
     return *this;
 }
+
+namespace {
+struct TraceResult {
+    int counter;
+    MonoPair<FastCall> calls;
+    TraceResult(int counter, MonoPair<FastCall> calls)
+        : counter(counter), calls(std::move(calls)) {}
+};
+} // namespace
+
+static unsigned workerCount(const TraceGenerationOpts &opts) {
+    if (opts.Threads == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return opts.Threads;
+}
+
+// Produces the items on a separate thread and passes their inputs to process
+// on a pool of workers. finished is called by the last worker, whileRunning
+// runs on the calling thread while the items are processed.
+static void processItems(MonoPair<const Function *> funs,
+                         std::function<Optional<WorkItem>()> produce,
+                         TraceGenerationOpts opts, InputCallback process,
+                         std::function<void()> finished,
+                         std::function<void()> whileRunning) {
+    const unsigned threads = workerCount(opts);
+    BoundedMPMCQueue<WorkItem> work(opts.QueueSize);
+
+    std::thread producer([&]() {
+        for (int counter = 0;; ++counter) {
+            Optional<WorkItem> item = produce();
+            if (!item.hasValue()) {
+                break;
+            }
+            item->counter = counter;
+            work.push(std::move(*item));
+        }
+        work.close();
+    });
+
+    std::atomic<unsigned> runningWorkers(threads);
+    auto worker = [&]() {
+        // Layouts are cached per worker since the cache is not thread safe
+        FrameLayouts layouts;
+        while (Optional<WorkItem> item = work.pop()) {
+            MonoPair<FastVarMap> variables = {
+                getVarMap(funs.first, item->vals.first),
+                getVarMap(funs.second, item->vals.second)};
+            MonoPair<Heap> heaps = item->heaps;
+            if (!item->heapSet) {
+                unsigned int heapSeed =
+                    opts.Seed + static_cast<unsigned>(item->counter);
+                Heap heap(randomHeap(*funs.first, variables.first, 5, -20, 20,
+                                     &heapSeed),
+                          Integer(mpz_class(0)));
+                heaps = {heap, heap};
+            }
+            process(TraceInputs(item->counter, std::move(variables),
+                                std::move(heaps)),
+                    layouts);
+        }
+        if (--runningWorkers == 0) {
+            finished();
+        }
+    };
+    vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    whileRunning();
+    producer.join();
+    for (auto &thread : workers) {
+        thread.join();
+    }
+}
+
+void generateTraces(MonoPair<const Function *> funs,
+                    std::function<Optional<WorkItem>()> produce,
+                    const AnalysisResultsMap &analysisResults,
+                    TraceGenerationOpts opts, TraceCallback callback) {
+    BoundedMPMCQueue<TraceResult> results(opts.QueueSize);
+    // Traces can arrive out of order and are buffered until all preceding
+    // traces have been passed to the callback. A slow trace would otherwise
+    // keep all later ones in memory, so the producer waits while the window
+    // of traces that have not been passed to the callback is full.
+    const int window = 4 * static_cast<int>(workerCount(opts));
+    std::mutex windowMutex;
+    std::condition_variable windowMoved;
+    int produced = 0;
+    int next = 0;
+    auto produceInWindow = [&]() -> Optional<WorkItem> {
+        {
+            std::unique_lock<std::mutex> lock(windowMutex);
+            windowMoved.wait(lock,
+                             [&]() { return produced - next < window; });
+        }
+        Optional<WorkItem> item = produce();
+        if (item.hasValue()) {
+            std::lock_guard<std::mutex> lock(windowMutex);
+            ++produced;
+        }
+        return item;
+    };
+    processItems(
+        funs, produceInWindow, opts,
+        [&](TraceInputs inputs, FrameLayouts &layouts) {
+            results.push(TraceResult(
+                inputs.counter,
+                interpretFunctionPair(funs, std::move(inputs.variables),
+                                      std::move(inputs.heaps), opts.MaxSteps,
+                                      analysisResults, layouts)));
+        },
+        [&]() { results.close(); },
+        [&]() {
+            map<int, MonoPair<FastCall>> pending;
+            int delivered = 0;
+            while (Optional<TraceResult> result = results.pop()) {
+                pending.insert(
+                    std::make_pair(result->counter, std::move(result->calls)));
+                for (auto it = pending.find(delivered); it != pending.end();
+                     it = pending.find(delivered)) {
+                    callback(std::move(it->second));
+                    pending.erase(it);
+                    ++delivered;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(windowMutex);
+                    next = delivered;
+                }
+                windowMoved.notify_one();
+            }
+        });
+}
+
+void generateTraces(MonoPair<const Function *> funs, Range range,
+                    const AnalysisResultsMap &analysisResults,
+                    TraceGenerationOpts opts, TraceCallback callback) {
+    auto it = range.begin();
+    const auto end = range.end();
+    generateTraces(funs,
+                   [&]() -> Optional<WorkItem> {
+                       if (it == end) {
+                           return llvm::None;
+                       }
+                       WorkItem item({*it, *it}, 0);
+                       ++it;
+                       return item;
+                   },
+                   analysisResults, opts, callback);
+}
+
+// Sample i is generated from Seed + i
+static std::function<Optional<WorkItem>()>
+randomItems(MonoPair<const Function *> funs, unsigned count, int lowerBound,
+            int upperBound, unsigned seed) {
+    assert(funs.first->arg_size() == funs.second->arg_size());
+    return [=, sample = 0u]() mutable -> Optional<WorkItem> {
+        if (sample == count) {
+            return llvm::None;
+        }
+        std::mt19937 gen(seed + sample);
+        std::uniform_int_distribution<> distribution(lowerBound, upperBound);
+        vector<mpz_class> vals(funs.first->arg_size());
+        for (auto &val : vals) {
+            val = mpz_class(distribution(gen));
+        }
+        ++sample;
+        return WorkItem({vals, vals}, 0);
+    };
+}
+
+void generateRandomTraces(MonoPair<const Function *> funs, unsigned count,
+                          int lowerBound, int upperBound,
+                          const AnalysisResultsMap &analysisResults,
+                          TraceGenerationOpts opts, TraceCallback callback) {
+    generateTraces(funs,
+                   randomItems(funs, count, lowerBound, upperBound, opts.Seed),
+                   analysisResults, opts, callback);
+}
+
+void forEachRandomInput(MonoPair<const Function *> funs, unsigned count,
+                        int lowerBound, int upperBound,
+                        TraceGenerationOpts opts, InputCallback callback) {
+    processItems(funs,
+                 randomItems(funs, count, lowerBound, upperBound, opts.Seed),
+                 opts, callback, []() {}, []() {});
+}
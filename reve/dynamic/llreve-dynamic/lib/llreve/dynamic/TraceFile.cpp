@@ -0,0 +1,513 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "llreve/dynamic/TraceFile.h"
+
+#include "Helper.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using llvm::Function;
+using llvm::StringRef;
+using llvm::Value;
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace llreve {
+namespace dynamic {
+
+static const char Magic[] = "LLRVTRC1";
+static const size_t MagicSize = sizeof(Magic) - 1;
+// The offsets of the name table and the index
+static const size_t FooterSize = 16;
+
+// Flags of a block step
+static const uint8_t KeyframeFlag = 1;
+static const uint8_t HeapFlag = 2;
+
+// Tags of integers
+enum class IntegerTag : uint8_t { Small, Positive, Negative, Bounded };
+
+using Delta = StateDelta<const Value *>;
+
+static uint64_t zigzag(int64_t val) {
+    return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+
+static int64_t unzigzag(uint64_t val) {
+    return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+string traceFilePath(const string &dir) { return dir + "/traces.bin"; }
+
+TraceWriter::TraceWriter(const string &dir) : offset(0) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        logError("Couldn’t create trace directory " + dir + ": " +
+                 std::strerror(errno) + "\n");
+        exit(1);
+    }
+    const string path = traceFilePath(dir);
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        logError("Couldn’t open trace file " + path + "\n");
+        exit(1);
+    }
+    buffer.append(Magic, MagicSize);
+}
+
+TraceWriter::~TraceWriter() { close(); }
+
+uint64_t TraceWriter::stringId(StringRef str) {
+    auto it = stringIds.find(str);
+    if (it != stringIds.end()) {
+        return it->second;
+    }
+    uint64_t id = strings.size();
+    stringIds.insert({str, id});
+    strings.push_back(str.str());
+    return id;
+}
+
+void TraceWriter::write(const MonoPair<FastCall> &calls) {
+    uint64_t first = offset + buffer.size();
+    writeCall(calls.first, Program::First);
+    uint64_t second = offset + buffer.size();
+    writeCall(calls.second, Program::Second);
+    index.push_back({first, second});
+    flush();
+}
+
+void TraceWriter::close() {
+    if (file == nullptr) {
+        return;
+    }
+    uint64_t tableOffset = offset + buffer.size();
+    writeVarint(strings.size());
+    for (const auto &str : strings) {
+        writeVarint(str.size());
+        buffer.append(str);
+    }
+    uint64_t indexOffset = offset + buffer.size();
+    writeVarint(index.size());
+    for (const auto &calls : index) {
+        writeVarint(calls.first);
+        writeVarint(calls.second);
+    }
+    writeFixed(tableOffset);
+    writeFixed(indexOffset);
+    flush();
+    if (fclose(file) != 0) {
+        logError("Couldn’t write trace file\n");
+        exit(1);
+    }
+    file = nullptr;
+}
+
+void TraceWriter::flush() {
+    if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+        logError("Couldn’t write trace file\n");
+        exit(1);
+    }
+    offset += buffer.size();
+    buffer.clear();
+}
+
+void TraceWriter::writeCall(const FastCall &call, Program prog) {
+    const FrameLayout &layout = layouts.get(*call.function);
+    writeVarint(stringId(call.function->getName()));
+    buffer.push_back(prog == Program::First ? 0 : 1);
+    writeState(call.entryState, layout);
+    writeState(call.returnState, layout);
+    buffer.push_back(call.earlyExit ? 1 : 0);
+    writeVarint(call.blocksVisited);
+    writeVarint(call.steps.size());
+    const Delta *prevDelta = nullptr;
+    for (const auto &step : call.steps) {
+        const Delta &delta = *step.delta;
+        // Deltas that don’t continue the previous step of this call can’t be
+        // reconstructed from the file so their complete state is written
+        bool keyframe =
+            delta.previous == nullptr || delta.previous.get() != prevDelta;
+        bool heapChanged = keyframe ||
+                           !delta.heap.sharesEntriesWith(prevDelta->heap) ||
+                           delta.heap.background != prevDelta->heap.background;
+        writeVarint(stringId(step.blockName));
+        buffer.push_back(static_cast<char>((keyframe ? KeyframeFlag : 0) |
+                                           (heapChanged ? HeapFlag : 0)));
+        if (keyframe && delta.previous != nullptr) {
+            writeVariables(delta.state().variables, layout);
+        } else {
+            writeVariables(delta.changed, layout);
+        }
+        if (heapChanged) {
+            writeHeap(delta.heap);
+        }
+        writeVarint(step.calls.size());
+        for (const auto &nestedCall : step.calls) {
+            writeCall(nestedCall, prog);
+        }
+        prevDelta = &delta;
+    }
+}
+
+void TraceWriter::writeState(const FastState &state,
+                             const FrameLayout &layout) {
+    writeVariables(state.variables, layout);
+    writeHeap(state.heap);
+}
+
+void TraceWriter::writeVariables(const FastVarMap &variables,
+                                 const FrameLayout &layout) {
+    writeVarint(variables.size());
+    for (const auto &var : variables) {
+        // Slots are shifted by one, zero marks a variable that is not part of
+        // the function and is stored by name
+        unsigned slot = layout.slot(var.first);
+        if (slot == FrameLayout::NoSlot) {
+            writeVarint(0);
+            writeVarint(stringId(var.first->getName()));
+        } else {
+            writeVarint(slot + 1);
+        }
+        writeInteger(var.second);
+    }
+}
+
+void TraceWriter::writeHeap(const Heap &heap) {
+    writeInteger(heap.background);
+    const HeapMap &entries = heap.assignedValues();
+    writeVarint(entries.size());
+    for (const auto &entry : entries) {
+        writeInteger(entry.first);
+        writeInteger(entry.second);
+    }
+}
+
+void TraceWriter::writeInteger(const Integer &val) {
+    switch (val.type) {
+    case IntType::Unbounded:
+        if (val.isSmall) {
+            buffer.push_back(static_cast<char>(IntegerTag::Small));
+            writeVarint(zigzag(val.small));
+        } else {
+            const mpz_srcptr mpz = val.unbounded.get_mpz_t();
+            buffer.push_back(static_cast<char>(
+                mpz_sgn(mpz) < 0 ? IntegerTag::Negative
+                                 : IntegerTag::Positive));
+            // The magnitude in little endian byte order
+            vector<char> bytes((mpz_sizeinbase(mpz, 2) + 7) / 8);
+            size_t count = 0;
+            mpz_export(bytes.data(), &count, -1, 1, 0, 0, mpz);
+            writeVarint(count);
+            buffer.append(bytes.data(), count);
+        }
+        break;
+    case IntType::Bounded:
+        buffer.push_back(static_cast<char>(IntegerTag::Bounded));
+        writeVarint(val.bounded.getBitWidth());
+        for (unsigned i = 0; i < val.bounded.getNumWords(); ++i) {
+            writeVarint(val.bounded.getRawData()[i]);
+        }
+        break;
+    }
+}
+
+void TraceWriter::writeVarint(uint64_t val) {
+    while (val >= 0x80) {
+        buffer.push_back(static_cast<char>((val & 0x7f) | 0x80));
+        val >>= 7;
+    }
+    buffer.push_back(static_cast<char>(val));
+}
+
+void TraceWriter::writeFixed(uint64_t val) {
+    for (unsigned i = 0; i < 8; ++i) {
+        buffer.push_back(static_cast<char>((val >> (8 * i)) & 0xff));
+    }
+}
+
+/// Reads the values of a record directly from the mapped file
+class TraceReader::Decoder {
+    const uint8_t *pos;
+    const uint8_t *end;
+
+    void require(size_t n) {
+        if (static_cast<size_t>(end - pos) < n) {
+            logError("Truncated trace file\n");
+            exit(1);
+        }
+    }
+
+  public:
+    Decoder(const uint8_t *begin, const uint8_t *end) : pos(begin), end(end) {}
+    uint8_t byte() {
+        require(1);
+        return *pos++;
+    }
+    uint64_t varint() {
+        uint64_t val = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            val |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return val;
+            }
+        }
+        logError("Invalid varint in trace file\n");
+        exit(1);
+    }
+    StringRef bytes(size_t n) {
+        require(n);
+        StringRef str(reinterpret_cast<const char *>(pos), n);
+        pos += n;
+        return str;
+    }
+    Integer integer() {
+        const auto tag = static_cast<IntegerTag>(byte());
+        switch (tag) {
+        case IntegerTag::Small:
+            return Integer::fromSmall(unzigzag(varint()));
+        case IntegerTag::Positive:
+        case IntegerTag::Negative: {
+            bool negative = tag == IntegerTag::Negative;
+            StringRef magnitude = bytes(varint());
+            mpz_class val;
+            mpz_import(val.get_mpz_t(), magnitude.size(), -1, 1, 0, 0,
+                       magnitude.data());
+            return Integer(negative ? mpz_class(-val) : val);
+        }
+        case IntegerTag::Bounded: {
+            unsigned width = static_cast<unsigned>(varint());
+            vector<uint64_t> words((width + 63) / 64);
+            for (auto &word : words) {
+                word = varint();
+            }
+            return Integer(llvm::APInt(width, words));
+        }
+        }
+        logError("Invalid integer in trace file\n");
+        exit(1);
+    }
+};
+
+static uint64_t readFixed(const uint8_t *data) {
+    uint64_t val = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        val |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+    return val;
+}
+
+TraceReader::TraceReader(const string &dir,
+                         MonoPair<const llvm::Module *> modules)
+    : modules(modules) {
+    const string path = traceFilePath(dir);
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat s;
+    if (fd < 0 || fstat(fd, &s) != 0) {
+        logError("Couldn’t open trace file " + path + "\n");
+        exit(1);
+    }
+    size = static_cast<size_t>(s.st_size);
+    if (size < MagicSize + FooterSize) {
+        logError("Trace file " + path + " is truncated\n");
+        exit(1);
+    }
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        logError("Couldn’t map trace file " + path + "\n");
+        exit(1);
+    }
+    data = static_cast<const uint8_t *>(mapping);
+    if (std::memcmp(data, Magic, MagicSize) != 0) {
+        logError(path + " is not a trace file\n");
+        exit(1);
+    }
+    const uint8_t *footer = data + size - FooterSize;
+    uint64_t tableOffset = readFixed(footer);
+    uint64_t indexOffset = readFixed(footer + 8);
+    if (tableOffset > size - FooterSize || indexOffset > size - FooterSize) {
+        logError("Trace file " + path + " is corrupted\n");
+        exit(1);
+    }
+    Decoder table(data + tableOffset, footer);
+    strings.resize(table.varint());
+    for (auto &str : strings) {
+        str = table.bytes(table.varint());
+    }
+    Decoder traceIndex(data + indexOffset, footer);
+    uint64_t traceCount = traceIndex.varint();
+    for (uint64_t i = 0; i < traceCount; ++i) {
+        uint64_t first = traceIndex.varint();
+        uint64_t second = traceIndex.varint();
+        if (first >= tableOffset || second >= tableOffset) {
+            logError("Trace file " + path + " is corrupted\n");
+            exit(1);
+        }
+        index.push_back({first, second});
+    }
+}
+
+TraceReader::~TraceReader() {
+    munmap(const_cast<uint8_t *>(data), size);
+    ::close(fd);
+}
+
+MonoPair<FastCall> TraceReader::trace(size_t i) {
+    const uint8_t *footer = data + size - FooterSize;
+    Decoder first(data + index.at(i).first, footer);
+    Decoder second(data + index.at(i).second, footer);
+    FastCall firstCall = readCall(first);
+    return {std::move(firstCall), readCall(second)};
+}
+
+StringRef TraceReader::name(uint64_t id) const {
+    if (id >= strings.size()) {
+        logError("Invalid name in trace file\n");
+        exit(1);
+    }
+    return strings[id];
+}
+
+const Function &TraceReader::function(uint64_t nameId, Program prog) {
+    auto it = functions.find({nameId, prog});
+    if (it == functions.end()) {
+        const llvm::Module *mod =
+            prog == Program::First ? modules.first : modules.second;
+        const Function *fun = mod->getFunction(name(nameId));
+        if (fun == nullptr) {
+            logError("Trace refers to unknown function " +
+                     name(nameId).str() + "\n");
+            exit(1);
+        }
+        it = functions.insert({{nameId, prog}, fun}).first;
+    }
+    return *it->second;
+}
+
+const llvm::StringMap<const Value *> &TraceReader::foreignValues() {
+    if (valuesByName.empty()) {
+        for (const llvm::Module *mod : {modules.first, modules.second}) {
+            for (const auto &fun : *mod) {
+                for (const auto &arg : fun.args()) {
+                    valuesByName.insert({arg.getName(), &arg});
+                }
+                for (const auto &bb : fun) {
+                    for (const auto &instr : bb) {
+                        if (!instr.getName().empty()) {
+                            valuesByName.insert({instr.getName(), &instr});
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return valuesByName;
+}
+
+FastCall TraceReader::readCall(Decoder &decoder) {
+    uint64_t nameId = decoder.varint();
+    Program prog = decoder.byte() == 0 ? Program::First : Program::Second;
+    const Function &fun = function(nameId, prog);
+    FastState entryState = readState(decoder, fun);
+    FastState returnState = readState(decoder, fun);
+    bool earlyExit = decoder.byte() != 0;
+    uint32_t blocksVisited = static_cast<uint32_t>(decoder.varint());
+    vector<BlockStep<const Value *>> steps;
+    shared_ptr<const Delta> prevDelta;
+    uint64_t stepCount = decoder.varint();
+    for (uint64_t i = 0; i < stepCount; ++i) {
+        StringRef blockName = name(decoder.varint());
+        uint8_t flags = decoder.byte();
+        bool keyframe = (flags & KeyframeFlag) != 0;
+        if (!keyframe && prevDelta == nullptr) {
+            logError("Trace file contains a delta without a keyframe\n");
+            exit(1);
+        }
+        FastVarMap variables = readVariables(decoder, fun);
+        Heap heap = (flags & HeapFlag) != 0 ? readHeap(decoder)
+                                            : prevDelta->heap;
+        prevDelta = make_shared<Delta>(keyframe ? nullptr : prevDelta,
+                                       std::move(variables), std::move(heap));
+        vector<FastCall> calls;
+        uint64_t callCount = decoder.varint();
+        for (uint64_t j = 0; j < callCount; ++j) {
+            calls.push_back(readCall(decoder));
+        }
+        steps.emplace_back(blockName, prevDelta, std::move(calls));
+    }
+    return FastCall(&fun, std::move(entryState), std::move(returnState),
+                    std::move(steps), earlyExit, blocksVisited);
+}
+
+FastState TraceReader::readState(Decoder &decoder, const Function &fun) {
+    FastVarMap variables = readVariables(decoder, fun);
+    return FastState(std::move(variables), readHeap(decoder));
+}
+
+FastVarMap TraceReader::readVariables(Decoder &decoder, const Function &fun) {
+    const FrameLayout &layout = layouts.get(fun);
+    uint64_t count = decoder.varint();
+    FastVarMap variables(static_cast<unsigned>(count));
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t key = decoder.varint();
+        const Value *var = nullptr;
+        if (key == 0) {
+            StringRef varName = name(decoder.varint());
+            auto it = foreignValues().find(varName);
+            if (it == foreignValues().end()) {
+                logError("Trace refers to unknown variable " + varName.str() +
+                         "\n");
+                exit(1);
+            }
+            var = it->second;
+        } else if (key - 1 < layout.values.size()) {
+            var = layout.values[key - 1];
+        } else {
+            logError("Trace doesn’t match the function " +
+                     fun.getName().str() + "\n");
+            exit(1);
+        }
+        Integer val = decoder.integer();
+        variables.insert({var, std::move(val)});
+    }
+    return variables;
+}
+
+Heap TraceReader::readHeap(Decoder &decoder) {
+    Integer background = decoder.integer();
+    uint64_t count = decoder.varint();
+    HeapMap entries;
+    for (uint64_t i = 0; i < count; ++i) {
+        Integer address = decoder.integer();
+        Integer val = decoder.integer();
+        entries.insert({std::move(address), std::move(val)});
+    }
+    return Heap(std::move(entries), std::move(background));
+}
+
+void replayTraces(const string &dir, MonoPair<const llvm::Module *> modules,
+                  std::function<void(MonoPair<FastCall>)> callback) {
+    TraceReader reader(dir, modules);
+    for (size_t i = 0; i < reader.traces(); ++i) {
+        callback(reader.trace(i));
+    }
+}
+} // namespace dynamic
+} // namespace llreve
@@ -8,7 +8,9 @@
  * See LICENSE (distributed with this file) for details.
  */
 
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <vector>
 
@@ -59,6 +61,10 @@ static llreve::cl::opt<string>
     PatternFileFlag("patterns",
                     llreve::cl::desc("Path to file containing patterns"),
                     llreve::cl::Required);
+static llreve::cl::opt<string> PatternCacheFlag(
+    "pattern-cache",
+    llreve::cl::desc("Path to a cache of the compiled patterns, it is "
+                     "written if it doesn’t match the pattern file"));
 static llreve::cl::list<string> IncludesFlag("I",
                                              llreve::cl::desc("Include path"));
 static llreve::cl::opt<string> ResourceDirFlag(
@@ -92,6 +98,28 @@ static void printVersion() {
     std::cout << "llreve-dynamic version " << g_GIT_SHA1 << "\n";
 }
 
+// Compiles and preprocesses another copy of the programs after the options
+// have been initialized for the first one
+static ProgramCopy copyPrograms(const char *exeName, InputOpts inputOpts,
+                                PreprocessOpts preprocessOpts) {
+    MonoPair<std::shared_ptr<CodeGenAction>> actions = {
+        std::make_shared<clang::EmitLLVMOnlyAction>(),
+        std::make_shared<clang::EmitLLVMOnlyAction>()};
+    MonoPair<shared_ptr<llvm::Module>> modules = compileToModules(
+        exeName, inputOpts, {*actions.first, *actions.second});
+    MonoPair<llvm::Module &> moduleRefs = {*modules.first, *modules.second};
+    auto functionNumerals = generateFunctionMap(moduleRefs);
+    ProgramFunctions functions = {
+        findMainFunction(moduleRefs, MainFunctionFlag),
+        inferCoupledFunctionsByName(moduleRefs),
+        std::move(functionNumerals.first), std::move(functionNumerals.second)};
+    functions.select();
+    AnalysisResultsMap analysisResults =
+        preprocessModules(moduleRefs, preprocessOpts);
+    return {std::move(actions), std::move(modules), std::move(functions),
+            std::move(analysisResults)};
+}
+
 int main(int argc, const char **argv) {
     llreve::cl::SetVersionPrinter(printVersion);
     llreve::cl::ParseCommandLineOptions(argc, argv);
@@ -139,30 +167,49 @@ int main(int argc, const char **argv) {
         exit(1);
     }
 
-    FILE *patternFile = fopen(PatternFileFlag.c_str(), "r");
-    if (patternFile == nullptr) {
-        logError("Couldn’t open pattern file\n");
-        exit(1);
+    std::ifstream patternSource(PatternFileFlag);
+    const string source((std::istreambuf_iterator<char>(patternSource)),
+                        std::istreambuf_iterator<char>());
+    shared_ptr<PatternLibrary> library;
+    if (!PatternCacheFlag.empty()) {
+        library = PatternLibrary::read(PatternCacheFlag, source);
+    }
+    vector<shared_ptr<HeapPattern<VariablePlaceholder>>> patterns;
+    if (library != nullptr) {
+        patterns = library->patterns();
+    } else {
+        FILE *patternFile = fopen(PatternFileFlag.c_str(), "r");
+        if (patternFile == nullptr) {
+            logError("Couldn’t open pattern file\n");
+            exit(1);
+        }
+        patterns = parsePatterns(patternFile);
+        fclose(patternFile);
+        if (!PatternCacheFlag.empty()) {
+            PatternLibrary::get(patterns)->write(PatternCacheFlag, source);
+        }
     }
-    auto patterns = parsePatterns(patternFile);
     std::cerr << "Found " << patterns.size() << " patterns\n";
     for (auto pat : patterns) {
         pat->dump(std::cerr);
         std::cerr << "\n";
     }
-    fclose(patternFile);
 
     FileOptions fileOpts = getFileOptions(inputOpts.FileNames);
+    const SerializeOpts serializeOpts(OutputFileNameFlag, !InstantiateFlag,
+                                      MergeImplications, true, false);
     vector<smt::SharedSMTRef> smtExprs;
     if (OnlyTransform) {
-        smtExprs = driver(moduleRefs, analysisResults, patterns, fileOpts);
+        smtExprs = driver(moduleRefs, analysisResults, patterns, fileOpts,
+                          serializeOpts, [&]() {
+                              return copyPrograms(argv[0], inputOpts,
+                                                  preprocessOpts);
+                          });
     } else {
         smtExprs = cegarDriver(moduleRefs, analysisResults, patterns, fileOpts);
     }
     if (!smtExprs.empty() && !OutputFileNameFlag.empty()) {
-        serializeSMT(smtExprs, OnlyTransform,
-                     SerializeOpts(OutputFileNameFlag, !InstantiateFlag,
-                                   MergeImplications, true, false));
+        serializeSMT(smtExprs, OnlyTransform, serializeOpts);
     }
 
     llvm::llvm_shutdown();
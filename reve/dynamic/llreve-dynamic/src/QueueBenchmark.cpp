@@ -0,0 +1,140 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+// Compares the throughput of the queues in ThreadSafeQueue.h for several
+// producers and consumers passing around heap allocated items.
+//
+// Usage: llreve-queue-benchmark [producers] [consumers] [items]
+
+#include "llreve/dynamic/ThreadSafeQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+// Roughly the size of the argument vectors in a work item
+using Item = vector<uint64_t>;
+static const size_t ItemSize = 16;
+
+static Item makeItem(uint64_t i) { return Item(ItemSize, i); }
+
+// Every consumer checks the items it receives so that both queues have to
+// move the payload
+static uint64_t consume(const Item &item) {
+    return std::accumulate(item.begin(), item.end(), uint64_t(0));
+}
+
+template <typename Run>
+static void report(const std::string &name, uint64_t items, Run run) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t checksum = run();
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << name << ": " << static_cast<uint64_t>(items / seconds)
+              << " items/s (checksum " << checksum << ")\n";
+}
+
+static uint64_t runThreadSafeQueue(unsigned producers, unsigned consumers,
+                                   uint64_t items) {
+    ThreadSafeQueue<Item> queue;
+    std::atomic<uint64_t> checksum(0);
+    vector<std::thread> threads;
+    for (unsigned p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p]() {
+            for (uint64_t i = p; i < items; i += producers) {
+                queue.push(makeItem(i));
+            }
+        });
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+        threads.emplace_back([&]() {
+            uint64_t sum = 0;
+            // The queue can’t be closed so an empty item signals the end
+            for (Item item = queue.pop(); !item.empty(); item = queue.pop()) {
+                sum += consume(item);
+            }
+            checksum += sum;
+        });
+    }
+    for (unsigned p = 0; p < producers; ++p) {
+        threads[p].join();
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+        queue.push(Item());
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+        threads[producers + c].join();
+    }
+    return checksum;
+}
+
+static uint64_t runMPMCQueue(unsigned producers, unsigned consumers,
+                             uint64_t items, size_t batchSize) {
+    BoundedMPMCQueue<Item> queue(1024);
+    std::atomic<uint64_t> checksum(0);
+    std::atomic<unsigned> runningProducers(producers);
+    vector<std::thread> threads;
+    for (unsigned p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p]() {
+            for (uint64_t i = p; i < items; i += producers) {
+                queue.push(makeItem(i));
+            }
+            if (--runningProducers == 0) {
+                queue.close();
+            }
+        });
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+        threads.emplace_back([&]() {
+            uint64_t sum = 0;
+            vector<Item> batch;
+            while (queue.pop_batch(batch, batchSize) > 0) {
+                for (const auto &item : batch) {
+                    sum += consume(item);
+                }
+                batch.clear();
+            }
+            checksum += sum;
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return checksum;
+}
+
+int main(int argc, const char **argv) {
+    unsigned producers = argc > 1 ? std::stoul(argv[1]) : 4;
+    unsigned consumers = argc > 2 ? std::stoul(argv[2]) : 4;
+    uint64_t items = argc > 3 ? std::stoull(argv[3]) : 2000000;
+    if (producers == 0 || consumers == 0) {
+        std::cerr << "At least one producer and one consumer are required\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << producers << " producers, " << consumers << " consumers, "
+              << items << " items\n";
+    report("ThreadSafeQueue", items, [&]() {
+        return runThreadSafeQueue(producers, consumers, items);
+    });
+    report("BoundedMPMCQueue", items, [&]() {
+        return runMPMCQueue(producers, consumers, items, 1);
+    });
+    report("BoundedMPMCQueue (batches of 32)", items, [&]() {
+        return runMPMCQueue(producers, consumers, items, 32);
+    });
+    return EXIT_SUCCESS;
+}
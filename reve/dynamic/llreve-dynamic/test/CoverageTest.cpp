@@ -0,0 +1,192 @@
+#include "llreve/dynamic/Coverage.h"
+
+#include <gtest/gtest.h>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/SourceMgr.h"
+
+// Checks that the inputs only depend on the seed and the recorded keys, which
+// inputs end up in the corpus and that saturated keys are ignored
+
+using namespace llreve::dynamic;
+
+static const char *const Program = R"(
+define i32 @f(i32 %x, i32* %p) {
+entry:
+  %v = load i32, i32* %p
+  %r = add i32 %x, %v
+  ret i32 %r
+}
+)";
+
+// The bounds of the random inputs, corpus entries far outside them are easy
+// to tell apart from fresh inputs and their mutations
+static const int LowerBound = -5;
+static const int UpperBound = 5;
+static const long Far = 1000;
+
+class CoverageTest : public testing::Test {
+  protected:
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> module;
+    const llvm::Function *fun = nullptr;
+
+    virtual void SetUp() {
+        llvm::SMDiagnostic error;
+        module = llvm::parseAssemblyString(Program, error, context);
+        ASSERT_TRUE(module);
+        fun = module->getFunction("f");
+    }
+
+    CoverageGuidedInputs inputs(unsigned seed) {
+        return CoverageGuidedInputs({fun, fun}, LowerBound, UpperBound, seed);
+    }
+};
+
+static CoverageKey key(int mark) {
+    return CoverageKey(Mark(mark), LoopInfo::None, 0);
+}
+
+static WorkItem input(long x, long p) {
+    std::vector<mpz_class> vals = {x, p};
+    WorkItem item({vals, vals}, 0);
+    HeapMap entries;
+    entries.set(Integer(mpz_class(p)), Integer(mpz_class(x)));
+    const Heap heap(std::move(entries), Integer(mpz_class(0)));
+    item.heaps = {heap, heap};
+    item.heapSet = true;
+    return item;
+}
+
+// The key an input reaches in the tests that need some feedback
+static CoverageKey keyOf(const WorkItem &input) {
+    return key(static_cast<int>(input.vals.first[0].get_si() % 3));
+}
+
+static void expectSameInputs(const std::vector<WorkItem> &expected,
+                             const std::vector<WorkItem> &actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected[i].vals.first, actual[i].vals.first);
+        EXPECT_EQ(expected[i].vals.second, actual[i].vals.second);
+        EXPECT_TRUE(expected[i].heaps.first.assignedValues() ==
+                    actual[i].heaps.first.assignedValues());
+        EXPECT_EQ(expected[i].heaps.first.background,
+                  actual[i].heaps.first.background);
+    }
+}
+
+// Both programs get the same arguments and heap and the pointer stays inside
+// the bounds since the heap is placed at it
+static void expectWellFormed(const WorkItem &input) {
+    EXPECT_EQ(input.vals.first, input.vals.second);
+    ASSERT_EQ(input.vals.first.size(), 2u);
+    EXPECT_GE(input.vals.first[1], LowerBound);
+    EXPECT_LE(input.vals.first[1], UpperBound);
+    EXPECT_TRUE(input.heapSet);
+    EXPECT_TRUE(input.heaps.first.assignedValues() ==
+                input.heaps.second.assignedValues());
+    EXPECT_FALSE(input.heaps.first.assignedValues().empty());
+}
+
+// Mutations change the argument by at most 10 or pick a value inside the
+// bounds
+static size_t farInputs(const std::vector<WorkItem> &inputs) {
+    size_t far = 0;
+    for (const auto &input : inputs) {
+        expectWellFormed(input);
+        if (abs(input.vals.first[0]) > Far / 2) {
+            ++far;
+        }
+    }
+    return far;
+}
+
+TEST_F(CoverageTest, RoundsAreReproducible) {
+    auto first = inputs(42);
+    auto second = inputs(42);
+    auto other = inputs(43);
+    bool differs = false;
+    for (int round = 0; round < 5; ++round) {
+        const auto firstRound = first.nextRound(50);
+        const auto otherRound = other.nextRound(50);
+        expectSameInputs(firstRound, second.nextRound(50));
+        for (size_t i = 0; i < firstRound.size(); ++i) {
+            expectWellFormed(firstRound[i]);
+            differs = differs ||
+                      firstRound[i].vals.first != otherRound[i].vals.first;
+            // Corpus entries outside the bounds show up in the next rounds
+            WorkItem recorded = firstRound[i];
+            if (i % 10 == 0) {
+                recorded.vals.first[0] += Far;
+                recorded.vals.second[0] += Far;
+            }
+            const auto keys = std::vector<CoverageKey>{keyOf(recorded)};
+            EXPECT_EQ(first.record(recorded, keys),
+                      second.record(recorded, keys));
+            other.record(otherRound[i], {keyOf(otherRound[i])});
+        }
+        EXPECT_TRUE(first.coverage() == second.coverage());
+    }
+    EXPECT_TRUE(differs);
+}
+
+TEST_F(CoverageTest, RecordCountsEachKeyOncePerTrace) {
+    auto generator = inputs(1);
+    EXPECT_TRUE(generator.record(input(0, 0), {key(1), key(2), key(1)}));
+    EXPECT_FALSE(generator.record(input(1, 0), {key(2)}));
+    EXPECT_TRUE(generator.record(input(2, 0), {key(2), key(3)}));
+    EXPECT_EQ(generator.coverage().at(key(1)), 1u);
+    EXPECT_EQ(generator.coverage().at(key(2)), 3u);
+    EXPECT_EQ(generator.coverage().at(key(3)), 1u);
+    EXPECT_EQ(generator.coverage().size(), 3u);
+}
+
+TEST_F(CoverageTest, FreshInputsWithoutCorpus) {
+    auto generator = inputs(2);
+    EXPECT_EQ(farInputs(generator.nextRound(200)), 0u);
+}
+
+TEST_F(CoverageTest, InputsReachingRareKeysAreMutated) {
+    auto generator = inputs(3);
+    EXPECT_TRUE(generator.record(input(Far, 0), {key(1)}));
+    // Most inputs are mutations of the only corpus entry, the rest are fresh
+    const size_t far = farInputs(generator.nextRound(400));
+    EXPECT_GT(far, 100u);
+    EXPECT_LT(far, 400u);
+}
+
+TEST_F(CoverageTest, InputsReachingFrequentKeysAreDropped) {
+    auto generator = inputs(4);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(generator.record(input(0, 0), {key(1)}), i == 0);
+    }
+    // The key has been reached often enough
+    EXPECT_FALSE(generator.record(input(Far, 0), {key(1)}));
+    EXPECT_EQ(farInputs(generator.nextRound(400)), 0u);
+
+    // A rare key keeps the input even if its other keys are frequent
+    EXPECT_TRUE(generator.record(input(-Far, 0), {key(1), key(2)}));
+    EXPECT_GT(farInputs(generator.nextRound(400)), 0u);
+}
+
+TEST_F(CoverageTest, SaturatedKeysAreIgnored) {
+    auto generator = inputs(5);
+    EXPECT_FALSE(generator.saturated());
+    generator.record(input(Far, 0), {key(1)});
+    generator.record(input(0, 0), {key(2)});
+    generator.saturate(key(1));
+    EXPECT_FALSE(generator.saturated());
+    // The corpus entry only reaches the saturated key
+    EXPECT_EQ(farInputs(generator.nextRound(400)), 0u);
+
+    // Inputs that only reach saturated keys aren’t added to the corpus
+    generator.record(input(-Far, 0), {key(1)});
+    EXPECT_EQ(farInputs(generator.nextRound(400)), 0u);
+
+    generator.saturate(key(2));
+    EXPECT_TRUE(generator.saturated());
+    generator.record(input(Far, 0), {key(3)});
+    EXPECT_FALSE(generator.saturated());
+}
@@ -0,0 +1,260 @@
+#include "llreve/dynamic/HeapMap.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+// Checks the trie against a std::map, including addresses whose hashes
+// collide completely and therefore end up in the nodes below MaxDepth
+
+using namespace llreve::dynamic;
+
+using Reference = std::map<mpz_class, mpz_class>;
+
+static Integer integer(const mpz_class &val) { return Integer(val); }
+
+// Big integers are hashed by their limbs, so an address and its negation
+// have the same hash
+static mpz_class collidingAddress(long i) {
+    mpz_class address = 1;
+    address <<= 100;
+    return address + i;
+}
+
+static HeapMap
+build(const std::vector<std::pair<mpz_class, mpz_class>> &entries) {
+    HeapMap map;
+    for (const auto &entry : entries) {
+        map.set(integer(entry.first), integer(entry.second));
+    }
+    return map;
+}
+
+static void expectSameEntries(const Reference &expected, const HeapMap &map) {
+    EXPECT_EQ(map.size(), expected.size());
+    size_t visited = 0;
+    for (const auto &entry : map) {
+        auto it = expected.find(entry.first.asUnbounded());
+        ASSERT_NE(it, expected.end()) << entry.first.asUnbounded().get_str();
+        EXPECT_EQ(entry.second, integer(it->second));
+        ++visited;
+    }
+    EXPECT_EQ(visited, expected.size());
+    for (const auto &entry : expected) {
+        const Integer *val = map.lookup(integer(entry.first));
+        ASSERT_NE(val, nullptr) << entry.first.get_str();
+        EXPECT_EQ(*val, integer(entry.second));
+    }
+}
+
+// Small addresses, big ones and pairs of colliding ones
+static std::vector<std::pair<mpz_class, mpz_class>>
+randomEntries(std::mt19937 &gen, size_t size) {
+    std::uniform_int_distribution<long> values(-50, 50);
+    std::vector<std::pair<mpz_class, mpz_class>> entries;
+    for (size_t i = 0; i < size; ++i) {
+        mpz_class address;
+        switch (gen() % 3) {
+        case 0:
+            address = values(gen) * 1000 + static_cast<long>(i);
+            break;
+        case 1:
+            address = collidingAddress(values(gen));
+            break;
+        default:
+            address = -collidingAddress(values(gen));
+            break;
+        }
+        entries.push_back({address, values(gen)});
+    }
+    return entries;
+}
+
+static Reference reference(
+    const std::vector<std::pair<mpz_class, mpz_class>> &entries) {
+    Reference result;
+    for (const auto &entry : entries) {
+        result[entry.first] = entry.second;
+    }
+    return result;
+}
+
+TEST(HeapMapTest, CopiesAreIsolated) {
+    HeapMap original;
+    Reference expected;
+    for (long i = 0; i < 200; ++i) {
+        original.set(integer(i * 7), integer(i));
+        expected[i * 7] = i;
+    }
+    HeapMap copy = original;
+    EXPECT_TRUE(copy.sharesRootWith(original));
+    // Storing the value an entry already has keeps sharing the nodes
+    copy.set(integer(7), integer(1));
+    EXPECT_TRUE(copy.sharesRootWith(original));
+
+    copy.set(integer(7), integer(-1));
+    EXPECT_TRUE(copy.insert({integer(3), integer(4)}));
+    EXPECT_FALSE(copy.sharesRootWith(original));
+    expectSameEntries(expected, original);
+    Reference copyExpected = expected;
+    copyExpected[7] = -1;
+    copyExpected[3] = 4;
+    expectSameEntries(copyExpected, copy);
+
+    // Modifying the original doesn’t change the copy either
+    original.set(integer(14), integer(100));
+    expected[14] = 100;
+    expectSameEntries(expected, original);
+    expectSameEntries(copyExpected, copy);
+    EXPECT_FALSE(original == copy);
+}
+
+TEST(HeapMapTest, EqualityIgnoresInsertionOrder) {
+    std::mt19937 gen(17);
+    for (int round = 0; round < 50; ++round) {
+        const Reference expected =
+            reference(randomEntries(gen, 1 + gen() % 300));
+        std::vector<std::pair<mpz_class, mpz_class>> unique(expected.begin(),
+                                                            expected.end());
+        const HeapMap ordered = build(unique);
+        std::reverse(unique.begin(), unique.end());
+        const HeapMap reversed = build(unique);
+        expectSameEntries(expected, ordered);
+        EXPECT_TRUE(ordered == reversed);
+        EXPECT_TRUE(reversed == ordered);
+
+        // A single different value or a missing entry is noticed
+        HeapMap changed = reversed;
+        const auto &some = unique[gen() % unique.size()];
+        changed.set(integer(some.first), integer(some.second + 1));
+        EXPECT_FALSE(ordered == changed);
+        changed.set(integer(some.first), integer(some.second));
+        EXPECT_TRUE(ordered == changed);
+        unique.pop_back();
+        EXPECT_FALSE(ordered == build(unique));
+    }
+}
+
+TEST(HeapMapTest, CollidingAddresses) {
+    const mpz_class address = collidingAddress(5);
+    ASSERT_EQ(hash_value(integer(address)), hash_value(integer(-address)));
+    HeapMap map;
+    Reference expected;
+    for (long i = 0; i < 20; ++i) {
+        map.set(integer(collidingAddress(i)), integer(i));
+        map.set(integer(-collidingAddress(i)), integer(-i));
+        expected[collidingAddress(i)] = i;
+        expected[-collidingAddress(i)] = -i;
+    }
+    expectSameEntries(expected, map);
+    EXPECT_FALSE(map.insert({integer(-address), integer(1)}));
+    map.set(integer(-address), integer(1));
+    expected[-address] = 1;
+    expectSameEntries(expected, map);
+    EXPECT_EQ(*map.lookup(integer(address)), integer(5));
+
+    // The entries below MaxDepth are unordered
+    HeapMap swapped;
+    for (long i = 19; i >= 0; --i) {
+        swapped.set(integer(-collidingAddress(i)), integer(-i));
+        swapped.set(integer(collidingAddress(i)), integer(i));
+    }
+    swapped.set(integer(-address), integer(1));
+    EXPECT_TRUE(map == swapped);
+    swapped.set(integer(address), integer(6));
+    EXPECT_FALSE(map == swapped);
+    EXPECT_FALSE(map.isContainedIn(swapped, integer(0)));
+    swapped.set(integer(address), integer(5));
+    EXPECT_TRUE(map.isContainedIn(swapped, integer(0)));
+}
+
+// Each entry of small has the same value in big or, if big has none, the
+// background value
+static bool referenceContainedIn(const Reference &small, const Reference &big,
+                                 const mpz_class &background) {
+    for (const auto &entry : small) {
+        auto it = big.find(entry.first);
+        if (entry.second != (it == big.end() ? background : it->second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(HeapMapTest, ContainedInWithBackground) {
+    std::mt19937 gen(23);
+    size_t contained = 0;
+    for (int round = 0; round < 400; ++round) {
+        const mpz_class background = static_cast<long>(gen() % 3);
+        Reference big = reference(randomEntries(gen, gen() % 40));
+        Reference small;
+        // Entries of big, entries with the background value and a few others
+        for (const auto &entry : big) {
+            if (gen() % 2 == 0) {
+                small.insert(entry);
+            }
+        }
+        for (const auto &entry : randomEntries(gen, gen() % 10)) {
+            if (big.count(entry.first) == 0) {
+                small[entry.first] = gen() % 8 == 0 ? entry.second : background;
+            }
+        }
+        const HeapMap smallMap = build({small.begin(), small.end()});
+        const HeapMap bigMap = build({big.begin(), big.end()});
+        const bool expected = referenceContainedIn(small, big, background);
+        contained += expected;
+        EXPECT_EQ(smallMap.isContainedIn(bigMap, integer(background)),
+                  expected);
+
+        // Subtrees shared with big are skipped, the others still count
+        HeapMap modified = bigMap;
+        Reference modifiedReference = big;
+        for (int i = 0; i < 3; ++i) {
+            const mpz_class address = static_cast<long>(gen() % 20);
+            const mpz_class val = static_cast<long>(gen() % 3);
+            modified.set(integer(address), integer(val));
+            modifiedReference[address] = val;
+        }
+        EXPECT_TRUE(bigMap.isContainedIn(bigMap, integer(background)));
+        EXPECT_EQ(modified.isContainedIn(bigMap, integer(background)),
+                  referenceContainedIn(modifiedReference, big, background));
+        EXPECT_EQ(bigMap.isContainedIn(modified, integer(background)),
+                  referenceContainedIn(big, modifiedReference, background));
+    }
+    // Both results have to occur for the comparison to mean something
+    EXPECT_GT(contained, 0u);
+    EXPECT_LT(contained, 400u);
+}
+
+TEST(HeapMapTest, IterationVisitsEachEntryOnce) {
+    HeapMap empty;
+    EXPECT_TRUE(empty.begin() == empty.end());
+    std::mt19937 gen(29);
+    for (int round = 0; round < 20; ++round) {
+        auto entries = randomEntries(gen, gen() % 500);
+        const Reference expected = reference(entries);
+        const HeapMap map = build(entries);
+        expectSameEntries(expected, map);
+
+        // Without colliding addresses the order only depends on the entries
+        std::vector<std::pair<mpz_class, mpz_class>> small;
+        for (const auto &entry : expected) {
+            if (abs(entry.first) < 1000000) {
+                small.push_back(entry);
+            }
+        }
+        const HeapMap ordered = build(small);
+        std::shuffle(small.begin(), small.end(), gen);
+        const HeapMap shuffled = build(small);
+        auto it = shuffled.begin();
+        for (const auto &entry : ordered) {
+            ASSERT_TRUE(it != shuffled.end());
+            EXPECT_EQ(entry.first, it->first);
+            EXPECT_EQ(entry.second, it->second);
+            ++it;
+        }
+        EXPECT_TRUE(it == shuffled.end());
+    }
+}
@@ -0,0 +1,175 @@
+#include "llreve/dynamic/HeapPattern.h"
+
+#include <gtest/gtest.h>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <random>
+
+// Evaluates compiled patterns on random heaps and arguments and checks the
+// results against matching the instantiated patterns
+
+using namespace llreve::dynamic;
+
+using std::make_shared;
+using std::shared_ptr;
+
+using Pattern = shared_ptr<HeapPattern<VariablePlaceholder>>;
+using Expr = shared_ptr<HeapExpr<VariablePlaceholder>>;
+
+static Expr var() {
+    return make_shared<Variable<VariablePlaceholder>>(VariablePlaceholder());
+}
+static Expr constant(long val) {
+    return make_shared<Constant<VariablePlaceholder>>(mpz_class(val));
+}
+static Expr hole(size_t index) {
+    return make_shared<Hole<VariablePlaceholder>>(index);
+}
+static Expr load(ProgramIndex prog, Expr address) {
+    return make_shared<HeapAccess<VariablePlaceholder>>(prog, address);
+}
+static Expr add(Expr lhs, Expr rhs) {
+    return make_shared<BinaryIntExpr<VariablePlaceholder>>(
+        BinaryIntOp::Add, makeMonoPair(lhs, rhs));
+}
+static Pattern compare(BinaryIntProp op, Expr lhs, Expr rhs) {
+    return make_shared<HeapExprProp<VariablePlaceholder>>(
+        op, makeMonoPair(lhs, rhs));
+}
+static Pattern both(Pattern lhs, Pattern rhs) {
+    return make_shared<BinaryHeapPattern<VariablePlaceholder>>(
+        BinaryBooleanOp::And, makeMonoPair(lhs, rhs));
+}
+static Pattern range(RangeQuantifier quant, Expr lower, Expr upper,
+                     size_t index, Pattern body) {
+    return make_shared<RangeProp<VariablePlaceholder>>(
+        quant, makeMonoPair(lower, upper), index, body);
+}
+
+static const auto First = ProgramIndex::First;
+static const auto Second = ProgramIndex::Second;
+static const auto All = RangeQuantifier::All;
+static const auto Any = RangeQuantifier::Any;
+
+static Integer integer(int64_t val) {
+    return Integer(mpz_class(static_cast<long>(val)));
+}
+
+class HeapPatternTest : public testing::Test {
+  protected:
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> module;
+    std::vector<const llvm::Value *> arguments;
+
+    virtual void SetUp() {
+        llvm::SMDiagnostic error;
+        module = llvm::parseAssemblyString(
+            "define void @f(i32 %a, i32 %b, i32 %c, i32 %d, i32 %e) {\n"
+            "  ret void\n"
+            "}\n",
+            error, context);
+        ASSERT_TRUE(module != nullptr);
+        for (const auto &arg : module->getFunction("f")->args()) {
+            arguments.push_back(&arg);
+        }
+    }
+
+    // Compares the compiled pattern, the pattern restored from its
+    // serialization and the instantiated pattern on random inputs
+    void checkAgainstMatches(const Pattern &pat) {
+        const CompiledPattern compiled(pat);
+        ASSERT_LE(compiled.arguments(), arguments.size());
+        std::string serialized;
+        compiled.serialize(serialized);
+        llvm::StringRef in(serialized);
+        llvm::Optional<CompiledPattern> restored =
+            CompiledPattern::deserialize(in);
+        ASSERT_TRUE(restored.hasValue());
+        EXPECT_TRUE(in.empty());
+        const auto instantiated = compiled.instantiate(
+            llvm::makeArrayRef(arguments).take_front(compiled.arguments()));
+        std::mt19937 gen(1);
+        std::uniform_int_distribution<int64_t> values(-2, 4);
+        CompiledPattern::Registers registers;
+        size_t matched = 0;
+        for (int i = 0; i < 2000; ++i) {
+            std::vector<int64_t> args(compiled.arguments());
+            FastVarMap variables;
+            for (size_t j = 0; j < args.size(); ++j) {
+                args[j] = values(gen);
+                variables.insert({arguments[j], integer(args[j])});
+            }
+            HeapMap first, second;
+            for (int address = -2; address <= 4; ++address) {
+                if (gen() % 3 != 0) {
+                    first.set(integer(address), integer(values(gen)));
+                }
+                if (gen() % 3 != 0) {
+                    second.set(integer(address), integer(values(gen)));
+                }
+            }
+            const Heap firstHeap(first, integer(gen() % 2));
+            const Heap secondHeap(second, integer(gen() % 2));
+            const MonoPair<const Heap &> heaps = {firstHeap, secondHeap};
+            const bool expected = instantiated->matches(variables, heaps);
+            matched += expected;
+            EXPECT_EQ(compiled.evaluate(args.data(), heaps, registers),
+                      llvm::Optional<bool>(expected));
+            EXPECT_EQ(restored->evaluate(args.data(), heaps, registers),
+                      llvm::Optional<bool>(expected));
+            registers.addresses.clear();
+        }
+        // Both results have to occur for the comparison to mean something
+        EXPECT_GT(matched, 0u);
+        EXPECT_LT(matched, 2000u);
+    }
+};
+
+TEST_F(HeapPatternTest, SiblingRangesWithTheSameIndex) {
+    // (and (forall i_0 in [a, b] H_1[i_0] = H_2[i_0])
+    //      (exists i_0 in [c, d] H_1[i_0] > i_0 + 1))
+    checkAgainstMatches(
+        both(range(All, var(), var(), 0,
+                   compare(BinaryIntProp::EQ, load(First, hole(0)),
+                           load(Second, hole(0)))),
+             range(Any, var(), var(), 0,
+                   compare(BinaryIntProp::GT, load(First, hole(0)),
+                           add(hole(0), constant(1))))));
+}
+
+TEST_F(HeapPatternTest, NestedRanges) {
+    // (forall i_0 in [a, b] (exists i_1 in [c, i_0] H_1[i_0] = H_2[i_1]))
+    checkAgainstMatches(range(
+        All, var(), var(), 0,
+        range(Any, var(), hole(0), 1,
+              compare(BinaryIntProp::EQ, load(First, hole(0)),
+                      load(Second, hole(1))))));
+}
+
+TEST_F(HeapPatternTest, NestedRangeShadowsIndex) {
+    // (forall i_0 in [a, b]
+    //     (and (exists i_0 in [c, d] H_2[i_0] = e) (H_1[i_0] >= i_0)))
+    // The use of i_0 after the inner range refers to the outer range again.
+    checkAgainstMatches(range(
+        All, var(), var(), 0,
+        both(range(Any, var(), var(), 0,
+                   compare(BinaryIntProp::EQ, load(Second, hole(0)), var())),
+             compare(BinaryIntProp::GE, load(First, hole(0)), hole(0)))));
+}
+
+TEST_F(HeapPatternTest, SiblingRangesInsideRange) {
+    // (exists i_1 in [a, b] (and (forall i_0 in [c, i_1] H_1[i_0] <= H_1[i_1])
+    //                            (forall i_0 in [i_1, d] H_1[i_0] >= 0)))
+    checkAgainstMatches(range(
+        Any, var(), var(), 1,
+        both(range(All, var(), hole(1), 0,
+                   compare(BinaryIntProp::LE, load(First, hole(0)),
+                           load(First, hole(1)))),
+             range(All, hole(1), var(), 0,
+                   compare(BinaryIntProp::GE, load(First, hole(0)),
+                           constant(0))))));
+}
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+#include <array>
+#include <memory>
+
+// Runs llreve-dynamic with -check-jit, which fails as soon as the matches of
+// the JIT and the interpreter differ for one of the traces
+
+static std::string PathToTestExecutable;
+
+static std::pair<int, std::string> exec(const std::string &cmd) {
+    std::array<char, 128> buffer;
+    std::string result;
+    auto pipe = popen(cmd.c_str(), "r");
+    if (!pipe)
+        throw std::runtime_error("popen() failed!");
+    while (!feof(pipe)) {
+        if (fgets(buffer.data(), 128, pipe) != NULL)
+            result += buffer.data();
+    }
+    int exitCode = pclose(pipe);
+    return {exitCode, result};
+}
+
+class JitTest : public testing::TestWithParam<
+                    ::testing::tuple<std::string, std::string>> {
+  protected:
+    virtual void SetUp() {}
+    virtual void TearDown() {}
+};
+
+TEST_P(JitTest, MatchesInterpreter) {
+    std::string directory;
+    std::string fileName;
+    std::tie(directory, fileName) = GetParam();
+    const std::string root = PathToTestExecutable + "../../../";
+    fileName = root + "examples/" + directory + "/" + fileName;
+    std::ostringstream command;
+    command << PathToTestExecutable
+            << "llreve-dynamic -bounded -only-transform -check-jit"
+            << " -patterns=" << root << "dynamic/patterns/looppatterns"
+            << " -I=" << root << "examples/headers"
+            << " " << fileName << "_1.c"
+            << " " << fileName << "_2.c 2>&1";
+    std::string output;
+    int exitCode;
+    std::tie(exitCode, output) = exec(command.str());
+    ASSERT_EQ(exitCode, 0) << output;
+    // These programs must not fall back to the interpreter
+    ASSERT_EQ(output.find("Using the interpreter"), std::string::npos)
+        << output;
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Bitvect, JitTest,
+    testing::Combine(testing::Values("bitvect"),
+                     testing::Values("andmod", "barthe2-big", "loop",
+                                     "loop2")));
+
+static std::string getDirectory(std::string filePath) {
+    auto pos = filePath.rfind('/');
+    if (pos != std::string::npos) {
+        filePath = filePath.substr(0, pos) + "/";
+    }
+    return filePath;
+}
+
+int main(int argc, char **argv) {
+    PathToTestExecutable = getDirectory(argv[0]);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,239 @@
+#include "llreve/dynamic/Linear.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+// Compares EchelonBasis with the exact rational Gauss-Jordan elimination that
+// was used before. The null space of the basis has one vector per non pivot
+// column, so it is unique up to the scaling that makes its entries coprime.
+
+using std::vector;
+
+// The null space of m computed over the rationals, m must have full rank
+static Matrix<mpq_class> referenceNullSpace(Matrix<mpq_class> m) {
+    if (m.empty()) {
+        return {};
+    }
+    const size_t cols = m[0].size();
+    vector<size_t> pivots;
+    for (size_t col = 0; col < cols && pivots.size() < m.size(); ++col) {
+        const size_t current = pivots.size();
+        size_t nonZeroRow = current;
+        while (nonZeroRow < m.size() && m[nonZeroRow][col] == 0) {
+            ++nonZeroRow;
+        }
+        if (nonZeroRow == m.size()) {
+            continue;
+        }
+        std::swap(m[nonZeroRow], m[current]);
+        const mpq_class leading = m[current][col];
+        for (auto &entry : m[current]) {
+            entry /= leading;
+        }
+        for (size_t i = 0; i < m.size(); ++i) {
+            if (i != current && m[i][col] != 0) {
+                const mpq_class multiple = m[i][col];
+                for (size_t j = col; j < cols; ++j) {
+                    m[i][j] -= multiple * m[current][j];
+                }
+            }
+        }
+        pivots.push_back(col);
+    }
+    EXPECT_EQ(pivots.size(), m.size()) << "the rows are dependent";
+    Matrix<mpq_class> result;
+    for (size_t free = 0; free < cols; ++free) {
+        if (std::find(pivots.begin(), pivots.end(), free) != pivots.end()) {
+            continue;
+        }
+        vector<mpq_class> vec(cols, 0);
+        vec[free] = -1;
+        for (size_t i = 0; i < pivots.size(); ++i) {
+            vec[pivots[i]] = m[i][free];
+        }
+        result.push_back(vec);
+    }
+    return result;
+}
+
+// Scales the vector to coprime integer entries without changing its sign
+static vector<mpz_class> primitive(const vector<mpq_class> &vec) {
+    mpz_class denominator = 1;
+    for (const auto &entry : vec) {
+        denominator = lcm(denominator, entry.get_den());
+    }
+    vector<mpz_class> result;
+    mpz_class divisor = 0;
+    for (const auto &entry : vec) {
+        result.push_back(entry.get_num() * (denominator / entry.get_den()));
+        divisor = gcd(divisor, result.back());
+    }
+    for (auto &entry : result) {
+        entry /= divisor;
+    }
+    return result;
+}
+
+// Inserts the rows and checks the basis against the reference after each
+// row. Returns the number of rows that have been added.
+static size_t checkAgainstReference(const Matrix<mpz_class> &rows) {
+    EchelonBasis basis;
+    Matrix<mpq_class> independent;
+    for (const auto &row : rows) {
+        const bool added = basis.insert(row);
+        Matrix<mpq_class> extended = independent;
+        extended.emplace_back(row.begin(), row.end());
+        // A row is independent iff it is not orthogonal to the null space
+        bool expectedAdded = independent.empty() ? !isZero(row) : false;
+        for (const auto &vec : referenceNullSpace(independent)) {
+            mpq_class product = 0;
+            for (size_t i = 0; i < row.size(); ++i) {
+                product += vec[i] * row[i];
+            }
+            expectedAdded |= product != 0;
+        }
+        EXPECT_EQ(added, expectedAdded);
+        if (added) {
+            independent = std::move(extended);
+        }
+        EXPECT_EQ(basis.rank(), independent.size());
+        Matrix<mpz_class> expected;
+        if (independent.empty()) {
+            for (size_t free = 0; free < row.size(); ++free) {
+                vector<mpz_class> vec(row.size(), 0);
+                vec[free] = -1;
+                expected.push_back(vec);
+            }
+        }
+        for (const auto &vec : referenceNullSpace(independent)) {
+            expected.push_back(primitive(vec));
+        }
+        EXPECT_EQ(basis.nullSpace(), expected);
+    }
+    return independent.size();
+}
+
+static vector<mpz_class> combination(const Matrix<mpz_class> &rows,
+                                     const vector<long> &factors) {
+    vector<mpz_class> result(rows[0].size(), 0);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        for (size_t j = 0; j < result.size(); ++j) {
+            result[j] += factors[i] * rows[i][j];
+        }
+    }
+    return result;
+}
+
+TEST(EchelonBasisTest, RankDeficientRows) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<long> entries(-20, 20);
+    Matrix<mpz_class> generators(3, vector<mpz_class>(7));
+    for (auto &row : generators) {
+        for (auto &entry : row) {
+            entry = entries(gen);
+        }
+    }
+    Matrix<mpz_class> rows;
+    for (int i = 0; i < 30; ++i) {
+        rows.push_back(combination(
+            generators, {entries(gen), entries(gen), entries(gen)}));
+    }
+    // Zero rows and duplicates are dependent
+    rows.push_back(vector<mpz_class>(7, 0));
+    rows.push_back(rows.front());
+    EXPECT_EQ(checkAgainstReference(rows), 3u);
+}
+
+TEST(EchelonBasisTest, FullRankRows) {
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<long> entries(-5, 5);
+    Matrix<mpz_class> rows;
+    for (int i = 0; i < 12; ++i) {
+        vector<mpz_class> row;
+        for (int j = 0; j < 5; ++j) {
+            row.push_back(entries(gen));
+        }
+        rows.push_back(row);
+    }
+    EXPECT_EQ(checkAgainstReference(rows), 5u);
+}
+
+TEST(EchelonBasisTest, EntriesLargerThanOnePrime) {
+    // Rows that are dependent modulo the first prime make the basis check
+    // them exactly and switch to another prime. The third row is dependent,
+    // the fourth vanishes modulo the prime but is independent.
+    const mpz_class prime = (mpz_class(1) << 31) - 1;
+    Matrix<mpz_class> rows = {
+        {prime, 0, 0, 1},
+        {0, prime * prime, 0, 2},
+        {prime * 3, prime * prime * 5, 0, 13},
+        {0, 0, prime, 0},
+    };
+    // Null space entries that need several primes to be reconstructed
+    std::mt19937 gen(3);
+    std::uniform_int_distribution<long> entries(1, 1L << 40);
+    for (int i = 0; i < 3; ++i) {
+        vector<mpz_class> row;
+        for (int j = 0; j < 6; ++j) {
+            row.push_back(mpz_class(entries(gen)) * entries(gen) -
+                          entries(gen));
+        }
+        rows.push_back(row);
+    }
+    Matrix<mpz_class> first(rows.begin(), rows.begin() + 4);
+    EXPECT_EQ(checkAgainstReference(first), 3u);
+    Matrix<mpz_class> second(rows.begin() + 4, rows.end());
+    second.push_back(combination(second, {-7, 1L << 35, 3}));
+    EXPECT_EQ(checkAgainstReference(second), 3u);
+}
+
+TEST(EchelonBasisTest, EntriesTooLargeForAllPrimes) {
+    // The entries of the reduced row echelon form are quotients of minors
+    // with more bits than the product of all primes, so the rational
+    // reconstruction fails and the exact elimination is used
+    std::mt19937 gen(11);
+    Matrix<mpz_class> rows;
+    for (int i = 0; i < 3; ++i) {
+        vector<mpz_class> row;
+        for (int j = 0; j < 5; ++j) {
+            mpz_class entry = 1;
+            entry <<= 2200;
+            row.push_back(entry * (gen() % 1000 + 1) + gen());
+        }
+        rows.push_back(row);
+    }
+    rows.push_back(combination(rows, {2, -3, 5}));
+    EXPECT_EQ(checkAgainstReference(rows), 3u);
+}
+
+TEST(EchelonBasisTest, SmallRowsMatchBigRows) {
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<int64_t> entries(-3, 3);
+    EchelonBasis small;
+    EchelonBasis big;
+    Matrix<int64_t> generators(2, vector<int64_t>(4));
+    for (auto &row : generators) {
+        for (auto &entry : row) {
+            entry = entries(gen);
+        }
+    }
+    for (int i = 0; i < 20; ++i) {
+        vector<int64_t> row(4);
+        const int64_t a = entries(gen), b = entries(gen);
+        for (size_t j = 0; j < row.size(); ++j) {
+            row[j] = a * generators[0][j] + b * generators[1][j];
+        }
+        // Entries whose dot products with the null space overflow
+        if (i == 10) {
+            row[0] = INT64_MAX;
+        }
+        vector<mpz_class> bigRow;
+        for (int64_t entry : row) {
+            bigRow.emplace_back(static_cast<long>(entry));
+        }
+        EXPECT_EQ(small.insert(llvm::ArrayRef<int64_t>(row)),
+                  big.insert(bigRow));
+        EXPECT_EQ(small.nullSpace(), big.nullSpace());
+    }
+}
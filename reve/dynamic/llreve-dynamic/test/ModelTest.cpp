@@ -0,0 +1,264 @@
+#include "llreve/dynamic/Model.h"
+
+#include <gtest/gtest.h>
+
+#include <z3++.h>
+
+#include <sstream>
+
+// Reads models in the forms printed by solvers and compares the arrays with
+// the ones of the expression trees that were built for models before, and
+// with the values z3 evaluates its own models to
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+static shared_ptr<Sat> parseSat(const string &output) {
+    auto result = parseResult(llvm::StringRef(output));
+    EXPECT_TRUE(result && result->isSat()) << output;
+    return std::dynamic_pointer_cast<Sat>(result);
+}
+
+static shared_ptr<TopLevelExpr> definition(const Sat &sat, const string &name) {
+    for (const auto &expr : sat.model.exprs) {
+        if (expr->getName() == name) {
+            return expr;
+        }
+    }
+    ADD_FAILURE() << name << " is not defined";
+    return nullptr;
+}
+
+static void expectSameArray(const ArrayVal &expected, const ArrayVal &actual) {
+    EXPECT_EQ(expected.background, actual.background);
+    EXPECT_EQ(expected.vals, actual.vals);
+}
+
+// The ite chain (ite (= x i_0) v_0 (ite (= x i_1) v_1 ... background)) as it
+// was built for models before
+static shared_ptr<SMTExpr>
+iteTree(const std::vector<std::pair<long, long>> &entries, long background) {
+    shared_ptr<SMTExpr> tree = make_shared<Int>(mpz_class(background));
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        tree = make_shared<ITE>(
+            make_shared<Eq>(make_shared<Identifier>("x"),
+                            make_shared<Int>(mpz_class(it->first))),
+            make_shared<Int>(mpz_class(it->second)), tree);
+    }
+    return tree;
+}
+
+static string scalar(long val) {
+    return val < 0 ? "(- " + std::to_string(-val) + ")" : std::to_string(val);
+}
+
+static string iteText(const std::vector<std::pair<long, long>> &entries,
+                      long background) {
+    string text;
+    for (const auto &entry : entries) {
+        text += "(ite (= x " + scalar(entry.first) + ") " +
+                scalar(entry.second) + " ";
+    }
+    text += scalar(background);
+    text.append(entries.size(), ')');
+    return text;
+}
+
+TEST(ModelTest, ResultsWithoutModel) {
+    EXPECT_FALSE(parseResult(llvm::StringRef("unsat\n"))->isSat());
+    EXPECT_EQ(parseResult(llvm::StringRef("unknown\n")), nullptr);
+    EXPECT_EQ(parseResult(llvm::StringRef("")), nullptr);
+    // Warnings and errors before the result are skipped
+    EXPECT_FALSE(parseResult(llvm::StringRef("WARNING: unused option\n"
+                                             "(error \"line 3: sat\")\n"
+                                             "unsat\n"))
+                     ->isSat());
+    auto sat = parseSat("sat\n");
+    ASSERT_TRUE(sat);
+    EXPECT_TRUE(sat->model.exprs.empty());
+}
+
+TEST(ModelTest, ResultToken) {
+    EXPECT_EQ(resultToken("unsat\n"), "unsat");
+    EXPECT_EQ(resultToken("WARNING: unused option\n"
+                          "(error \"line 3: unsat\")\n"
+                          "sat\n(model (define-fun x () (_ BitVec 8) #x01))"),
+              "sat");
+    EXPECT_EQ(resultToken("timeout\n"), "timeout");
+    EXPECT_EQ(resultToken("(error \"unknown\")\n"), "");
+}
+
+TEST(ModelTest, Scalars) {
+    auto sat = parseSat("sat\n"
+                        "(model\n"
+                        "  (define-fun x () Int (- 5))\n"
+                        "  (define-fun |y z| () Int "
+                        "123456789012345678901234567890)\n"
+                        "  ; a comment\n"
+                        "  (define-fun MAIN () Bool true)\n"
+                        "  (define-fun PROGRAM_1 () Bool false)\n"
+                        ")\n");
+    ASSERT_TRUE(sat);
+    EXPECT_EQ(definition(*sat, "x")->getVal(), -5);
+    EXPECT_EQ(definition(*sat, "y z")->getVal(),
+              mpz_class("123456789012345678901234567890"));
+    EXPECT_EQ(definition(*sat, "MAIN")->getVal(), 1);
+    EXPECT_EQ(definition(*sat, "PROGRAM_1")->getVal(), 0);
+}
+
+TEST(ModelTest, IteChainsMatchExpressionTrees) {
+    const std::vector<std::pair<long, long>> entries = {
+        {3, -5}, {-1, 7}, {0, 0}, {12, -4}};
+    auto sat = parseSat("sat\n(\n  (define-fun k!0 ((x Int)) Int " +
+                        iteText(entries, -2) + ")\n)\n");
+    ASSERT_TRUE(sat);
+    const auto fun = definition(*sat, "k!0");
+    EXPECT_EQ(fun->type(), Type::IntFun);
+    expectSameArray(iteTree(entries, -2)->getArrayVal(), fun->getArrayVal());
+}
+
+TEST(ModelTest, OuterIteTakesPrecedence) {
+    // The expression trees kept the innermost entry, which is not what the
+    // definition means
+    auto sat = parseSat("sat\n(\n  (define-fun k!0 ((x Int)) Int " +
+                        iteText({{3, -5}, {3, 8}}, 1) + ")\n)\n");
+    ASSERT_TRUE(sat);
+    expectSameArray({1, {{3, -5}}}, definition(*sat, "k!0")->getArrayVal());
+}
+
+TEST(ModelTest, StoresAndAsArray) {
+    auto sat = parseSat(
+        "sat\n"
+        "(model\n"
+        "  (define-fun HEAP$1_old () (Array Int Int)\n"
+        "    (store (store ((as const (Array Int Int)) (- 1)) 2 5) 2 6))\n"
+        "  (define-fun HEAP$2_old () (Array Int Int)\n"
+        "    (store (_ as-array k!1) 4 (- 9)))\n"
+        "  (define-fun k!1 ((x!0 Int)) Int\n"
+        "    (ite (= x!0 4) 1 (ite (= 7 x!0) 3 0)))\n"
+        "  (define-fun f ((x!0 Int) (x!1 Int)) Int (+ x!0 x!1))\n"
+        ")\n");
+    ASSERT_TRUE(sat);
+    const auto first = definition(*sat, "HEAP$1_old");
+    EXPECT_EQ(first->type(), Type::IntArray);
+    // The outer store takes precedence
+    expectSameArray({-1, {{2, 6}}}, first->getArrayVal());
+    expectSameArray({0, {{4, -9}, {7, 3}}},
+                    definition(*sat, "HEAP$2_old")->getArrayVal());
+    // Functions with several arguments are skipped
+    EXPECT_EQ(sat->model.exprs.size(), 3u);
+}
+
+TEST(ModelTest, Lambda) {
+    auto sat = parseSat("sat\n"
+                        "(\n"
+                        "  (define-fun HEAP$1 () (Array Int Int)\n"
+                        "    (lambda ((x!1 Int)) (ite (= x!1 (- 3)) 4 "
+                        "(ite (= x!1 2) (- 8) 1))))\n"
+                        ")\n");
+    ASSERT_TRUE(sat);
+    expectSameArray({1, {{-3, 4}, {2, -8}}},
+                    definition(*sat, "HEAP$1")->getArrayVal());
+}
+
+TEST(ModelTest, DeeplyNestedDefinitions) {
+    // The old expression trees can still be evaluated at this depth
+    std::vector<std::pair<long, long>> entries;
+    for (long i = 0; i < 2000; ++i) {
+        entries.push_back({i * 7 - 3000, i % 13 - 6});
+    }
+    auto sat = parseSat("sat\n(\n  (define-fun k!0 ((x Int)) Int " +
+                        iteText(entries, 11) + ")\n)\n");
+    ASSERT_TRUE(sat);
+    expectSameArray(iteTree(entries, 11)->getArrayVal(),
+                    definition(*sat, "k!0")->getArrayVal());
+
+    // Chains that would overflow the stack if they were read recursively
+    const size_t depth = 200000;
+    string stores;
+    for (size_t i = 0; i < depth; ++i) {
+        stores += "(store ";
+    }
+    stores += "((as const (Array Int Int)) 0)";
+    for (size_t i = 0; i < depth; ++i) {
+        stores += " " + std::to_string(i) + " " + scalar(-long(i)) + ")";
+    }
+    sat = parseSat("sat\n((define-fun a () (Array Int Int) " + stores + "))");
+    ASSERT_TRUE(sat);
+    const ArrayVal array = definition(*sat, "a")->getArrayVal();
+    ASSERT_EQ(array.vals.size(), depth);
+    EXPECT_EQ(array.vals.at(depth - 1), -long(depth - 1));
+}
+
+TEST(ModelTest, BitVectorsAreSkipped) {
+    auto sat = parseSat(
+        "sat\n"
+        "(model\n"
+        "  (define-fun x () (_ BitVec 32) #x0000000a)\n"
+        "  (define-fun HEAP$1 () (Array (_ BitVec 32) (_ BitVec 8))\n"
+        "    (store ((as const (Array (_ BitVec 32) (_ BitVec 8))) #x00)\n"
+        "      #x00000004 #xff))\n"
+        "  (define-fun k!0 ((x!0 (_ BitVec 32))) (_ BitVec 8)\n"
+        "    (ite (= x!0 #x00000004) #xff #x00))\n"
+        "  (define-fun y () Int 3)\n"
+        ")\n");
+    ASSERT_TRUE(sat);
+    ASSERT_EQ(sat->model.exprs.size(), 1u);
+    EXPECT_EQ(definition(*sat, "y")->getVal(), 3);
+
+    z3::context z3Cxt;
+    z3::solver z3Solver(z3Cxt);
+    z3::sort arraySort =
+        z3Cxt.array_sort(z3Cxt.bv_sort(32), z3Cxt.bv_sort(8));
+    z3::expr heap = z3Cxt.constant("HEAP$1", arraySort);
+    z3::expr i = z3Cxt.bv_const("i", 32);
+    z3Solver.add(z3::select(heap, i) == z3Cxt.bv_val(7, 8));
+    z3Solver.add(i == z3Cxt.bv_val(-3, 32));
+    z3Solver.add(z3Cxt.int_const("n") == 5);
+    ASSERT_EQ(z3Solver.check(), z3::sat);
+    std::stringstream output;
+    output << "sat\n(\n" << z3Solver.get_model() << ")\n";
+    sat = parseSat(output.str());
+    ASSERT_TRUE(sat);
+    EXPECT_EQ(definition(*sat, "n")->getVal(), 5);
+    for (const auto &expr : sat->model.exprs) {
+        EXPECT_NE(expr->getName(), "i");
+        EXPECT_NE(expr->getName(), "HEAP$1");
+    }
+}
+
+TEST(ModelTest, ModelsPrintedByZ3) {
+    z3::context z3Cxt;
+    z3::solver z3Solver(z3Cxt);
+    z3::sort arraySort = z3Cxt.array_sort(z3Cxt.int_sort(), z3Cxt.int_sort());
+    z3::expr first = z3Cxt.constant("HEAP$1_old", arraySort);
+    z3::expr second = z3Cxt.constant("HEAP$2_old", arraySort);
+    z3::expr x = z3Cxt.int_const("x");
+    z3Solver.add(z3::select(first, 3) == -5);
+    z3Solver.add(z3::select(first, -2) == 7);
+    z3Solver.add(z3::select(first, 10) == 0);
+    z3Solver.add(second == z3::store(first, x, 42));
+    z3Solver.add(x == -12);
+    ASSERT_EQ(z3Solver.check(), z3::sat);
+    z3::model model = z3Solver.get_model();
+    // The output of get-model encloses the definitions in parentheses
+    std::stringstream output;
+    output << "sat\n(\n" << model << ")\n";
+    auto sat = parseSat(output.str());
+    ASSERT_TRUE(sat);
+    EXPECT_EQ(definition(*sat, "x")->getVal(), -12);
+    for (const auto &array : {first, second}) {
+        const ArrayVal val =
+            definition(*sat, array.decl().name().str())->getArrayVal();
+        for (int i = -20; i <= 20; ++i) {
+            const z3::expr expected =
+                model.eval(z3::select(array, i), true);
+            const auto it = val.vals.find(i);
+            const mpz_class actual =
+                it == val.vals.end() ? val.background : it->second;
+            EXPECT_EQ(actual, mpz_class(expected.get_decimal_string(0)))
+                << array << "[" << i << "]";
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#include "llreve/dynamic/ThreadSafeQueue.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// A small capacity makes the producers wait for the consumers and the other
+// way round, so both the spinning and the blocking paths are taken
+
+static const int ItemsPerProducer = 20000;
+
+static void checkExactlyOnce(const std::vector<std::vector<int>> &received,
+                             int producers) {
+    std::vector<int> counts(producers * ItemsPerProducer, 0);
+    for (const auto &items : received) {
+        for (int item : items) {
+            ASSERT_GE(item, 0);
+            ASSERT_LT(item, static_cast<int>(counts.size()));
+            ++counts[item];
+        }
+    }
+    for (size_t item = 0; item < counts.size(); ++item) {
+        ASSERT_EQ(counts[item], 1) << "item " << item;
+    }
+}
+
+static std::vector<std::thread>
+startProducers(BoundedMPMCQueue<int> &queue, int producers) {
+    std::vector<std::thread> threads;
+    for (int producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&queue, producer]() {
+            for (int i = 0; i < ItemsPerProducer; ++i) {
+                ASSERT_TRUE(queue.push(producer * ItemsPerProducer + i));
+            }
+        });
+    }
+    return threads;
+}
+
+class QueueTest : public testing::TestWithParam<::testing::tuple<int, int>> {
+};
+
+TEST_P(QueueTest, PopDeliversEachItemOnce) {
+    int producers, consumers;
+    std::tie(producers, consumers) = GetParam();
+    BoundedMPMCQueue<int> queue(4);
+    std::vector<std::vector<int>> received(consumers);
+    std::vector<std::thread> consumerThreads;
+    for (int consumer = 0; consumer < consumers; ++consumer) {
+        consumerThreads.emplace_back([&queue, &received, consumer]() {
+            while (llvm::Optional<int> item = queue.pop()) {
+                received[consumer].push_back(*item);
+            }
+        });
+    }
+    for (auto &thread : startProducers(queue, producers)) {
+        thread.join();
+    }
+    queue.close();
+    for (auto &thread : consumerThreads) {
+        thread.join();
+    }
+    checkExactlyOnce(received, producers);
+}
+
+TEST_P(QueueTest, PopBatchDeliversEachItemOnce) {
+    int producers, consumers;
+    std::tie(producers, consumers) = GetParam();
+    BoundedMPMCQueue<int> queue(8);
+    std::vector<std::vector<int>> received(consumers);
+    std::vector<std::thread> consumerThreads;
+    for (int consumer = 0; consumer < consumers; ++consumer) {
+        consumerThreads.emplace_back([&queue, &received, consumer]() {
+            while (queue.pop_batch(received[consumer], 3) > 0) {
+            }
+        });
+    }
+    for (auto &thread : startProducers(queue, producers)) {
+        thread.join();
+    }
+    queue.close();
+    for (auto &thread : consumerThreads) {
+        thread.join();
+    }
+    checkExactlyOnce(received, producers);
+}
+
+INSTANTIATE_TEST_CASE_P(ProducersAndConsumers, QueueTest,
+                        testing::Values(::testing::make_tuple(1, 1),
+                                        ::testing::make_tuple(1, 4),
+                                        ::testing::make_tuple(4, 1),
+                                        ::testing::make_tuple(4, 4)));
+
+TEST(QueueCloseTest, WakesBlockedConsumers) {
+    BoundedMPMCQueue<int> queue(4);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < 4; ++i) {
+        consumers.emplace_back(
+            [&queue]() { ASSERT_FALSE(queue.pop().hasValue()); });
+    }
+    // Give the consumers time to give up spinning
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.close();
+    for (auto &thread : consumers) {
+        thread.join();
+    }
+}
+
+TEST(QueueCloseTest, WakesBlockedProducers) {
+    BoundedMPMCQueue<int> queue(2);
+    ASSERT_TRUE(queue.push(0));
+    ASSERT_TRUE(queue.push(1));
+    std::thread producer([&queue]() { ASSERT_FALSE(queue.push(2)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.close();
+    producer.join();
+    ASSERT_EQ(*queue.pop(), 0);
+    ASSERT_EQ(*queue.pop(), 1);
+    ASSERT_FALSE(queue.pop().hasValue());
+}
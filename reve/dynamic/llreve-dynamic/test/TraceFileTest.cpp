@@ -0,0 +1,244 @@
+#include "llreve/dynamic/TraceFile.h"
+
+#include <gtest/gtest.h>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <cstdlib>
+#include <fstream>
+
+// Writes traces built by hand to a trace file and checks that the reader
+// returns the same calls, including heaps, nested calls and the steps that
+// are only stored as deltas
+
+using namespace llreve::dynamic;
+
+static const char *const Program1 = R"(
+define i32 @g(i32 %a) {
+entry:
+  %b = add i32 %a, 1
+  ret i32 %b
+}
+
+define i32 @f(i32 %x, i32* %p) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %v = load i32, i32* %p
+  %c = call i32 @g(i32 %v)
+  %next = add i32 %i, %c
+  %done = icmp sgt i32 %next, %x
+  br i1 %done, label %exit, label %loop
+exit:
+  ret i32 %next
+}
+)";
+
+static const char *const Program2 = R"(
+define i32 @f(i32 %x, i32* %p) {
+entry:
+  %y = mul i32 %x, 2
+  ret i32 %y
+}
+)";
+
+class TraceFileTest : public testing::Test {
+  protected:
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> first;
+    std::unique_ptr<llvm::Module> second;
+    std::string dir;
+
+    virtual void SetUp() {
+        llvm::SMDiagnostic error;
+        first = llvm::parseAssemblyString(Program1, error, context);
+        second = llvm::parseAssemblyString(Program2, error, context);
+        ASSERT_TRUE(first && second);
+        char dirTemplate[] = "/tmp/llreve-trace-test-XXXXXX";
+        ASSERT_NE(mkdtemp(dirTemplate), nullptr);
+        dir = dirTemplate;
+    }
+    virtual void TearDown() {
+        std::remove(traceFilePath(dir).c_str());
+        rmdir(dir.c_str());
+    }
+
+    const llvm::Value *value(const llvm::Function &fun, llvm::StringRef name) {
+        return fun.getValueSymbolTable()->lookup(name);
+    }
+};
+
+static Integer integer(long val) { return Integer(mpz_class(val)); }
+
+static Heap heap(std::vector<std::pair<long, long>> entries, long background) {
+    HeapMap map;
+    for (const auto &entry : entries) {
+        map.set(integer(entry.first), integer(entry.second));
+    }
+    return Heap(std::move(map), integer(background));
+}
+
+static void expectSameVariables(const FastVarMap &expected,
+                                const FastVarMap &actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (const auto &var : expected) {
+        auto it = actual.find(var.first);
+        ASSERT_NE(it, actual.end()) << var.first->getName().str();
+        EXPECT_EQ(var.second, it->second) << var.first->getName().str();
+    }
+}
+
+static void expectSameState(const FastState &expected,
+                            const FastState &actual) {
+    expectSameVariables(expected.variables, actual.variables);
+    EXPECT_TRUE(expected.heap == actual.heap);
+    EXPECT_EQ(expected.heap.background, actual.heap.background);
+}
+
+static void expectSameCall(const FastCall &expected, const FastCall &actual) {
+    EXPECT_EQ(expected.function, actual.function);
+    expectSameState(expected.entryState, actual.entryState);
+    expectSameState(expected.returnState, actual.returnState);
+    EXPECT_EQ(expected.earlyExit, actual.earlyExit);
+    EXPECT_EQ(expected.blocksVisited, actual.blocksVisited);
+    ASSERT_EQ(expected.steps.size(), actual.steps.size());
+    for (size_t i = 0; i < expected.steps.size(); ++i) {
+        const auto &expectedStep = expected.steps[i];
+        const auto &actualStep = actual.steps[i];
+        EXPECT_EQ(expectedStep.blockName, actualStep.blockName);
+        expectSameState(expectedStep.delta->state(), actualStep.delta->state());
+        ASSERT_EQ(expectedStep.calls.size(), actualStep.calls.size());
+        for (size_t j = 0; j < expectedStep.calls.size(); ++j) {
+            expectSameCall(expectedStep.calls[j], actualStep.calls[j]);
+        }
+    }
+}
+
+TEST_F(TraceFileTest, ReadsWrittenTraces) {
+    const llvm::Function &f1 = *first->getFunction("f");
+    const llvm::Function &g = *first->getFunction("g");
+    const llvm::Function &f2 = *second->getFunction("f");
+    const llvm::Value *x1 = value(f1, "x");
+    const llvm::Value *p1 = value(f1, "p");
+    const llvm::Value *i = value(f1, "i");
+    const llvm::Value *v = value(f1, "v");
+    const llvm::Value *c = value(f1, "c");
+    const llvm::Value *next = value(f1, "next");
+    const llvm::Value *a = value(g, "a");
+    const llvm::Value *b = value(g, "b");
+
+    // Values that need the different encodings of integers
+    const mpz_class big("123456789012345678901234567890");
+    const Heap entryHeap = heap({{5, -3}, {6, 7}, {-1, 0}}, 0);
+    HeapMap storedMap = entryHeap.assignedValues();
+    storedMap.set(Integer(mpz_class(big)), Integer(mpz_class(-big)));
+    const Heap storedHeap(storedMap, integer(-4));
+
+    FastVarMap entryVariables;
+    entryVariables.insert({x1, integer(3)});
+    entryVariables.insert({p1, integer(5)});
+    FastState entry(entryVariables, entryHeap);
+
+    auto gCall = [&](long arg, const Heap &callHeap) {
+        FastVarMap gEntry;
+        gEntry.insert({a, integer(arg)});
+        FastVarMap gReturn = gEntry;
+        gReturn.insert({b, integer(arg + 1)});
+        std::vector<BlockStep<const llvm::Value *>> steps;
+        steps.emplace_back("entry", FastState(gReturn, callHeap),
+                           std::vector<FastCall>());
+        return FastCall(&g, FastState(gEntry, callHeap),
+                        FastState(gReturn, callHeap), std::move(steps), false,
+                        1);
+    };
+
+    // A keyframe followed by deltas, one of them changes the heap
+    std::vector<BlockStep<const llvm::Value *>> steps;
+    steps.emplace_back("entry", entry, std::vector<FastCall>());
+    auto delta = steps.back().delta;
+    FastVarMap changed;
+    changed.insert({i, integer(0)});
+    changed.insert({v, integer(-3)});
+    changed.insert({c, integer(-2)});
+    changed.insert({next, integer(-2)});
+    std::vector<FastCall> calls;
+    calls.push_back(gCall(-3, entryHeap));
+    delta = std::make_shared<StateDelta<const llvm::Value *>>(
+        delta, changed, entryHeap);
+    steps.emplace_back("loop", delta, std::move(calls));
+    changed.clear();
+    changed.insert({i, integer(-2)});
+    changed.insert({next, Integer(mpz_class(big))});
+    calls.clear();
+    calls.push_back(gCall(-3, storedHeap));
+    delta = std::make_shared<StateDelta<const llvm::Value *>>(
+        delta, changed, storedHeap);
+    steps.emplace_back("loop", delta, std::move(calls));
+    changed.clear();
+    delta = std::make_shared<StateDelta<const llvm::Value *>>(
+        delta, changed, storedHeap);
+    steps.emplace_back("exit", delta, std::vector<FastCall>());
+    FastState returnState = delta->state();
+    FastCall firstCall(&f1, entry, returnState, std::move(steps), false, 4);
+
+    FastVarMap secondEntry;
+    secondEntry.insert({value(f2, "x"), integer(3)});
+    secondEntry.insert({value(f2, "p"), integer(5)});
+    FastVarMap secondReturn = secondEntry;
+    secondReturn.insert({value(f2, "y"), integer(6)});
+    std::vector<BlockStep<const llvm::Value *>> secondSteps;
+    secondSteps.emplace_back("entry", FastState(secondReturn, entryHeap),
+                             std::vector<FastCall>());
+    // A call that ran out of steps
+    FastCall secondCall(&f2, FastState(secondEntry, entryHeap),
+                        FastState(secondReturn, entryHeap),
+                        std::move(secondSteps), true, 1);
+
+    const MonoPair<FastCall> trace = {firstCall, secondCall};
+    const MonoPair<FastCall> otherTrace = {gCall(7, storedHeap), secondCall};
+    {
+        TraceWriter writer(dir);
+        writer.write(trace);
+        writer.write(otherTrace);
+    }
+
+    TraceReader reader(dir, {first.get(), second.get()});
+    ASSERT_EQ(reader.traces(), 2u);
+    // Traces can be read in any order
+    MonoPair<FastCall> last = reader.trace(1);
+    expectSameCall(otherTrace.first, last.first);
+    expectSameCall(otherTrace.second, last.second);
+    MonoPair<FastCall> read = reader.trace(0);
+    expectSameCall(trace.first, read.first);
+    expectSameCall(trace.second, read.second);
+
+    size_t replayed = 0;
+    replayTraces(dir, {first.get(), second.get()},
+                 [&](MonoPair<FastCall> calls) {
+                     const MonoPair<FastCall> &expected =
+                         replayed == 0 ? trace : otherTrace;
+                     expectSameCall(expected.first, calls.first);
+                     expectSameCall(expected.second, calls.second);
+                     ++replayed;
+                 });
+    EXPECT_EQ(replayed, 2u);
+}
+
+TEST_F(TraceFileTest, ReadsEmptyFile) {
+    { TraceWriter writer(dir); }
+    TraceReader reader(dir, {first.get(), second.get()});
+    EXPECT_EQ(reader.traces(), 0u);
+}
+
+TEST_F(TraceFileTest, RejectsOtherFiles) {
+    {
+        std::ofstream file(traceFilePath(dir));
+        file << "LLRVTRC0 is an older version of the format";
+    }
+    EXPECT_EXIT(TraceReader(dir, {first.get(), second.get()}),
+                testing::ExitedWithCode(1), "not a trace file");
+}
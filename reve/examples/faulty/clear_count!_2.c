@@ -0,0 +1,10 @@
+extern int __mark(int);
+
+int clear(int *a, int n) {
+   int i = 0;
+   while(__mark(42) & (i < n)) {
+      a[i] = 1;
+      i++;
+   }
+   return i;
+}
@@ -0,0 +1,15 @@
+/*@ opt -heap @*/
+/*@ rel_out (= HEAP$1 HEAP$2) @*/
+extern int __mark(int);
+
+// Only the heap is observed so the different results don’t matter
+int clear(int *a, int n) {
+   int i = 0;
+   int count = 0;
+   while(__mark(42) & (i < n)) {
+      a[i] = 0;
+      count = count + 2;
+      i++;
+   }
+   return count;
+}
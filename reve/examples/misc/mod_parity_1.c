@@ -0,0 +1,5 @@
+// Not equivalent in C for negative x but equivalent under the unbounded
+// encoding, which uses mod with a non-negative result
+int f(int x) {
+    return x % 2 == 1;
+}
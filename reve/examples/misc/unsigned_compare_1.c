@@ -0,0 +1,6 @@
+// Not equivalent in C for negative x but equivalent under the unbounded
+// encoding, which compares unsigned values like signed ones
+int f(int x) {
+    unsigned u = x;
+    return u < 5;
+}
@@ -8,13 +8,19 @@
  * See LICENSE (distributed with this file) for details.
  */
 
+#include "BoundedCheck.h"
+#include "CommonSubexpressions.h"
 #include "Compile.h"
+#include "ConeOfInfluence.h"
 #include "GitSHA1.h"
+#include "HornSimplification.h"
 #include "ModuleSMTGeneration.h"
 #include "Opts.h"
 #include "Preprocess.h"
 #include "Serialize.h"
 
+#include "llreve/dynamic/Falsify.h"
+
 #include "clang/Driver/Compilation.h"
 
 #include "llvm/Support/ManagedStatic.h"
@@ -174,6 +180,57 @@ static llreve::cl::opt<bool>
 static llreve::cl::opt<bool> InlineLets("inline-lets",
                                         llreve::cl::desc("Inline lets"),
                                         llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool> SimplifyHornFlag(
+    "simplify-horn",
+    llreve::cl::desc("Inline single use predicates and remove redundant "
+                     "clauses before printing the SMT"),
+    llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool> ConeOfInfluenceFlag(
+    "cone-of-influence",
+    llreve::cl::desc("Remove instructions of the main functions that cannot "
+                     "influence the variables mentioned by the relations"),
+    llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool> CSEFlag(
+    "cse",
+    llreve::cl::desc("Extract repeated subterms into define-funs if this "
+                     "makes the SMT smaller"),
+    llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool>
+    StatsFlag("stats",
+              llreve::cl::desc("Print statistics about the generated SMT to "
+                               "stderr"),
+              llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool> FalsifyFirstFlag(
+    "falsify-first",
+    llreve::cl::desc("Run both programs on concrete inputs before generating "
+                     "SMT and, if they violate the output relation, print the "
+                     "inputs and exit with status 2 without writing SMT"),
+    llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<unsigned> FalsifyTimeoutFlag(
+    "falsify-timeout",
+    llreve::cl::desc("Time budget for -falsify-first in milliseconds"),
+    llreve::cl::init(1000), llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<unsigned> FalsifyThreadsFlag(
+    "falsify-threads",
+    llreve::cl::desc("Number of threads used by -falsify-first, 0 uses all "
+                     "hardware threads"),
+    llreve::cl::init(0), llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<bool> BoundedCheckFlag(
+    "bmc",
+    llreve::cl::desc("Unroll the programs up to a bounded depth before "
+                     "generating SMT and, if a counterexample is found, print "
+                     "it and exit with status 2 without writing SMT"),
+    llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<unsigned> BoundedCheckDepthFlag(
+    "bmc-depth",
+    llreve::cl::desc("Maximal number of steps between marks for -bmc"),
+    llreve::cl::init(10), llreve::cl::cat(ReveCategory));
+static llreve::cl::opt<unsigned> BoundedCheckTimeoutFlag(
+    "bmc-timeout", llreve::cl::desc("Time budget for -bmc in milliseconds"),
+    llreve::cl::init(2000), llreve::cl::cat(ReveCategory));
+
+// Exit status of the quick checks if they find a counterexample
+static const int CounterexampleExitStatus = 2;
 
 static void printVersion() {
     std::cout << "llreve version " << g_GIT_SHA1 << "\n";
@@ -197,6 +254,8 @@ int main(int argc, const char **argv) {
     InputOpts inputOpts(IncludesFlag, ResourceDirFlag, FileName1Flag,
                         FileName2Flag);
     FileOptions fileOpts = getFileOptions(inputOpts.FileNames);
+    preprocessOpts.ConeOfInfluence = ConeOfInfluenceFlag;
+    preprocessOpts.Observed = observedState(fileOpts);
     SerializeOpts serializeOpts(OutputFileNameFlag, DontInstantiate,
                                 BitVectFlag, true, InlineLets);
 
@@ -237,8 +296,50 @@ int main(int argc, const char **argv) {
     printModule(*modules.first, IRFileName1);
     printModule(*modules.second, IRFileName2);
 
+    if (FalsifyFirstFlag) {
+        const auto witness = llreve::dynamic::falsify(
+            moduleRefs, SMTGenerationOpts::getInstance().MainFunctions,
+            analysisResults, fileOpts,
+            llreve::dynamic::FalsifyOpts(FalsifyTimeoutFlag,
+                                         FalsifyThreadsFlag, 10000, 0));
+        if (witness.hasValue()) {
+            std::cout << "NOT_EQUIVALENT\n";
+            llreve::dynamic::dumpWitness(std::cout, *witness);
+            llvm::llvm_shutdown();
+            return CounterexampleExitStatus;
+        }
+    }
+    if (BoundedCheckFlag) {
+        const auto counterexample = boundedCheck(
+            moduleRefs, SMTGenerationOpts::getInstance().MainFunctions,
+            analysisResults, fileOpts,
+            BoundedCheckOpts(BoundedCheckDepthFlag, BoundedCheckTimeoutFlag));
+        if (counterexample.hasValue()) {
+            std::cout << "NOT_EQUIVALENT\n";
+            dumpBoundedCounterexample(std::cout, *counterexample);
+            llvm::llvm_shutdown();
+            return CounterexampleExitStatus;
+        }
+    }
+
     vector<SharedSMTRef> smtExprs =
         generateSMT(moduleRefs, analysisResults, fileOpts);
+    if (SimplifyHornFlag) {
+        smtExprs = simplifyHornClauses(std::move(smtExprs));
+    }
+    if (CSEFlag) {
+        CommonSubexpressionStats cseStats;
+        smtExprs = extractCommonSubexpressions(std::move(smtExprs), cseStats);
+        if (StatsFlag) {
+            llvm::errs() << "cse: " << cseStats.definitions
+                         << " definitions, size " << cseStats.sizeBefore
+                         << " -> " << cseStats.sizeAfter << " bytes\n";
+        }
+    }
+    if (StatsFlag) {
+        llvm::errs() << "smt: " << smtExprs.size() << " expressions, size "
+                     << serializedSize(smtExprs) << " bytes\n";
+    }
 
     serializeSMT(smtExprs,
                  SMTGenerationOpts::getInstance().OutputFormat == SMTFormat::Z3,
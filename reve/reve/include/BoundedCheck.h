@@ -0,0 +1,61 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "AnalysisResults.h"
+#include "MonoPair.h"
+#include "Opts.h"
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/Module.h"
+
+#include <map>
+#include <ostream>
+
+struct BoundedCheckOpts {
+    // Maximal number of mark to mark steps each program is unrolled
+    unsigned MaxDepth;
+    // Wall clock budget for all depths in milliseconds
+    unsigned Timeout;
+    BoundedCheckOpts(unsigned maxDepth, unsigned timeout)
+        : MaxDepth(maxDepth), Timeout(timeout) {}
+};
+
+/// Inputs on which the programs terminate within the bound and violate the
+/// output relation. The values are stored as printed by Z3.
+struct BoundedCounterexample {
+    unsigned depth;
+    std::map<std::string, std::string> arguments;
+    MonoPair<std::string> results;
+    BoundedCounterexample(unsigned depth,
+                          std::map<std::string, std::string> arguments,
+                          MonoPair<std::string> results)
+        : depth(depth), arguments(std::move(arguments)),
+          results(std::move(results)) {}
+};
+
+/// Search for a counterexample by unrolling the paths between marks of both
+/// main functions up to increasing depths. In contrast to the Horn encoding
+/// no invariants are involved so each query is quantifier free and solved
+/// in-process.
+auto boundedCheck(MonoPair<const llvm::Module &> modules,
+                  MonoPair<const llvm::Function *> functions,
+                  const AnalysisResultsMap &analysisResults,
+                  const llreve::opts::FileOptions &fileOpts,
+                  BoundedCheckOpts opts)
+    -> llvm::Optional<BoundedCounterexample>;
+
+/// Checks if the paths of the function can be unrolled. Calls are not inlined
+/// so only functions without calls are supported.
+auto canUnroll(const llvm::Function &fun) -> bool;
+
+void dumpBoundedCounterexample(std::ostream &out,
+                               const BoundedCounterexample &counterexample);
@@ -0,0 +1,36 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "SMT.h"
+
+struct CommonSubexpressionStats {
+    // Number of introduced define-funs
+    unsigned definitions = 0;
+    // Size of the serialized assertions and definitions in bytes
+    size_t sizeBefore = 0;
+    size_t sizeAfter = 0;
+};
+
+/// Hoist subterms that occur repeatedly in the assertions into define-funs.
+/**
+Only terms consisting of operator applications, variables and constants are
+considered. The free variables of a term become the arguments of its
+definition so terms that are parametrized over the quantified variables of a
+clause can be shared between clauses. Predicate applications are never
+extracted and a term is only extracted if this makes the output smaller.
+*/
+auto extractCommonSubexpressions(std::vector<smt::SharedSMTRef> smtExprs,
+                                 CommonSubexpressionStats &stats)
+    -> std::vector<smt::SharedSMTRef>;
+
+/// Number of bytes the expressions take up when they are serialized.
+auto serializedSize(const std::vector<smt::SharedSMTRef> &smtExprs) -> size_t;
@@ -0,0 +1,30 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "Opts.h"
+
+#include "llvm/IR/Function.h"
+
+/// Determine if the relations mention the return values and the heaps. The
+/// default relations mention both.
+auto observedState(const llreve::opts::FileOptions &fileOpts)
+    -> llreve::opts::ObservedState;
+
+/// Remove the instructions that can’t influence the observed state.
+/**
+Branch conditions, calls and the observed parts of the final state are
+relevant, everything they depend on is relevant as well. Stores only become
+relevant if the heap is observed, loaded or passed to a call. Returns the
+number of removed instructions. Functions that use the stack are not reduced.
+*/
+auto reduceToConeOfInfluence(llvm::Function &fun,
+                             llreve::opts::ObservedState observed) -> unsigned;
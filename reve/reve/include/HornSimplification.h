@@ -0,0 +1,25 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#pragma once
+
+#include "SMT.h"
+
+/// Simplify the Horn clauses produced by generateSMT before they are
+/// serialized.
+/**
+This removes duplicate clauses, clauses with a constant false premise, clauses
+whose premises can never be satisfied because they use a predicate that is not
+derivable from the facts and clauses whose head does not contribute to any
+query. Predicates that are defined by a single clause and used in a single
+premise are inlined into the clause using them.
+*/
+auto simplifyHornClauses(std::vector<smt::SharedSMTRef> smtExprs)
+    -> std::vector<smt::SharedSMTRef>;
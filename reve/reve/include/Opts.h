@@ -29,15 +29,26 @@ template <typename T> struct FunctionInvariant {
 namespace opts {
 extern llreve::cl::OptionCategory ReveCategory;
 
+/// The parts of the final states of the main functions that are mentioned by
+/// the relations
+struct ObservedState {
+    bool ReturnValue = true;
+    bool Heap = true;
+};
+
 /// Options used for preprocessing modules
 class PreprocessOpts {
   public:
     bool ShowCFG;
     bool ShowMarkedCFG;
     bool InferMarks;
+    // Remove the instructions of the main functions that can’t influence the
+    // observed state
+    bool ConeOfInfluence;
+    ObservedState Observed;
     PreprocessOpts(bool showCFG, bool showMarkedCFG, bool inferMarks)
         : ShowCFG(showCFG), ShowMarkedCFG(showMarkedCFG),
-          InferMarks(inferMarks) {}
+          InferMarks(inferMarks), ConeOfInfluence(false) {}
 };
 
 enum class HeapOpt { Enabled, Disabled };
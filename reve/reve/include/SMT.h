@@ -106,6 +106,13 @@ class SMTExpr : public std::enable_shared_from_this<SMTExpr> {
     // Needed because we compile without rtti and thereby can’t use a dynamic
     // cast to check the type
     virtual bool isConstantFalse() const { return false; }
+    // For the same reason these are used to take apart Horn clauses, they
+    // return nullptr if the expression is of a different type
+    virtual const Assert *asAssert() const { return nullptr; }
+    virtual const Forall *asForall() const { return nullptr; }
+    virtual const Let *asLet() const { return nullptr; }
+    virtual const Op *asOp() const { return nullptr; }
+    virtual const FunDecl *asFunDecl() const { return nullptr; }
 };
 
 using SMTRef = std::unique_ptr<SMTExpr>;
@@ -134,6 +141,7 @@ class Assert : public SMTExpr {
     void toZ3(z3::context &cxt, z3::solver &solver,
               llvm::StringMap<z3::expr> &nameMap,
               llvm::StringMap<Z3DefineFun> &defineFunMap) const override;
+    const Assert *asAssert() const override { return this; }
 };
 
 // TypedVariable is simply a reference to a variable with a type attached to it,
@@ -201,6 +209,7 @@ class Forall : public SMTExpr {
     std::vector<SharedSMTRef> splitConjunctions() override;
     SharedSMTRef
     inlineLets(std::map<std::string, SharedSMTRef> assignments) override;
+    const Forall *asForall() const override { return this; }
 };
 
 class CheckSat : public SMTExpr {
@@ -243,6 +252,7 @@ class Let : public SMTExpr {
     z3::expr
     toZ3Expr(z3::context &cxt, llvm::StringMap<z3::expr> &nameMap,
              const llvm::StringMap<Z3DefineFun> &defineFunMap) const override;
+    const Let *asLet() const override { return this; }
 };
 
 // We could unify these in a generic type but it’s probably not worth the
@@ -315,6 +325,7 @@ class Op : public SMTExpr {
     z3::expr
     toZ3Expr(z3::context &cxt, llvm::StringMap<z3::expr> &nameMap,
              const llvm::StringMap<Z3DefineFun> &defineFunMap) const override;
+    const Op *asOp() const override { return this; }
 };
 
 class FPCmp : public SMTExpr {
@@ -424,6 +435,7 @@ class FunDecl : public SMTExpr {
           outType(std::move(outType)) {}
     std::shared_ptr<SMTExpr> accept(SMTVisitor &visitor) const override;
     sexpr::SExprRef toSExpr() const override;
+    const FunDecl *asFunDecl() const override { return this; }
 };
 
 class FunDef : public SMTExpr {
@@ -0,0 +1,325 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "BoundedCheck.h"
+
+#include "FunctionSMTGeneration.h"
+#include "Helper.h"
+#include "ModuleSMTGeneration.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <chrono>
+
+using llvm::Optional;
+using llvm::dyn_cast;
+using llvm::isa;
+
+using smt::FunDef;
+using smt::SMTRef;
+using smt::SortedVar;
+using smt::TypedVariable;
+
+using std::make_unique;
+using std::map;
+using std::string;
+using std::vector;
+
+using namespace llreve::opts;
+
+bool canUnroll(const llvm::Function &fun) {
+    for (const auto &bb : fun) {
+        for (const auto &instr : bb) {
+            if (instr.getType()->isFloatingPointTy()) {
+                return false;
+            }
+            for (const auto op : instr.operand_values()) {
+                if (isa<llvm::GlobalVariable>(op) ||
+                    isa<llvm::ConstantExpr>(op) || isa<llvm::ConstantFP>(op)) {
+                    return false;
+                }
+            }
+            if (const auto call = dyn_cast<llvm::CallInst>(&instr)) {
+                const auto calledFun = call->getCalledFunction();
+                if (calledFun == nullptr ||
+                    calledFun->getIntrinsicID() != llvm::Intrinsic::memcpy) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static z3::sort z3Sort(z3::context &cxt, const smt::Type &type) {
+    switch (type.getTag()) {
+    case smt::TypeTag::Bool:
+        return cxt.bool_sort();
+    case smt::TypeTag::Array:
+        return cxt.array_sort(cxt.int_sort(), cxt.int_sort());
+    default:
+        return cxt.int_sort();
+    }
+}
+
+namespace {
+/// The paths between the marks of a single program. Every variable has a
+/// separate copy for each step, the result values have only one copy since the
+/// exit is reached at most once.
+class Unrolling {
+    z3::context &cxt;
+    const AnalysisResults &results;
+    Program prog;
+    vector<SortedVar> exitVars;
+
+  public:
+    Unrolling(z3::context &cxt, const AnalysisResults &results,
+              const llvm::Type *returnType, Program prog)
+        : cxt(cxt), results(results), prog(prog) {
+        exitVars.push_back({resultName(prog), smt::llvmType(returnType)});
+        if (SMTGenerationOpts::getInstance().Heap == HeapOpt::Enabled) {
+            exitVars.push_back({heapResultName(prog), smt::memoryType()});
+        }
+    }
+    z3::expr mark(unsigned step) const {
+        const string name = "MARK$" + std::to_string(programIndex(prog)) +
+                            "@" + std::to_string(step);
+        return cxt.int_const(name.c_str());
+    }
+    z3::expr variable(const SortedVar &var, unsigned step) const {
+        const string name = var.name + "@" + std::to_string(step);
+        return cxt.constant(name.c_str(), z3Sort(cxt, var.type));
+    }
+    z3::expr exitVariable(const SortedVar &var) const {
+        return cxt.constant(var.name.c_str(), z3Sort(cxt, var.type));
+    }
+    const vector<SortedVar> &entryVars() const {
+        return results.freeVariables.at(ENTRY_MARK);
+    }
+    const vector<SortedVar> &resultVars() const { return exitVars; }
+    /// The program moves along one path from the mark at step to the mark at
+    /// step + 1 or has already reached the exit
+    z3::expr transition(unsigned step) const;
+};
+} // namespace
+
+z3::expr Unrolling::transition(unsigned step) const {
+    z3::expr exitMark = cxt.int_val(EXIT_MARK.asInt());
+    z3::expr result = mark(step) == exitMark && mark(step + 1) == exitMark;
+    for (const auto &startIt : results.paths) {
+        const Mark startMark = startIt.first;
+        const auto &startVars = results.freeVariables.at(startMark);
+        for (const auto &endIt : startIt.second) {
+            const Mark endMark = endIt.first;
+            const auto &endVars = endMark == EXIT_MARK
+                                      ? exitVars
+                                      : results.freeVariables.at(endMark);
+            for (const auto &path : endIt.second) {
+                llvm::StringMap<z3::expr> nameMap;
+                for (const auto &var : startVars) {
+                    nameMap.insert({var.name + "_old", variable(var, step)});
+                }
+                // The values at the end of the path are equated with the
+                // copies of the next step
+                vector<smt::SharedSMTRef> endEqualities;
+                for (const auto &var : endVars) {
+                    const string nextName = var.name + "$next";
+                    nameMap.insert({nextName, endMark == EXIT_MARK
+                                                  ? exitVariable(var)
+                                                  : variable(var, step + 1)});
+                    endEqualities.push_back(
+                        makeOp("=", smt::typedVariableFromSortedVar(var),
+                               make_unique<TypedVariable>(nextName, var.type)));
+                }
+                SMTRef clause = make_unique<smt::ConstantBool>(true);
+                if (!endEqualities.empty()) {
+                    clause = make_unique<smt::Op>("and", endEqualities);
+                }
+                // canUnroll guarantees that there are no calls so there is
+                // only a single list of blocks
+                auto blocks = splitAssignmentsFromCalls(
+                                  assignmentsOnPath(path, prog, startVars,
+                                                    endMark == EXIT_MARK))
+                                  .assignments;
+                assert(blocks.size() == 1);
+                // In contrast to addAssignments the conditions are conjoined
+                // since we are looking for an execution along this path
+                for (auto blockIt = blocks.front().rbegin();
+                     blockIt != blocks.front().rend(); ++blockIt) {
+                    clause = smt::fastNestLets(std::move(clause),
+                                               blockIt->definitions);
+                    if (blockIt->condition) {
+                        clause = makeOp("and", blockIt->condition,
+                                        std::move(clause));
+                    }
+                }
+                result =
+                    result ||
+                    (mark(step) == cxt.int_val(startMark.asInt()) &&
+                     mark(step + 1) == cxt.int_val(endMark.asInt()) &&
+                     clause->toZ3Expr(cxt, nameMap, {}));
+            }
+        }
+    }
+    return result;
+}
+
+static z3::expr relationExpr(z3::context &cxt, const FunDef &relation,
+                             const llvm::StringMap<z3::expr> &values) {
+    llvm::StringMap<z3::expr> nameMap;
+    for (const auto &arg : relation.args) {
+        auto it = values.find(arg.name);
+        if (it == values.end()) {
+            logError("No value for " + arg.name + " in " + relation.funName +
+                     "\n");
+            exit(1);
+        }
+        nameMap.insert({arg.name, it->second});
+    }
+    return relation.body->toZ3Expr(cxt, nameMap, {});
+}
+
+Optional<BoundedCounterexample>
+boundedCheck(MonoPair<const llvm::Module &> modules,
+             MonoPair<const llvm::Function *> functions,
+             const AnalysisResultsMap &analysisResults,
+             const FileOptions &fileOpts, BoundedCheckOpts opts) {
+    const auto &smtOpts = SMTGenerationOpts::getInstance();
+    if (smtOpts.BitVect || smtOpts.Stack == StackOpt::Enabled) {
+        logWarning("Bounded checking is not supported with bitvectors or a "
+                   "stack, skipping it\n");
+        return Optional<BoundedCounterexample>();
+    }
+    if (!canUnroll(*functions.first) || !canUnroll(*functions.second)) {
+        logWarning("Bounded checking only supports functions without calls "
+                   "and floats, skipping it\n");
+        return Optional<BoundedCounterexample>();
+    }
+    if ((fileOpts.InRelation == nullptr || fileOpts.AdditionalInRelation) &&
+        functions.first->arg_size() != functions.second->arg_size()) {
+        logWarning("Bounded checking requires a custom input relation for "
+                   "functions with different arguments\n");
+        return Optional<BoundedCounterexample>();
+    }
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(opts.Timeout);
+
+    z3::context cxt;
+    z3::solver solver(cxt);
+    MonoPair<Unrolling> unrollings = {
+        Unrolling(cxt, analysisResults.at(functions.first),
+                  functions.first->getReturnType(), Program::First),
+        Unrolling(cxt, analysisResults.at(functions.second),
+                  functions.second->getReturnType(), Program::Second)};
+
+    // The program does not use globals so there are no string constants
+    const auto inRelation =
+        inInvariant(functions, analysisResults, fileOpts.InRelation,
+                    modules.first, modules.second, false,
+                    fileOpts.AdditionalInRelation);
+    const auto outRelation =
+        outInvariant(getFunctionArguments(functions, analysisResults),
+                     fileOpts.OutRelation, functions.first->getReturnType());
+    llvm::StringMap<z3::expr> inValues;
+    llvm::StringMap<z3::expr> outValues;
+    unrollings.forEach([&](const Unrolling &unrolling) {
+        solver.add(unrolling.mark(0) == cxt.int_val(ENTRY_MARK.asInt()));
+        for (const auto &var : unrolling.entryVars()) {
+            inValues.insert({var.name, unrolling.variable(var, 0)});
+            // The input heaps are not passed through
+            if (!smt::isArray(var.type)) {
+                outValues.insert({var.name, unrolling.variable(var, 0)});
+            }
+        }
+        for (const auto &var : unrolling.resultVars()) {
+            outValues.insert({var.name, unrolling.exitVariable(var)});
+        }
+    });
+    // OUT_INV refers to the heaps after the call by their plain names
+    if (smtOpts.Heap == HeapOpt::Enabled) {
+        outValues.erase(heapName(Program::First));
+        outValues.erase(heapName(Program::Second));
+        outValues.insert({heapName(Program::First),
+                          outValues.find(heapResultName(Program::First))
+                              ->second});
+        outValues.insert({heapName(Program::Second),
+                          outValues.find(heapResultName(Program::Second))
+                              ->second});
+    }
+    solver.add(relationExpr(cxt, *inRelation, inValues));
+    solver.add(!relationExpr(cxt, *outRelation, outValues));
+
+    const z3::expr exitMark = cxt.int_val(EXIT_MARK.asInt());
+    for (unsigned depth = 1; depth <= opts.MaxDepth; ++depth) {
+        unrollings.forEach([&](const Unrolling &unrolling) {
+            solver.add(unrolling.transition(depth - 1));
+        });
+        const auto remaining =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now())
+                .count();
+        if (remaining <= 0) {
+            break;
+        }
+        z3::params params(cxt);
+        params.set("timeout", static_cast<unsigned>(remaining));
+        solver.set(params);
+        // Requiring both programs to have exited is only an assumption so the
+        // transitions can be reused for the next depth
+        const string exitedName = "EXITED@" + std::to_string(depth);
+        z3::expr exited = cxt.bool_const(exitedName.c_str());
+        solver.add(z3::implies(exited,
+                               unrollings.first.mark(depth) == exitMark &&
+                                   unrollings.second.mark(depth) == exitMark));
+        z3::expr_vector assumptions(cxt);
+        assumptions.push_back(exited);
+        const z3::check_result result = solver.check(assumptions);
+        if (result == z3::unknown) {
+            break;
+        }
+        if (result == z3::sat) {
+            z3::model model = solver.get_model();
+            map<string, string> arguments;
+            for (const auto &value : inValues) {
+                arguments.insert(
+                    {value.getKey().str(),
+                     model.eval(value.getValue(), true).to_string()});
+            }
+            MonoPair<string> results = unrollings.map<string>(
+                [&](const Unrolling &unrolling) {
+                    return model
+                        .eval(unrolling.exitVariable(
+                                  unrolling.resultVars().front()),
+                              true)
+                        .to_string();
+                });
+            return BoundedCounterexample(depth, std::move(arguments),
+                                         std::move(results));
+        }
+    }
+    return Optional<BoundedCounterexample>();
+}
+
+void dumpBoundedCounterexample(std::ostream &out,
+                               const BoundedCounterexample &counterexample) {
+    out << "; Counterexample found by unrolling to depth "
+        << counterexample.depth << "\n";
+    out << "; arguments:\n";
+    for (const auto &arg : counterexample.arguments) {
+        out << ";   " << arg.first << " = " << arg.second << "\n";
+    }
+    out << "; results:\n";
+    out << ";   " << resultName(Program::First) << " = "
+        << counterexample.results.first << "\n";
+    out << ";   " << resultName(Program::Second) << " = "
+        << counterexample.results.second << "\n";
+}
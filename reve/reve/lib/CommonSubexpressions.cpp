@@ -0,0 +1,425 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "CommonSubexpressions.h"
+
+#include "Memory.h"
+
+#include "llvm/ADT/Optional.h"
+
+#include <algorithm>
+#include <sstream>
+
+using llvm::Optional;
+
+using smt::FunDef;
+using smt::Op;
+using smt::SMTExpr;
+using smt::SharedSMTRef;
+using smt::SortedVar;
+using smt::TypedVariable;
+
+using std::make_shared;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+// Id of terms that can’t be part of an extracted term
+static const int OPAQUE = -1;
+
+static const set<string> booleanOps = {
+    "and",   "or",    "not",   "=>",    "xor",   "=",     "distinct",
+    "<",     "<=",    ">",     ">=",    "bvult", "bvule", "bvugt",
+    "bvuge", "bvslt", "bvsle", "bvsgt", "bvsge"};
+
+// Operations whose result has the same type as their first argument
+static const set<string> homogeneousOps = {
+    "+",      "-",      "*",      "div",    "mod",    "abs",
+    "bvadd",  "bvsub",  "bvmul",  "bvudiv", "bvsdiv", "bvurem",
+    "bvsrem", "bvand",  "bvor",   "bvxor",  "bvshl",  "bvlshr",
+    "bvashr", "bvnot",  "bvneg",  "store"};
+
+namespace {
+struct Term {
+    // Number of nodes in the term
+    size_t size;
+    unsigned occurrences;
+    bool isOp;
+    // Ids of the arguments of an operator application
+    vector<int> args;
+    // Only set for variables
+    Optional<SortedVar> variable;
+    // Not set if we don’t know the type of the term
+    Optional<smt::Type> type;
+    SharedSMTRef representative;
+    Term(size_t size, bool isOp, vector<int> args, Optional<smt::Type> type)
+        : size(size), occurrences(0), isOp(isOp), args(std::move(args)),
+          type(std::move(type)) {}
+};
+
+struct Definition {
+    string name;
+    // Ids of the free variables in the order of the arguments
+    vector<int> variables;
+};
+
+/// Structurally equal terms are assigned the same id. Arguments always have a
+/// smaller id than the terms they are used in.
+class TermTable {
+    map<string, int> ids;
+
+  public:
+    vector<Term> terms;
+    int intern(const string &key, Term term) {
+        auto it = ids.find(key);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        int id = static_cast<int>(terms.size());
+        terms.push_back(std::move(term));
+        ids.insert({key, id});
+        return id;
+    }
+    void collectVariables(int id, set<int> &variables) const {
+        const Term &term = terms.at(id);
+        if (term.variable) {
+            variables.insert(id);
+        }
+        for (int arg : term.args) {
+            collectVariables(arg, variables);
+        }
+    }
+    vector<int> freeVariables(int id) const {
+        set<int> variables;
+        collectVariables(id, variables);
+        return vector<int>(variables.begin(), variables.end());
+    }
+    /// Account for the fact that count occurrences of the term have been
+    /// replaced by applications so the subterms occur less often
+    void removeOccurrences(int id, unsigned count) {
+        for (int arg : terms.at(id).args) {
+            Term &term = terms.at(arg);
+            term.occurrences -= std::min(term.occurrences, count);
+            removeOccurrences(arg, count);
+        }
+    }
+};
+
+/// Assigns ids to the terms in an expression. Since accept traverses the
+/// arguments between dispatch and reassemble the ids of the arguments are
+/// collected on a stack of frames.
+struct TermNumbering : smt::SMTVisitor {
+    TermTable &table;
+    const set<string> &predicates;
+    const map<string, smt::Type> &functionTypes;
+    vector<vector<int>> frames = {{}};
+    TermNumbering(TermTable &table, const set<string> &predicates,
+                  const map<string, smt::Type> &functionTypes)
+        : table(table), predicates(predicates), functionTypes(functionTypes) {
+    }
+    virtual ~TermNumbering() = default;
+    /// Called for every term that has an id, the result replaces the term
+    virtual SharedSMTRef term(int id, SMTExpr &expr) {
+        return expr.shared_from_this();
+    }
+
+    void push(int id) { frames.back().push_back(id); }
+    void pop() { frames.back().pop_back(); }
+    void open() { frames.emplace_back(); }
+    SharedSMTRef opaque(SMTExpr &expr) {
+        push(OPAQUE);
+        return expr.shared_from_this();
+    }
+    SharedSMTRef close(SMTExpr &expr) {
+        frames.pop_back();
+        return opaque(expr);
+    }
+
+    void dispatch(smt::Assert & /* unused */) override { open(); }
+    void dispatch(smt::Forall & /* unused */) override { open(); }
+    void dispatch(smt::Let & /* unused */) override { open(); }
+    void dispatch(Op & /* unused */) override { open(); }
+    void dispatch(smt::BinaryFPOperator & /* unused */) override { open(); }
+    void dispatch(FunDef & /* unused */) override { open(); }
+
+    SharedSMTRef reassemble(smt::Assert &expr) override { return close(expr); }
+    SharedSMTRef reassemble(smt::Forall &expr) override {
+        return close(expr);
+    }
+    SharedSMTRef reassemble(smt::BinaryFPOperator &expr) override {
+        return close(expr);
+    }
+    SharedSMTRef reassemble(FunDef &expr) override { return close(expr); }
+    SharedSMTRef reassemble(smt::Let &let) override {
+        frames.pop_back();
+        // The bindings are traversed before the let is dispatched
+        for (size_t i = 0; i < let.defs.assgns.size(); ++i) {
+            pop();
+        }
+        return opaque(let);
+    }
+    SharedSMTRef reassemble(smt::TypeCast &cast) override {
+        // The operand is traversed before the cast is dispatched
+        pop();
+        return opaque(cast);
+    }
+    // FPCmp does not traverse its operands
+    SharedSMTRef reassemble(smt::FPCmp &expr) override { return opaque(expr); }
+    SharedSMTRef reassemble(smt::ConstantFP &expr) override {
+        return opaque(expr);
+    }
+    // Could be a variable but we don’t know its type
+    SharedSMTRef reassemble(smt::ConstantString &expr) override {
+        return opaque(expr);
+    }
+
+    SharedSMTRef reassemble(TypedVariable &var) override {
+        std::ostringstream key;
+        key << "v " << var.name << " " << *var.type.toSExpr();
+        Term term(1, false, {}, var.type);
+        term.variable = SortedVar(var.name, var.type);
+        int id = table.intern(key.str(), std::move(term));
+        push(id);
+        return this->term(id, var);
+    }
+    SharedSMTRef reassemble(smt::ConstantInt &constant) override {
+        std::ostringstream key;
+        key << "c " << *constant.toSExpr();
+        int id = table.intern(
+            key.str(),
+            Term(1, false, {},
+                 smt::Type(smt::IntType(constant.value.getBitWidth()))));
+        push(id);
+        return term(id, constant);
+    }
+    SharedSMTRef reassemble(smt::ConstantBool &constant) override {
+        int id = table.intern(constant.value ? "c true" : "c false",
+                              Term(1, false, {}, smt::Type(smt::boolType())));
+        push(id);
+        return term(id, constant);
+    }
+    SharedSMTRef reassemble(Op &op) override {
+        vector<int> args = std::move(frames.back());
+        frames.pop_back();
+        if (predicates.count(op.opName) > 0 ||
+            std::find(args.begin(), args.end(), OPAQUE) != args.end()) {
+            return opaque(op);
+        }
+        std::ostringstream key;
+        key << "o" << op.instantiate << " " << op.opName;
+        size_t size = 1;
+        for (int arg : args) {
+            key << " " << arg;
+            size += table.terms.at(arg).size;
+        }
+        Optional<smt::Type> type = resultType(op.opName, args);
+        int id = table.intern(key.str(),
+                              Term(size, true, std::move(args), type));
+        push(id);
+        return term(id, op);
+    }
+
+    Optional<smt::Type> resultType(const string &opName,
+                                   const vector<int> &args) const {
+        if (booleanOps.count(opName) > 0) {
+            return smt::Type(smt::boolType());
+        }
+        if (homogeneousOps.count(opName) > 0 && !args.empty()) {
+            return table.terms.at(args.front()).type;
+        }
+        if (opName == "ite" && args.size() == 3) {
+            return table.terms.at(args.at(1)).type;
+        }
+        // All arrays are memories
+        if (opName == "select" && args.size() == 2) {
+            return smt::Type(smt::IntType(8));
+        }
+        auto it = functionTypes.find(opName);
+        if (it != functionTypes.end()) {
+            return it->second;
+        }
+        return Optional<smt::Type>();
+    }
+};
+
+struct OccurrenceCounter : TermNumbering {
+    using TermNumbering::TermNumbering;
+    SharedSMTRef term(int id, SMTExpr &expr) override {
+        Term &term = table.terms.at(id);
+        ++term.occurrences;
+        if (!term.representative) {
+            term.representative = expr.shared_from_this();
+        }
+        return expr.shared_from_this();
+    }
+};
+
+struct DefinitionInliner : TermNumbering {
+    const map<int, Definition> &definitions;
+    // Renaming of variables to the arguments of the definition whose body is
+    // constructed and the id of that definition
+    const map<int, string> &parameters;
+    int root;
+    DefinitionInliner(TermTable &table, const set<string> &predicates,
+                      const map<string, smt::Type> &functionTypes,
+                      const map<int, Definition> &definitions,
+                      const map<int, string> &parameters, int root)
+        : TermNumbering(table, predicates, functionTypes),
+          definitions(definitions), parameters(parameters), root(root) {}
+    SharedSMTRef variable(int id) const {
+        const SortedVar &var = *table.terms.at(id).variable;
+        auto it = parameters.find(id);
+        return make_shared<TypedVariable>(
+            it == parameters.end() ? var.name : it->second, var.type);
+    }
+    SharedSMTRef term(int id, SMTExpr &expr) override {
+        if (table.terms.at(id).variable) {
+            return variable(id);
+        }
+        auto it = definitions.find(id);
+        if (id == root || it == definitions.end()) {
+            return expr.shared_from_this();
+        }
+        vector<SharedSMTRef> args;
+        for (int var : it->second.variables) {
+            args.push_back(variable(var));
+        }
+        return make_shared<Op>(it->second.name, std::move(args));
+    }
+};
+} // namespace
+
+/// Keep the prefix of heaps so they are still recognized when arrays are
+/// instantiated
+static string parameterName(const string &name, size_t index) {
+    std::smatch match;
+    if (std::regex_match(name, match, HEAP_REGEX)) {
+        return match[1].str() + "$" + match[2].str() + "_arg" +
+               std::to_string(index);
+    }
+    return "arg$" + std::to_string(index);
+}
+
+size_t serializedSize(const vector<SharedSMTRef> &smtExprs) {
+    size_t size = 0;
+    for (const auto &expr : smtExprs) {
+        std::ostringstream out;
+        out << *expr->toSExpr();
+        size += out.str().size();
+    }
+    return size;
+}
+
+vector<SharedSMTRef>
+extractCommonSubexpressions(vector<SharedSMTRef> smtExprs,
+                            CommonSubexpressionStats &stats) {
+    set<string> predicates;
+    map<string, smt::Type> functionTypes;
+    for (const auto &expr : smtExprs) {
+        if (const auto funDecl = expr->asFunDecl()) {
+            if (funDecl->outType.getTag() == smt::TypeTag::Bool) {
+                predicates.insert(funDecl->funName);
+            } else {
+                functionTypes.insert({funDecl->funName, funDecl->outType});
+            }
+        }
+    }
+    stats.sizeBefore = serializedSize(smtExprs);
+
+    TermTable table;
+    OccurrenceCounter counter(table, predicates, functionTypes);
+    for (const auto &expr : smtExprs) {
+        if (expr->asAssert()) {
+            expr->accept(counter);
+        }
+    }
+
+    // Larger terms are considered first, extracting them reduces the number
+    // of occurrences of their subterms
+    vector<int> candidates;
+    for (size_t id = 0; id < table.terms.size(); ++id) {
+        const Term &term = table.terms.at(id);
+        if (term.isOp && term.type && term.occurrences > 1 && term.size > 1) {
+            candidates.push_back(static_cast<int>(id));
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [&](int a, int b) {
+        return table.terms.at(a).size > table.terms.at(b).size;
+    });
+    map<int, Definition> definitions;
+    for (int id : candidates) {
+        const Term &term = table.terms.at(id);
+        const size_t occurrences = term.occurrences;
+        if (occurrences < 2) {
+            continue;
+        }
+        vector<int> variables = table.freeVariables(id);
+        // The definition needs the body, the parameters and its name and
+        // every occurrence becomes an application to the free variables
+        const size_t sizeBefore = occurrences * term.size;
+        const size_t sizeAfter = term.size + variables.size() + 1 +
+                                 occurrences * (variables.size() + 1);
+        if (sizeAfter >= sizeBefore) {
+            continue;
+        }
+        definitions.insert({id, {"", std::move(variables)}});
+        table.removeOccurrences(id, static_cast<unsigned>(occurrences - 1));
+    }
+    stats.definitions = static_cast<unsigned>(definitions.size());
+    if (definitions.empty()) {
+        stats.sizeAfter = stats.sizeBefore;
+        return smtExprs;
+    }
+    unsigned index = 0;
+    for (auto &it : definitions) {
+        it.second.name = "CSE_" + std::to_string(index++);
+    }
+
+    // Definitions can use definitions of their subterms which have a smaller
+    // id so they are emitted in the order of their ids
+    vector<SharedSMTRef> funDefs;
+    for (const auto &it : definitions) {
+        const Term &term = table.terms.at(it.first);
+        map<int, string> parameters;
+        vector<SortedVar> args;
+        for (int var : it.second.variables) {
+            const SortedVar &variable = *table.terms.at(var).variable;
+            string name = parameterName(variable.name, args.size());
+            parameters.insert({var, name});
+            args.push_back(SortedVar(name, variable.type));
+        }
+        DefinitionInliner inliner(table, predicates, functionTypes,
+                                  definitions, parameters, it.first);
+        funDefs.push_back(make_shared<FunDef>(it.second.name, std::move(args),
+                                              *term.type,
+                                              term.representative->accept(
+                                                  inliner)));
+    }
+
+    vector<SharedSMTRef> result;
+    const map<int, string> noParameters;
+    DefinitionInliner inliner(table, predicates, functionTypes, definitions,
+                              noParameters, OPAQUE);
+    bool inserted = false;
+    for (const auto &expr : smtExprs) {
+        if (!expr->asAssert()) {
+            result.push_back(expr);
+            continue;
+        }
+        if (!inserted) {
+            result.insert(result.end(), funDefs.begin(), funDefs.end());
+            inserted = true;
+        }
+        result.push_back(expr->accept(inliner));
+    }
+    stats.sizeAfter = serializedSize(result);
+    return result;
+}
@@ -0,0 +1,169 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "ConeOfInfluence.h"
+
+#include "Helper.h"
+#include "Memory.h"
+#include "Program.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <set>
+
+using llvm::dyn_cast;
+using llvm::isa;
+
+using std::set;
+using std::string;
+using std::vector;
+
+using namespace llreve::opts;
+
+namespace {
+struct NameCollector : smt::SMTVisitor {
+    set<string> names;
+    void dispatch(smt::TypedVariable &var) override { names.insert(var.name); }
+    void dispatch(smt::ConstantString &str) override {
+        names.insert(str.value);
+    }
+};
+} // namespace
+
+static set<string> mentionedNames(const smt::SMTExpr &relation) {
+    NameCollector collector;
+    relation.accept(collector);
+    return collector.names;
+}
+
+static bool mentionsHeap(const set<string> &names) {
+    for (const auto &name : names) {
+        if (std::regex_match(name, HEAP_REGEX)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ObservedState observedState(const FileOptions &fileOpts) {
+    ObservedState observed;
+    if (fileOpts.OutRelation != nullptr) {
+        const auto outNames = mentionedNames(*fileOpts.OutRelation);
+        observed.ReturnValue =
+            outNames.count(resultName(Program::First)) > 0 ||
+            outNames.count(resultName(Program::Second)) > 0;
+        observed.Heap = mentionsHeap(outNames);
+        // A custom input relation can only be used if the heaps still exist
+        if (fileOpts.InRelation != nullptr) {
+            observed.Heap = observed.Heap ||
+                            mentionsHeap(mentionedNames(*fileOpts.InRelation));
+        }
+    }
+    return observed;
+}
+
+static bool isMemcpy(const llvm::Instruction &instr) {
+    if (const auto call = dyn_cast<llvm::CallInst>(&instr)) {
+        const auto fun = call->getCalledFunction();
+        return fun != nullptr &&
+               fun->getIntrinsicID() == llvm::Intrinsic::memcpy;
+    }
+    return false;
+}
+
+unsigned reduceToConeOfInfluence(llvm::Function &fun, ObservedState observed) {
+    for (const auto &bb : fun) {
+        for (const auto &instr : bb) {
+            if (isa<llvm::AllocaInst>(&instr)) {
+                return 0;
+            }
+        }
+    }
+    // The result is used by the callers of a recursive main function
+    if (!observed.ReturnValue && fun.use_empty()) {
+        for (auto &bb : fun) {
+            if (auto ret = dyn_cast<llvm::ReturnInst>(bb.getTerminator())) {
+                if (const auto val = ret->getReturnValue()) {
+                    ret->setOperand(
+                        0, llvm::Constant::getNullValue(val->getType()));
+                }
+            }
+        }
+    }
+
+    set<const llvm::Instruction *> relevant;
+    vector<const llvm::Instruction *> worklist;
+    const auto markRelevant = [&](const llvm::Value *val) {
+        if (const auto instr = dyn_cast<llvm::Instruction>(val)) {
+            if (relevant.insert(instr).second) {
+                worklist.push_back(instr);
+            }
+        }
+    };
+    bool heapRelevant = false;
+    const auto markHeapRelevant = [&]() {
+        if (heapRelevant) {
+            return;
+        }
+        heapRelevant = true;
+        for (const auto &bb : fun) {
+            for (const auto &instr : bb) {
+                if (isa<llvm::StoreInst>(&instr) || isMemcpy(instr)) {
+                    markRelevant(&instr);
+                }
+            }
+        }
+    };
+
+    for (const auto &bb : fun) {
+        for (const auto &instr : bb) {
+            if (instr.isTerminator() ||
+                (isa<llvm::CallInst>(&instr) && !isMemcpy(instr))) {
+                markRelevant(&instr);
+            }
+        }
+    }
+    if (observed.Heap) {
+        markHeapRelevant();
+    }
+    while (!worklist.empty()) {
+        const llvm::Instruction *instr = worklist.back();
+        worklist.pop_back();
+        // Callees can access the heap
+        if (isa<llvm::LoadInst>(instr) ||
+            (isa<llvm::CallInst>(instr) && !isMemcpy(*instr))) {
+            markHeapRelevant();
+        }
+        for (const auto op : instr->operand_values()) {
+            markRelevant(op);
+        }
+    }
+
+    vector<llvm::Instruction *> irrelevant;
+    for (auto &bb : fun) {
+        for (auto &instr : bb) {
+            if (relevant.count(&instr) == 0) {
+                irrelevant.push_back(&instr);
+            }
+        }
+    }
+    // Irrelevant instructions are only used by other irrelevant instructions
+    for (auto instr : irrelevant) {
+        if (!instr->getType()->isVoidTy()) {
+            instr->replaceAllUsesWith(llvm::UndefValue::get(instr->getType()));
+        }
+    }
+    for (auto instr : irrelevant) {
+        instr->eraseFromParent();
+    }
+    return static_cast<unsigned>(irrelevant.size());
+}
@@ -0,0 +1,481 @@
+/*
+ * This file is part of
+ *    llreve - Automatic regression verification for LLVM programs
+ *
+ * Copyright (C) 2016 Karlsruhe Institute of Technology
+ *
+ * The system is published under a BSD license.
+ * See LICENSE (distributed with this file) for details.
+ */
+
+#include "HornSimplification.h"
+
+#include "Opts.h"
+
+#include <algorithm>
+#include <sstream>
+
+using smt::Forall;
+using smt::Let;
+using smt::Op;
+using smt::SMTExpr;
+using smt::SharedSMTRef;
+using smt::SortedVar;
+
+using std::make_shared;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+using namespace llreve::opts;
+
+namespace {
+// Counts the applications of predicates. Predicates without arguments are
+// represented as plain strings so they are counted as well.
+struct PredicateCounter : smt::SMTVisitor {
+    const set<string> &predicates;
+    map<string, unsigned> occurrences;
+    // FPCmp does not traverse its operands so we can’t rename variables in it
+    bool containsFPCmp = false;
+    PredicateCounter(const set<string> &predicates) : predicates(predicates) {}
+    void count(const string &name) {
+        if (predicates.count(name) > 0) {
+            ++occurrences[name];
+        }
+    }
+    void dispatch(Op &op) override { count(op.opName); }
+    void dispatch(smt::ConstantString &str) override { count(str.value); }
+    void dispatch(smt::TypedVariable &var) override { count(var.name); }
+    void dispatch(smt::FPCmp & /* unused */) override { containsFPCmp = true; }
+};
+
+struct BinderCollector : smt::SMTVisitor {
+    set<string> binders;
+    void dispatch(Forall &forall) override {
+        for (const auto &var : forall.vars) {
+            binders.insert(var.name);
+        }
+    }
+    void dispatch(Let &let) override {
+        for (const auto &assignment : let.defs.assgns) {
+            binders.insert(assignment.first);
+        }
+    }
+};
+
+struct BinderRenamer : smt::SMTVisitor {
+    const map<string, string> &newNames;
+    BinderRenamer(const map<string, string> &newNames) : newNames(newNames) {}
+    void rename(string &name) {
+        auto it = newNames.find(name);
+        if (it != newNames.end()) {
+            name = it->second;
+        }
+    }
+    void dispatch(smt::TypedVariable &var) override { rename(var.name); }
+    void dispatch(smt::ConstantString &str) override { rename(str.value); }
+    void dispatch(Forall &forall) override {
+        for (auto &var : forall.vars) {
+            rename(var.name);
+        }
+    }
+    void dispatch(Let &let) override {
+        for (auto &assignment : let.defs.assgns) {
+            rename(assignment.first);
+        }
+    }
+};
+
+/// A clause is a chain of foralls, lets and implications ending in the head
+struct HornClause {
+    SharedSMTRef expr;
+    const SMTExpr *head;
+    bool falsePremise;
+    map<string, unsigned> headPredicates;
+    // Occurrences outside of the head
+    map<string, unsigned> bodyPredicates;
+    bool containsFPCmp;
+    HornClause(SharedSMTRef expr)
+        : expr(std::move(expr)), head(nullptr), falsePremise(false),
+          containsFPCmp(false) {}
+    /// The head is a single predicate application
+    bool simple() const {
+        return headPredicates.size() == 1 && head->asOp() != nullptr &&
+               head->asOp()->opName == headPredicates.begin()->first;
+    }
+};
+} // namespace
+
+static const Op *asImplication(const SMTExpr &expr) {
+    const Op *op = expr.asOp();
+    if (op != nullptr && op->opName == "=>" && op->args.size() == 2) {
+        return op;
+    }
+    return nullptr;
+}
+
+static HornClause analyzeClause(SharedSMTRef expr,
+                                const set<string> &predicates) {
+    HornClause clause(std::move(expr));
+    const SMTExpr *current = clause.expr.get();
+    while (true) {
+        if (const auto forall = current->asForall()) {
+            current = forall->expr.get();
+        } else if (const auto let = current->asLet()) {
+            current = let->expr.get();
+        } else if (const auto implication = asImplication(*current)) {
+            if (implication->args.at(0)->isConstantFalse()) {
+                clause.falsePremise = true;
+            }
+            current = implication->args.at(1).get();
+        } else {
+            break;
+        }
+    }
+    clause.head = current;
+    PredicateCounter allCounter(predicates);
+    clause.expr->accept(allCounter);
+    PredicateCounter headCounter(predicates);
+    clause.head->accept(headCounter);
+    clause.containsFPCmp = allCounter.containsFPCmp;
+    clause.headPredicates = headCounter.occurrences;
+    for (const auto &occurrence : allCounter.occurrences) {
+        auto headIt = headCounter.occurrences.find(occurrence.first);
+        unsigned inHead =
+            headIt == headCounter.occurrences.end() ? 0 : headIt->second;
+        if (occurrence.second > inHead) {
+            clause.bodyPredicates[occurrence.first] =
+                occurrence.second - inHead;
+        }
+    }
+    return clause;
+}
+
+static string clauseKey(const SMTExpr &expr) {
+    std::ostringstream out;
+    out << *expr.toSExpr();
+    return out.str();
+}
+
+static vector<HornClause> removeDuplicatesAndFalsePremises(
+    vector<HornClause> clauses) {
+    vector<HornClause> result;
+    set<string> seen;
+    for (auto &clause : clauses) {
+        if (clause.falsePremise) {
+            continue;
+        }
+        if (!seen.insert(clauseKey(*clause.expr)).second) {
+            continue;
+        }
+        result.push_back(std::move(clause));
+    }
+    return result;
+}
+
+/// Remove clauses that use a predicate which is not derivable from the facts
+static vector<HornClause> removeUnreachable(vector<HornClause> clauses) {
+    set<string> derivable;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const auto &clause : clauses) {
+            bool applicable = std::all_of(
+                clause.bodyPredicates.begin(), clause.bodyPredicates.end(),
+                [&derivable](const auto &pred) {
+                    return derivable.count(pred.first) > 0;
+                });
+            if (!applicable) {
+                continue;
+            }
+            for (const auto &pred : clause.headPredicates) {
+                changed = derivable.insert(pred.first).second || changed;
+            }
+        }
+    }
+    vector<HornClause> result;
+    for (auto &clause : clauses) {
+        bool applicable = std::all_of(
+            clause.bodyPredicates.begin(), clause.bodyPredicates.end(),
+            [&derivable](const auto &pred) {
+                return derivable.count(pred.first) > 0;
+            });
+        if (applicable) {
+            result.push_back(std::move(clause));
+        }
+    }
+    return result;
+}
+
+/// Remove clauses defining a predicate that is never used on the way to a
+/// query. Such a predicate can simply be set to true.
+static vector<HornClause> removeUseless(vector<HornClause> clauses,
+                                        const set<string> &roots) {
+    set<string> useful = roots;
+    for (const auto &clause : clauses) {
+        // We don’t look into complex heads so we have to keep everything
+        // that is mentioned in them
+        if (!clause.simple()) {
+            for (const auto &pred : clause.headPredicates) {
+                useful.insert(pred.first);
+            }
+            for (const auto &pred : clause.bodyPredicates) {
+                useful.insert(pred.first);
+            }
+        }
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const auto &clause : clauses) {
+            if (clause.simple() &&
+                useful.count(clause.headPredicates.begin()->first) > 0) {
+                for (const auto &pred : clause.bodyPredicates) {
+                    changed = useful.insert(pred.first).second || changed;
+                }
+            }
+        }
+    }
+    vector<HornClause> result;
+    for (auto &clause : clauses) {
+        if (!clause.simple() ||
+            useful.count(clause.headPredicates.begin()->first) > 0) {
+            result.push_back(std::move(clause));
+        }
+    }
+    return result;
+}
+
+/// Turn the clause into a premise that holds if its head holds for the
+/// passed arguments. The quantified variables are collected in hoisted since
+/// they need to be quantified in the clause the premise is inserted into.
+static SharedSMTRef clauseAsPremise(const SharedSMTRef &expr,
+                                    const vector<SharedSMTRef> &actualArgs,
+                                    vector<SortedVar> &hoisted) {
+    if (const auto forall = expr->asForall()) {
+        hoisted.insert(hoisted.end(), forall->vars.begin(),
+                       forall->vars.end());
+        return clauseAsPremise(forall->expr, actualArgs, hoisted);
+    }
+    if (const auto let = expr->asLet()) {
+        return make_shared<Let>(
+            let->defs, clauseAsPremise(let->expr, actualArgs, hoisted));
+    }
+    if (const auto implication = asImplication(*expr)) {
+        return makeOp("and", implication->args.at(0),
+                      clauseAsPremise(implication->args.at(1), actualArgs,
+                                      hoisted));
+    }
+    const Op *head = expr->asOp();
+    assert(head != nullptr && head->args.size() == actualArgs.size());
+    vector<SharedSMTRef> equalities;
+    for (size_t i = 0; i < actualArgs.size(); ++i) {
+        equalities.push_back(makeOp("=", head->args.at(i), actualArgs.at(i)));
+    }
+    if (equalities.empty()) {
+        return make_shared<smt::ConstantBool>(true);
+    }
+    if (equalities.size() == 1) {
+        return equalities.front();
+    }
+    return make_shared<Op>("and", equalities);
+}
+
+/// Replace the premise that applies predicate by the definition of the
+/// predicate. Returns nullptr if the application is not a premise.
+static SharedSMTRef inlinePremise(const SharedSMTRef &expr,
+                                  const string &predicate,
+                                  const SharedSMTRef &definition,
+                                  vector<SortedVar> &hoisted) {
+    if (const auto forall = expr->asForall()) {
+        auto inner = inlinePremise(forall->expr, predicate, definition, hoisted);
+        if (inner == nullptr) {
+            return nullptr;
+        }
+        return make_shared<Forall>(forall->vars, inner);
+    }
+    if (const auto let = expr->asLet()) {
+        auto inner = inlinePremise(let->expr, predicate, definition, hoisted);
+        if (inner == nullptr) {
+            return nullptr;
+        }
+        return make_shared<Let>(let->defs, inner);
+    }
+    if (const auto implication = asImplication(*expr)) {
+        const Op *premise = implication->args.at(0)->asOp();
+        if (premise != nullptr && premise->opName == predicate) {
+            auto premiseDefinition =
+                clauseAsPremise(definition, premise->args, hoisted);
+            return make_shared<Op>(
+                "=>",
+                vector<SharedSMTRef>{premiseDefinition,
+                                     implication->args.at(1)},
+                implication->instantiate);
+        }
+        auto inner = inlinePremise(implication->args.at(1), predicate,
+                                   definition, hoisted);
+        if (inner == nullptr) {
+            return nullptr;
+        }
+        return make_shared<Op>(
+            "=>", vector<SharedSMTRef>{implication->args.at(0), inner},
+            implication->instantiate);
+    }
+    return nullptr;
+}
+
+static SharedSMTRef renameBinders(const SMTExpr &expr, unsigned index) {
+    BinderCollector collector;
+    expr.accept(collector);
+    map<string, string> newNames;
+    for (const auto &binder : collector.binders) {
+        newNames.insert({binder, binder + "_inl" + std::to_string(index)});
+    }
+    BinderRenamer renamer(newNames);
+    return expr.accept(renamer);
+}
+
+/// Inline predicates that have a single definition and a single use. Returns
+/// the names of the inlined predicates.
+static set<string> inlineSingleUse(vector<HornClause> &clauses,
+                                   const set<string> &predicates,
+                                   const set<string> &roots,
+                                   unsigned &inlineCounter) {
+    map<string, vector<size_t>> definitions;
+    map<string, vector<size_t>> uses;
+    map<string, unsigned> useCounts;
+    for (size_t i = 0; i < clauses.size(); ++i) {
+        for (const auto &pred : clauses[i].headPredicates) {
+            definitions[pred.first].push_back(i);
+        }
+        for (const auto &pred : clauses[i].bodyPredicates) {
+            uses[pred.first].push_back(i);
+            useCounts[pred.first] += pred.second;
+        }
+    }
+    set<string> inlined;
+    // Each clause takes part in at most one inlining per round so the
+    // analysis stays valid
+    set<size_t> touched;
+    for (const auto &pred : predicates) {
+        if (roots.count(pred) > 0 || definitions[pred].size() != 1 ||
+            useCounts[pred] != 1) {
+            continue;
+        }
+        const size_t defIndex = definitions[pred].front();
+        const size_t useIndex = uses[pred].front();
+        const HornClause &def = clauses[defIndex];
+        if (defIndex == useIndex || !def.simple() ||
+            def.headPredicates.begin()->second != 1 || def.containsFPCmp ||
+            touched.count(defIndex) > 0 || touched.count(useIndex) > 0) {
+            continue;
+        }
+        vector<SortedVar> hoisted;
+        auto inlinedClause =
+            inlinePremise(clauses[useIndex].expr, pred,
+                          renameBinders(*def.expr, inlineCounter), hoisted);
+        if (inlinedClause == nullptr) {
+            continue;
+        }
+        ++inlineCounter;
+        if (!hoisted.empty()) {
+            if (const auto forall = inlinedClause->asForall()) {
+                hoisted.insert(hoisted.begin(), forall->vars.begin(),
+                               forall->vars.end());
+                inlinedClause = make_shared<Forall>(hoisted, forall->expr);
+            } else {
+                inlinedClause = make_shared<Forall>(hoisted, inlinedClause);
+            }
+        }
+        clauses[useIndex] = analyzeClause(inlinedClause, predicates);
+        touched.insert(defIndex);
+        touched.insert(useIndex);
+        inlined.insert(pred);
+    }
+    vector<HornClause> result;
+    for (size_t i = 0; i < clauses.size(); ++i) {
+        const auto &heads = clauses[i].headPredicates;
+        if (heads.size() == 1 && inlined.count(heads.begin()->first) > 0) {
+            continue;
+        }
+        result.push_back(std::move(clauses[i]));
+    }
+    clauses = std::move(result);
+    return inlined;
+}
+
+vector<SharedSMTRef> simplifyHornClauses(vector<SharedSMTRef> smtExprs) {
+    const auto &smtOpts = SMTGenerationOpts::getInstance();
+    // The inverted encoding asserts a single disjunction
+    if (smtOpts.Invert) {
+        return smtExprs;
+    }
+    set<string> predicates;
+    for (const auto &expr : smtExprs) {
+        if (const auto funDecl = expr->asFunDecl()) {
+            if (funDecl->outType.getTag() == smt::TypeTag::Bool) {
+                predicates.insert(funDecl->funName);
+            }
+        }
+    }
+    // Predicates that are used outside of the clauses
+    set<string> roots;
+    if (smtOpts.OutputFormat == SMTFormat::Z3) {
+        roots.insert("END_QUERY");
+    }
+    vector<HornClause> clauses;
+    for (const auto &expr : smtExprs) {
+        if (const auto assertion = expr->asAssert()) {
+            clauses.push_back(analyzeClause(assertion->expr, predicates));
+        } else if (!expr->asFunDecl()) {
+            PredicateCounter counter(predicates);
+            expr->accept(counter);
+            for (const auto &occurrence : counter.occurrences) {
+                roots.insert(occurrence.first);
+            }
+        }
+    }
+
+    unsigned inlineCounter = 0;
+    set<string> removedPredicates;
+    do {
+        clauses = removeDuplicatesAndFalsePremises(std::move(clauses));
+        clauses = removeUnreachable(std::move(clauses));
+        clauses = removeUseless(std::move(clauses), roots);
+    } while (!inlineSingleUse(clauses, predicates, roots, inlineCounter)
+                  .empty());
+
+    set<string> remainingPredicates = roots;
+    for (const auto &clause : clauses) {
+        for (const auto &pred : clause.headPredicates) {
+            remainingPredicates.insert(pred.first);
+        }
+        for (const auto &pred : clause.bodyPredicates) {
+            remainingPredicates.insert(pred.first);
+        }
+    }
+
+    // The assertions are emitted in place of the first assertion, the
+    // declarations of predicates that no longer occur are dropped
+    vector<SharedSMTRef> result;
+    bool clausesEmitted = false;
+    for (auto &expr : smtExprs) {
+        if (expr->asAssert()) {
+            if (!clausesEmitted) {
+                for (const auto &clause : clauses) {
+                    result.push_back(make_shared<smt::Assert>(clause.expr));
+                }
+                clausesEmitted = true;
+            }
+        } else if (const auto funDecl = expr->asFunDecl()) {
+            if (predicates.count(funDecl->funName) == 0 ||
+                remainingPredicates.count(funDecl->funName) > 0) {
+                result.push_back(std::move(expr));
+            }
+        } else {
+            result.push_back(std::move(expr));
+        }
+    }
+    return result;
+}
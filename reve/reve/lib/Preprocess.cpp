@@ -10,6 +10,7 @@
 
 #include "Preprocess.h"
 
+#include "ConeOfInfluence.h"
 #include "Helper.h"
 #include "InferMarks.h"
 #include "InlinePass.h"
@@ -69,6 +70,15 @@ AnalysisResultsMap preprocessModules(MonoPair<llvm::Module &> modules,
     map<const llvm::Function *, PassAnalysisResults> passResults;
     runFunctionPasses(modules.first, opts, passResults, Program::First);
     runFunctionPasses(modules.second, opts, passResults, Program::Second);
+    if (opts.ConeOfInfluence) {
+        // This has to happen before the free variables are collected and the
+        // memory options are detected so the removed variables and heaps
+        // don’t show up in the invariants
+        SMTGenerationOpts::getInstance().MainFunctions.forEach(
+            [&](llvm::Function *fun) {
+                reduceToConeOfInfluence(*fun, opts.Observed);
+            });
+    }
     nameModuleGlobals(modules.first, Program::First);
     nameModuleGlobals(modules.second, Program::Second);
     detectMemoryOptions(modules);
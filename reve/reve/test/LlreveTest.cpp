@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <memory>
 #include <regex>
+#include <sys/wait.h>
 
 using std::string;
 
@@ -63,22 +64,14 @@ ExpectedResult parseEldResult(const std::string &output) {
     return ExpectedResult::UNKNOWN;
 }
 
-class LlreveTest
-    : public testing::TestWithParam<
-          ::testing::tuple<std::string, std::string, ExpectedResult, Solver>> {
-  protected:
-    virtual void SetUp() {}
-    virtual void TearDown() {}
-};
+static std::string examplePath(const std::string &directory,
+                               const std::string &fileName) {
+    return PathToTestExecutable + "../../examples/" + directory + "/" +
+           fileName;
+}
 
-TEST_P(LlreveTest, Llreve) {
-    std::string directory;
-    std::string fileName;
-    ExpectedResult expectedResult;
-    Solver solver;
-    std::tie(directory, fileName, expectedResult, solver) = GetParam();
-    fileName =
-        PathToTestExecutable + "../../examples/" + directory + "/" + fileName;
+// Creates the file llreve writes the SMT to
+static std::string smtOutputFile() {
     char smtOutput[7] = "XXXXXX";
     int fd = mkstemp(smtOutput);
     if (fd == -1) {
@@ -86,19 +79,31 @@ TEST_P(LlreveTest, Llreve) {
         exit(1);
     }
     close(fd);
+    return smtOutput;
+}
+
+static std::pair<int, std::string> runLlreve(const std::string &example,
+                                             const std::string &flags,
+                                             const std::string &smtOutput) {
     std::ostringstream llreveCommand;
     llreveCommand << PathToTestExecutable
                   << "llreve -inline-opts -o=" << smtOutput
                   << " -I=" << PathToTestExecutable << "../../examples/headers"
-                  << " ";
-    if (solver == Solver::Z3) {
-        llreveCommand << "-muz ";
-    }
-    llreveCommand << fileName << "_1.c"
-                  << " " << fileName << "_2.c";
+                  << " " << flags << " ";
+    llreveCommand << example << "_1.c"
+                  << " " << example << "_2.c";
+    return exec(llreveCommand.str());
+}
+
+// Generates SMT for the example with the given flags and checks the result
+// of the solver
+static void checkResult(const std::string &example, const std::string &flags,
+                        ExpectedResult expectedResult, Solver solver) {
+    const std::string smtOutput = smtOutputFile();
     std::string llreveOutput;
     int exitCode;
-    std::tie(exitCode, llreveOutput) = exec(llreveCommand.str());
+    std::tie(exitCode, llreveOutput) = runLlreve(
+        example, solver == Solver::Z3 ? flags + " -muz" : flags, smtOutput);
     ASSERT_EQ(exitCode, 0);
     switch (solver) {
     case Solver::Z3: {
@@ -119,8 +124,72 @@ TEST_P(LlreveTest, Llreve) {
         parseEldResult(eldOutput);
         break;
     }
-    std::remove(smtOutput);
-    EXPECT_EQ(0, 0);
+    std::remove(smtOutput.c_str());
+}
+
+class LlreveTest
+    : public testing::TestWithParam<
+          ::testing::tuple<std::string, std::string, ExpectedResult, Solver>> {
+  protected:
+    virtual void SetUp() {}
+    virtual void TearDown() {}
+};
+
+TEST_P(LlreveTest, Llreve) {
+    std::string directory;
+    std::string fileName;
+    ExpectedResult expectedResult;
+    Solver solver;
+    std::tie(directory, fileName, expectedResult, solver) = GetParam();
+    checkResult(examplePath(directory, fileName), "", expectedResult, solver);
+}
+
+// The checks that run on concrete or unrolled programs before any SMT is
+// generated. They print NOT_EQUIVALENT with a counterexample and exit with
+// status 2 if they find one.
+class QuickCheckTest
+    : public testing::TestWithParam<::testing::tuple<
+          std::string, std::string, std::string, ExpectedResult>> {};
+
+TEST_P(QuickCheckTest, Counterexample) {
+    std::string directory;
+    std::string fileName;
+    std::string flags;
+    ExpectedResult expectedResult;
+    std::tie(directory, fileName, flags, expectedResult) = GetParam();
+    const std::string smtOutput = smtOutputFile();
+    std::string llreveOutput;
+    int exitCode;
+    std::tie(exitCode, llreveOutput) =
+        runLlreve(examplePath(directory, fileName), flags, smtOutput);
+    std::remove(smtOutput.c_str());
+    if (expectedResult == ExpectedResult::NOT_EQUIVALENT) {
+        ASSERT_TRUE(WIFEXITED(exitCode));
+        EXPECT_EQ(WEXITSTATUS(exitCode), 2);
+        EXPECT_TRUE(std::regex_search(llreveOutput,
+                                      std::regex("^NOT_EQUIVALENT\n")))
+            << llreveOutput;
+    } else {
+        EXPECT_EQ(exitCode, 0);
+        EXPECT_EQ(llreveOutput.find("NOT_EQUIVALENT"), std::string::npos)
+            << llreveOutput;
+    }
+}
+
+// Flags that only transform the generated SMT must not change the result of
+// the solver
+class SMTFlagTest
+    : public testing::TestWithParam<::testing::tuple<
+          std::string, std::string, std::string, ExpectedResult>> {};
+
+TEST_P(SMTFlagTest, SameResult) {
+    std::string directory;
+    std::string fileName;
+    std::string flags;
+    ExpectedResult expectedResult;
+    std::tie(directory, fileName, flags, expectedResult) = GetParam();
+    checkResult(examplePath(directory, fileName), flags, expectedResult,
+                Solver::Z3);
 }
 
 INSTANTIATE_TEST_CASE_P(
@@ -139,8 +208,8 @@ INSTANTIATE_TEST_CASE_P(
     Faulty, LlreveTest,
     testing::Combine(testing::Values("faulty"),
                      testing::Values("ackermann!", "add-horn!", "barthe!",
-                                     "inlining!", "limit1!", "limit2!",
-                                     "loop5!", "nested-while!"),
+                                     "clear_count!", "inlining!", "limit1!",
+                                     "limit2!", "loop5!", "nested-while!"),
                      testing::Values(ExpectedResult::NOT_EQUIVALENT),
                      testing::Values(Solver::Z3, Solver::ELDARICA)));
 
@@ -156,8 +225,9 @@ INSTANTIATE_TEST_CASE_P(
 INSTANTIATE_TEST_CASE_P(
     Heap, LlreveTest,
     testing::Combine(testing::Values("heap"),
-                     testing::Values("clearstr", "fib", "heap_call", "memcpy_a",
-                                     "memcpy_b", "propagate"),
+                     testing::Values("clear_count", "clearstr", "fib",
+                                     "heap_call", "memcpy_a", "memcpy_b",
+                                     "propagate"),
                      testing::Values(ExpectedResult::EQUIVALENT),
                      testing::Values(Solver::Z3, Solver::ELDARICA)));
 
@@ -191,6 +261,95 @@ INSTANTIATE_TEST_CASE_P(
                      testing::Values(ExpectedResult::EQUIVALENT),
                      testing::Values(Solver::Z3)));
 
+INSTANTIATE_TEST_CASE_P(
+    FalsifyFaulty, QuickCheckTest,
+    testing::Combine(testing::Values("faulty"),
+                     testing::Values("add-horn!", "limit1!", "limit2!",
+                                     "loop5!", "nested-while!"),
+                     testing::Values("-falsify-first"),
+                     testing::Values(ExpectedResult::NOT_EQUIVALENT)));
+
+// Division, remainder and unsigned comparisons behave differently in the
+// interpreter and in the encoding, so falsification must not report these
+INSTANTIATE_TEST_CASE_P(
+    FalsifyEquivalent, QuickCheckTest,
+    testing::Combine(testing::Values("misc"),
+                     testing::Values("mod_parity", "unsigned_compare"),
+                     testing::Values("-falsify-first"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    EncodingSemantics, LlreveTest,
+    testing::Combine(testing::Values("misc"),
+                     testing::Values("mod_parity", "unsigned_compare"),
+                     testing::Values(ExpectedResult::EQUIVALENT),
+                     testing::Values(Solver::Z3)));
+
+INSTANTIATE_TEST_CASE_P(
+    BoundedCheckFaulty, QuickCheckTest,
+    testing::Combine(testing::Values("faulty"),
+                     testing::Values("loop5!", "nested-while!"),
+                     testing::Values("-bmc"),
+                     testing::Values(ExpectedResult::NOT_EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    BoundedCheckEquivalent, QuickCheckTest,
+    testing::Combine(testing::Values("loop"),
+                     testing::Values("barthe", "loop", "nested-while",
+                                     "simple-loop", "while-if"),
+                     testing::Values("-bmc"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    SimplifyHornEquivalent, SMTFlagTest,
+    testing::Combine(testing::Values("loop"),
+                     testing::Values("barthe", "nested-while"),
+                     testing::Values("-simplify-horn"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    SimplifyHornFaulty, SMTFlagTest,
+    testing::Combine(testing::Values("faulty"),
+                     testing::Values("barthe!", "loop5!"),
+                     testing::Values("-simplify-horn"),
+                     testing::Values(ExpectedResult::NOT_EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    CSEEquivalent, SMTFlagTest,
+    testing::Combine(testing::Values("loop"),
+                     testing::Values("barthe", "nested-while"),
+                     testing::Values("-cse"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    CSEFaulty, SMTFlagTest,
+    testing::Combine(testing::Values("faulty"),
+                     testing::Values("barthe!", "loop5!"),
+                     testing::Values("-cse"),
+                     testing::Values(ExpectedResult::NOT_EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    ConeOfInfluenceEquivalent, SMTFlagTest,
+    testing::Combine(testing::Values("loop"),
+                     testing::Values("barthe", "nested-while"),
+                     testing::Values("-cone-of-influence"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+// The output relation of clear_count only observes the heap
+INSTANTIATE_TEST_CASE_P(
+    ConeOfInfluenceHeap, SMTFlagTest,
+    testing::Combine(testing::Values("heap"),
+                     testing::Values("clear_count", "fib"),
+                     testing::Values("-cone-of-influence"),
+                     testing::Values(ExpectedResult::EQUIVALENT)));
+
+INSTANTIATE_TEST_CASE_P(
+    ConeOfInfluenceFaulty, SMTFlagTest,
+    testing::Combine(testing::Values("faulty"),
+                     testing::Values("barthe!", "clear_count!", "loop5!"),
+                     testing::Values("-cone-of-influence"),
+                     testing::Values(ExpectedResult::NOT_EQUIVALENT)));
+
 static std::string getDirectory(std::string filePath) {
     auto pos = filePath.rfind('/');
     if (pos != std::string::npos) {